@@ -277,6 +277,7 @@ chatty_application_startup (GApplication *application)
   chatty_history_open (db_path, "chatty-history.db");
 
   self->settings = chatty_settings_get_default ();
+  chatty_history_apply_settings (self->settings);
 
   self->css_provider = gtk_css_provider_new ();
   gtk_css_provider_load_from_resource (self->css_provider,
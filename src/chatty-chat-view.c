@@ -20,6 +20,7 @@
 #include "chatty-window.h"
 #include "users/chatty-contact.h"
 #include "users/chatty-pp-buddy.h"
+#include "chatty-message-list-view.h"
 #include "chatty-message-row.h"
 #include "chatty-chat-view.h"
 
@@ -47,6 +48,12 @@ struct _ChattyChatView
   ChattyChat *chat;
   ChattyConversation *chatty_conv;
   char       *last_message_id;  /* id of last sent message, currently used only for SMS */
+  ChattyHistoryCursor history_cursor; /* Position of the oldest message loaded from history */
+  gboolean    history_cursor_set;
+  gboolean    history_loading;
+  GCancellable *history_cancellable;
+  GPtrArray  *markup_messages;  /* Messages with markup not yet saved to history */
+  guint       save_markup_id;
   guint       message_type;
   guint       refresh_typing_id;
   gboolean    first_scroll_to_bottom;
@@ -61,6 +68,8 @@ static GHashTable *ht_emoticon = NULL;
 #define MSG_BUBBLE_MAX_RATIO .3
 
 #define LAZY_LOAD_INITIAL_MSGS_LIMIT 20
+/* Messages kept in memory while the chat is shown and scrolled to the bottom */
+#define MESSAGE_WINDOW_SIZE 200
 
 G_DEFINE_TYPE (ChattyChatView, chatty_chat_view, GTK_TYPE_BOX)
 
@@ -370,80 +379,99 @@ chatty_update_typing_status (ChattyChatView *self)
 }
 
 static void
-chatty_conv_get_im_messages_cb (const guchar *msg,
-                                int           direction,
-                                time_t        time_stamp,
-                                const guchar *uuid,
-                                gpointer      user_data,
-                                int           last_message)
+chat_view_history_loaded_cb (GObject      *object,
+                             GAsyncResult *result,
+                             gpointer      user_data)
 {
-  ChattyChatView *self = user_data;
-  ChattyMsgDirection msg_direction;
+  g_autoptr(ChattyChatView) self = user_data;
+  g_autoptr(GPtrArray) messages = NULL;
+  g_autoptr(GError) error = NULL;
 
   g_assert (CHATTY_IS_CHAT_VIEW (self));
 
-  if (direction == 1)
-    msg_direction = CHATTY_DIRECTION_IN;
-  else if (direction == -1)
-    msg_direction = CHATTY_DIRECTION_OUT;
-  else
-    msg_direction = CHATTY_DIRECTION_SYSTEM; /* TODO: LELAND: Do we have this case for IMs? */
+  messages = chatty_history_load_finish (result, &self->history_cursor, &error);
+  self->history_loading = FALSE;
 
-  if (msg && *msg) {
-    g_autoptr(ChattyMessage) message = NULL;
+  if (!messages) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning ("Error loading history: %s", error->message);
 
-    message = chatty_message_new (NULL, NULL, (const char *)msg, (const char *)uuid,
-                                  time_stamp, msg_direction, 0);
-    chatty_chat_prepend_message (self->chat, message);
+    return;
   }
+
+  self->history_cursor_set = TRUE;
+
+  /* The page only had messages without text, older ones may be shown */
+  if (messages->len == 0) {
+    if (self->chatty_conv && !chatty_history_cursor_at_start (&self->history_cursor))
+      chatty_chat_view_load (self, LAZY_LOAD_INITIAL_MSGS_LIMIT);
+
+    return;
+  }
+
+  for (guint i = 0; i < messages->len; i++) {
+    ChattyMessage *message = messages->pdata[i];
+    const char *alias;
+
+    alias = chatty_message_get_user_alias (message);
+
+    /* History only knows the nick of MUC participants */
+    if (alias && !chatty_message_get_user (message))
+      chatty_message_set_user (message, (ChattyItem *)chatty_chat_find_user (self->chat, alias));
+  }
+
+  /*
+   * Add the whole page at once, so that the list is updated only once.
+   * If the chat was hidden meanwhile, the page is trimmed on ::changed.
+   */
+  chatty_chat_prepend_messages (self->chat, messages);
 }
 
 
+/*
+ * Release the messages older than the latest @n_keep ones.
+ * They are loaded again from history when scrolled to.
+ */
 static void
-chatty_conv_get_chat_messages_cb (const guchar *msg,
-                                  int           direction,
-                                  int           time_stamp,
-                                  const char   *room,
-                                  const guchar *who,
-                                  const guchar *uuid,
-                                  gpointer      user_data)
+chat_view_trim_messages (ChattyChatView *self,
+                         guint           n_keep)
 {
-  ChattyChatView *self = user_data;
-  g_autoptr(ChattyMessage) message = NULL;
-
   g_assert (CHATTY_IS_CHAT_VIEW (self));
 
-  if (msg && *msg) {
-    if (direction == 1) {
-      ChattyPpBuddy *buddy = NULL;
-      const char    *alias = NULL;
+  /* The page being loaded would continue from a released message */
+  if (!self->chat || self->history_loading)
+    return;
 
-      if (who)
-        alias = strchr ((const char *)who, '/');
+  /* The next load starts again from the first message in the chat */
+  if (chatty_chat_trim_messages (self->chat, n_keep))
+    self->history_cursor_set = FALSE;
+}
 
-      /* Skip ‘/’ */
-      if (alias)
-        alias++;
-      else
-        alias = (const char *)who;
-
-      if (alias)
-        buddy = chatty_chat_find_user (self->chat, alias);
-
-      message = chatty_message_new ((ChattyItem *)buddy, alias,
-                                    (const char *)msg, (const char *)uuid,
-                                    time_stamp, CHATTY_DIRECTION_IN, 0);
-      chatty_chat_prepend_message (self->chat, message);
-    } else if (direction == -1) {
-      message = chatty_message_new (NULL, NULL, (const char *)msg, (const char *)uuid,
-                                    0, CHATTY_DIRECTION_OUT, 0);
-      chatty_chat_prepend_message (self->chat, message);
-    } else {
-      message = chatty_message_new (NULL, NULL, (const char *)msg, (const char *)uuid,
-                                    time_stamp, CHATTY_DIRECTION_SYSTEM, 0);
-      chatty_chat_prepend_message (self->chat, message);
-    }
+
+static void
+chat_view_chat_changed_cb (ChattyChatView *self)
+{
+  gdouble value, upper, page_size;
+
+  g_assert (CHATTY_IS_CHAT_VIEW (self));
+
+  /* Messages received while the chat isn’t shown */
+  if (!gtk_widget_get_mapped (GTK_WIDGET (self))) {
+    chat_view_trim_messages (self, LAZY_LOAD_INITIAL_MSGS_LIMIT);
+
+    return;
   }
+
+  if (chatty_chat_get_resident_messages (self->chat) <= MESSAGE_WINDOW_SIZE)
+    return;
+
+  value = gtk_adjustment_get_value (self->vadjustment);
+  upper = gtk_adjustment_get_upper (self->vadjustment);
+  page_size = gtk_adjustment_get_page_size (self->vadjustment);
+
+  /* Don’t pull the messages being read from under the user */
+  if (upper - page_size - value <= 1.0)
+    chat_view_trim_messages (self, MESSAGE_WINDOW_SIZE);
 }
 
 
@@ -458,70 +486,109 @@ chat_view_edge_overshot_cb (ChattyChatView  *self,
 }
 
 
-static GtkWidget *
-chat_view_message_row_new (ChattyMessage  *message,
-                           ChattyChatView *self)
+static gboolean
+chat_view_save_markup_cb (gpointer user_data)
 {
-  GtkWidget *row;
-  ChattyProtocol protocol;
-  gboolean is_im = TRUE;
+  ChattyChatView *self = user_data;
+  PurpleConversation *conv;
+  PurpleAccount *account;
+  const char *name;
 
-  g_assert (CHATTY_IS_MESSAGE (message));
   g_assert (CHATTY_IS_CHAT_VIEW (self));
 
-  if (self->message_type == CHATTY_MSG_TYPE_MUC)
-    is_im = FALSE;
+  self->save_markup_id = 0;
+  conv = self->chatty_conv->conv;
+  account = purple_conversation_get_account (conv);
+  name = purple_conversation_get_name (conv);
 
-  protocol = chatty_chat_get_protocol (self->chat);
-  row = chatty_message_row_new (message, protocol, is_im);
-  chatty_message_row_set_alias (CHATTY_MESSAGE_ROW (row),
-                                chatty_message_get_user_alias (message));
+  chatty_history_begin_batch ();
+
+  for (guint i = 0; i < self->markup_messages->len; i++) {
+    ChattyMessage *message = self->markup_messages->pdata[i];
+
+    if (self->message_type == CHATTY_MSG_TYPE_MUC)
+      chatty_history_set_chat_markup (name,
+                                      chatty_message_get_uid (message),
+                                      chatty_message_get_markup (message));
+    else
+      chatty_history_set_im_markup (account->username,
+                                    chatty_message_get_uid (message),
+                                    chatty_message_get_markup (message));
+  }
+
+  chatty_history_end_batch ();
+  g_ptr_array_set_size (self->markup_messages, 0);
 
-  return GTK_WIDGET (row);
+  return G_SOURCE_REMOVE;
 }
 
+
+/*
+ * Save the markup generated for @message, so that it is
+ * loaded from history next time.  Rows are bound a few at
+ * a time, the markups are saved together once idle.
+ */
 static void
-messages_items_changed_cb (ChattyChatView *self,
-                           guint           position,
-                           guint           removed,
-                           guint           added)
+chat_view_queue_save_markup (ChattyChatView *self,
+                             ChattyMessage  *message)
 {
-  ChattyMessage *next_msg, *msg;
-  GtkListBoxRow *row, *next_row;
-  GtkListBox *list;
-  time_t next_time, time;
-
   g_assert (CHATTY_IS_CHAT_VIEW (self));
 
-  if (added == 0)
+  if (!self->chatty_conv ||
+      !chatty_message_get_uid (message) ||
+      !chatty_message_get_markup (message))
     return;
 
-  /* Don't hide footers in group chats */
-  if (self->message_type == CHATTY_MSG_TYPE_MUC)
-    return;
+  g_ptr_array_add (self->markup_messages, g_object_ref (message));
 
-  list = GTK_LIST_BOX (self->message_list);
+  if (!self->save_markup_id)
+    self->save_markup_id = g_idle_add (chat_view_save_markup_cb, self);
+}
 
-  for (gint i = position; i < position + added; i++) {
-    next_row = gtk_list_box_get_row_at_index (list, i + 1);
 
-    if (!next_row)
-      break;
+static void
+chat_view_bind_message_row (ChattyMessageRow *row,
+                            ChattyMessage    *message,
+                            guint             position,
+                            ChattyChatView   *self)
+{
+  g_autoptr(ChattyMessage) next_msg = NULL;
+  GListModel *messages;
+  ChattyProtocol protocol;
+  gboolean is_im = TRUE;
+  gboolean has_markup;
+
+  g_assert (CHATTY_IS_MESSAGE_ROW (row));
+  g_assert (CHATTY_IS_MESSAGE (message));
+  g_assert (CHATTY_IS_CHAT_VIEW (self));
 
-    row = gtk_list_box_get_row_at_index (list, i);
-    msg = chatty_message_row_get_item (CHATTY_MESSAGE_ROW (row));
-    time = chatty_message_get_time (msg);
+  if (self->message_type == CHATTY_MSG_TYPE_MUC)
+    is_im = FALSE;
 
-    next_msg = chatty_message_row_get_item (CHATTY_MESSAGE_ROW (next_row));
-    next_time = chatty_message_get_time (next_msg);
+  /* The row generates the markup if it isn't cached yet */
+  has_markup = chatty_message_get_markup (message) != NULL;
+  protocol = chatty_chat_get_protocol (self->chat);
+  chatty_message_row_set_item (row, message, protocol, is_im);
+  chatty_message_row_set_alias (row, chatty_message_get_user_alias (message));
 
-    /*
-     * Hide time if the message following the current one belong to the same
-     * day
-     */
-    if (chat_view_time_is_same_day (time, next_time))
-      chatty_message_row_hide_footer (CHATTY_MESSAGE_ROW (row));
-  }
+  if (!has_markup)
+    chat_view_queue_save_markup (self, message);
+
+  /* Don't hide footers in group chats */
+  if (!is_im)
+    return;
+
+  messages = chatty_chat_get_messages (self->chat);
+  next_msg = g_list_model_get_item (messages, position + 1);
+
+  /*
+   * Hide time if the message following the current one belong to the same
+   * day
+   */
+  if (next_msg &&
+      chat_view_time_is_same_day (chatty_message_get_time (message),
+                                  chatty_message_get_time (next_msg)))
+    chatty_message_row_hide_footer (row);
 }
 
 static void
@@ -937,12 +1004,41 @@ chat_view_sms_sent_cb (const char *sms_id,
     chatty_message_set_status (message, sent_status, time_now);
 }
 
+static void
+chatty_chat_view_unmap (GtkWidget *widget)
+{
+  ChattyChatView *self = (ChattyChatView *)widget;
+
+  /* The chat is no longer shown, keep only what is needed to show it again */
+  chat_view_trim_messages (self, LAZY_LOAD_INITIAL_MSGS_LIMIT);
+
+  GTK_WIDGET_CLASS (chatty_chat_view_parent_class)->unmap (widget);
+}
+
+static void
+chatty_chat_view_dispose (GObject *object)
+{
+  ChattyChatView *self = (ChattyChatView *)object;
+
+  g_cancellable_cancel (self->history_cancellable);
+
+  /* Save the markups still queued, or they are generated again next time */
+  if (self->save_markup_id) {
+    g_clear_handle_id (&self->save_markup_id, g_source_remove);
+    chat_view_save_markup_cb (self);
+  }
+
+  G_OBJECT_CLASS (chatty_chat_view_parent_class)->dispose (object);
+}
+
 static void
 chatty_chat_view_finalize (GObject *object)
 {
   ChattyChatView *self = (ChattyChatView *)object;
 
   g_clear_object (&self->chat);
+  g_clear_object (&self->history_cancellable);
+  g_ptr_array_unref (self->markup_messages);
 
   G_OBJECT_CLASS (chatty_chat_view_parent_class)->finalize (object);
 }
@@ -953,8 +1049,13 @@ chatty_chat_view_class_init (ChattyChatViewClass *klass)
   GObjectClass   *object_class = G_OBJECT_CLASS (klass);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
 
+  object_class->dispose = chatty_chat_view_dispose;
   object_class->finalize = chatty_chat_view_finalize;
 
+  widget_class->unmap = chatty_chat_view_unmap;
+
+  g_type_ensure (CHATTY_TYPE_MESSAGE_LIST_VIEW);
+
   gtk_widget_class_set_template_from_resource (widget_class,
                                                "/sm/puri/chatty/"
                                                "ui/chatty-chat-view.ui");
@@ -992,7 +1093,10 @@ chatty_chat_view_init (ChattyChatView *self)
   GtkAdjustment *vadjustment;
 
   gtk_widget_init_template (GTK_WIDGET (self));
-  gtk_list_box_set_placeholder(GTK_LIST_BOX (self->message_list), self->empty_view);
+  chatty_message_list_view_set_placeholder (CHATTY_MESSAGE_LIST_VIEW (self->message_list),
+                                            self->empty_view);
+  self->history_cancellable = g_cancellable_new ();
+  self->markup_messages = g_ptr_array_new_with_free_func (g_object_unref);
 
   vadjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (self->scrolled_window));
   g_signal_connect_after (G_OBJECT (vadjustment), "notify::upper",
@@ -1045,19 +1149,18 @@ chatty_chat_view_set_chat (ChattyChatView *self,
   conv = chatty_chat_get_purple_conv (chat);
   self->chatty_conv = CHATTY_CONVERSATION (conv);
 
-  gtk_list_box_bind_model (GTK_LIST_BOX (self->message_list),
-                           chatty_chat_get_messages (self->chat),
-                           (GtkListBoxCreateWidgetFunc)chat_view_message_row_new,
-                           self, NULL);
-  g_signal_connect_object (chatty_chat_get_messages (self->chat),
-                           "items-changed",
-                           G_CALLBACK (messages_items_changed_cb),
-                           self,
-                           G_CONNECT_SWAPPED | G_CONNECT_AFTER);
+  chatty_message_list_view_bind_model (CHATTY_MESSAGE_LIST_VIEW (self->message_list),
+                                       chatty_chat_get_messages (self->chat),
+                                       (ChattyMessageListViewBindFunc)chat_view_bind_message_row,
+                                       self);
   g_signal_connect_object (self->chat, "notify::encrypt",
                            G_CALLBACK (chat_encrypt_changed_cb),
                            self,
                            G_CONNECT_SWAPPED);
+  g_signal_connect_object (self->chat, "changed",
+                           G_CALLBACK (chat_view_chat_changed_cb),
+                           self,
+                           G_CONNECT_SWAPPED);
 
   chat_encrypt_changed_cb (self);
   chatty_chat_view_update (self);
@@ -1077,10 +1180,9 @@ chatty_chat_view_load (ChattyChatView *self,
                        guint           limit)
 {
   g_autoptr(ChattyMessage) message = NULL;
-  GListModel *message_list;
   PurpleAccount *account;
   const gchar   *conv_name;
-  const char    *uid = NULL;
+  g_autofree char *who = NULL;
   gboolean       im;
 
   g_return_if_fail (CHATTY_IS_CHAT_VIEW (self));
@@ -1091,32 +1193,40 @@ chatty_chat_view_load (ChattyChatView *self,
   conv_name = purple_conversation_get_name (self->chatty_conv->conv);
   account = purple_conversation_get_account (self->chatty_conv->conv);
 
-  /* Get the uid of the first message */
-  message_list = chatty_chat_get_messages (self->chat);
-  message = g_list_model_get_item (message_list, 0);
-  if (message)
-    uid = chatty_message_get_uid (message);
+  /* Remove resource (user could be connecting from different devices/applications) */
+  if (im)
+    who = chatty_utils_jabber_id_strip (conv_name);
 
-  if (im) {
-    g_autofree char *who = NULL;
+  /* Wait for the page being loaded, the next one starts where it ends */
+  if (self->history_loading)
+    return;
 
-    /* Remove resource (user could be connecting from different devices/applications) */
-    who = chatty_utils_jabber_id_strip (conv_name);
+  /* All the history is loaded */
+  if (self->history_cursor_set && chatty_history_cursor_at_start (&self->history_cursor))
+    return;
 
-    chatty_history_get_im_messages (account->username,
-                                    who,
-                                    chatty_conv_get_im_messages_cb,
-                                    self,
-                                    limit,
-                                    uid);
-  } else {
-    chatty_history_get_chat_messages (account->username,
-                                      conv_name,
-                                      chatty_conv_get_chat_messages_cb,
-                                      self,
-                                      limit,
-                                      uid);
-  }
+  /*
+   * On the first load, start from the first message already in the chat (if
+   * any), so that it isn't loaded twice.  Later loads continue from the
+   * oldest message loaded so far.
+   */
+  if (!self->history_cursor_set)
+    message = g_list_model_get_item (chatty_chat_get_messages (self->chat), 0);
+
+  self->history_loading = TRUE;
+
+  if (im)
+    chatty_history_load_im_async (account->username, who, message,
+                                  self->history_cursor_set ? &self->history_cursor : NULL,
+                                  limit, self->history_cancellable,
+                                  chat_view_history_loaded_cb,
+                                  g_object_ref (self));
+  else
+    chatty_history_load_chat_async (account->username, conv_name, message,
+                                    self->history_cursor_set ? &self->history_cursor : NULL,
+                                    limit, self->history_cancellable,
+                                    chat_view_history_loaded_cb,
+                                    g_object_ref (self));
 }
 
 
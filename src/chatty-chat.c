@@ -17,9 +17,9 @@
 # include "config.h"
 #endif
 
-#include "contrib/gtk.h"
 #include "chatty-settings.h"
 #include "chatty-icons.h"
+#include "chatty-message-list.h"
 #include "chatty-utils.h"
 #include "users/chatty-pp-buddy.h"
 #include "users/chatty-pp-account.h"
@@ -53,15 +53,27 @@ struct _ChattyChat
 
   PurpleChat         *pp_chat;
   PurpleConversation *conv;
+  /* Room occupants, kept sorted with sort_chat_buddy() */
   GListStore         *chat_users;
-  GtkSortListModel   *sorted_chat_users;
-  GListStore         *message_store;
-
+  ChattyMessageList  *message_list;
+
+  /* Room occupants by name, owned by chat_users or pending_users */
+  GHashTable         *users_by_name;
+  /* Occupants who joined since the last main loop iteration */
+  GPtrArray          *pending_users;
+  guint               pending_users_id;
+  /* Occupants who left since, still in chat_users */
+  GPtrArray          *leaving_users;
+  guint               leaving_users_id;
+
+  /* The latest message, and its details cached for the chat list */
+  ChattyMessage      *last_msg;
   char               *last_message;
+  time_t              last_msg_time;
+  ChattyMsgDirection  last_msg_direction;
+
   char               *chat_name;
   guint               unread_count;
-  guint               last_msg_time;
-  e_msg_dir           last_msg_direction;
   ChattyEncryption    encrypt;
 };
 
@@ -71,6 +83,7 @@ enum {
   PROP_0,
   PROP_ENCRYPT,
   PROP_PURPLE_CHAT,
+  PROP_RESIDENT_MESSAGES,
   N_PROPS
 };
 
@@ -184,28 +197,331 @@ lurch_status_changed_cb (int      err,
 }
 
 static ChattyPpBuddy *
-chat_find_user (ChattyChat *self,
-                const char *user,
-                guint      *index)
+chat_find_user (ChattyChat  *self,
+                const char  *user,
+                const char **name)
+{
+  PurpleConvChatBuddy *cb = NULL;
+  PurpleConvChat *chat = NULL;
+  gpointer buddy = NULL, key = NULL;
+
+  g_assert (CHATTY_IS_CHAT (self));
+
+  if (g_hash_table_lookup_extended (self->users_by_name, user, &key, &buddy)) {
+    if (name)
+      *name = key;
+
+    return buddy;
+  }
+
+  /* libpurple may match the name in a different case */
+  if (self->conv)
+    chat = purple_conversation_get_chat_data (self->conv);
+
+  if (chat)
+    cb = purple_conv_chat_cb_find (chat, user);
+
+  if (cb && g_hash_table_lookup_extended (self->users_by_name, cb->name, &key, &buddy)) {
+    if (name)
+      *name = key;
+
+    return buddy;
+  }
+
+  return NULL;
+}
+
+static gint
+sort_pending_buddy (gconstpointer a,
+                    gconstpointer b)
+{
+  return sort_chat_buddy (*(ChattyPpBuddy **)a, *(ChattyPpBuddy **)b);
+}
+
+/*
+ * Find the position of @buddy in chat_users by bisecting the list.
+ * If @buddy has changed since it was sorted, say, if its role did,
+ * the list is searched item by item.
+ */
+static gboolean
+chat_find_user_position (ChattyChat    *self,
+                         ChattyPpBuddy *buddy,
+                         guint         *position)
 {
+  GListModel *model;
+  guint low = 0, high;
+
+  g_assert (CHATTY_IS_CHAT (self));
+
+  model = G_LIST_MODEL (self->chat_users);
+  high = g_list_model_get_n_items (model);
+
+  while (low < high) {
+    g_autoptr(ChattyPpBuddy) item = NULL;
+    guint mid;
+
+    mid = low + (high - low) / 2;
+    item = g_list_model_get_item (model, mid);
+
+    if (sort_chat_buddy (item, buddy) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  for (guint i = low; i < g_list_model_get_n_items (model); i++) {
+    g_autoptr(ChattyPpBuddy) item = NULL;
+
+    item = g_list_model_get_item (model, i);
+
+    if (item == buddy) {
+      *position = i;
+
+      return TRUE;
+    }
+
+    if (sort_chat_buddy (item, buddy) != 0)
+      break;
+  }
+
+  return chatty_utils_get_item_position (model, buddy, position);
+}
+
+/* Whether @buddy can be at @position without breaking the order */
+static gboolean
+chat_user_fits (ChattyChat    *self,
+                ChattyPpBuddy *buddy,
+                guint          position)
+{
+  GListModel *model;
   guint n_items;
 
   g_assert (CHATTY_IS_CHAT (self));
 
-  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->chat_users));
-  for (guint i = 0; i < n_items; i++) {
-    g_autoptr(ChattyPpBuddy) buddy = NULL;
+  model = G_LIST_MODEL (self->chat_users);
+  n_items = g_list_model_get_n_items (model);
+
+  if (position > 0) {
+    g_autoptr(ChattyPpBuddy) prev = NULL;
+
+    prev = g_list_model_get_item (model, position - 1);
+
+    if (sort_chat_buddy (prev, buddy) > 0)
+      return FALSE;
+  }
+
+  if (position + 1 < n_items) {
+    g_autoptr(ChattyPpBuddy) next = NULL;
+
+    next = g_list_model_get_item (model, position + 1);
 
-    buddy = g_list_model_get_item (G_LIST_MODEL (self->chat_users), i);
-    if (chatty_pp_buddy_get_id (buddy) == user) {
-      if (index)
-        *index = i;
+    if (sort_chat_buddy (buddy, next) > 0)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Replace the user at @position with @buddy, keeping the list sorted */
+static void
+chat_replace_user (ChattyChat    *self,
+                   guint          position,
+                   ChattyPpBuddy *buddy)
+{
+  g_assert (CHATTY_IS_CHAT (self));
+
+  if (chat_user_fits (self, buddy, position)) {
+    g_list_store_splice (self->chat_users, position, 1, (gpointer *)&buddy, 1);
+  } else {
+    g_object_ref (buddy);
+    g_list_store_remove (self->chat_users, position);
+    g_list_store_insert_sorted (self->chat_users, buddy,
+                                (GCompareDataFunc)sort_chat_buddy, NULL);
+    g_object_unref (buddy);
+  }
+}
+
+/* Remove the users who left from chat_users at once */
+static void
+chat_flush_leaving_users (ChattyChat *self)
+{
+  g_autoptr(GHashTable) removed = NULL;
+  g_autoptr(GPtrArray) kept = NULL;
+  guint first = G_MAXUINT, last = 0;
+
+  g_assert (CHATTY_IS_CHAT (self));
+
+  g_clear_handle_id (&self->leaving_users_id, g_source_remove);
+
+  if (!self->leaving_users->len)
+    return;
 
-      return buddy;
+  removed = g_hash_table_new (NULL, NULL);
+
+  for (guint i = 0; i < self->leaving_users->len; i++) {
+    ChattyPpBuddy *buddy = self->leaving_users->pdata[i];
+    guint position;
+
+    if (chat_find_user_position (self, buddy, &position)) {
+      g_hash_table_add (removed, buddy);
+      first = MIN (first, position);
+      last = MAX (last, position);
     }
   }
 
-  return NULL;
+  if (g_hash_table_size (removed)) {
+    /* Replace the span of the list from the first to the last removed user */
+    kept = g_ptr_array_new_with_free_func (g_object_unref);
+
+    for (guint i = first + 1; i < last; i++) {
+      g_autoptr(ChattyPpBuddy) buddy = NULL;
+
+      buddy = g_list_model_get_item (G_LIST_MODEL (self->chat_users), i);
+
+      if (!g_hash_table_contains (removed, buddy))
+        g_ptr_array_add (kept, g_steal_pointer (&buddy));
+    }
+
+    g_list_store_splice (self->chat_users, first, last - first + 1,
+                         kept->pdata, kept->len);
+  }
+
+  g_ptr_array_set_size (self->leaving_users, 0);
+}
+
+static gboolean
+chat_leaving_users_cb (gpointer user_data)
+{
+  ChattyChat *self = user_data;
+
+  g_assert (CHATTY_IS_CHAT (self));
+
+  self->leaving_users_id = 0;
+  chat_flush_leaving_users (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Forget @user, and queue them to be removed from chat_users.
+ * The chat buddy of @user is freed by libpurple once they have
+ * left, so @buddy keeps a copy of it until then.
+ */
+static void
+chat_queue_leaving_user (ChattyChat *self,
+                         const char *user)
+{
+  ChattyPpBuddy *buddy;
+  const char *name;
+
+  g_assert (CHATTY_IS_CHAT (self));
+
+  buddy = chat_find_user (self, user, &name);
+
+  if (!buddy)
+    return;
+
+  g_hash_table_remove (self->users_by_name, name);
+
+  /* Users who haven’t been added to the list model yet */
+  if (g_ptr_array_remove (self->pending_users, buddy))
+    return;
+
+  chatty_pp_buddy_keep_chat_buddy (buddy);
+  g_ptr_array_add (self->leaving_users, g_object_ref (buddy));
+}
+
+/* The position at which @buddy would be inserted in chat_users */
+static guint
+chat_find_insert_position (ChattyChat    *self,
+                           ChattyPpBuddy *buddy)
+{
+  GListModel *model;
+  guint low = 0, high;
+
+  g_assert (CHATTY_IS_CHAT (self));
+
+  model = G_LIST_MODEL (self->chat_users);
+  high = g_list_model_get_n_items (model);
+
+  while (low < high) {
+    g_autoptr(ChattyPpBuddy) item = NULL;
+    guint mid;
+
+    mid = low + (high - low) / 2;
+    item = g_list_model_get_item (model, mid);
+
+    if (sort_chat_buddy (item, buddy) <= 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+static void
+chat_flush_pending_users (ChattyChat *self)
+{
+  g_autoptr(GPtrArray) merged = NULL;
+  GListModel *model;
+  GPtrArray *pending;
+  guint first, n_items, i, j;
+
+  g_assert (CHATTY_IS_CHAT (self));
+
+  g_clear_handle_id (&self->pending_users_id, g_source_remove);
+  chat_flush_leaving_users (self);
+
+  pending = self->pending_users;
+
+  if (!pending->len)
+    return;
+
+  model = G_LIST_MODEL (self->chat_users);
+  g_ptr_array_sort (pending, sort_pending_buddy);
+  n_items = g_list_model_get_n_items (model);
+  first = chat_find_insert_position (self, pending->pdata[0]);
+
+  /*
+   * Merge the sorted pending users with the users after the place of
+   * the first of them, so that the list is changed only once.  When
+   * joining a room all users come before the list is populated, and
+   * are just appended.
+   */
+  merged = g_ptr_array_new_full (n_items - first + pending->len, g_object_unref);
+
+  for (i = first, j = 0; i < n_items || j < pending->len;) {
+    g_autoptr(ChattyPpBuddy) item = NULL;
+
+    if (i < n_items)
+      item = g_list_model_get_item (model, i);
+
+    if (item && (j == pending->len || sort_chat_buddy (item, pending->pdata[j]) <= 0)) {
+      g_ptr_array_add (merged, g_steal_pointer (&item));
+      i++;
+    } else {
+      g_ptr_array_add (merged, g_object_ref (pending->pdata[j]));
+      j++;
+    }
+  }
+
+  g_list_store_splice (self->chat_users, first, n_items - first,
+                       merged->pdata, merged->len);
+  g_ptr_array_set_size (pending, 0);
+}
+
+static gboolean
+chat_pending_users_cb (gpointer user_data)
+{
+  ChattyChat *self = user_data;
+
+  g_assert (CHATTY_IS_CHAT (self));
+
+  self->pending_users_id = 0;
+  chat_flush_pending_users (self);
+
+  return G_SOURCE_REMOVE;
 }
 
 static void
@@ -313,6 +629,43 @@ chatty_chat_get_avatar (ChattyItem *item)
   return NULL;
 }
 
+static void
+chat_update_last_message (ChattyChat *self)
+{
+  ChattyMessage *message;
+  char *preview;
+
+  message = chatty_message_list_get_last (self->message_list);
+
+  if (!message || message == self->last_msg)
+    return;
+
+  g_set_object (&self->last_msg, message);
+  self->last_msg_time = chatty_message_get_time (message);
+  self->last_msg_direction = chatty_message_get_msg_direction (message);
+
+  preview = purple_markup_strip_html (chatty_message_get_text (message));
+  g_free (self->last_message);
+  self->last_message = g_strstrip (preview);
+}
+
+static void
+chat_messages_items_changed_cb (ChattyChat *self,
+                                guint       position,
+                                guint       removed,
+                                guint       added)
+{
+  g_assert (CHATTY_IS_CHAT (self));
+
+  /* The latest message is kept when older ones are released */
+  if (added &&
+      position + added == g_list_model_get_n_items (G_LIST_MODEL (self->message_list)))
+    chat_update_last_message (self);
+
+  if (removed != added)
+    g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_RESIDENT_MESSAGES]);
+}
+
 static void
 chatty_chat_get_property (GObject    *object,
                           guint       prop_id,
@@ -327,6 +680,10 @@ chatty_chat_get_property (GObject    *object,
       g_value_set_boolean (value, self->encrypt == CHATTY_ENCRYPTION_ENABLED);
       break;
 
+    case PROP_RESIDENT_MESSAGES:
+      g_value_set_uint (value, chatty_chat_get_resident_messages (self));
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -361,11 +718,15 @@ chatty_chat_finalize (GObject *object)
 {
   ChattyChat *self = (ChattyChat *)object;
 
+  g_clear_handle_id (&self->pending_users_id, g_source_remove);
   g_list_store_remove_all (self->chat_users);
-  g_list_store_remove_all (self->message_store);
-  g_object_unref (self->message_store);
+  g_ptr_array_unref (self->pending_users);
+  g_clear_handle_id (&self->leaving_users_id, g_source_remove);
+  g_ptr_array_unref (self->leaving_users);
+  g_hash_table_unref (self->users_by_name);
+  g_object_unref (self->message_list);
   g_object_unref (self->chat_users);
-  g_object_unref (self->sorted_chat_users);
+  g_clear_object (&self->last_msg);
   g_free (self->last_message);
   g_free (self->chat_name);
 
@@ -400,6 +761,13 @@ chatty_chat_class_init (ChattyChatClass *klass)
                           "The PurpleChat to be used to create the object",
                           G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
+  properties[PROP_RESIDENT_MESSAGES] =
+    g_param_spec_uint ("resident-messages",
+                       "Resident Messages",
+                       "The number of messages kept in memory",
+                       0, G_MAXUINT, 0,
+                       G_PARAM_READABLE | G_PARAM_EXPLICIT_NOTIFY | G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (object_class, N_PROPS, properties);
 
   /**
@@ -420,13 +788,15 @@ chatty_chat_class_init (ChattyChatClass *klass)
 static void
 chatty_chat_init (ChattyChat *self)
 {
-  g_autoptr(GtkSorter) sorter = NULL;
-
-  sorter = gtk_custom_sorter_new ((GCompareDataFunc)sort_chat_buddy, NULL, NULL);
   self->chat_users = g_list_store_new (CHATTY_TYPE_PP_BUDDY);
-  self->sorted_chat_users = gtk_sort_list_model_new (G_LIST_MODEL (self->chat_users), sorter);
-
-  self->message_store = g_list_store_new (CHATTY_TYPE_MESSAGE);
+  self->users_by_name = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->pending_users = g_ptr_array_new_with_free_func (g_object_unref);
+  self->leaving_users = g_ptr_array_new_with_free_func (g_object_unref);
+
+  self->message_list = chatty_message_list_new ();
+  g_signal_connect_object (self->message_list, "items-changed",
+                           G_CALLBACK (chat_messages_items_changed_cb), self,
+                           G_CONNECT_SWAPPED);
 }
 
 
@@ -671,7 +1041,7 @@ chatty_chat_get_messages (ChattyChat *self)
 {
   g_return_val_if_fail (CHATTY_IS_CHAT (self), NULL);
 
-  return G_LIST_MODEL (self->message_store);
+  return G_LIST_MODEL (self->message_list);
 }
 
 
@@ -684,7 +1054,7 @@ chatty_chat_find_message_with_id (ChattyChat *self,
   g_return_val_if_fail (CHATTY_IS_CHAT (self), NULL);
   g_return_val_if_fail (id, NULL);
 
-  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->message_store));
+  n_items = g_list_model_get_n_items (G_LIST_MODEL (self->message_list));
 
   if (n_items == 0)
     return NULL;
@@ -694,7 +1064,7 @@ chatty_chat_find_message_with_id (ChattyChat *self,
     g_autoptr(ChattyMessage) message = NULL;
     const char *message_id;
 
-    message = g_list_model_get_item (G_LIST_MODEL (self->message_store), i - 1);
+    message = g_list_model_get_item (G_LIST_MODEL (self->message_list), i - 1);
     message_id = chatty_message_get_id (message);
 
     /*
@@ -711,6 +1081,16 @@ chatty_chat_find_message_with_id (ChattyChat *self,
   return NULL;
 }
 
+/**
+ * chatty_chat_append_message:
+ * @self: a #ChattyChat
+ * @message: A #ChattyMessage
+ *
+ * Add a new @message to @self.  The message is placed
+ * by its time, after the messages with the same time,
+ * so that messages from the archive received late
+ * don’t end up at the bottom.
+ */
 void
 chatty_chat_append_message (ChattyChat    *self,
                             ChattyMessage *message)
@@ -718,10 +1098,19 @@ chatty_chat_append_message (ChattyChat    *self,
   g_return_if_fail (CHATTY_IS_CHAT (self));
   g_return_if_fail (CHATTY_IS_MESSAGE (message));
 
-  g_list_store_append (self->message_store, message);
+  chatty_message_list_add (self->message_list, message, FALSE);
   g_signal_emit (self, signals[CHANGED], 0);
 }
 
+/**
+ * chatty_chat_prepend_message:
+ * @self: a #ChattyChat
+ * @message: A #ChattyMessage
+ *
+ * Add an older @message to @self, say, from history.
+ * The message is placed by its time, before the
+ * messages with the same time.
+ */
 void
 chatty_chat_prepend_message (ChattyChat    *self,
                              ChattyMessage *message)
@@ -729,10 +1118,80 @@ chatty_chat_prepend_message (ChattyChat    *self,
   g_return_if_fail (CHATTY_IS_CHAT (self));
   g_return_if_fail (CHATTY_IS_MESSAGE (message));
 
-  g_list_store_insert (self->message_store, 0, message);
+  chatty_message_list_add (self->message_list, message, TRUE);
+  g_signal_emit (self, signals[CHANGED], 0);
+}
+
+/**
+ * chatty_chat_prepend_messages:
+ * @self: a #ChattyChat
+ * @messages: A #GPtrArray of #ChattyMessage
+ *
+ * Same as chatty_chat_prepend_message(), but for
+ * a batch of @messages, like a page of history.
+ * Each message is placed by its time, and the
+ * message model and @self are notified once.
+ */
+void
+chatty_chat_prepend_messages (ChattyChat *self,
+                              GPtrArray  *messages)
+{
+  g_return_if_fail (CHATTY_IS_CHAT (self));
+  g_return_if_fail (messages);
+
+  if (messages->len == 0)
+    return;
+
+  chatty_message_list_add_messages (self->message_list, messages, TRUE);
   g_signal_emit (self, signals[CHANGED], 0);
 }
 
+/**
+ * chatty_chat_trim_messages:
+ * @self: a #ChattyChat
+ * @n_keep: The number of messages to keep
+ *
+ * Release the oldest messages of @self, keeping the
+ * latest @n_keep ones.  The released messages are
+ * still in the history, and can be loaded again.
+ *
+ * Returns: The number of messages released
+ */
+guint
+chatty_chat_trim_messages (ChattyChat *self,
+                           guint       n_keep)
+{
+  guint n_removed;
+
+  g_return_val_if_fail (CHATTY_IS_CHAT (self), 0);
+
+  n_removed = chatty_message_list_trim (self->message_list, n_keep);
+
+  if (n_removed)
+    g_debug ("Released %u messages of ‘%s’, %u kept", n_removed,
+             chatty_item_get_name (CHATTY_ITEM (self)),
+             chatty_chat_get_resident_messages (self));
+
+  return n_removed;
+}
+
+/**
+ * chatty_chat_get_resident_messages:
+ * @self: a #ChattyChat
+ *
+ * Get the number of messages of @self kept in memory,
+ * which is useful to diagnose memory usage.
+ *
+ * Returns: The number of messages
+ */
+guint
+chatty_chat_get_resident_messages (ChattyChat *self)
+{
+  g_return_val_if_fail (CHATTY_IS_CHAT (self), 0);
+
+  return g_list_model_get_n_items (G_LIST_MODEL (self->message_list));
+}
+
 /**
  * chatty_chat_add_users:
  * @self: a #ChattyChat
@@ -742,29 +1201,34 @@ chatty_chat_prepend_message (ChattyChat    *self,
  * @self.  This function only adds the items to
  * the internal list model, so that it can be
  * used to create widgets.
+ *
+ * Users added until the next main loop iteration
+ * are added to the list model at once, as servers
+ * tell about each user joining a room separately.
  */
 void
 chatty_chat_add_users (ChattyChat *self,
                        GList      *users)
 {
   ChattyPpBuddy *buddy;
-  GPtrArray *users_array;
 
   g_return_if_fail (CHATTY_IS_CHAT (self));
 
-  users_array = g_ptr_array_new_with_free_func (g_object_unref);
-
   for (GList *node = users; node; node = node->next) {
+    PurpleConvChatBuddy *cb = node->data;
+
+    if (g_hash_table_contains (self->users_by_name, cb->name))
+      continue;
+
     buddy = g_object_new (CHATTY_TYPE_PP_BUDDY,
-                          "chat-buddy", node->data, NULL);
+                          "chat-buddy", cb, NULL);
     chatty_pp_buddy_set_chat (buddy, self->conv);
-    g_ptr_array_add (users_array, buddy);
+    g_hash_table_insert (self->users_by_name, g_strdup (cb->name), buddy);
+    g_ptr_array_add (self->pending_users, buddy);
   }
 
-  g_list_store_splice (self->chat_users, 0, 0,
-                       users_array->pdata, users_array->len);
-
-  g_ptr_array_free (users_array, TRUE);
+  if (self->pending_users->len && !self->pending_users_id)
+    self->pending_users_id = g_idle_add (chat_pending_users_cb, self);
 }
 
 
@@ -773,32 +1237,109 @@ chatty_chat_add_users (ChattyChat *self,
  * @self: a #ChattyChat
  * @users: A #GList of removed users
  *
- * Remove a #GList of `const char*` users to
- * @self.  This function only remove the items
- * the internal list model, so that it can be
- * used to create widgets.
+ * Remove a #GList of `const char*` users from
+ * @self.  This function only removes the items
+ * from the internal list model, so that it can
+ * be used to create widgets.  The list model is
+ * changed only once for all @users, and for the
+ * users who left before.
+ */
+void
+chatty_chat_remove_users (ChattyChat *self,
+                          GList      *users)
+{
+  g_return_if_fail (CHATTY_IS_CHAT (self));
+
+  for (GList *node = users; node; node = node->next)
+    chat_queue_leaving_user (self, node->data);
+
+  chat_flush_leaving_users (self);
+}
+
+
+/**
+ * chatty_chat_remove_user:
+ * @self: a #ChattyChat
+ * @user: The name of the removed user
+ *
+ * Remove @user from @self.  See chatty_chat_remove_users().
+ *
+ * Users leaving until the next main loop iteration
+ * are removed from the list model at once, as servers
+ * tell about each user leaving a room separately.
+ * This should be called while the #PurpleConvChatBuddy
+ * of @user is still in the conversation.
  */
 void
 chatty_chat_remove_user (ChattyChat *self,
                          const char *user)
+{
+  g_return_if_fail (CHATTY_IS_CHAT (self));
+  g_return_if_fail (user);
+
+  chat_queue_leaving_user (self, user);
+
+  if (self->leaving_users->len && !self->leaving_users_id)
+    self->leaving_users_id = g_idle_add (chat_leaving_users_cb, self);
+}
+
+
+/**
+ * chatty_chat_rename_user:
+ * @self: a #ChattyChat
+ * @old_name: The previous name of the user
+ * @new_name: The new name of the user
+ *
+ * Replace the user named @old_name with the
+ * #PurpleConvChatBuddy named @new_name in the
+ * conversation of @self.  The user is moved in
+ * the list model only if the new name sorts at
+ * a different place.
+ */
+void
+chatty_chat_rename_user (ChattyChat *self,
+                         const char *old_name,
+                         const char *new_name)
 {
   PurpleConvChatBuddy *cb = NULL;
-  PurpleConvChat *chat;
-  ChattyPpBuddy *buddy = NULL;
+  PurpleConvChat *chat = NULL;
+  ChattyPpBuddy *buddy, *new_buddy;
+  const char *name;
   guint index;
 
   g_return_if_fail (CHATTY_IS_CHAT (self));
+  g_return_if_fail (old_name);
+  g_return_if_fail (new_name);
+
+  buddy = chat_find_user (self, old_name, &name);
 
-  chat  = purple_conversation_get_chat_data (self->conv);
+  if (self->conv)
+    chat = purple_conversation_get_chat_data (self->conv);
 
   if (chat)
-    cb = purple_conv_chat_cb_find (chat, user);
+    cb = purple_conv_chat_cb_find (chat, new_name);
+
+  if (!buddy || !cb)
+    return;
+
+  new_buddy = g_object_new (CHATTY_TYPE_PP_BUDDY,
+                            "chat-buddy", cb, NULL);
+  chatty_pp_buddy_set_chat (new_buddy, self->conv);
+
+  g_hash_table_remove (self->users_by_name, name);
+  g_hash_table_insert (self->users_by_name, g_strdup (cb->name), new_buddy);
+
+  if (g_ptr_array_find (self->pending_users, buddy, &index)) {
+    self->pending_users->pdata[index] = new_buddy;
+    g_object_unref (buddy);
 
-  if (cb)
-    buddy = chat_find_user (self, cb->name, &index);
+    return;
+  }
+
+  if (chat_find_user_position (self, buddy, &index))
+    chat_replace_user (self, index, new_buddy);
 
-  if (buddy)
-    g_list_store_remove (self->chat_users, index);
+  g_object_unref (new_buddy);
 }
 
 GListModel *
@@ -806,7 +1347,9 @@ chatty_chat_get_users (ChattyChat *self)
 {
   g_return_val_if_fail (CHATTY_IS_CHAT (self), NULL);
 
-  return G_LIST_MODEL (self->sorted_chat_users);
+  chat_flush_pending_users (self);
+
+  return G_LIST_MODEL (self->chat_users);
 }
 
 
@@ -826,35 +1369,46 @@ chatty_chat_emit_user_changed (ChattyChat *self,
                                const char *user)
 {
   ChattyPpBuddy *buddy;
+  guint position;
 
   g_return_if_fail (CHATTY_IS_CHAT (self));
   g_return_if_fail (user);
 
   buddy = chat_find_user (self, user, NULL);
 
-  if (buddy)
-    g_signal_emit_by_name (buddy, "changed");
+  if (!buddy)
+    return;
+
+  /* The role of the user may have changed, which changes the order */
+  if (!g_ptr_array_find (self->pending_users, buddy, NULL) &&
+      chat_find_user_position (self, buddy, &position) &&
+      !chat_user_fits (self, buddy, position))
+    chat_replace_user (self, position, buddy);
+
+  g_signal_emit_by_name (buddy, "changed");
 }
 
 
+/**
+ * chatty_chat_get_last_message:
+ * @self: a #ChattyChat
+ *
+ * Get the text of the latest message of @self, without
+ * HTML and surrounding whitespace, to preview it.  This
+ * is cached, so that it's cheap to get for every update
+ * of the chat list.
+ *
+ * Returns: (transfer none): The text, or an empty string
+ */
 const char *
 chatty_chat_get_last_message (ChattyChat *self)
 {
-  g_autoptr(ChattyMessage) message = NULL;
-  GListModel *model;
-  guint n_items;
-
   g_return_val_if_fail (CHATTY_IS_CHAT (self), "");
 
-  model = G_LIST_MODEL (self->message_store);
-  n_items = g_list_model_get_n_items (model);
-
-  if (n_items == 0)
+  if (!self->last_message)
     return "";
 
-  message = g_list_model_get_item (model, n_items - 1);
-
-  return chatty_message_get_text (message);
+  return self->last_message;
 }
 
 guint
@@ -878,24 +1432,38 @@ chatty_chat_set_unread_count (ChattyChat *self,
   g_signal_emit (self, signals[CHANGED], 0);
 }
 
+/**
+ * chatty_chat_get_last_msg_time:
+ * @self: a #ChattyChat
+ *
+ * Get the time of the latest message of @self.  This is
+ * cached, as it's compared when sorting the chat list.
+ *
+ * Returns: The time, or 0 if @self has no message
+ */
 time_t
 chatty_chat_get_last_msg_time (ChattyChat *self)
 {
-  g_autoptr(ChattyMessage) message = NULL;
-  GListModel *model;
-  guint n_items;
-
   g_return_val_if_fail (CHATTY_IS_CHAT (self), 0);
 
-  model = G_LIST_MODEL (self->message_store);
-  n_items = g_list_model_get_n_items (model);
-
-  if (n_items == 0)
-    return 0;
+  return self->last_msg_time;
+}
 
-  message = g_list_model_get_item (model, n_items - 1);
+/**
+ * chatty_chat_get_last_msg_direction:
+ * @self: a #ChattyChat
+ *
+ * Get the direction of the latest message of @self.
+ *
+ * Returns: The direction, or %CHATTY_DIRECTION_UNKNOWN
+ * if @self has no message
+ */
+ChattyMsgDirection
+chatty_chat_get_last_msg_direction (ChattyChat *self)
+{
+  g_return_val_if_fail (CHATTY_IS_CHAT (self), CHATTY_DIRECTION_UNKNOWN);
 
-  return chatty_message_get_time (message);
+  return self->last_msg_direction;
 }
 
 ChattyEncryption
@@ -54,10 +54,20 @@ void                chatty_chat_append_message       (ChattyChat         *self,
                                                        ChattyMessage      *message);
 void                chatty_chat_prepend_message       (ChattyChat         *self,
                                                        ChattyMessage      *message);
+void                chatty_chat_prepend_messages      (ChattyChat         *self,
+                                                       GPtrArray          *messages);
+guint               chatty_chat_trim_messages         (ChattyChat         *self,
+                                                       guint               n_keep);
+guint               chatty_chat_get_resident_messages (ChattyChat         *self);
 void                chatty_chat_add_users             (ChattyChat         *self,
                                                        GList              *users);
+void                chatty_chat_remove_users          (ChattyChat         *self,
+                                                       GList              *users);
 void                chatty_chat_remove_user           (ChattyChat         *self,
                                                        const char         *user);
+void                chatty_chat_rename_user           (ChattyChat         *self,
+                                                       const char         *old_name,
+                                                       const char         *new_name);
 GListModel         *chatty_chat_get_users             (ChattyChat         *self);
 ChattyPpBuddy      *chatty_chat_find_user             (ChattyChat         *self,
                                                        const char         *username);
@@ -68,6 +78,7 @@ guint               chatty_chat_get_unread_count      (ChattyChat         *self)
 void                chatty_chat_set_unread_count      (ChattyChat         *self,
                                                        guint               unread_count);
 time_t              chatty_chat_get_last_msg_time      (ChattyChat        *self);
+ChattyMsgDirection  chatty_chat_get_last_msg_direction (ChattyChat        *self);
 ChattyEncryption    chatty_chat_get_encryption_status  (ChattyChat        *self);
 void                chatty_chat_load_encryption_status (ChattyChat        *self);
 void                chatty_chat_set_encryption         (ChattyChat        *self,
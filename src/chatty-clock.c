@@ -0,0 +1,439 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-clock.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-clock"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <glib/gi18n.h>
+
+#include "chatty-clock.h"
+
+/**
+ * SECTION: chatty-clock
+ * @title: ChattyClock
+ * @short_description: Format times relative to now
+ * @include: "chatty-clock.h"
+ *
+ * #ChattyClock formats times for display, like the time of the last
+ * message of a chat, and tells when such strings change as time goes
+ * by.
+ *
+ * A relative time like “~3h” only changes at certain boundaries, which
+ * chatty_clock_get_time_ago() returns.  A watch added for that time
+ * with chatty_clock_add_watch() is called once it's reached, so that
+ * only the strings that changed are updated.  All the watches share a
+ * single timeout, set for the earliest of them.
+ *
+ * The clock format of the desktop is read once, and kept updated.
+ */
+
+/* https://gitlab.gnome.org/GNOME/gsettings-desktop-schemas/-/blob/master/schemas/org.gnome.desktop.interface.gschema.xml.in */
+#define INTERFACE_SCHEMA  "org.gnome.desktop.interface"
+#define CLOCK_FORMAT_24H  0
+#define CLOCK_FORMAT_12H  1
+
+#define SECONDS_PER_MINUTE  60
+#define SECONDS_PER_HOUR    3600
+#define SECONDS_PER_DAY     86400
+
+typedef struct {
+  GSequenceIter   *iter;
+  time_t           when;
+  guint            id;
+  ChattyClockFunc  callback;
+  gpointer         user_data;
+} ClockWatch;
+
+struct _ChattyClock
+{
+  GObject     parent_instance;
+
+  GSettings  *interface_settings;
+  int         clock_format;
+
+  /* Sorted by time, then by id */
+  GSequence  *watches;
+  GHashTable *watch_ids;
+  guint       last_watch_id;
+  guint       timeout_id;
+  /* The time watches are run for, while they are */
+  time_t      dispatch_time;
+};
+
+G_DEFINE_TYPE (ChattyClock, chatty_clock, G_TYPE_OBJECT)
+
+static int
+clock_watch_compare (gconstpointer a,
+                     gconstpointer b,
+                     gpointer      user_data)
+{
+  const ClockWatch *watch_a = a;
+  const ClockWatch *watch_b = b;
+
+  if (watch_a->when != watch_b->when)
+    return watch_a->when < watch_b->when ? -1 : 1;
+
+  return watch_a->id < watch_b->id ? -1 : watch_a->id > watch_b->id;
+}
+
+static void clock_schedule (ChattyClock *self);
+
+static gboolean
+clock_timeout_cb (gpointer user_data)
+{
+  ChattyClock *self = user_data;
+
+  g_assert (CHATTY_IS_CLOCK (self));
+
+  self->timeout_id = 0;
+  self->dispatch_time = time (NULL);
+
+  /* Watches added meanwhile are run at the next second at the earliest */
+  while (g_sequence_get_length (self->watches) > 0)
+    {
+      ChattyClockFunc callback;
+      ClockWatch *watch;
+      gpointer data;
+
+      watch = g_sequence_get (g_sequence_get_begin_iter (self->watches));
+
+      if (watch->when > self->dispatch_time)
+        break;
+
+      callback = watch->callback;
+      data = watch->user_data;
+      g_hash_table_remove (self->watch_ids, GUINT_TO_POINTER (watch->id));
+      g_sequence_remove (watch->iter);
+
+      callback (data);
+    }
+
+  self->dispatch_time = 0;
+  clock_schedule (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+clock_schedule (ChattyClock *self)
+{
+  ClockWatch *watch;
+  time_t delay;
+
+  g_assert (CHATTY_IS_CLOCK (self));
+
+  if (self->dispatch_time)
+    return;
+
+  g_clear_handle_id (&self->timeout_id, g_source_remove);
+
+  if (g_sequence_get_length (self->watches) == 0)
+    return;
+
+  watch = g_sequence_get (g_sequence_get_begin_iter (self->watches));
+  delay = watch->when - time (NULL);
+  delay = CLAMP (delay, 0, G_MAXUINT);
+
+  self->timeout_id = g_timeout_add_seconds (delay, clock_timeout_cb, self);
+}
+
+static void
+clock_format_changed_cb (ChattyClock *self)
+{
+  g_assert (CHATTY_IS_CLOCK (self));
+
+  self->clock_format = g_settings_get_enum (self->interface_settings, "clock-format");
+}
+
+static void
+chatty_clock_finalize (GObject *object)
+{
+  ChattyClock *self = (ChattyClock *)object;
+
+  g_clear_handle_id (&self->timeout_id, g_source_remove);
+  g_clear_object (&self->interface_settings);
+  g_hash_table_unref (self->watch_ids);
+  g_sequence_free (self->watches);
+
+  G_OBJECT_CLASS (chatty_clock_parent_class)->finalize (object);
+}
+
+static void
+chatty_clock_class_init (ChattyClockClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = chatty_clock_finalize;
+}
+
+static void
+chatty_clock_init (ChattyClock *self)
+{
+  GSettingsSchemaSource *source;
+  GSettingsSchema *schema = NULL;
+
+  self->watches = g_sequence_new (g_free);
+  self->watch_ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+  self->clock_format = CLOCK_FORMAT_24H;
+
+  /* The schema may not be installed, say, when running tests */
+  source = g_settings_schema_source_get_default ();
+
+  if (source)
+    schema = g_settings_schema_source_lookup (source, INTERFACE_SCHEMA, TRUE);
+
+  if (schema)
+    {
+      self->interface_settings = g_settings_new (INTERFACE_SCHEMA);
+      g_signal_connect_object (self->interface_settings, "changed::clock-format",
+                               G_CALLBACK (clock_format_changed_cb), self,
+                               G_CONNECT_SWAPPED);
+      clock_format_changed_cb (self);
+      g_settings_schema_unref (schema);
+    }
+}
+
+/**
+ * chatty_clock_get_default:
+ *
+ * Get the default clock
+ *
+ * Returns: (transfer none): A #ChattyClock.
+ */
+ChattyClock *
+chatty_clock_get_default (void)
+{
+  static ChattyClock *self;
+
+  if (!self)
+    {
+      self = g_object_new (CHATTY_TYPE_CLOCK, NULL);
+      g_object_add_weak_pointer (G_OBJECT (self), (gpointer *)&self);
+    }
+
+  return self;
+}
+
+/**
+ * chatty_clock_get_human_time:
+ * @self: A #ChattyClock
+ * @unix_time: A UNIX time
+ *
+ * Format @unix_time as the time for today, the day of
+ * the week and the time for the last week, and as the
+ * date otherwise.
+ *
+ * Returns: (transfer full): The time as string
+ */
+char *
+chatty_clock_get_human_time (ChattyClock *self,
+                             time_t       unix_time)
+{
+  g_autoptr(GDateTime) now = NULL;
+  g_autoptr(GDateTime) utc_time = NULL;
+  g_autoptr(GDateTime) local_time = NULL;
+  gint year_now, month_now, day_now;
+  gint year, month, day;
+
+  g_return_val_if_fail (CHATTY_IS_CLOCK (self), g_strdup (""));
+  g_return_val_if_fail (unix_time >= 0, g_strdup (""));
+
+  now = g_date_time_new_now_local ();
+  utc_time = g_date_time_new_from_unix_utc (unix_time);
+  local_time = g_date_time_to_local (utc_time);
+
+  g_date_time_get_ymd (now, &year_now, &month_now, &day_now);
+  g_date_time_get_ymd (local_time, &year, &month, &day);
+
+  if (year  == year_now &&
+      month == month_now)
+    {
+      /* Time Format */
+      if (day == day_now && self->clock_format == CLOCK_FORMAT_24H)
+        return g_date_time_format (local_time, "%R");
+      else if (day == day_now)
+        /* TRANSLATORS: Time format with time in AM/PM format */
+        return g_date_time_format (local_time, _("%I:%M %p"));
+
+      /* Localized day name */
+      if (day_now - day <= 7 && self->clock_format == CLOCK_FORMAT_24H)
+        /* TRANSLATORS: Time format as supported by g_date_time_format() */
+        return g_date_time_format (local_time, _("%A %R"));
+      else if (day_now - day <= 7)
+        /* TRANSLATORS: Time format with day and time in AM/PM format */
+        return g_date_time_format (local_time, _("%A %I:%M %p"));
+    }
+
+  /* TRANSLATORS: Year format as supported by g_date_time_format() */
+  return g_date_time_format (local_time, _("%Y-%m-%d"));
+}
+
+/**
+ * chatty_clock_get_time_ago:
+ * @self: A #ChattyClock
+ * @unix_time: A UNIX time in the past
+ * @next_change: (out) (optional): Return location for
+ *   the time the string changes
+ *
+ * Format how long ago @unix_time was, like “<30s” or
+ * “~3h”, based on the Ruby on Rails method
+ * ‘distance_of_time_in_words’.  Times more than a day
+ * ago are formatted as the date.
+ *
+ * @next_change is set to the time the string for
+ * @unix_time will change, or to 0 if it won't.
+ *
+ * Returns: (transfer full): The time as string
+ */
+char *
+chatty_clock_get_time_ago (ChattyClock *self,
+                           time_t       unix_time,
+                           time_t      *next_change)
+{
+  const char *prefix = "";
+  const char *unit;
+  time_t distance, change;
+  int number;
+
+  g_return_val_if_fail (CHATTY_IS_CLOCK (self), g_strdup (""));
+
+  /* Times from a clock running ahead are now */
+  distance = MAX (time (NULL) - unix_time, 0);
+
+  if (distance < 15) {
+    prefix = "<";
+    number = 15;
+    unit = _("s");
+    change = 15;
+  } else if (distance < 30) {
+    prefix = "<";
+    number = 30;
+    unit = _("s");
+    change = 30;
+  } else if (distance < SECONDS_PER_MINUTE) {
+    prefix = "<";
+    number = 1;
+    unit = _("m");
+    change = SECONDS_PER_MINUTE;
+  } else if (distance < 2 * SECONDS_PER_MINUTE) {
+    prefix = "~";
+    number = 1;
+    unit = _("m");
+    change = 2 * SECONDS_PER_MINUTE;
+  } else if (distance < 45 * SECONDS_PER_MINUTE) {
+    number = distance / SECONDS_PER_MINUTE;
+    unit = _("m");
+    change = (number + 1) * SECONDS_PER_MINUTE;
+  } else if (distance < 90 * SECONDS_PER_MINUTE) {
+    prefix = "~";
+    number = 1;
+    unit = _("h");
+    change = 90 * SECONDS_PER_MINUTE;
+  } else if (distance < SECONDS_PER_DAY) {
+    prefix = "~";
+    number = distance / SECONDS_PER_HOUR;
+    unit = _("h");
+    change = (number + 1) * SECONDS_PER_HOUR;
+  } else {
+    g_autoptr(GDateTime) utc_time = NULL;
+    g_autoptr(GDateTime) local_time = NULL;
+
+    if (next_change)
+      *next_change = 0;
+
+    utc_time = g_date_time_new_from_unix_utc (unix_time);
+    local_time = g_date_time_to_local (utc_time);
+
+    return g_date_time_format (local_time, "%d.%m.%y");
+  }
+
+  if (next_change)
+    *next_change = unix_time + change;
+
+  return g_strdup_printf ("%s%d%s", prefix, number, unit);
+}
+
+/**
+ * chatty_clock_add_watch:
+ * @self: A #ChattyClock
+ * @when: A UNIX time
+ * @callback: The function to call at @when
+ * @user_data: The data for @callback
+ *
+ * Call @callback once @when is reached, say, the time
+ * returned by chatty_clock_get_time_ago() as the next
+ * change.  The watch is removed once @callback is called.
+ *
+ * The watch should be removed with chatty_clock_remove_watch()
+ * if @user_data is gone before.
+ *
+ * Returns: The id of the watch
+ */
+guint
+chatty_clock_add_watch (ChattyClock     *self,
+                        time_t           when,
+                        ChattyClockFunc  callback,
+                        gpointer         user_data)
+{
+  ClockWatch *watch;
+
+  g_return_val_if_fail (CHATTY_IS_CLOCK (self), 0);
+  g_return_val_if_fail (callback, 0);
+
+  /* Don't run watches added by a watch in the same loop */
+  if (self->dispatch_time && when <= self->dispatch_time)
+    when = self->dispatch_time + 1;
+
+  watch = g_new0 (ClockWatch, 1);
+  watch->when = when;
+  watch->id = ++self->last_watch_id;
+  watch->callback = callback;
+  watch->user_data = user_data;
+  watch->iter = g_sequence_insert_sorted (self->watches, watch,
+                                          clock_watch_compare, NULL);
+  g_hash_table_insert (self->watch_ids, GUINT_TO_POINTER (watch->id), watch);
+
+  if (g_sequence_iter_is_begin (watch->iter))
+    clock_schedule (self);
+
+  return watch->id;
+}
+
+/**
+ * chatty_clock_remove_watch:
+ * @self: A #ChattyClock
+ * @watch_id: The id of a watch
+ *
+ * Remove the watch @watch_id, as returned by
+ * chatty_clock_add_watch(), without calling it.
+ * Nothing is done if the watch was already called.
+ */
+void
+chatty_clock_remove_watch (ChattyClock *self,
+                           guint        watch_id)
+{
+  ClockWatch *watch;
+  gboolean first;
+
+  g_return_if_fail (CHATTY_IS_CLOCK (self));
+
+  watch = g_hash_table_lookup (self->watch_ids, GUINT_TO_POINTER (watch_id));
+
+  if (!watch)
+    return;
+
+  g_hash_table_remove (self->watch_ids, GUINT_TO_POINTER (watch_id));
+  first = g_sequence_iter_is_begin (watch->iter);
+  g_sequence_remove (watch->iter);
+
+  if (first)
+    clock_schedule (self);
+}
@@ -0,0 +1,34 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-clock.h
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define CHATTY_TYPE_CLOCK (chatty_clock_get_type ())
+
+G_DECLARE_FINAL_TYPE (ChattyClock, chatty_clock, CHATTY, CLOCK, GObject)
+
+typedef void (*ChattyClockFunc) (gpointer user_data);
+
+ChattyClock *chatty_clock_get_default    (void);
+char        *chatty_clock_get_human_time (ChattyClock     *self,
+                                          time_t           unix_time);
+char        *chatty_clock_get_time_ago   (ChattyClock     *self,
+                                          time_t           unix_time,
+                                          time_t          *next_change);
+guint        chatty_clock_add_watch      (ChattyClock     *self,
+                                          time_t           when,
+                                          ChattyClockFunc  callback,
+                                          gpointer         user_data);
+void         chatty_clock_remove_watch   (ChattyClock     *self,
+                                          guint            watch_id);
+
+G_END_DECLS
@@ -179,25 +179,123 @@ chatty_conv_show_conversation (PurpleConversation *conv)
 }
 
 
-void
-chatty_conv_add_history_since_component (GHashTable *components,
-                                         const char *account,
-                                         const char *room){
-  time_t mtime;
-  struct tm * timeinfo;
+typedef struct {
+  char *account;
+  char *protocol_id;
+  char *room;
+} ChattyConvJoin;
+
+static void
+chatty_conv_join_free (ChattyConvJoin *join)
+{
+  g_free (join->account);
+  g_free (join->protocol_id);
+  g_free (join->room);
+  g_free (join);
+}
+
+
+static void
+chatty_conv_join_chat_since (PurpleChat *chat,
+                             time_t      mtime)
+{
+  PurpleAccount *account;
+  GHashTable    *components;
+  struct tm     *timeinfo;
 
   g_autofree gchar *iso_timestamp = g_malloc0(MAX_GMT_ISO_SIZE * sizeof(char));
 
-  mtime = chatty_history_get_chat_last_message_time(account, room);
+  account = purple_chat_get_account (chat);
+  components = purple_chat_get_components (chat);
+
   mtime += 1; // Use the next epoch to exclude the last stored message(s)
   timeinfo = gmtime (&mtime);
-  g_return_if_fail (strftime (iso_timestamp,
-                              MAX_GMT_ISO_SIZE * sizeof(char),
-                              "%Y-%m-%dT%H:%M:%SZ",
-                              timeinfo));
 
-  g_hash_table_steal (components, "history_since");
-  g_hash_table_insert (components, "history_since", g_steal_pointer(&iso_timestamp));
+  if (strftime (iso_timestamp,
+                MAX_GMT_ISO_SIZE * sizeof(char),
+                "%Y-%m-%dT%H:%M:%SZ",
+                timeinfo)) {
+    g_hash_table_steal (components, "history_since");
+    g_hash_table_insert (components, "history_since", g_steal_pointer(&iso_timestamp));
+  }
+
+  serv_join_chat (purple_account_get_connection (account), components);
+}
+
+
+static void
+chatty_conv_last_message_time_cb (GObject      *object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+  ChattyConvJoin *join = user_data;
+  g_autoptr(GError) error = NULL;
+  PurpleAccount *account;
+  PurpleChat    *chat = NULL;
+  time_t         mtime;
+
+  mtime = chatty_history_get_chat_last_message_time_finish (result, &error);
+
+  if (error)
+    g_debug ("Failed to get last message time of %s: %s", join->room, error->message);
+
+  /* The chat or the connection may have gone meanwhile */
+  account = purple_accounts_find (join->account, join->protocol_id);
+
+  if (account && purple_account_is_connected (account))
+    chat = purple_blist_find_chat (account, join->room);
+
+  if (chat) {
+    PurpleConversation *conv;
+
+    conv = purple_find_conversation_with_account (PURPLE_CONV_TYPE_CHAT,
+                                                  join->room, account);
+
+    if (conv && !purple_conv_chat_has_left (PURPLE_CONV_CHAT (conv)))
+      chat = NULL;
+  }
+
+  if (chat)
+    chatty_conv_join_chat_since (chat, mtime);
+
+  chatty_conv_join_free (join);
+}
+
+
+/**
+ * chatty_conv_join_chat_with_history:
+ * @chat: a PurpleChat
+ * @room: the name of the room of @chat
+ *
+ * Joins @chat, asking for the messages since the last
+ * one stored in history.  If that time isn't known yet
+ * the chat is joined once history has told it.
+ */
+void
+chatty_conv_join_chat_with_history (PurpleChat *chat,
+                                    const char *room)
+{
+  PurpleAccount  *account;
+  ChattyConvJoin *join;
+  time_t          mtime;
+
+  account = purple_chat_get_account (chat);
+
+  if (chatty_manager_take_room_last_message_time (chatty_manager_get_default (),
+                                                  account->username, room, &mtime)) {
+    chatty_conv_join_chat_since (chat, mtime);
+
+    return;
+  }
+
+  join = g_new0 (ChattyConvJoin, 1);
+  join->account = g_strdup (account->username);
+  join->protocol_id = g_strdup (purple_account_get_protocol_id (account));
+  join->room = g_strdup (room);
+
+  chatty_history_get_chat_last_message_time_async (account->username, room, NULL,
+                                                   chatty_conv_last_message_time_cb,
+                                                   join);
 }
 
 
@@ -242,8 +340,7 @@ chatty_conv_join_chat (PurpleChat *chat)
                                                 account);
 
   if (!conv || purple_conv_chat_has_left (PURPLE_CONV_CHAT(conv))) {
-    chatty_conv_add_history_since_component(components, account->username, name);
-    serv_join_chat (purple_account_get_connection (account), components);
+    chatty_conv_join_chat_with_history (chat, name);
   } else if (conv) {
     purple_conversation_present(conv);
   }
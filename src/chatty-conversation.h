@@ -40,7 +40,7 @@ void *chatty_conversations_get_handle (void);
 void chatty_conversations_init (void);
 void chatty_conversations_uninit (void);
 ChattyConversation * chatty_conv_container_get_active_chatty_conv (GtkNotebook *notebook);
-void chatty_conv_add_history_since_component(GHashTable *components, const char *account, const char *room);
+void chatty_conv_join_chat_with_history (PurpleChat *chat, const char *room);
 
 
 
@@ -14,6 +14,7 @@
 #define CHAT_WHO_IDX        6
 #define CHAT_UID_IDX        7
 #define CHAT_MESSAGE_IDX    8
+#define CHAT_TIME_MS_IDX    9
 
 #define IM_ID_IDX         1
 #define IM_TIMESTAMP_IDX  2
@@ -22,591 +23,2815 @@
 #define IM_WHO_IDX        5
 #define IM_UID_IDX        6
 #define IM_MESSAGE_IDX    7
+#define IM_TIME_MS_IDX    8
+
+/*
+ * The messages of a conversation are ordered by their “seq”:
+ * the time in milliseconds times SEQ_PER_MS, plus the number
+ * of messages already stored for the same millisecond.  So
+ * messages are in server time order, even if they are received
+ * out of order, and in arrival order within a millisecond.  The
+ * messages that don't fit in their millisecond go after the last
+ * message of the conversation, so that seq stays unique.
+ */
+#define SEQ_PER_MS 1024
+#define SEQ_PER_MS_SQL G_STRINGIFY (SEQ_PER_MS)
+
+/* Commit an open batch after this many rows or seconds */
+#define BATCH_MAX_ROWS       500
+#define BATCH_MAX_INTERVAL   3
+
+/* Default interval to checkpoint the write-ahead log, in seconds */
+#define CHECKPOINT_INTERVAL  300
+
+/* Check if a search is cancelled every this many SQLite VM steps */
+#define SEARCH_PROGRESS_STEPS 1000
 
 #include "chatty-history.h"
+#include "chatty-settings.h"
 #include "chatty-utils.h"
 #include <sqlite3.h>
 #include <glib.h>
 #include "stdio.h"
 #include <sys/stat.h>
 #include <limits.h>
+#include <string.h>
+
+typedef enum {
+  STMT_CHAT_TIMESTAMP_FOR_UID,
+  STMT_IM_TIMESTAMP_FOR_UID,
+  STMT_CHAT_INSERT,
+  STMT_IM_INSERT,
+  STMT_CHAT_LAST_MESSAGE_TIME,
+  STMT_IM_LAST_MESSAGE,
+  STMT_IM_LAST_MESSAGES,
+  STMT_CHAT_LAST_MESSAGES,
+  STMT_SEARCH,
+  STMT_IM_UIDS,
+  STMT_CHAT_UIDS,
+  STMT_CHAT_MESSAGES,
+  STMT_IM_MESSAGES,
+  STMT_CHAT_DELETE,
+  STMT_IM_DELETE,
+  STMT_CHAT_SET_MARKUP,
+  STMT_IM_SET_MARKUP,
+  STMT_BEGIN,
+  STMT_COMMIT,
+  N_STATEMENTS
+} HistoryStatement;
+
+/*
+ * Statements are compiled on first use and kept until the
+ * database is closed.  Each user resets the statement (and
+ * clears the bindings) after use so that it can be reused
+ * with new values without being parsed again.
+ */
+typedef struct {
+  const char   *sql;
+  sqlite3_stmt *stmt;
+  guint         n_prepared;
+  guint         n_reused;
+} HistoryStatementEntry;
+
+/*
+ * A job run by the history worker thread.  @data is
+ * owned by the job and freed with @free_func once
+ * @func has been run.
+ */
+typedef void (*HistoryJobFunc) (gpointer data);
+
+typedef struct {
+  HistoryJobFunc  func;
+  gpointer        data;
+  GDestroyNotify  free_func;
+} HistoryJob;
+
+/* A message to be added, a conversation to be deleted, or the markup of a message */
+typedef struct {
+  char   *message;
+  int     direction;
+  char   *account;
+  char   *who;
+  char   *uid;
+  gint64  mtime_ms;
+  char   *room;
+} HistoryRow;
+
+/* Pragma values read from ChattySettings on the main thread */
+typedef struct {
+  gint64 synchronous;
+  gint64 temp_store;
+  gint64 cache_size;
+  gint64 mmap_size;
+  guint  checkpoint_interval;
+} HistoryTuning;
+
+typedef void (*HistoryChatMessageCb) (const unsigned char *msg,
+                                      int                  direction,
+                                      time_t               time_stamp,
+                                      const char          *room,
+                                      const unsigned char *who,
+                                      const unsigned char *uuid,
+                                      gpointer             data);
+typedef void (*HistoryImMessageCb) (const unsigned char *msg,
+                                    int                  direction,
+                                    time_t               time_stamp,
+                                    const unsigned char *uuid,
+                                    gpointer             data,
+                                    int                  last_message);
+
+/*
+ * A page of messages loaded in the worker.  @markup is the cached
+ * markup (see chatty_history_set_im_markup()) of the row being read,
+ * set before the callbacks above are run.
+ */
+typedef struct {
+  GPtrArray           *messages;
+  const unsigned char *markup;
+} HistoryPage;
+
+typedef struct {
+  char                *account;
+  char                *name;
+  char                *before_uid;
+  time_t               before_time;
+  ChattyHistoryCursor  cursor;
+  gboolean             has_cursor;
+  guint                limit;
+  gboolean             is_im;
+} HistoryLoad;
+
+/*
+ * The database is owned by the worker thread.  The main
+ * thread only queues jobs, and gets the results of reads
+ * back with a #GTask, it never waits for the worker.
+ */
+static GThread *worker_thread;
+static GMutex   worker_mutex;
+static GCond    worker_cond;
+static GQueue   worker_jobs = G_QUEUE_INIT;
+static gboolean worker_quit;
 
 static sqlite3 *db;
 
+/* Batch (transaction) state, see chatty_history_begin_batch() */
+static guint batch_depth;
+static guint batch_rows;
 
-int
-get_chat_timestamp_for_uuid(const char *uuid, const char *room)
-{
+static guint    checkpoint_interval;
+static gboolean checkpoint_needed;
 
-  int rc;
-  sqlite3_stmt *stmt;
-  unsigned int timestamp  = INT_MAX;
+/*
+ * Monotonic times at which the worker commits the open batch
+ * and checkpoints the log, 0 if not set.  The worker waits for
+ * jobs until the nearest one, see history_run_timers().
+ */
+static gint64 batch_deadline;
+static gint64 checkpoint_deadline;
+
+static gboolean search_available;
+
+static HistoryStatementEntry statements[N_STATEMENTS] = {
+  [STMT_CHAT_TIMESTAMP_FOR_UID] = {
+    "SELECT timestamp,seq FROM chatty_chat WHERE uid=(?) AND room=(?)" },
+  [STMT_IM_TIMESTAMP_FOR_UID] = {
+    "SELECT timestamp,seq FROM chatty_im WHERE uid=(?) AND account=(?)" },
+  /* seq is the next free one in the millisecond, see SEQ_PER_MS */
+  [STMT_CHAT_INSERT] = {
+    "INSERT INTO chatty_chat (timestamp,direction,account,room,who,uid,message,timestamp_ms,seq) "
+    "VALUES (?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, (SELECT CASE "
+    "WHEN max(seq) IS NULL THEN ?9*" SEQ_PER_MS_SQL " "
+    "WHEN max(seq)+1 < (?9+1)*" SEQ_PER_MS_SQL " THEN max(seq)+1 "
+    "ELSE (SELECT max(seq)+1 FROM chatty_chat WHERE room=?5 AND account=?4) END "
+    "FROM chatty_chat WHERE room=?5 AND account=?4 "
+    "AND seq BETWEEN ?9*" SEQ_PER_MS_SQL " AND (?9+1)*" SEQ_PER_MS_SQL "-1))" },
+  [STMT_IM_INSERT] = {
+    "INSERT INTO chatty_im (timestamp,direction,account,who,uid,message,timestamp_ms,seq) "
+    "VALUES (?2, ?3, ?4, ?5, ?6, ?7, ?8, (SELECT CASE "
+    "WHEN max(seq) IS NULL THEN ?8*" SEQ_PER_MS_SQL " "
+    "WHEN max(seq)+1 < (?8+1)*" SEQ_PER_MS_SQL " THEN max(seq)+1 "
+    "ELSE (SELECT max(seq)+1 FROM chatty_im WHERE account=?4 AND who=?5) END "
+    "FROM chatty_im WHERE account=?4 AND who=?5 "
+    "AND seq BETWEEN ?8*" SEQ_PER_MS_SQL " AND (?8+1)*" SEQ_PER_MS_SQL "-1))" },
+  [STMT_CHAT_LAST_MESSAGE_TIME] = {
+    "SELECT timestamp FROM chatty_chat WHERE account=(?) AND room=(?) ORDER BY seq DESC LIMIT 1" },
+  [STMT_IM_LAST_MESSAGE] = {
+    "SELECT message,direction,timestamp,uid FROM chatty_im WHERE account=(?) AND who=(?) ORDER BY seq DESC LIMIT 1" },
+  /*
+   * SQLite returns the bare columns of the row with the max()
+   * value.  Both walk the (account, who|room, seq) indexes.
+   */
+  [STMT_IM_LAST_MESSAGES] = {
+    "SELECT account,who,message,direction,timestamp,uid,max(seq) FROM chatty_im GROUP BY account, who" },
+  [STMT_CHAT_LAST_MESSAGES] = {
+    "SELECT account,room,message,direction,timestamp,uid,who,max(seq) FROM chatty_chat GROUP BY room, account" },
+  /* The latest messages only, the time of the oldest one is the last column */
+  [STMT_IM_UIDS] = {
+    "SELECT uid,timestamp FROM chatty_im WHERE account=?1 ORDER BY seq DESC LIMIT ?2" },
+  [STMT_CHAT_UIDS] = {
+    "SELECT room,uid,timestamp FROM chatty_chat WHERE account=?1 ORDER BY seq DESC LIMIT ?2" },
+  /* Snippet matches are delimited with \1 and \2, see history_snippet_to_markup() */
+  [STMT_SEARCH] = {
+    "SELECT account,who,NULL,uid,timestamp,snippet(chatty_im_fts, 0, char(1), char(2), '…', 12),"
+    "bm25(chatty_im_fts) AS rank FROM chatty_im_fts JOIN chatty_im ON chatty_im.id=chatty_im_fts.rowid "
+    "WHERE chatty_im_fts MATCH ?1 UNION ALL "
+    "SELECT account,who,room,uid,timestamp,snippet(chatty_chat_fts, 0, char(1), char(2), '…', 12),"
+    "bm25(chatty_chat_fts) FROM chatty_chat_fts JOIN chatty_chat ON chatty_chat.id=chatty_chat_fts.rowid "
+    "WHERE chatty_chat_fts MATCH ?1 ORDER BY rank LIMIT ?2 OFFSET ?3" },
+  [STMT_CHAT_MESSAGES] = {
+    "SELECT timestamp,direction,message,who,uid,seq,markup FROM chatty_chat WHERE account=?1 AND room=?2 "
+    "AND seq < ?3 ORDER BY seq DESC LIMIT ?4" },
+  [STMT_IM_MESSAGES] = {
+    "SELECT timestamp,direction,message,uid,seq,markup FROM chatty_im WHERE account=?1 AND who=?2 "
+    "AND seq < ?3 ORDER BY seq DESC LIMIT ?4" },
+  [STMT_CHAT_DELETE] = {
+    "DELETE FROM chatty_chat WHERE account=(?) AND room=(?)" },
+  [STMT_IM_DELETE] = {
+    "DELETE FROM chatty_im WHERE account=(?) AND who=(?)" },
+  /* Both use the unique uid indexes */
+  [STMT_CHAT_SET_MARKUP] = {
+    "UPDATE chatty_chat SET markup=?3 WHERE room=?1 AND uid=?2" },
+  [STMT_IM_SET_MARKUP] = {
+    "UPDATE chatty_im SET markup=?3 WHERE account=?1 AND uid=?2" },
+  [STMT_BEGIN] = {
+    "BEGIN TRANSACTION" },
+  [STMT_COMMIT] = {
+    "COMMIT TRANSACTION" },
+};
 
-  rc = sqlite3_prepare_v2(db, "SELECT timestamp FROM chatty_chat WHERE uid=(?) AND room=(?)", -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    g_debug("Error preparing when getting timestamp for uuid (CHAT). errno: %d, desc: %s", rc, sqlite3_errmsg(db));
 
-  rc = sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-    g_debug("Error binding when getting timestamp for uuid (CHAT) errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+static void
+history_job_free (HistoryJob *job)
+{
+  if (job->free_func)
+    job->free_func (job->data);
 
-  rc = sqlite3_bind_text(stmt, 2, room, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-    g_debug("Error binding when getting timestamp for uuid (CHAT) errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  g_free (job);
+}
 
-  while ((sqlite3_step(stmt)) == SQLITE_ROW) {
-    timestamp = sqlite3_column_int(stmt, 0);
-  }
 
-  rc = sqlite3_finalize(stmt);
-  if (rc != SQLITE_OK)
-    g_debug("Error finalizing when getting timestamp for uuid (CHAT) errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+static void history_run_timers (void);
+
+static gint64
+history_get_next_deadline (void)
+{
+  if (!batch_deadline || !checkpoint_deadline)
+    return batch_deadline | checkpoint_deadline;
 
-  return timestamp;
+  return MIN (batch_deadline, checkpoint_deadline);
 }
 
 
-int
-get_im_timestamp_for_uuid(const char *uuid, const char *account)
+static gpointer
+history_worker_cb (gpointer user_data)
 {
+  g_mutex_lock (&worker_mutex);
 
-  int rc;
-  sqlite3_stmt *stmt;
-  unsigned int timestamp  = INT_MAX;
+  while (TRUE) {
+    HistoryJob *job;
 
-  rc = sqlite3_prepare_v2(db, "SELECT timestamp FROM chatty_im WHERE uid=(?) AND account=(?)", -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    g_debug("Error preparing when getting timestamp for uuid (IM). errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+    while (g_queue_is_empty (&worker_jobs) && !worker_quit) {
+      gint64 deadline;
 
-  rc = sqlite3_bind_text(stmt, 1, uuid, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-    g_debug("Error binding when getting timestamp for uuid (IM) errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+      deadline = history_get_next_deadline ();
 
-  rc = sqlite3_bind_text(stmt, 2, account, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-    g_debug("Error binding when getting timestamp for uuid (IM) errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+      if (!deadline) {
+        g_cond_wait (&worker_cond, &worker_mutex);
+      } else if (!g_cond_wait_until (&worker_cond, &worker_mutex, deadline)) {
+        g_mutex_unlock (&worker_mutex);
+        history_run_timers ();
+        g_mutex_lock (&worker_mutex);
+      }
+    }
 
-  while ((sqlite3_step(stmt)) == SQLITE_ROW) {
-    timestamp = sqlite3_column_int(stmt, 0);
+    /* Only quit once every queued job has been run */
+    job = g_queue_pop_head (&worker_jobs);
+    if (!job)
+      break;
+
+    g_mutex_unlock (&worker_mutex);
+
+    job->func (job->data);
+    history_job_free (job);
+    /* The worker may be kept busy past a deadline */
+    history_run_timers ();
+
+    g_mutex_lock (&worker_mutex);
   }
 
-  rc = sqlite3_finalize(stmt);
-  if (rc != SQLITE_OK)
-    g_debug("Error finalizing when getting timestamp for uuid (IM) errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  g_mutex_unlock (&worker_mutex);
 
-  return timestamp;
+  return NULL;
 }
 
 
+/*
+ * history_queue:
+ * @func: The function to run in the worker thread
+ * @data: (transfer full) (nullable): The data for @func
+ * @free_func: (nullable): The function to free @data
+ *
+ * Queue @func to be run in the worker thread.  Jobs
+ * are run in the order they are queued.  If the history
+ * isn't open, @data is freed and @func is never run.
+ */
 static void
-chatty_history_create_chat_schema (void)
+history_queue (HistoryJobFunc func,
+               gpointer       data,
+               GDestroyNotify free_func)
 {
-  int rc;
-  char *sql;
-  char *zErrMsg = 0;
-
-  sql = "CREATE TABLE IF NOT EXISTS chatty_chat("  \
-    "id                 INTEGER     NOT NULL    PRIMARY KEY AUTOINCREMENT," \
-    "timestamp          INTEGER     NOT_NULL," \
-    "direction          INTEGER     NOT NULL," \
-    "account            TEXT        NOT NULL," \
-    "room               TEXT        NOT_NULL," \
-    "who                TEXT,"  \
-    "uid                TEXT        NOT_NULL," \
-    "message            TEXT," \
-    "UNIQUE (timestamp, message)"
-    ");";
-
-  rc = sqlite3_exec(db, sql, NULL, NULL, &zErrMsg);
-
-  if( rc != SQLITE_OK ){
-    g_debug("Error when creating chatty_chat table. errno: %d, desc: %s. %s", rc, sqlite3_errmsg(db), zErrMsg);
-    sqlite3_free(zErrMsg);
-  } else {
-    g_debug("chatty_chat table created successfully");
-  }
+  HistoryJob *job;
+
+  job = g_new (HistoryJob, 1);
+  job->func = func;
+  job->data = data;
+  job->free_func = free_func;
 
-  // The archiving entity is room jid, uid may only be unique within entity scope
-  sql = "CREATE UNIQUE INDEX IF NOT EXISTS chatty_chat_room_uid ON chatty_chat(room, uid);";
+  g_mutex_lock (&worker_mutex);
 
-  rc = sqlite3_exec(db, sql, NULL, NULL, &zErrMsg);
+  if (!worker_thread) {
+    g_mutex_unlock (&worker_mutex);
+    history_job_free (job);
 
-  g_debug("Create Index chatty_chat_accuid: %s", (rc == SQLITE_OK)? "OK" : zErrMsg);
+    return;
+  }
 
+  g_queue_push_tail (&worker_jobs, job);
+  g_cond_broadcast (&worker_cond);
+  g_mutex_unlock (&worker_mutex);
 }
 
 
 static void
-chatty_history_create_im_schema (void)
+history_queue_task (HistoryJobFunc  func,
+                    GTask          *task)
 {
-  int rc;
-  char *sql;
-  char *zErrMsg = 0;
-
-  sql = "CREATE TABLE IF NOT EXISTS chatty_im("  \
-    "id                 INTEGER     NOT NULL    PRIMARY KEY AUTOINCREMENT," \
-    "timestamp          INTEGER     NOT_NULL,"  \
-    "direction          INTEGER     NOT NULL," \
-    "account            TEXT        NOT_NULL," \
-    "who                TEXT        NOT_NULL," \
-    "uid                TEXT        NOT_NULL," \
-    "message            TEXT," \
-    "UNIQUE (timestamp, message)"
-    ");";
-
-  rc = sqlite3_exec(db, sql, NULL, NULL, &zErrMsg);
-
-  if( rc != SQLITE_OK ){
-    g_debug("Error when creating chatty_im table. errno: %d, desc: %s. %s", rc, sqlite3_errmsg(db), zErrMsg);
-  } else {
-    g_debug("chatty_im table created successfully");
-  }
+  /* Only the main thread starts and stops the worker */
+  if (!worker_thread) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_CLOSED,
+                             "History database is not open");
+    g_object_unref (task);
 
-  // The archiving entity is bare jid, uid may only be unique within entity scope
-  sql = "CREATE UNIQUE INDEX IF NOT EXISTS chatty_im_acc_uid ON chatty_im(account, uid);";
+    return;
+  }
 
-  rc = sqlite3_exec(db, sql, NULL, NULL, &zErrMsg);
+  history_queue (func, task, g_object_unref);
+}
 
-  g_debug("Create Index chatty_im_accuid: %s", (rc == SQLITE_OK)? "OK" : zErrMsg);
 
+static void
+history_row_free (HistoryRow *row)
+{
+  g_free (row->message);
+  g_free (row->account);
+  g_free (row->who);
+  g_free (row->uid);
+  g_free (row->room);
+  g_free (row);
 }
 
 
-static void
-chatty_history_create_schemas (void)
+static HistoryRow *
+history_row_new (const char *message,
+                 int         direction,
+                 const char *account,
+                 const char *who,
+                 const char *uid,
+                 gint64      mtime_ms,
+                 const char *room)
 {
-  chatty_history_create_chat_schema();
-  chatty_history_create_im_schema();
+  HistoryRow *row;
+
+  row = g_new (HistoryRow, 1);
+  row->message = g_strdup (message);
+  row->direction = direction;
+  row->account = g_strdup (account);
+  row->who = g_strdup (who);
+  row->uid = g_strdup (uid);
+  row->mtime_ms = mtime_ms;
+  row->room = g_strdup (room);
+
+  return row;
 }
 
 
-int
-chatty_history_open (const char *dir,
-                     const char *file_name)
+/*
+ * history_get_statement:
+ * @id: a #HistoryStatement
+ *
+ * Get the compiled statement for @id, preparing
+ * it if this is the first use.  The statement
+ * should be given back with history_release_statement()
+ * once done.
+ *
+ * Returns: (transfer none) (nullable): a #sqlite3_stmt
+ */
+static sqlite3_stmt *
+history_get_statement (HistoryStatement id)
 {
+  HistoryStatementEntry *entry;
   int rc;
-  g_autofree char *db_path = NULL;
 
-  g_assert (dir && *dir);
-  g_assert (file_name && *file_name);
+  g_assert (id < N_STATEMENTS);
 
-  if(db == NULL){
-    g_mkdir_with_parents (dir, S_IRWXU);
-    db_path = g_build_filename (dir, file_name, NULL);
-    rc = sqlite3_open(db_path, &db);
+  entry = &statements[id];
 
-    if (rc != SQLITE_OK){
-      g_debug("Database could not be opened. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
-    } else {
-      g_debug("Database opened successfully");
-    }
+  if (entry->stmt) {
+    entry->n_reused++;
 
-    chatty_history_create_schemas();
+    return entry->stmt;
   }
 
-  return 1;
+  rc = sqlite3_prepare_v3 (db, entry->sql, -1, SQLITE_PREPARE_PERSISTENT, &entry->stmt, NULL);
+  if (rc != SQLITE_OK) {
+    g_debug ("Error preparing statement '%s'. errno: %d, desc: %s", entry->sql, rc, sqlite3_errmsg (db));
+    entry->stmt = NULL;
 
+    return NULL;
+  }
+
+  entry->n_prepared++;
+
+  return entry->stmt;
 }
 
 
-void
-chatty_history_close (void)
+static void
+history_release_statement (sqlite3_stmt *stmt)
 {
-  int rc;
+  if (!stmt)
+    return;
 
-  if(db != NULL){
-    rc = sqlite3_close(db);
+  sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+}
 
-    if (rc != SQLITE_OK){
-      g_debug("Database could not be closed. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
-    } else {
-      g_debug("Database closed successfully");
-    }
-  }
 
-  db = NULL;
+static void
+history_finalize_statements (void)
+{
+  for (guint i = 0; i < N_STATEMENTS; i++) {
+    HistoryStatementEntry *entry = &statements[i];
+
+    if (entry->n_prepared)
+      g_debug ("Statement '%s' prepared %u times, reused %u times",
+               entry->sql, entry->n_prepared, entry->n_reused);
+
+    g_clear_pointer (&entry->stmt, sqlite3_finalize);
+  }
 }
 
 
-void
-chatty_history_add_chat_message ( const char *message,
-                                  int         direction,
-                                  const char *account,
-                                  const char *who,
-                                  const char *uid,
-                                  time_t      mtime,
-                                  const char *room)
+static void
+history_exec_statement (HistoryStatement id)
 {
-
   sqlite3_stmt *stmt;
   int rc;
 
-  rc = sqlite3_prepare_v2(db, "INSERT INTO chatty_chat VALUES (?, ?, ?, ?, ?, ?, ?, ?)", -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-      g_debug("Error preparing statement when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  stmt = history_get_statement (id);
+  if (!stmt)
+    return;
 
-  rc = sqlite3_bind_text(stmt, CHAT_MESSAGE_IDX, message, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  rc = sqlite3_step (stmt);
+  if (rc != SQLITE_DONE)
+    g_debug ("Error executing '%s'. errno: %d, desc: %s", statements[id].sql, rc, sqlite3_errmsg (db));
 
-  rc = sqlite3_bind_int(stmt, CHAT_DIRECTION_IDX, direction);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  history_release_statement (stmt);
+}
 
-  rc = sqlite3_bind_text(stmt, CHAT_ACCOUNT_IDX, account, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
 
-  rc = sqlite3_bind_text(stmt, CHAT_UID_IDX, uid, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+/*
+ * Commit the rows added so far in the current batch,
+ * and start a new transaction for the rest of the batch
+ */
+static void
+history_batch_flush (gpointer user_data)
+{
+  if (!batch_depth || !batch_rows)
+    return;
 
-  rc = sqlite3_bind_int64(stmt, CHAT_TIMESTAMP_IDX, mtime);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  g_debug ("Committing %u batched rows", batch_rows);
+  history_exec_statement (STMT_COMMIT);
+  history_exec_statement (STMT_BEGIN);
+  batch_rows = 0;
+}
 
-  rc = sqlite3_bind_text(stmt, CHAT_ROOM_IDX, room, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
 
-  rc = sqlite3_bind_text(stmt, CHAT_WHO_IDX, who, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+static void
+history_batch_row_added (void)
+{
+  checkpoint_needed = TRUE;
 
-  rc = sqlite3_step(stmt);
-  if (rc != SQLITE_DONE)
-      g_debug("Error in step when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  if (!batch_depth)
+    return;
 
-  rc = sqlite3_finalize(stmt);
-  if (rc != SQLITE_OK)
-    g_debug("Error finalizing when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  batch_rows++;
 
+  if (batch_rows >= BATCH_MAX_ROWS)
+    history_batch_flush (NULL);
 }
 
 
-void
-chatty_history_add_im_message (const char *message,
-                              int         direction,
-                              const char *account,
-                              const char *who,
-                              const char *uid,
-                              time_t      mtime)
+static void
+history_begin_batch (gpointer user_data)
 {
+  if (!db)
+    return;
 
-  sqlite3_stmt *stmt;
-  int rc;
-
-  rc = sqlite3_prepare_v2(db, "INSERT INTO chatty_im VALUES (?, ?, ?, ?, ?, ?, ?)", -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-      g_debug("Error preparing statement when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
-
-  rc = sqlite3_bind_text(stmt, IM_MESSAGE_IDX, message, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
-
-  rc = sqlite3_bind_int(stmt, IM_DIRECTION_IDX, direction);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  if (batch_depth++)
+    return;
 
-  rc = sqlite3_bind_text(stmt, IM_WHO_IDX, who, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  batch_rows = 0;
+  history_exec_statement (STMT_BEGIN);
+  batch_deadline = g_get_monotonic_time () + BATCH_MAX_INTERVAL * G_TIME_SPAN_SECOND;
+}
 
-  rc = sqlite3_bind_text(stmt, IM_ACCOUNT_IDX, account, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
 
-  rc = sqlite3_bind_text(stmt, IM_UID_IDX, uid, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+static void
+history_end_batch (gpointer user_data)
+{
+  if (!db || !batch_depth)
+    return;
 
-  rc = sqlite3_bind_int64(stmt, IM_TIMESTAMP_IDX, mtime);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  if (--batch_depth)
+    return;
 
-  rc = sqlite3_step(stmt);
-  if (rc != SQLITE_DONE)
-      g_debug("Error in step when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  batch_deadline = 0;
+  g_debug ("Committing batch of %u rows", batch_rows);
+  history_exec_statement (STMT_COMMIT);
+  batch_rows = 0;
+}
 
-  rc = sqlite3_finalize(stmt);
-  if (rc != SQLITE_OK)
-      g_debug("Error finalizing when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
 
+/**
+ * chatty_history_begin_batch:
+ *
+ * Start a batch of history updates.  All messages added
+ * until the matching chatty_history_end_batch() are written
+ * in a single transaction instead of one transaction (and
+ * so one sync to disk) per message.
+ *
+ * To limit the amount of data at risk, the transaction is
+ * committed every few hundred rows or few seconds while the
+ * batch is kept open.
+ *
+ * Batches can be nested, the transaction is committed when
+ * the outermost batch is ended.
+ */
+void
+chatty_history_begin_batch (void)
+{
+  history_queue (history_begin_batch, NULL, NULL);
 }
 
 
-int
-chatty_history_get_chat_last_message_time (const char* account,
-                                           const char* room)
+/**
+ * chatty_history_end_batch:
+ *
+ * End a batch started with chatty_history_begin_batch().
+ * If this is the outermost batch, the pending messages
+ * are committed to the database.
+ */
+void
+chatty_history_end_batch (void)
 {
+  history_queue (history_end_batch, NULL, NULL);
+}
 
-  int rc;
-  sqlite3_stmt *stmt;
-  int time_stamp  = 0;
 
-  rc = sqlite3_prepare_v2(db, "SELECT max(timestamp),max(id)  FROM chatty_chat WHERE room=(?)", -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-      g_debug("Error preparing when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+static void
+history_get_statement_stats (gpointer user_data)
+{
+  GTask *task = user_data;
+  guint *stats;
 
-  rc = sqlite3_bind_text(stmt, 1, room, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  stats = g_new0 (guint, 2);
 
-  while ((sqlite3_step(stmt)) == SQLITE_ROW) {
-      time_stamp = sqlite3_column_int(stmt, 0);
+  for (guint i = 0; i < N_STATEMENTS; i++) {
+    stats[0] += statements[i].n_prepared;
+    stats[1] += statements[i].n_reused;
   }
 
-  rc = sqlite3_finalize(stmt);
-  if (rc != SQLITE_OK)
-      g_debug("Error finalizing when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
-
-  return time_stamp;
+  g_task_return_pointer (task, stats, g_free);
 }
 
 
-char
-chatty_history_get_im_last_message (const char *account,
-                                    const char *who,
-                                    ChattyLog  *chatty_log)
+/**
+ * chatty_history_get_statement_stats_async:
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when done
+ * @user_data: user data for @callback
+ *
+ * Get the number of times SQL statements were compiled
+ * and the number of times an already compiled statement
+ * was reused since the process started.  As jobs are run
+ * in order, every change queued before is done once this
+ * is finished.  Finish with
+ * chatty_history_get_statement_stats_finish().
+ */
+void
+chatty_history_get_statement_stats_async (GCancellable        *cancellable,
+                                          GAsyncReadyCallback  callback,
+                                          gpointer             user_data)
 {
-  int           rc;
-  sqlite3_stmt *stmt;
-
-  rc = sqlite3_prepare_v2(db, "SELECT message,direction,max(timestamp),uid,max(id) FROM chatty_im WHERE account=(?) AND who=(?)", -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-    g_debug("Error preparing when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
-
-  rc = sqlite3_bind_text(stmt, 1, account, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-    g_debug("Error binding when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
-
-  rc = sqlite3_bind_text(stmt, 2, who, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-    g_debug("Error binding when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  GTask *task;
 
-  while ((sqlite3_step(stmt)) == SQLITE_ROW) {
-    chatty_log->msg = (char *) g_strdup((const gchar *) sqlite3_column_text(stmt, 0));
-    chatty_log->dir = sqlite3_column_int(stmt, 1);
-    chatty_log->epoch = sqlite3_column_int(stmt, 2);
-    chatty_log->uid = g_strdup((const char *)sqlite3_column_text(stmt, 3));
-  }
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
 
-  rc = sqlite3_finalize(stmt);
-  if (rc != SQLITE_OK)
-    g_debug("Error finalizing when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_get_statement_stats_async);
 
-  // epoch is 0 if no messages are found in the query
-  // the max() query ALWAYS contains a row.
-  // TODO: @LELAND: Do something better here
-  return chatty_log->epoch;
+  history_queue_task (history_get_statement_stats, task);
 }
 
 
-void
-chatty_history_get_chat_messages (const char *account,
-                                  const char *room,
-                                  void (*cb)( const unsigned char *msg,
-                                              int direction,
-                                              int time_stamp,
-                                              const char *room,
-                                              const unsigned char *who,
-                                              const unsigned char *uuid,
-                                              gpointer data),
-                                  gpointer    data,
-                                  guint       limit,
-                                  const char *oldest_message_displayed)
-{
-
-  int                  rc;
-  sqlite3_stmt        *stmt;
-  const unsigned char *msg;
-  int                  time_stamp;
-  int                  direction;
-  const unsigned char *who;
-  const unsigned char* uuid;
-  int                  from_timestamp;
-  char                 skip;
+/**
+ * chatty_history_get_statement_stats_finish:
+ * @result: A #GAsyncResult
+ * @n_prepared: (out) (optional): return location for prepare count
+ * @n_reused: (out) (optional): return location for reuse count
+ * @error: (nullable): A #GError
+ *
+ * Finish chatty_history_get_statement_stats_async().
+ *
+ * Returns: %TRUE on success, %FALSE on error.
+ */
+gboolean
+chatty_history_get_statement_stats_finish (GAsyncResult  *result,
+                                           guint         *n_prepared,
+                                           guint         *n_reused,
+                                           GError       **error)
+{
+  g_autofree guint *stats = NULL;
 
-  from_timestamp = get_chat_timestamp_for_uuid(oldest_message_displayed, room);
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
 
-  rc = sqlite3_prepare_v2(db, "SELECT timestamp,direction,message,who,uid FROM chatty_chat WHERE account=(?) AND room=(?) AND timestamp <= (?) ORDER BY timestamp DESC, id DESC LIMIT (?)", -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-      g_debug("Error preparing statement when querying CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  stats = g_task_propagate_pointer (G_TASK (result), error);
 
-  rc = sqlite3_bind_text(stmt, 1, account, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding values when querying CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  if (!stats)
+    return FALSE;
 
-  rc = sqlite3_bind_text(stmt, 2, room, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding values when querying CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  if (n_prepared)
+    *n_prepared = stats[0];
 
-  rc = sqlite3_bind_int(stmt, 3, from_timestamp);
-  if (rc != SQLITE_OK)
-    g_debug("Error binding values when querying CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  if (n_reused)
+    *n_reused = stats[1];
 
-  rc = sqlite3_bind_int(stmt, 4, limit);
-  if (rc != SQLITE_OK)
-    g_debug("Error binding values when querying CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  return TRUE;
+}
 
-  skip = oldest_message_displayed != NULL;
-  while ((sqlite3_step(stmt)) == SQLITE_ROW) {
-      time_stamp = sqlite3_column_int(stmt, 0);
-      direction = sqlite3_column_int(stmt, 1);
-      msg = sqlite3_column_text(stmt, 2);
-      who = sqlite3_column_text(stmt, 3);
-      uuid = sqlite3_column_text(stmt, 4);
 
-      if (skip){
-        skip = g_strcmp0(oldest_message_displayed, (const char *)uuid);
-      } else {
-        cb(msg, direction, time_stamp, room, who, uuid, data);
-      }
+/*
+ * Schema migrations.  The database is at version N (as saved in
+ * “user_version” pragma) once the first N of these are applied.
+ * A released migration should never be modified, append a new
+ * one instead.
+ */
+static const char *migrations[] = {
+  /* 1: Initial schema.  Databases created before versioning are at version 0,
+   *    but already have these, hence “IF NOT EXISTS”. */
+  "CREATE TABLE IF NOT EXISTS chatty_chat("
+  "id                 INTEGER     NOT NULL    PRIMARY KEY AUTOINCREMENT,"
+  "timestamp          INTEGER     NOT_NULL,"
+  "direction          INTEGER     NOT NULL,"
+  "account            TEXT        NOT NULL,"
+  "room               TEXT        NOT_NULL,"
+  "who                TEXT,"
+  "uid                TEXT        NOT_NULL,"
+  "message            TEXT,"
+  "UNIQUE (timestamp, message)"
+  ");"
+  /* The archiving entity is room jid, uid may only be unique within entity scope */
+  "CREATE UNIQUE INDEX IF NOT EXISTS chatty_chat_room_uid ON chatty_chat(room, uid);"
+  "CREATE TABLE IF NOT EXISTS chatty_im("
+  "id                 INTEGER     NOT NULL    PRIMARY KEY AUTOINCREMENT,"
+  "timestamp          INTEGER     NOT_NULL,"
+  "direction          INTEGER     NOT NULL,"
+  "account            TEXT        NOT_NULL,"
+  "who                TEXT        NOT_NULL,"
+  "uid                TEXT        NOT_NULL,"
+  "message            TEXT,"
+  "UNIQUE (timestamp, message)"
+  ");"
+  /* The archiving entity is bare jid, uid may only be unique within entity scope */
+  "CREATE UNIQUE INDEX IF NOT EXISTS chatty_im_acc_uid ON chatty_im(account, uid);",
+
+  /* 2: Indexes for paging, last message and delete.  They hold every column
+   *    the queries filter and sort on (id being the implicit rowid), so only
+   *    the rows actually returned are read from the tables. */
+  "CREATE INDEX IF NOT EXISTS chatty_im_acc_who_time ON chatty_im(account, who, timestamp);"
+  "CREATE INDEX IF NOT EXISTS chatty_chat_room_acc_time ON chatty_chat(room, account, timestamp);",
+
+  /* 3: Millisecond timestamps and the per-conversation order (see SEQ_PER_MS),
+   *    which replaces (timestamp, id) in the indexes.  Existing messages of
+   *    the same second keep their id order. */
+  "ALTER TABLE chatty_im ADD COLUMN timestamp_ms INTEGER;"
+  "ALTER TABLE chatty_im ADD COLUMN seq INTEGER;"
+  "UPDATE chatty_im SET timestamp_ms=timestamp*1000;"
+  "UPDATE chatty_im SET seq=timestamp_ms*" SEQ_PER_MS_SQL "+(SELECT count(*) FROM chatty_im AS o "
+  "WHERE o.account=chatty_im.account AND o.who=chatty_im.who "
+  "AND o.timestamp=chatty_im.timestamp AND o.id<chatty_im.id);"
+  "ALTER TABLE chatty_chat ADD COLUMN timestamp_ms INTEGER;"
+  "ALTER TABLE chatty_chat ADD COLUMN seq INTEGER;"
+  "UPDATE chatty_chat SET timestamp_ms=timestamp*1000;"
+  "UPDATE chatty_chat SET seq=timestamp_ms*" SEQ_PER_MS_SQL "+(SELECT count(*) FROM chatty_chat AS o "
+  "WHERE o.room=chatty_chat.room AND o.account=chatty_chat.account "
+  "AND o.timestamp=chatty_chat.timestamp AND o.id<chatty_chat.id);"
+  "DROP INDEX IF EXISTS chatty_im_acc_who_time;"
+  "DROP INDEX IF EXISTS chatty_chat_room_acc_time;"
+  "CREATE INDEX chatty_im_acc_who_seq ON chatty_im(account, who, seq);"
+  "CREATE INDEX chatty_chat_room_acc_seq ON chatty_chat(room, account, seq);",
+
+  /* 4: The Pango markup of the message, made by chatty_markup_from_text()
+   *    and cached once it's first shown.  Set it to NULL in a new migration
+   *    if that function changes the markup it makes. */
+  "ALTER TABLE chatty_im ADD COLUMN markup TEXT;"
+  "ALTER TABLE chatty_chat ADD COLUMN markup TEXT;",
+
+  /* 5: seq is unique in a conversation.  A message that got the seq of an
+   *    older one, as its millisecond was full, is moved after the last one
+   *    (adding its id keeps the moved ones apart). */
+  "UPDATE chatty_im SET seq=(SELECT max(seq) FROM chatty_im AS o "
+  "WHERE o.account=chatty_im.account AND o.who=chatty_im.who)+id "
+  "WHERE EXISTS (SELECT 1 FROM chatty_im AS o WHERE o.account=chatty_im.account "
+  "AND o.who=chatty_im.who AND o.seq=chatty_im.seq AND o.id<chatty_im.id);"
+  "UPDATE chatty_chat SET seq=(SELECT max(seq) FROM chatty_chat AS o "
+  "WHERE o.room=chatty_chat.room AND o.account=chatty_chat.account)+id "
+  "WHERE EXISTS (SELECT 1 FROM chatty_chat AS o WHERE o.room=chatty_chat.room "
+  "AND o.account=chatty_chat.account AND o.seq=chatty_chat.seq AND o.id<chatty_chat.id);"
+  "DROP INDEX chatty_im_acc_who_seq;"
+  "DROP INDEX chatty_chat_room_acc_seq;"
+  "CREATE UNIQUE INDEX chatty_im_acc_who_seq ON chatty_im(account, who, seq);"
+  "CREATE UNIQUE INDEX chatty_chat_room_acc_seq ON chatty_chat(room, account, seq);",
+};
+
+
+static int
+history_get_version (void)
+{
+  sqlite3_stmt *stmt;
+  int version = -1;
+  int rc;
+
+  rc = sqlite3_prepare_v2 (db, "PRAGMA user_version;", -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    g_debug ("Error getting schema version. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
 
+    return -1;
   }
 
-  rc = sqlite3_finalize(stmt);
-  if (rc != SQLITE_OK)
-    g_debug("Error finalizing when querying CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    version = sqlite3_column_int (stmt, 0);
+
+  sqlite3_finalize (stmt);
 
+  return version;
 }
 
 
+static gboolean
+history_migrate_to (int version)
+{
+  g_autofree char *sql = NULL;
+  char *err_msg = NULL;
+  int rc;
+
+  g_assert (version > 0 && version <= (int)G_N_ELEMENTS (migrations));
+
+  sql = g_strdup_printf ("BEGIN TRANSACTION;"
+                         "%s"
+                         "PRAGMA user_version=%d;"
+                         "COMMIT TRANSACTION;",
+                         migrations[version - 1], version);
+  rc = sqlite3_exec (db, sql, NULL, NULL, &err_msg);
+
+  if (rc != SQLITE_OK) {
+    g_warning ("Error migrating history to version %d. errno: %d, desc: %s",
+               version, rc, err_msg);
+    sqlite3_free (err_msg);
+    sqlite3_exec (db, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+
+    return FALSE;
+  }
+
+  g_debug ("History migrated to version %d", version);
+
+  return TRUE;
+}
+
+
+/*
+ * Bring the database schema to the latest version.  Each
+ * migration is applied in its own transaction, so that an
+ * error leaves the database at the last good version.
+ */
+static void
+history_migrate (void)
+{
+  int version;
+
+  version = history_get_version ();
+
+  if (version < 0)
+    return;
+
+  if (version > (int)G_N_ELEMENTS (migrations))
+    g_debug ("History version %d is newer than the supported %u",
+             version, (guint)G_N_ELEMENTS (migrations));
+
+  for (int i = version + 1; i <= (int)G_N_ELEMENTS (migrations); i++)
+    if (!history_migrate_to (i))
+      break;
+}
+
+
+/*
+ * The full text index is not a versioned migration, as it
+ * needs SQLite built with FTS5.  Without it, history works
+ * as before, only search is not available.
+ *
+ * The index is an external content table: it only stores
+ * the index, the text is read from the message tables.  The
+ * triggers keep it in sync with them.
+ */
+static const char *search_schema =
+  "CREATE VIRTUAL TABLE chatty_im_fts USING fts5(message, content='chatty_im', content_rowid='id');"
+  "CREATE TRIGGER chatty_im_fts_insert AFTER INSERT ON chatty_im BEGIN "
+  "INSERT INTO chatty_im_fts(rowid, message) VALUES (new.id, new.message); END;"
+  "CREATE TRIGGER chatty_im_fts_delete AFTER DELETE ON chatty_im BEGIN "
+  "INSERT INTO chatty_im_fts(chatty_im_fts, rowid, message) VALUES ('delete', old.id, old.message); END;"
+  "CREATE TRIGGER chatty_im_fts_update AFTER UPDATE OF message ON chatty_im BEGIN "
+  "INSERT INTO chatty_im_fts(chatty_im_fts, rowid, message) VALUES ('delete', old.id, old.message);"
+  "INSERT INTO chatty_im_fts(rowid, message) VALUES (new.id, new.message); END;"
+
+  "CREATE VIRTUAL TABLE chatty_chat_fts USING fts5(message, content='chatty_chat', content_rowid='id');"
+  "CREATE TRIGGER chatty_chat_fts_insert AFTER INSERT ON chatty_chat BEGIN "
+  "INSERT INTO chatty_chat_fts(rowid, message) VALUES (new.id, new.message); END;"
+  "CREATE TRIGGER chatty_chat_fts_delete AFTER DELETE ON chatty_chat BEGIN "
+  "INSERT INTO chatty_chat_fts(chatty_chat_fts, rowid, message) VALUES ('delete', old.id, old.message); END;"
+  "CREATE TRIGGER chatty_chat_fts_update AFTER UPDATE OF message ON chatty_chat BEGIN "
+  "INSERT INTO chatty_chat_fts(chatty_chat_fts, rowid, message) VALUES ('delete', old.id, old.message);"
+  "INSERT INTO chatty_chat_fts(rowid, message) VALUES (new.id, new.message); END;"
+
+  /* Index the existing messages */
+  "INSERT INTO chatty_im_fts(chatty_im_fts) VALUES ('rebuild');"
+  "INSERT INTO chatty_chat_fts(chatty_chat_fts) VALUES ('rebuild');";
+
+static void
+history_setup_search (void)
+{
+  sqlite3_stmt *stmt;
+  char *err_msg = NULL;
+  int rc;
+
+  rc = sqlite3_prepare_v2 (db, "SELECT 1 FROM sqlite_master WHERE type='table' AND name='chatty_chat_fts'",
+                           -1, &stmt, NULL);
+  if (rc != SQLITE_OK) {
+    g_debug ("Error checking search index. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
+    return;
+  }
+
+  search_available = sqlite3_step (stmt) == SQLITE_ROW;
+  sqlite3_finalize (stmt);
+
+  if (search_available)
+    return;
+
+  rc = sqlite3_exec (db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+
+  if (rc == SQLITE_OK)
+    rc = sqlite3_exec (db, search_schema, NULL, NULL, &err_msg);
+
+  if (rc == SQLITE_OK)
+    rc = sqlite3_exec (db, "COMMIT TRANSACTION;", NULL, NULL, &err_msg);
+
+  if (rc != SQLITE_OK) {
+    g_warning ("Error creating search index, search disabled. errno: %d, desc: %s", rc, err_msg);
+    sqlite3_free (err_msg);
+    sqlite3_exec (db, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+
+    return;
+  }
+
+  g_debug ("Search index created");
+  search_available = TRUE;
+}
+
+
+static void
+history_set_pragma (const char *pragma,
+                    gint64      value)
+{
+  g_autofree char *sql = NULL;
+  char *err_msg = NULL;
+  int rc;
+
+  sql = g_strdup_printf ("PRAGMA %s=%" G_GINT64_FORMAT ";", pragma, value);
+  rc = sqlite3_exec (db, sql, NULL, NULL, &err_msg);
+
+  if (rc != SQLITE_OK) {
+    g_debug ("Error setting pragma %s. errno: %d, desc: %s", pragma, rc, err_msg);
+    sqlite3_free (err_msg);
+  }
+}
+
+
+static void
+history_checkpoint (void)
+{
+  int rc, n_log, n_done;
+
+  /* Don't bother if nothing changed */
+  if (!db || !checkpoint_needed)
+    return;
+
+  /*
+   * The log can't be checkpointed in a transaction.  A batch may be
+   * left open for long (say, by a query that never ends), so commit
+   * what it has so far rather than wait for it.
+   */
+  if (batch_depth)
+    history_exec_statement (STMT_COMMIT);
+
+  rc = sqlite3_wal_checkpoint_v2 (db, NULL, SQLITE_CHECKPOINT_PASSIVE, &n_log, &n_done);
+
+  if (rc == SQLITE_OK) {
+    g_debug ("Checkpointed %d of %d WAL frames", n_done, n_log);
+    checkpoint_needed = n_done < n_log;
+  } else {
+    g_debug ("Error in WAL checkpoint. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
+  }
+
+  if (batch_depth) {
+    history_exec_statement (STMT_BEGIN);
+    batch_rows = 0;
+  }
+}
+
+
+/* Run in the worker thread, commit the batch and checkpoint when due */
+static void
+history_run_timers (void)
+{
+  gint64 now;
+
+  if (!history_get_next_deadline ())
+    return;
+
+  now = g_get_monotonic_time ();
+
+  if (batch_deadline && now >= batch_deadline) {
+    history_batch_flush (NULL);
+    batch_deadline = now + BATCH_MAX_INTERVAL * G_TIME_SPAN_SECOND;
+  }
+
+  if (checkpoint_deadline && now >= checkpoint_deadline) {
+    history_checkpoint ();
+    checkpoint_deadline = now + checkpoint_interval * G_TIME_SPAN_SECOND;
+  }
+}
+
+
+static void
+history_set_checkpoint_interval (guint interval)
+{
+  checkpoint_interval = interval;
+  checkpoint_deadline = 0;
+
+  if (interval)
+    checkpoint_deadline = g_get_monotonic_time () + interval * G_TIME_SPAN_SECOND;
+}
+
+
+static void
+history_set_journal (void)
+{
+  char *err_msg = NULL;
+  int rc;
+
+  /*
+   * With a write-ahead log, reading the history doesn't block
+   * on messages being written and the other way around.  The
+   * WAL is also consistent with synchronous=NORMAL, so that
+   * there is no sync to disk on each commit.
+   */
+  rc = sqlite3_exec (db, "PRAGMA journal_mode=WAL;", NULL, NULL, &err_msg);
+
+  if (rc != SQLITE_OK) {
+    g_debug ("Error enabling WAL journal. errno: %d, desc: %s", rc, err_msg);
+    sqlite3_free (err_msg);
+  }
+
+  history_set_pragma ("synchronous", 1);
+  history_set_pragma ("temp_store", 2);
+  history_set_checkpoint_interval (CHECKPOINT_INTERVAL);
+}
+
+
+static void
+history_apply_tuning (gpointer user_data)
+{
+  HistoryTuning *tuning = user_data;
+
+  if (!db)
+    return;
+
+  history_set_pragma ("synchronous", tuning->synchronous);
+  history_set_pragma ("temp_store", tuning->temp_store);
+  history_set_pragma ("cache_size", tuning->cache_size);
+  history_set_pragma ("mmap_size", tuning->mmap_size);
+  history_set_checkpoint_interval (tuning->checkpoint_interval);
+}
+
+
+/**
+ * chatty_history_apply_settings:
+ * @settings: A #ChattySettings
+ *
+ * Tune the history database with the values set
+ * in @settings.  The database should have been
+ * opened with chatty_history_open().
+ *
+ * The values are read once, this is to be called
+ * again if they should be applied after a change.
+ */
+void
+chatty_history_apply_settings (ChattySettings *settings)
+{
+  HistoryTuning *tuning;
+
+  g_return_if_fail (CHATTY_IS_SETTINGS (settings));
+
+  tuning = g_new (HistoryTuning, 1);
+  tuning->synchronous = chatty_settings_get_history_synchronous (settings);
+  tuning->temp_store = chatty_settings_get_history_temp_store (settings);
+  /* A negative value sets the size in KiB instead of pages */
+  tuning->cache_size = -(gint64)chatty_settings_get_history_cache_size (settings);
+  tuning->mmap_size = (gint64)chatty_settings_get_history_mmap_size (settings) * 1024 * 1024;
+  tuning->checkpoint_interval = chatty_settings_get_history_checkpoint_interval (settings);
+
+  history_queue (history_apply_tuning, tuning, g_free);
+}
+
+
+static void
+history_open (gpointer user_data)
+{
+  const char *db_path = user_data;
+  int rc;
+
+  rc = sqlite3_open(db_path, &db);
+
+  if (rc != SQLITE_OK){
+    g_debug("Database could not be opened. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  } else {
+    g_debug("Database opened successfully");
+  }
+
+  history_set_journal ();
+  history_migrate ();
+  history_setup_search ();
+}
+
+
+/**
+ * chatty_history_open:
+ * @dir: The directory to store the database in
+ * @file_name: The database file name
+ *
+ * Start the history worker thread, which opens (and
+ * if needed, upgrades) the database.  Every other call
+ * made after this is run after the database is ready.
+ */
+int
+chatty_history_open (const char *dir,
+                     const char *file_name)
+{
+  char *db_path;
+
+  g_assert (dir && *dir);
+  g_assert (file_name && *file_name);
+
+  if (worker_thread)
+    return 1;
+
+  g_mkdir_with_parents (dir, S_IRWXU);
+  db_path = g_build_filename (dir, file_name, NULL);
+
+  worker_quit = FALSE;
+  worker_thread = g_thread_new ("chatty-history", history_worker_cb, NULL);
+  history_queue (history_open, db_path, g_free);
+
+  return 1;
+
+}
+
+
+static void
+history_close (gpointer user_data)
+{
+  int rc;
+
+  if(db != NULL){
+    if (batch_depth) {
+      history_exec_statement (STMT_COMMIT);
+      batch_depth = batch_rows = 0;
+    }
+
+    batch_deadline = checkpoint_deadline = 0;
+    history_finalize_statements ();
+
+    /* Leave a small WAL file behind */
+    rc = sqlite3_wal_checkpoint_v2 (db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+    if (rc != SQLITE_OK)
+      g_debug ("Error in WAL checkpoint. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
+
+    checkpoint_needed = FALSE;
+    search_available = FALSE;
+    rc = sqlite3_close(db);
+
+    if (rc != SQLITE_OK){
+      g_debug("Database could not be closed. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+    } else {
+      g_debug("Database closed successfully");
+    }
+  }
+
+  db = NULL;
+}
+
+
+/**
+ * chatty_history_close:
+ *
+ * Close the database once the queued jobs are
+ * done, and stop the history worker thread.
+ */
+void
+chatty_history_close (void)
+{
+  GThread *thread;
+
+  if (!worker_thread)
+    return;
+
+  history_queue (history_close, NULL, NULL);
+
+  g_mutex_lock (&worker_mutex);
+  thread = g_steal_pointer (&worker_thread);
+  worker_quit = TRUE;
+  g_cond_broadcast (&worker_cond);
+  g_mutex_unlock (&worker_mutex);
+
+  g_thread_join (thread);
+}
+
+
+static void
+history_add_chat_message (gpointer user_data)
+{
+  HistoryRow *row = user_data;
+  sqlite3_stmt *stmt;
+  int rc;
+
+  stmt = history_get_statement (STMT_CHAT_INSERT);
+  if (!stmt)
+    return;
+
+  rc = sqlite3_bind_text(stmt, CHAT_MESSAGE_IDX, row->message, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_int(stmt, CHAT_DIRECTION_IDX, row->direction);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, CHAT_ACCOUNT_IDX, row->account, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, CHAT_UID_IDX, row->uid, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_int64(stmt, CHAT_TIMESTAMP_IDX, row->mtime_ms / 1000);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_int64(stmt, CHAT_TIME_MS_IDX, row->mtime_ms);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, CHAT_ROOM_IDX, row->room, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, CHAT_WHO_IDX, row->who, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE)
+      g_debug("Error in step when adding CHAT message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  history_release_statement (stmt);
+  history_batch_row_added ();
+
+}
+
+
+void
+chatty_history_add_chat_message ( const char *message,
+                                  int         direction,
+                                  const char *account,
+                                  const char *who,
+                                  const char *uid,
+                                  time_t      mtime,
+                                  const char *room)
+{
+  chatty_history_add_chat_message_ms (message, direction, account, who, uid,
+                                      (gint64)mtime * 1000, room);
+}
+
+
+/**
+ * chatty_history_add_chat_message_ms:
+ *
+ * Same as chatty_history_add_chat_message(), with
+ * @mtime_ms the message time in milliseconds.
+ */
+void
+chatty_history_add_chat_message_ms (const char *message,
+                                    int         direction,
+                                    const char *account,
+                                    const char *who,
+                                    const char *uid,
+                                    gint64      mtime_ms,
+                                    const char *room)
+{
+  history_queue (history_add_chat_message,
+                 history_row_new (message, direction, account, who, uid, mtime_ms, room),
+                 (GDestroyNotify)history_row_free);
+}
+
+
+static void
+history_add_im_message (gpointer user_data)
+{
+  HistoryRow *row = user_data;
+  sqlite3_stmt *stmt;
+  int rc;
+
+  stmt = history_get_statement (STMT_IM_INSERT);
+  if (!stmt)
+    return;
+
+  rc = sqlite3_bind_text(stmt, IM_MESSAGE_IDX, row->message, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_int(stmt, IM_DIRECTION_IDX, row->direction);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, IM_WHO_IDX, row->who, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, IM_ACCOUNT_IDX, row->account, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, IM_UID_IDX, row->uid, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_int64(stmt, IM_TIMESTAMP_IDX, row->mtime_ms / 1000);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_int64(stmt, IM_TIME_MS_IDX, row->mtime_ms);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding value when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE)
+      g_debug("Error in step when adding IM message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  history_release_statement (stmt);
+  history_batch_row_added ();
+
+}
+
+
+void
+chatty_history_add_im_message (const char *message,
+                              int         direction,
+                              const char *account,
+                              const char *who,
+                              const char *uid,
+                              time_t      mtime)
+{
+  chatty_history_add_im_message_ms (message, direction, account, who, uid,
+                                    (gint64)mtime * 1000);
+}
+
+
+/**
+ * chatty_history_add_im_message_ms:
+ *
+ * Same as chatty_history_add_im_message(), with
+ * @mtime_ms the message time in milliseconds.
+ */
+void
+chatty_history_add_im_message_ms (const char *message,
+                                  int         direction,
+                                  const char *account,
+                                  const char *who,
+                                  const char *uid,
+                                  gint64      mtime_ms)
+{
+  history_queue (history_add_im_message,
+                 history_row_new (message, direction, account, who, uid, mtime_ms, NULL),
+                 (GDestroyNotify)history_row_free);
+}
+
+
+static void
+history_set_markup (HistoryStatement  id,
+                    const char       *name,
+                    HistoryRow       *row)
+{
+  sqlite3_stmt *stmt;
+  int rc;
+
+  stmt = history_get_statement (id);
+  if (!stmt)
+    return;
+
+  rc = sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+    g_debug("Error binding when setting markup. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, 2, row->uid, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+    g_debug("Error binding when setting markup. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, 3, row->message, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+    g_debug("Error binding when setting markup. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE)
+    g_debug("Error in step when setting markup. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  history_release_statement (stmt);
+  history_batch_row_added ();
+}
+
+
+static void
+history_set_chat_markup (gpointer user_data)
+{
+  HistoryRow *row = user_data;
+
+  history_set_markup (STMT_CHAT_SET_MARKUP, row->room, row);
+}
+
+
+static void
+history_set_im_markup (gpointer user_data)
+{
+  HistoryRow *row = user_data;
+
+  history_set_markup (STMT_IM_SET_MARKUP, row->account, row);
+}
+
+
+/**
+ * chatty_history_set_chat_markup:
+ * @room: The room name
+ * @uid: The uid of the message
+ * @markup: The Pango markup of the message
+ *
+ * Save the markup shown for the message @uid of @room,
+ * so that it is loaded with the message next time
+ * instead of being generated again.
+ */
+void
+chatty_history_set_chat_markup (const char *room,
+                                const char *uid,
+                                const char *markup)
+{
+  g_return_if_fail (room && uid && markup);
+
+  history_queue (history_set_chat_markup,
+                 history_row_new (markup, 0, NULL, NULL, uid, 0, room),
+                 (GDestroyNotify)history_row_free);
+}
+
+
+/**
+ * chatty_history_set_im_markup:
+ * @account: The account name
+ * @uid: The uid of the message
+ * @markup: The Pango markup of the message
+ *
+ * Same as chatty_history_set_chat_markup(), but for
+ * an IM message of @account.
+ */
+void
+chatty_history_set_im_markup (const char *account,
+                              const char *uid,
+                              const char *markup)
+{
+  g_return_if_fail (account && uid && markup);
+
+  history_queue (history_set_im_markup,
+                 history_row_new (markup, 0, account, NULL, uid, 0, NULL),
+                 (GDestroyNotify)history_row_free);
+}
+
+
+static time_t
+history_get_chat_last_message_time (const char *account,
+                                    const char *room)
+{
+
+  int rc;
+  sqlite3_stmt *stmt;
+  time_t time_stamp  = 0;
+
+  stmt = history_get_statement (STMT_CHAT_LAST_MESSAGE_TIME);
+  if (!stmt)
+    return time_stamp;
+
+  rc = sqlite3_bind_text(stmt, 1, account, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, 2, room, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+      g_debug("Error binding when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  while ((sqlite3_step(stmt)) == SQLITE_ROW) {
+      time_stamp = sqlite3_column_int64(stmt, 0);
+  }
+
+  history_release_statement (stmt);
+
+  return time_stamp;
+}
+
+
+static gboolean
+history_get_im_last_message (const char *account,
+                             const char *who,
+                             ChattyLog  *chatty_log)
+{
+  int           rc;
+  sqlite3_stmt *stmt;
+
+  // epoch is 0 if no messages are found in the query
+  chatty_log->epoch = 0;
+
+  stmt = history_get_statement (STMT_IM_LAST_MESSAGE);
+  if (!stmt)
+    return FALSE;
+
+  rc = sqlite3_bind_text(stmt, 1, account, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+    g_debug("Error binding when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, 2, who, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+    g_debug("Error binding when getting chat last message. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  while ((sqlite3_step(stmt)) == SQLITE_ROW) {
+    chatty_log->msg = (char *) g_strdup((const gchar *) sqlite3_column_text(stmt, 0));
+    chatty_log->dir = sqlite3_column_int(stmt, 1);
+    chatty_log->epoch = sqlite3_column_int64(stmt, 2);
+    chatty_log->uid = g_strdup((const char *)sqlite3_column_text(stmt, 3));
+  }
+
+  history_release_statement (stmt);
+
+  return chatty_log->epoch != 0;
+}
+
+
+/**
+ * chatty_history_cursor_init:
+ * @cursor: A #ChattyHistoryCursor
+ *
+ * Set @cursor to point past the newest message of
+ * a conversation, so that the next page loaded with
+ * it contains the latest messages.
+ */
+void
+chatty_history_cursor_init (ChattyHistoryCursor *cursor)
+{
+  g_return_if_fail (cursor);
+
+  cursor->seq = G_MAXINT64;
+  cursor->at_start = FALSE;
+}
+
+
+/**
+ * chatty_history_cursor_at_start:
+ * @cursor: A #ChattyHistoryCursor
+ *
+ * Get if the page that set @cursor was the first
+ * page of the conversation, so that there are no
+ * older messages to load.
+ *
+ * Returns: %TRUE if there are no older messages
+ */
+gboolean
+chatty_history_cursor_at_start (const ChattyHistoryCursor *cursor)
+{
+  g_return_val_if_fail (cursor, TRUE);
+
+  return cursor->at_start;
+}
+
+
+static gboolean
+history_get_cursor (HistoryStatement     id,
+                    const char          *uid,
+                    const char          *scope,
+                    ChattyHistoryCursor *cursor)
+{
+  sqlite3_stmt *stmt;
+  gboolean found = FALSE;
+  int rc;
+
+  stmt = history_get_statement (id);
+  if (!stmt)
+    return FALSE;
+
+  rc = sqlite3_bind_text (stmt, 1, uid, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+    g_debug ("Error binding when getting cursor for uid. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
+
+  rc = sqlite3_bind_text (stmt, 2, scope, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+    g_debug ("Error binding when getting cursor for uid. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
+
+  if (sqlite3_step (stmt) == SQLITE_ROW) {
+    cursor->seq = sqlite3_column_int64 (stmt, 1);
+    found = TRUE;
+  }
+
+  history_release_statement (stmt);
+
+  return found;
+}
+
+
+static void
+history_bind_page (sqlite3_stmt              *stmt,
+                   const char                *account,
+                   const char                *name,
+                   guint                      limit,
+                   const ChattyHistoryCursor *cursor)
+{
+  int rc;
+
+  rc = sqlite3_bind_text(stmt, 1, account, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+    g_debug("Error binding when querying messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+  if (rc != SQLITE_OK)
+    g_debug("Error binding when querying messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_int64(stmt, 3, cursor->seq);
+  if (rc != SQLITE_OK)
+    g_debug("Error binding when querying messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+
+  rc = sqlite3_bind_int(stmt, 4, limit);
+  if (rc != SQLITE_OK)
+    g_debug("Error binding when querying messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+}
+
+
+static guint
+history_get_chat_messages (const char           *account,
+                           const char           *room,
+                           HistoryChatMessageCb  cb,
+                           gpointer              data,
+                           guint                 limit,
+                           ChattyHistoryCursor  *cursor,
+                           const unsigned char **markup)
+{
+  sqlite3_stmt        *stmt;
+  const unsigned char *msg;
+  time_t               time_stamp;
+  int                  direction;
+  const unsigned char *who;
+  const unsigned char* uuid;
+  guint                count = 0;
+
+  stmt = history_get_statement (STMT_CHAT_MESSAGES);
+  if (!stmt)
+    return 0;
+
+  history_bind_page (stmt, account, room, limit, cursor);
+
+  while ((sqlite3_step(stmt)) == SQLITE_ROW) {
+      time_stamp = sqlite3_column_int64(stmt, 0);
+      direction = sqlite3_column_int(stmt, 1);
+      msg = sqlite3_column_text(stmt, 2);
+      who = sqlite3_column_text(stmt, 3);
+      uuid = sqlite3_column_text(stmt, 4);
+
+      cursor->seq = sqlite3_column_int64(stmt, 5);
+      count++;
+
+      if (markup)
+        *markup = sqlite3_column_text(stmt, 6);
+
+      cb(msg, direction, time_stamp, room, who, uuid, data);
+  }
+
+  history_release_statement (stmt);
+
+  return count;
+}
+
+
+static guint
+history_get_im_messages (const char           *account,
+                         const char           *who,
+                         HistoryImMessageCb    cb,
+                         gpointer              data,
+                         guint                 limit,
+                         ChattyHistoryCursor  *cursor,
+                         const unsigned char **markup)
+{
+  sqlite3_stmt        *stmt;
+  const unsigned char *msg;
+  time_t               time_stamp;
+  int                  direction;
+  const unsigned char* uuid;
+  guint                count = 0;
+
+  stmt = history_get_statement (STMT_IM_MESSAGES);
+  if (!stmt)
+    return 0;
+
+  history_bind_page (stmt, account, who, limit, cursor);
+
+  while ((sqlite3_step(stmt)) == SQLITE_ROW) {
+    time_stamp = sqlite3_column_int64(stmt, 0);
+    direction = sqlite3_column_int(stmt, 1);
+    msg = sqlite3_column_text(stmt, 2);
+    uuid = sqlite3_column_text(stmt, 3);
+
+    cursor->seq = sqlite3_column_int64(stmt, 4);
+
+    if (markup)
+      *markup = sqlite3_column_text(stmt, 5);
+
+    cb(msg, direction, time_stamp, uuid, data, count == 0);
+    count++;
+  }
+
+  history_release_statement (stmt);
+
+  return count;
+}
+
+
+static void
+history_load_free (HistoryLoad *load)
+{
+  g_free (load->account);
+  g_free (load->name);
+  g_free (load->before_uid);
+  g_free (load);
+}
+
+
+static ChattyMsgDirection
+history_get_msg_direction (int direction)
+{
+  if (direction == 1)
+    return CHATTY_DIRECTION_IN;
+  else if (direction == -1)
+    return CHATTY_DIRECTION_OUT;
+  else
+    return CHATTY_DIRECTION_SYSTEM;
+}
+
+
+static void
+history_load_im_cb (const unsigned char *msg,
+                    int                  direction,
+                    time_t               time_stamp,
+                    const unsigned char *uuid,
+                    gpointer             user_data,
+                    int                  last_message)
+{
+  HistoryPage *page = user_data;
+  ChattyMessage *message;
+
+  if (!msg || !*msg)
+    return;
+
+  message = chatty_message_new (NULL, NULL, (const char *)msg, (const char *)uuid,
+                                time_stamp, history_get_msg_direction (direction), 0);
+  chatty_message_set_markup (message, (const char *)page->markup);
+  g_ptr_array_add (page->messages, message);
+}
+
+
+static void
+history_load_chat_cb (const unsigned char *msg,
+                      int                  direction,
+                      time_t               time_stamp,
+                      const char          *room,
+                      const unsigned char *who,
+                      const unsigned char *uuid,
+                      gpointer             user_data)
+{
+  HistoryPage *page = user_data;
+  ChattyMessage *message;
+  const char *alias = NULL;
+
+  if (!msg || !*msg)
+    return;
+
+  /* The nick of the sender follows the room name */
+  if (direction == 1 && who) {
+    alias = strchr ((const char *)who, '/');
+
+    if (alias)
+      alias++;
+    else
+      alias = (const char *)who;
+  }
+
+  message = chatty_message_new (NULL, alias, (const char *)msg, (const char *)uuid,
+                                time_stamp, history_get_msg_direction (direction), 0);
+  chatty_message_set_markup (message, (const char *)page->markup);
+  g_ptr_array_add (page->messages, message);
+}
+
+
+static void
+history_load (gpointer user_data)
+{
+  GTask *task = user_data;
+  HistoryLoad *load;
+  HistoryPage page = { NULL };
+  g_autoptr(GPtrArray) messages = NULL;
+  guint n_rows;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  load = g_task_get_task_data (task);
+
+  if (!load->has_cursor) {
+    gboolean found = FALSE;
+
+    chatty_history_cursor_init (&load->cursor);
+    load->has_cursor = TRUE;
+
+    if (load->before_uid && load->is_im)
+      found = history_get_cursor (STMT_IM_TIMESTAMP_FOR_UID, load->before_uid,
+                                  load->account, &load->cursor);
+    else if (load->before_uid)
+      found = history_get_cursor (STMT_CHAT_TIMESTAMP_FOR_UID, load->before_uid,
+                                  load->name, &load->cursor);
+
+    /* Not in history, load the messages up to its time */
+    if (load->before_uid && !found)
+      load->cursor.seq = ((gint64)load->before_time + 1) * 1000 * SEQ_PER_MS;
+  }
+
+  messages = g_ptr_array_new_full (load->limit, g_object_unref);
+  page.messages = messages;
+
+  if (load->is_im)
+    n_rows = history_get_im_messages (load->account, load->name, history_load_im_cb,
+                                      &page, load->limit, &load->cursor, &page.markup);
+  else
+    n_rows = history_get_chat_messages (load->account, load->name, history_load_chat_cb,
+                                        &page, load->limit, &load->cursor, &page.markup);
+
+  /* Rows without text are skipped, they count toward the page all the same */
+  load->cursor.at_start = n_rows < load->limit;
+
+  /* Rows are read newest first */
+  for (guint i = 0, j = messages->len; i + 1 < j; i++, j--) {
+    gpointer tmp = messages->pdata[i];
+
+    messages->pdata[i] = messages->pdata[j - 1];
+    messages->pdata[j - 1] = tmp;
+  }
+
+  g_task_return_pointer (task, g_steal_pointer (&messages),
+                         (GDestroyNotify)g_ptr_array_unref);
+}
+
+
+static void
+history_load_async (gboolean                   is_im,
+                    const char                *account,
+                    const char                *name,
+                    ChattyMessage             *before,
+                    const ChattyHistoryCursor *cursor,
+                    guint                      limit,
+                    GCancellable              *cancellable,
+                    GAsyncReadyCallback        callback,
+                    gpointer                   user_data)
+{
+  HistoryLoad *load;
+  GTask *task;
+
+  g_return_if_fail (account && name);
+  g_return_if_fail (!before || CHATTY_IS_MESSAGE (before));
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  load = g_new0 (HistoryLoad, 1);
+  load->is_im = is_im;
+  load->account = g_strdup (account);
+  load->name = g_strdup (name);
+  load->limit = limit;
+
+  if (cursor) {
+    load->cursor = *cursor;
+    load->has_cursor = TRUE;
+  } else if (before) {
+    load->before_uid = g_strdup (chatty_message_get_uid (before));
+    load->before_time = chatty_message_get_time (before);
+  }
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, history_load_async);
+  g_task_set_task_data (task, load, (GDestroyNotify)history_load_free);
+
+  history_queue_task (history_load, task);
+}
+
+
+/**
+ * chatty_history_load_im_async:
+ * @account: The account name
+ * @who: The buddy name
+ * @before: (nullable): A #ChattyMessage
+ * @cursor: (nullable): A #ChattyHistoryCursor
+ * @limit: The maximum number of messages to load
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when done
+ * @user_data: user data for @callback
+ *
+ * Load up to @limit messages of the IM conversation with
+ * @who in the history worker thread.  @cursor should be
+ * the one got from the previous page, or %NULL to load the
+ * latest messages.  In the later case, if @before is set,
+ * only messages older than @before are loaded.
+ *
+ * Finish with chatty_history_load_finish().
+ */
+void
+chatty_history_load_im_async (const char                *account,
+                              const char                *who,
+                              ChattyMessage             *before,
+                              const ChattyHistoryCursor *cursor,
+                              guint                      limit,
+                              GCancellable              *cancellable,
+                              GAsyncReadyCallback        callback,
+                              gpointer                   user_data)
+{
+  history_load_async (TRUE, account, who, before, cursor, limit,
+                      cancellable, callback, user_data);
+}
+
+
+/**
+ * chatty_history_load_chat_async:
+ * @account: The account name
+ * @room: The room name
+ * @before: (nullable): A #ChattyMessage
+ * @cursor: (nullable): A #ChattyHistoryCursor
+ * @limit: The maximum number of messages to load
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when done
+ * @user_data: user data for @callback
+ *
+ * Same as chatty_history_load_im_async(), but for
+ * the MUC @room.  The user of incoming messages is
+ * not set, only the alias of the sender.
+ */
+void
+chatty_history_load_chat_async (const char                *account,
+                                const char                *room,
+                                ChattyMessage             *before,
+                                const ChattyHistoryCursor *cursor,
+                                guint                      limit,
+                                GCancellable              *cancellable,
+                                GAsyncReadyCallback        callback,
+                                gpointer                   user_data)
+{
+  history_load_async (FALSE, account, room, before, cursor, limit,
+                      cancellable, callback, user_data);
+}
+
+
+/**
+ * chatty_history_load_finish:
+ * @result: A #GAsyncResult
+ * @cursor: (out) (optional): A #ChattyHistoryCursor
+ * @error: (nullable): A #GError
+ *
+ * Finish chatty_history_load_im_async() or
+ * chatty_history_load_chat_async().  @cursor is set
+ * to load the page just before the one loaded.
+ *
+ * Messages without text are skipped, so a page can
+ * have less messages than asked, or none, even if
+ * there are older ones.  Use chatty_history_cursor_at_start()
+ * on @cursor to know if the start of the history is
+ * reached.
+ *
+ * Returns: (transfer full): An array of #ChattyMessage,
+ * oldest first, or %NULL on error.
+ */
+GPtrArray *
+chatty_history_load_finish (GAsyncResult         *result,
+                            ChattyHistoryCursor  *cursor,
+                            GError              **error)
+{
+  GPtrArray *messages;
+
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == history_load_async, NULL);
+
+  messages = g_task_propagate_pointer (G_TASK (result), error);
+
+  if (messages && cursor) {
+    HistoryLoad *load;
+
+    load = g_task_get_task_data (G_TASK (result));
+    *cursor = load->cursor;
+  }
+
+  return messages;
+}
+
+
+static void
+history_get_im_last_message_job (gpointer user_data)
+{
+  GTask *task = user_data;
+  HistoryLoad *load;
+  ChattyLog log = { 0 };
+  ChattyMessage *message = NULL;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  load = g_task_get_task_data (task);
+
+  if (history_get_im_last_message (load->account, load->name, &log))
+    message = chatty_message_new (NULL, NULL, log.msg, log.uid, log.epoch,
+                                  history_get_msg_direction (log.dir), 0);
+
+  g_free (log.msg);
+  g_free (log.uid);
+
+  g_task_return_pointer (task, message, g_object_unref);
+}
+
+
+/**
+ * chatty_history_get_im_last_message_async:
+ * @account: The account name
+ * @who: The buddy name
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when done
+ * @user_data: user data for @callback
+ *
+ * Get the last message of the IM conversation with
+ * @who in the history worker thread.  Finish with
+ * chatty_history_get_im_last_message_finish().
+ */
+void
+chatty_history_get_im_last_message_async (const char          *account,
+                                          const char          *who,
+                                          GCancellable        *cancellable,
+                                          GAsyncReadyCallback  callback,
+                                          gpointer             user_data)
+{
+  HistoryLoad *load;
+  GTask *task;
+
+  g_return_if_fail (account && who);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  load = g_new0 (HistoryLoad, 1);
+  load->is_im = TRUE;
+  load->account = g_strdup (account);
+  load->name = g_strdup (who);
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_get_im_last_message_async);
+  g_task_set_task_data (task, load, (GDestroyNotify)history_load_free);
+
+  history_queue_task (history_get_im_last_message_job, task);
+}
+
+
+/**
+ * chatty_history_get_im_last_message_finish:
+ * @result: A #GAsyncResult
+ * @error: (nullable): A #GError
+ *
+ * Finish chatty_history_get_im_last_message_async().
+ *
+ * Returns: (transfer full) (nullable): The last message,
+ * or %NULL if there is none or on error.
+ */
+ChattyMessage *
+chatty_history_get_im_last_message_finish (GAsyncResult  *result,
+                                           GError       **error)
+{
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+
+static void
+history_get_chat_last_message_time_job (gpointer user_data)
+{
+  GTask *task = user_data;
+  HistoryLoad *load;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  load = g_task_get_task_data (task);
+  g_task_return_int (task, history_get_chat_last_message_time (load->account, load->name));
+}
+
+
+/**
+ * chatty_history_get_chat_last_message_time_async:
+ * @account: The account name
+ * @room: The room name
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when done
+ * @user_data: user data for @callback
+ *
+ * Get the time of the last message of @room in the
+ * history worker thread.  Finish with
+ * chatty_history_get_chat_last_message_time_finish().
+ */
+void
+chatty_history_get_chat_last_message_time_async (const char          *account,
+                                                 const char          *room,
+                                                 GCancellable        *cancellable,
+                                                 GAsyncReadyCallback  callback,
+                                                 gpointer             user_data)
+{
+  HistoryLoad *load;
+  GTask *task;
+
+  g_return_if_fail (account && room);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  load = g_new0 (HistoryLoad, 1);
+  load->account = g_strdup (account);
+  load->name = g_strdup (room);
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_get_chat_last_message_time_async);
+  g_task_set_task_data (task, load, (GDestroyNotify)history_load_free);
+
+  history_queue_task (history_get_chat_last_message_time_job, task);
+}
+
+
+/**
+ * chatty_history_get_chat_last_message_time_finish:
+ * @result: A #GAsyncResult
+ * @error: (nullable): A #GError
+ *
+ * Finish chatty_history_get_chat_last_message_time_async().
+ *
+ * Returns: The time of the last message, or 0 if there
+ * is none or on error.
+ */
+time_t
+chatty_history_get_chat_last_message_time_finish (GAsyncResult  *result,
+                                                  GError       **error)
+{
+  gssize time_stamp;
+
+  g_return_val_if_fail (G_IS_TASK (result), 0);
+
+  time_stamp = g_task_propagate_int (G_TASK (result), error);
+
+  return time_stamp > 0 ? time_stamp : 0;
+}
+
+
+typedef struct {
+  GHashTable *ims;
+  GHashTable *chats;
+} HistoryLastMessages;
+
+static void
+history_last_messages_free (HistoryLastMessages *last)
+{
+  g_clear_pointer (&last->ims, g_hash_table_unref);
+  g_clear_pointer (&last->chats, g_hash_table_unref);
+  g_free (last);
+}
+
+
+static GHashTable *
+history_read_last_messages (HistoryStatement id)
+{
+  GHashTable *accounts;
+  sqlite3_stmt *stmt;
+
+  accounts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                    (GDestroyNotify)g_hash_table_unref);
+
+  stmt = history_get_statement (id);
+  if (!stmt)
+    return accounts;
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    ChattyMessage *message;
+    GHashTable *table;
+    const char *account, *name, *alias = NULL;
+    int direction;
+
+    account = (const char *)sqlite3_column_text (stmt, 0);
+    name = (const char *)sqlite3_column_text (stmt, 1);
+    direction = sqlite3_column_int (stmt, 3);
+
+    if (!account || !name)
+      continue;
+
+    /* The nick of the sender follows the room name */
+    if (id == STMT_CHAT_LAST_MESSAGES && direction == 1) {
+      alias = (const char *)sqlite3_column_text (stmt, 6);
+
+      if (alias && strchr (alias, '/'))
+        alias = strchr (alias, '/') + 1;
+    }
+
+    table = g_hash_table_lookup (accounts, account);
+
+    if (!table) {
+      table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+      g_hash_table_insert (accounts, g_strdup (account), table);
+    }
+
+    message = chatty_message_new (NULL, alias,
+                                  (const char *)sqlite3_column_text (stmt, 2),
+                                  (const char *)sqlite3_column_text (stmt, 5),
+                                  sqlite3_column_int64 (stmt, 4),
+                                  history_get_msg_direction (direction), 0);
+    g_hash_table_insert (table, g_strdup (name), message);
+  }
+
+  history_release_statement (stmt);
+
+  return accounts;
+}
+
+
+static void
+history_get_last_messages (gpointer user_data)
+{
+  GTask *task = user_data;
+  HistoryLastMessages *last;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  last = g_new0 (HistoryLastMessages, 1);
+  last->ims = history_read_last_messages (STMT_IM_LAST_MESSAGES);
+  last->chats = history_read_last_messages (STMT_CHAT_LAST_MESSAGES);
+
+  g_task_return_pointer (task, last, (GDestroyNotify)history_last_messages_free);
+}
+
+
+/**
+ * chatty_history_get_last_messages_async:
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when done
+ * @user_data: user data for @callback
+ *
+ * Get the last message of every IM conversation and
+ * every room in the history with a single query each,
+ * instead of one query per conversation.  Finish with
+ * chatty_history_get_last_messages_finish().
+ */
+void
+chatty_history_get_last_messages_async (GCancellable        *cancellable,
+                                        GAsyncReadyCallback  callback,
+                                        gpointer             user_data)
+{
+  GTask *task;
+
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_get_last_messages_async);
+
+  history_queue_task (history_get_last_messages, task);
+}
+
+
+/**
+ * chatty_history_get_last_messages_finish:
+ * @result: A #GAsyncResult
+ * @ims: (out) (optional) (transfer full): The IM messages
+ * @chats: (out) (optional) (transfer full): The room messages
+ * @error: (nullable): A #GError
+ *
+ * Finish chatty_history_get_last_messages_async().  @ims and
+ * @chats map account names to a #GHashTable, which maps
+ * buddy (or room) names to their last #ChattyMessage.
+ *
+ * Returns: %TRUE on success, %FALSE on error.
+ */
+gboolean
+chatty_history_get_last_messages_finish (GAsyncResult  *result,
+                                         GHashTable   **ims,
+                                         GHashTable   **chats,
+                                         GError       **error)
+{
+  HistoryLastMessages *last;
+
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+
+  last = g_task_propagate_pointer (G_TASK (result), error);
+
+  if (!last)
+    return FALSE;
+
+  if (ims)
+    *ims = g_steal_pointer (&last->ims);
+
+  if (chats)
+    *chats = g_steal_pointer (&last->chats);
+
+  history_last_messages_free (last);
+
+  return TRUE;
+}
+
+
+typedef struct {
+  char      *account;
+  guint      limit;
+  GPtrArray *im_uids;
+  GPtrArray *chat_uids;
+  time_t     since;
+} HistoryUids;
+
+static void
+history_uids_free (HistoryUids *uids)
+{
+  g_clear_pointer (&uids->im_uids, g_ptr_array_unref);
+  g_clear_pointer (&uids->chat_uids, g_ptr_array_unref);
+  g_free (uids->account);
+  g_free (uids);
+}
+
+
+/*
+ * Read the uids of the @limit latest messages of @account.  If
+ * there are more, @since is set to the time of the oldest one read.
+ */
+static GPtrArray *
+history_read_uids (HistoryStatement  id,
+                   const char       *account,
+                   guint             limit,
+                   time_t           *since)
+{
+  GPtrArray *uids;
+  sqlite3_stmt *stmt;
+  time_t time_stamp = 0;
+  guint n_rows = 0;
+  int n_columns;
+  int rc;
+
+  uids = g_ptr_array_new_with_free_func (g_free);
+
+  stmt = history_get_statement (id);
+  if (!stmt)
+    return uids;
+
+  rc = sqlite3_bind_text (stmt, 1, account, -1, SQLITE_STATIC);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_bind_int (stmt, 2, limit);
+  if (rc != SQLITE_OK)
+    g_debug ("Error binding when getting uids. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
+
+  n_columns = sqlite3_column_count (stmt);
+
+  while (sqlite3_step (stmt) == SQLITE_ROW) {
+    for (int i = 0; i < n_columns - 1; i++)
+      g_ptr_array_add (uids, g_strdup ((const char *)sqlite3_column_text (stmt, i)));
+
+    time_stamp = sqlite3_column_int64 (stmt, n_columns - 1);
+    n_rows++;
+  }
+
+  history_release_statement (stmt);
+
+  if (n_rows >= limit)
+    *since = MAX (*since, time_stamp);
+
+  return uids;
+}
+
+
+static void
+history_get_uids (gpointer user_data)
+{
+  GTask *task = user_data;
+  HistoryUids *uids;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  uids = g_task_get_task_data (task);
+  uids->im_uids = history_read_uids (STMT_IM_UIDS, uids->account, uids->limit, &uids->since);
+  uids->chat_uids = history_read_uids (STMT_CHAT_UIDS, uids->account, uids->limit, &uids->since);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+
+/**
+ * chatty_history_get_uids_async:
+ * @account: The account name
+ * @limit: The maximum number of IM and of room messages
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when done
+ * @user_data: user data for @callback
+ *
+ * Get the uids of the latest @limit IM messages and of
+ * the latest @limit room messages stored for @account,
+ * in order to know which messages are stored without a
+ * query per message.  Finish with
+ * chatty_history_get_uids_finish().
+ */
+void
+chatty_history_get_uids_async (const char          *account,
+                               guint                limit,
+                               GCancellable        *cancellable,
+                               GAsyncReadyCallback  callback,
+                               gpointer             user_data)
+{
+  HistoryUids *uids;
+  GTask *task;
+
+  g_return_if_fail (account);
+  g_return_if_fail (limit > 0);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  uids = g_new0 (HistoryUids, 1);
+  uids->account = g_strdup (account);
+  uids->limit = limit;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_get_uids_async);
+  g_task_set_task_data (task, uids, (GDestroyNotify)history_uids_free);
+
+  history_queue_task (history_get_uids, task);
+}
+
+
+/**
+ * chatty_history_get_uids_finish:
+ * @result: A #GAsyncResult
+ * @im_uids: (out) (optional) (transfer full): The IM message uids
+ * @chat_uids: (out) (optional) (transfer full): The room message uids
+ * @since: (out) (optional): The time up to which messages may
+ *   be stored without being listed, or 0 if all are listed
+ * @error: (nullable): A #GError
+ *
+ * Finish chatty_history_get_uids_async().  @chat_uids
+ * holds pairs of strings: the room name followed by the
+ * message uid, as uids are only unique within a room.
+ *
+ * Returns: %TRUE on success, %FALSE on error.
+ */
+gboolean
+chatty_history_get_uids_finish (GAsyncResult  *result,
+                                GPtrArray    **im_uids,
+                                GPtrArray    **chat_uids,
+                                time_t        *since,
+                                GError       **error)
+{
+  HistoryUids *uids;
+
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return FALSE;
+
+  uids = g_task_get_task_data (G_TASK (result));
+
+  if (im_uids)
+    *im_uids = g_steal_pointer (&uids->im_uids);
+
+  if (chat_uids)
+    *chat_uids = g_steal_pointer (&uids->chat_uids);
+
+  if (since)
+    *since = uids->since;
+
+  return TRUE;
+}
+
+
+typedef struct {
+  char  *query;
+  guint  limit;
+  guint  offset;
+} HistorySearch;
+
+static void
+history_search_free (HistorySearch *search)
+{
+  g_free (search->query);
+  g_free (search);
+}
+
+
+/**
+ * chatty_history_match_free:
+ * @match: A #ChattyHistoryMatch
+ *
+ * Free @match.
+ */
 void
-chatty_history_get_im_messages (const char* account,
-                                const char* who,
-                                void (*cb)(const unsigned char* msg,
-                                           int                  direction,
-                                           time_t               time_stamp,
-                                           const unsigned char  *uuid,
-                                           gpointer             data,
-                                           int                  last_message),
-                                gpointer   data,
-                                guint      limit,
-                                const char *oldest_message_displayed)
+chatty_history_match_free (ChattyHistoryMatch *match)
+{
+  if (!match)
+    return;
+
+  g_free (match->account);
+  g_free (match->who);
+  g_free (match->room);
+  g_free (match->uid);
+  g_free (match->snippet);
+  g_free (match);
+}
+
+
+/*
+ * Make a query from the words typed by the user: each
+ * word is quoted so that no character has a special
+ * meaning, and the last one is matched as a prefix
+ * so that results are shown while typing.
+ */
+static char *
+history_build_match_query (const char *text)
+{
+  g_auto(GStrv) words = NULL;
+  GString *query;
+
+  words = g_strsplit_set (text, " \t\n", -1);
+  query = g_string_new (NULL);
+
+  for (guint i = 0; words[i]; i++) {
+    if (!*words[i])
+      continue;
+
+    if (query->len)
+      g_string_append_c (query, ' ');
+
+    g_string_append_c (query, '"');
+
+    for (const char *c = words[i]; *c; c++) {
+      if (*c == '"')
+        g_string_append_c (query, '"');
+      g_string_append_c (query, *c);
+    }
+
+    g_string_append_c (query, '"');
+  }
+
+  if (!query->len)
+    return g_string_free (query, TRUE);
+
+  g_string_append_c (query, '*');
+
+  return g_string_free (query, FALSE);
+}
+
+
+/* Escape the snippet, and highlight the matches */
+static char *
+history_snippet_to_markup (const char *snippet)
+{
+  GString *markup;
+  const char *start;
+
+  markup = g_string_new (NULL);
+  start = snippet;
+
+  for (const char *c = snippet; ; c++) {
+    if (*c != '\1' && *c != '\2' && *c)
+      continue;
+
+    if (c > start) {
+      g_autofree char *text = g_markup_escape_text (start, c - start);
+
+      g_string_append (markup, text);
+    }
+
+    if (!*c)
+      break;
+
+    g_string_append (markup, *c == '\1' ? "<b>" : "</b>");
+    start = c + 1;
+  }
+
+  return g_string_free (markup, FALSE);
+}
+
+
+/* A non-zero return interrupts the statement being run */
+static int
+history_search_progress_cb (void *user_data)
 {
+  GCancellable *cancellable = user_data;
 
+  return g_cancellable_is_cancelled (cancellable);
+}
+
+
+static void
+history_search (gpointer user_data)
+{
+  GTask *task = user_data;
+  HistorySearch *search;
+  g_autoptr(GPtrArray) matches = NULL;
+  g_autofree char *query = NULL;
+  sqlite3_stmt *stmt;
   int rc;
-  sqlite3_stmt        *stmt;
-  const unsigned char *msg;
-  int                  time_stamp;
-  int                  direction;
-  int                  first;
-  const unsigned char* uuid;
-  int                  from_timestamp;
-  char                 skip;
 
-  from_timestamp = get_im_timestamp_for_uuid(oldest_message_displayed, account);
+  if (g_task_return_error_if_cancelled (task))
+    return;
 
-   // Then, fetch the result and detect the last row.
-  rc = sqlite3_prepare_v2(db, "SELECT timestamp,direction,message,uid FROM chatty_im WHERE account=(?) AND who=(?) AND timestamp <= (?) ORDER BY timestamp DESC, id DESC LIMIT (?)", -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-      g_debug("Error preparing statement when querying IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  if (!search_available) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                             "Search is not available");
+    return;
+  }
 
-  rc = sqlite3_bind_text(stmt, 1, account, -1, SQLITE_TRANSIENT);
-  if (rc != SQLITE_OK)
-      g_debug("Error binding when querying IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  search = g_task_get_task_data (task);
+  matches = g_ptr_array_new_with_free_func ((GDestroyNotify)chatty_history_match_free);
+  query = history_build_match_query (search->query);
+
+  if (!query) {
+    g_task_return_pointer (task, g_steal_pointer (&matches),
+                           (GDestroyNotify)g_ptr_array_unref);
+    return;
+  }
+
+  stmt = history_get_statement (STMT_SEARCH);
+  if (!stmt) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Error preparing search: %s", sqlite3_errmsg (db));
+    return;
+  }
 
-  rc = sqlite3_bind_text(stmt, 2, who, -1, SQLITE_TRANSIENT);
+  rc = sqlite3_bind_text (stmt, 1, query, -1, SQLITE_STATIC);
   if (rc != SQLITE_OK)
-    g_debug("Error binding when querying IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+    g_debug ("Error binding when searching. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
 
-  rc = sqlite3_bind_int(stmt, 3, from_timestamp);
+  rc = sqlite3_bind_int (stmt, 2, search->limit);
   if (rc != SQLITE_OK)
-    g_debug("Error binding when querying IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+    g_debug ("Error binding when searching. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
 
-  rc = sqlite3_bind_int(stmt, 4, limit);
+  rc = sqlite3_bind_int (stmt, 3, search->offset);
   if (rc != SQLITE_OK)
-    g_debug("Error binding when querying IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+    g_debug ("Error binding when searching. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
+
+  /* Ranking every match of a short text can take long, stop once not needed */
+  if (g_task_get_cancellable (task))
+    sqlite3_progress_handler (db, SEARCH_PROGRESS_STEPS, history_search_progress_cb,
+                              g_task_get_cancellable (task));
+
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+    ChattyHistoryMatch *match;
+
+    match = g_new0 (ChattyHistoryMatch, 1);
+    match->account = g_strdup ((const char *)sqlite3_column_text (stmt, 0));
+    match->who = g_strdup ((const char *)sqlite3_column_text (stmt, 1));
+    match->room = g_strdup ((const char *)sqlite3_column_text (stmt, 2));
+    match->uid = g_strdup ((const char *)sqlite3_column_text (stmt, 3));
+    match->time = sqlite3_column_int64 (stmt, 4);
+    match->snippet = history_snippet_to_markup ((const char *)sqlite3_column_text (stmt, 5));
+    match->rank = sqlite3_column_double (stmt, 6);
+
+    g_ptr_array_add (matches, match);
+  }
 
-  skip = oldest_message_displayed != NULL;
-  first = 1;
-  while ((sqlite3_step(stmt)) == SQLITE_ROW) {
-    time_stamp = sqlite3_column_int(stmt, 0);
-    direction = sqlite3_column_int(stmt, 1);
-    msg = sqlite3_column_text(stmt, 2);
-    uuid = sqlite3_column_text(stmt, 3);
+  sqlite3_progress_handler (db, 0, NULL, NULL);
 
-    // TODO: @LELAND: This approach would return a variable number of messages
-    // in case a burst of messages were received for the same epoch
-    // If this is an issue, we should use a more fine grain timestamp.
-    if (skip){
-      skip = g_strcmp0(oldest_message_displayed, (const char *) uuid);
-    } else {
-      cb(msg, direction, time_stamp, uuid, data, first);
-      first = 0;
-    }
-  }
+  if (rc != SQLITE_DONE && rc != SQLITE_INTERRUPT)
+    g_debug ("Error in step when searching. errno: %d, desc: %s", rc, sqlite3_errmsg (db));
 
-  rc = sqlite3_finalize(stmt);
-  if (rc != SQLITE_OK)
-      g_debug("Error finalizing when querying IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  history_release_statement (stmt);
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
 
+  g_task_return_pointer (task, g_steal_pointer (&matches),
+                         (GDestroyNotify)g_ptr_array_unref);
 }
 
 
+/**
+ * chatty_history_search_async:
+ * @text: The text to search
+ * @limit: The maximum number of matches
+ * @offset: The number of best matches to skip
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when done
+ * @user_data: user data for @callback
+ *
+ * Search messages containing all the words in @text,
+ * the last word being matched as a prefix.  Matches
+ * are sorted by relevance, the next page can be got
+ * by increasing @offset by @limit.
+ *
+ * Finish with chatty_history_search_finish().
+ */
 void
-chatty_history_delete_chat (const char* account,
-                            const char* room){
+chatty_history_search_async (const char          *text,
+                             guint                limit,
+                             guint                offset,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data)
+{
+  HistorySearch *search;
+  GTask *task;
+
+  g_return_if_fail (text);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  search = g_new0 (HistorySearch, 1);
+  search->query = g_strdup (text);
+  search->limit = limit;
+  search->offset = offset;
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_search_async);
+  g_task_set_task_data (task, search, (GDestroyNotify)history_search_free);
+
+  history_queue_task (history_search, task);
+}
+
+
+/**
+ * chatty_history_search_finish:
+ * @result: A #GAsyncResult
+ * @error: (nullable): A #GError
+ *
+ * Finish chatty_history_search_async().  If the
+ * history has no search index, the error is
+ * %G_IO_ERROR_NOT_SUPPORTED.
+ *
+ * Returns: (transfer full): An array of #ChattyHistoryMatch,
+ * best match first, or %NULL on error.
+ */
+GPtrArray *
+chatty_history_search_finish (GAsyncResult  *result,
+                              GError       **error)
+{
+  g_return_val_if_fail (G_IS_TASK (result), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+
+static void
+history_delete_chat (gpointer user_data)
+{
+  HistoryRow *row = user_data;
   int rc;
   sqlite3_stmt *stmt;
 
-  rc = sqlite3_prepare_v2(db, "DELETE FROM chatty_chat WHERE account=(?) AND room=(?)", -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-      g_debug("Error preparing statement when deleting CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  stmt = history_get_statement (STMT_CHAT_DELETE);
+  if (!stmt)
+    return;
 
-  rc = sqlite3_bind_text(stmt, 1, account, -1, SQLITE_TRANSIENT);
+  rc = sqlite3_bind_text(stmt, 1, row->account, -1, SQLITE_STATIC);
   if (rc != SQLITE_OK)
       g_debug("Error binding when deleting CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
 
-  rc = sqlite3_bind_text(stmt, 2, room, -1, SQLITE_TRANSIENT);
+  rc = sqlite3_bind_text(stmt, 2, row->room, -1, SQLITE_STATIC);
   if (rc != SQLITE_OK)
       g_debug("Error binding when deleting CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
 
-  sqlite3_step(stmt);
-  if (rc != SQLITE_OK)
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE)
       g_debug("Error in step when deleting CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
 
-  rc = sqlite3_finalize(stmt);
-  if (rc != SQLITE_OK)
-      g_debug("Error finalizing when deleting CHAT messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  history_release_statement (stmt);
+  checkpoint_needed = TRUE;
 
 }
 
 
 void
-chatty_history_delete_im (const char *account,
-                          const char *who){
+chatty_history_delete_chat (const char* account,
+                            const char* room)
+{
+  history_queue (history_delete_chat,
+                 history_row_new (NULL, 0, account, NULL, NULL, 0, room),
+                 (GDestroyNotify)history_row_free);
+}
+
+
+static void
+history_delete_im (gpointer user_data)
+{
+  HistoryRow *row = user_data;
   int rc;
   sqlite3_stmt *stmt;
 
-  rc = sqlite3_prepare_v2(db, "DELETE FROM chatty_im WHERE account=(?) AND who=(?)", -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
-      g_debug("Error preparing statement when deleting IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  stmt = history_get_statement (STMT_IM_DELETE);
+  if (!stmt)
+    return;
 
-  rc = sqlite3_bind_text(stmt, 1, account, -1, SQLITE_TRANSIENT);
+  rc = sqlite3_bind_text(stmt, 1, row->account, -1, SQLITE_STATIC);
   if (rc != SQLITE_OK)
       g_debug("Error binding when deleting IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
 
-  rc = sqlite3_bind_text(stmt, 2, who, -1, SQLITE_TRANSIENT);
+  rc = sqlite3_bind_text(stmt, 2, row->who, -1, SQLITE_STATIC);
   if (rc != SQLITE_OK)
       g_debug("Error binding when deleting IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
                                                             //
-  sqlite3_step(stmt);
-  if (rc != SQLITE_OK)
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE)
       g_debug("Error in step when deleting IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
 
-  rc = sqlite3_finalize(stmt);
-  if (rc != SQLITE_OK)
-      g_debug("Error finalizing when deleting IM messages. errno: %d, desc: %s", rc, sqlite3_errmsg(db));
+  history_release_statement (stmt);
+  checkpoint_needed = TRUE;
 
 }
 
 
 void
-chatty_history_add_message (PurpleAccount *pa, PurpleConvMessage *pcm,
-                            char **sid, PurpleConversationType type,
-                            gpointer data)
+chatty_history_delete_im (const char *account,
+                          const char *who)
+{
+  history_queue (history_delete_im,
+                 history_row_new (NULL, 0, account, who, NULL, 0, NULL),
+                 (GDestroyNotify)history_row_free);
+}
+
+
+/*
+ * The time of @pcm in milliseconds.  Messages stamped
+ * now get the current millisecond, to keep them in order.
+ */
+static gint64
+history_message_time_ms (PurpleConvMessage *pcm)
+{
+  gint64 now_ms = g_get_real_time () / 1000;
+
+  if (pcm->when == now_ms / 1000)
+    return now_ms;
+
+  return (gint64)pcm->when * 1000;
+}
+
+
+/*
+ * The row to store for @pcm, or %NULL if @pcm shouldn't
+ * be stored.  @sid is set to a new uid if it's %NULL.
+ */
+static HistoryRow *
+history_row_from_message (PurpleAccount          *pa,
+                          PurpleConvMessage      *pcm,
+                          char                  **sid,
+                          PurpleConversationType  type,
+                          gint64                  mtime_ms)
 {
   int dir = 0;
 
@@ -620,19 +2845,194 @@ chatty_history_add_message (PurpleAccount *pa, PurpleConvMessage *pcm,
 
   // MAM XEP for one should set it to take over the history
   if(pcm->flags & PURPLE_MESSAGE_NO_LOG)
-    return;
+    return NULL;
 
-  g_debug ("Add History: ID:%s, Acc:%s, Who:%s, Room:%s, Flags:%d, Dir:%d, Type:%d, TS:%ld, Body:%s",
-              *sid, pa->username, pcm->who, pcm->alias, pcm->flags, dir, type, pcm->when, pcm->what);
+  g_debug ("Add History: ID:%s, Acc:%s, Who:%s, Room:%s, Flags:%d, Dir:%d, Type:%d, TS:%" G_GINT64_FORMAT ", Body:%s",
+              *sid, pa->username, pcm->who, pcm->alias, pcm->flags, dir, type, mtime_ms, pcm->what);
 
   if(sid != NULL && *sid == NULL)
     *sid = g_uuid_string_random ();
 
-  if (type == PURPLE_CONV_TYPE_CHAT) {
-    chatty_history_add_chat_message(pcm->what, dir, pa->username, pcm->who,
-                                    *sid, pcm->when, pcm->alias);
-  } else {
-    chatty_history_add_im_message(pcm->what, dir, pa->username, pcm->who,
-                                  *sid, pcm->when);
+  return history_row_new (pcm->what, dir, pa->username, pcm->who, *sid, mtime_ms,
+                          type == PURPLE_CONV_TYPE_CHAT ? pcm->alias : NULL);
+}
+
+
+void
+chatty_history_add_message (PurpleAccount *pa, PurpleConvMessage *pcm,
+                            char **sid, PurpleConversationType type,
+                            gpointer data)
+{
+  chatty_history_add_message_ms (pa, pcm, sid, type, history_message_time_ms (pcm));
+}
+
+
+void
+chatty_history_add_message_ms (PurpleAccount *pa, PurpleConvMessage *pcm,
+                               char **sid, PurpleConversationType type,
+                               gint64 mtime_ms)
+{
+  HistoryRow *row;
+
+  row = history_row_from_message (pa, pcm, sid, type, mtime_ms);
+
+  if (!row)
+    return;
+
+  if (type == PURPLE_CONV_TYPE_CHAT)
+    history_queue (history_add_chat_message, row, (GDestroyNotify)history_row_free);
+  else
+    history_queue (history_add_im_message, row, (GDestroyNotify)history_row_free);
+}
+
+
+/* A message to be added unless it's already stored */
+typedef struct {
+  HistoryRow *row;
+  char       *origin_id;
+  gboolean    is_chat;
+} HistoryNewMessage;
+
+static void
+history_new_message_free (HistoryNewMessage *new_message)
+{
+  history_row_free (new_message->row);
+  g_free (new_message->origin_id);
+  g_free (new_message);
+}
+
+
+static gboolean
+history_has_uid (HistoryStatement  id,
+                 const char       *uid,
+                 const char       *scope)
+{
+  ChattyHistoryCursor cursor;
+
+  if (!uid)
+    return FALSE;
+
+  return history_get_cursor (id, uid, scope, &cursor);
+}
+
+
+/*
+ * Nothing else is run in between the lookup and the insert, so
+ * two copies of the same message can't both be found to be new.
+ */
+static void
+history_add_message_if_new (gpointer user_data)
+{
+  GTask *task = user_data;
+  HistoryNewMessage *new_message;
+  HistoryRow *row;
+  HistoryStatement id;
+  const char *scope;
+  gboolean stored;
+
+  if (g_task_return_error_if_cancelled (task))
+    return;
+
+  new_message = g_task_get_task_data (task);
+  row = new_message->row;
+
+  /* uids are unique within the room, or the account for IMs */
+  id = new_message->is_chat ? STMT_CHAT_TIMESTAMP_FOR_UID : STMT_IM_TIMESTAMP_FOR_UID;
+  scope = new_message->is_chat ? row->room : row->account;
+  stored = history_has_uid (id, row->uid, scope) ||
+           history_has_uid (id, new_message->origin_id, scope);
+
+  if (stored)
+    g_debug ("Message id %s for acc %s is already stored", row->uid, row->account);
+  else if (new_message->is_chat)
+    history_add_chat_message (row);
+  else
+    history_add_im_message (row);
+
+  g_task_return_boolean (task, !stored);
+}
+
+
+/**
+ * chatty_history_add_message_if_new_async:
+ * @pa: The #PurpleAccount of the message
+ * @pcm: The #PurpleConvMessage to store
+ * @uid: The uid of the message
+ * @origin_id: (nullable): The uid the message was sent with
+ * @type: The #PurpleConversationType of the message
+ * @mtime_ms: The time of the message in milliseconds,
+ *   or 0 to use the time of @pcm
+ * @cancellable: (nullable): A #GCancellable
+ * @callback: The callback to run when done
+ * @user_data: user data for @callback
+ *
+ * Same as chatty_history_add_message_ms(), but the message
+ * is only added if no message with @uid, or @origin_id, is
+ * stored yet.  Both are done in a single job, so that copies
+ * of a message received at once (eg. from the archive and
+ * live) are only added once.  Finish with
+ * chatty_history_add_message_if_new_finish().
+ */
+void
+chatty_history_add_message_if_new_async (PurpleAccount          *pa,
+                                         PurpleConvMessage      *pcm,
+                                         const char             *uid,
+                                         const char             *origin_id,
+                                         PurpleConversationType  type,
+                                         gint64                  mtime_ms,
+                                         GCancellable           *cancellable,
+                                         GAsyncReadyCallback     callback,
+                                         gpointer                user_data)
+{
+  HistoryNewMessage *new_message;
+  HistoryRow *row;
+  GTask *task;
+  char *sid;
+
+  g_return_if_fail (pa && pcm && uid);
+  g_return_if_fail (!cancellable || G_IS_CANCELLABLE (cancellable));
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, chatty_history_add_message_if_new_async);
+
+  if (!mtime_ms)
+    mtime_ms = history_message_time_ms (pcm);
+
+  sid = (char *)uid;
+  row = history_row_from_message (pa, pcm, &sid, type, mtime_ms);
+
+  if (!row) {
+    g_task_return_boolean (task, FALSE);
+    g_object_unref (task);
+
+    return;
   }
+
+  new_message = g_new0 (HistoryNewMessage, 1);
+  new_message->row = row;
+  new_message->origin_id = g_strdup (origin_id);
+  new_message->is_chat = type == PURPLE_CONV_TYPE_CHAT;
+  g_task_set_task_data (task, new_message, (GDestroyNotify)history_new_message_free);
+
+  history_queue_task (history_add_message_if_new, task);
+}
+
+
+/**
+ * chatty_history_add_message_if_new_finish:
+ * @result: A #GAsyncResult
+ * @error: (nullable): A #GError
+ *
+ * Finish chatty_history_add_message_if_new_async().
+ *
+ * Returns: %TRUE if the message was new and has been
+ * added, %FALSE if it was already stored or on error.
+ */
+gboolean
+chatty_history_add_message_if_new_finish (GAsyncResult  *result,
+                                          GError       **error)
+{
+  g_return_val_if_fail (G_IS_TASK (result), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
 }
@@ -9,9 +9,13 @@
 #define __HISTORY_H_INCLUDE__
 
 #include <glib.h>
+#include <gio/gio.h>
 #include <purple.h>
 #include <time.h>
 
+#include "chatty-message.h"
+#include "chatty-settings.h"
+
 /* #include "chatty-conversation.h" */
 
 typedef struct chatty_log ChattyLog;
@@ -30,6 +34,19 @@ int chatty_history_open (const char *dir,
 
 void chatty_history_close (void);
 
+void chatty_history_apply_settings (ChattySettings *settings);
+
+void chatty_history_begin_batch (void);
+void chatty_history_end_batch (void);
+
+void     chatty_history_get_statement_stats_async  (GCancellable        *cancellable,
+                                                    GAsyncReadyCallback  callback,
+                                                    gpointer             user_data);
+gboolean chatty_history_get_statement_stats_finish (GAsyncResult        *result,
+                                                    guint               *n_prepared,
+                                                    guint               *n_reused,
+                                                    GError             **error);
+
 void chatty_history_add_chat_message (const char *stanza,
                                       int         direction,
                                       const char *account,
@@ -45,49 +62,119 @@ void chatty_history_add_im_message (const char *stanza,
                                     const char *uid,
                                     time_t      m_time);
 
-/**
- * Returns the timestamp (time_t) for the message stored under specified ID
- * for the given account.
- *
- * @param uuid    zero terminated string containing message ID
- * @param account zero terminated string containing account name
- *
- * @return  the int representing timestamp (time_t) of the stored message or
- *          INT_MAX if message not found.
- */
-int get_im_timestamp_for_uuid(const char *uuid, const char *account);
-int get_chat_timestamp_for_uuid(const char *uuid, const char *room);
-
-void chatty_history_get_im_messages (const char* account,
-                                     const char* who,
-                                     void (*cb)(const unsigned char *msg,
-                                                int                  direction,
-                                                time_t               time_stamp,
-                                                const unsigned char *uuid,
-                                                gpointer            data,
-                                                int                 last_message),
-                                     gpointer   data,
-                                     guint      limit,
-                                     const char *oldest_message_displayed);
+void chatty_history_add_chat_message_ms (const char *stanza,
+                                         int         direction,
+                                         const char *account,
+                                         const char *who,
+                                         const char *uid,
+                                         gint64      mtime_ms,
+                                         const char *room);
+
+void chatty_history_add_im_message_ms (const char *stanza,
+                                       int         direction,
+                                       const char *account,
+                                       const char *who,
+                                       const char *uid,
+                                       gint64      mtime_ms);
+
+void chatty_history_set_chat_markup (const char *room,
+                                     const char *uid,
+                                     const char *markup);
+
+void chatty_history_set_im_markup (const char *account,
+                                   const char *uid,
+                                   const char *markup);
 
-void
-chatty_history_get_chat_messages (const char *account,
-                                  const char *room,
-                                  void (*cb)(const unsigned char *msg,
-                                            int                  direction,
-                                            int                  time_stamp,
-                                            const char           *room,
-                                            const unsigned char  *who,
-                                            const unsigned char  *uuid,
-                                            gpointer             data),
-                                  gpointer  data,
-                                  guint      limit,
-                                  const char *oldest_message_displayed);
-
-int
-chatty_history_get_chat_last_message_time (const char* account,
-                                           const char* room);
+/*
+ * A position in the history of a conversation, used to load
+ * it page by page.  The fields are private.
+ */
+typedef struct {
+  gint64   seq;
+  gboolean at_start;
+} ChattyHistoryCursor;
+
+void     chatty_history_cursor_init     (ChattyHistoryCursor       *cursor);
+gboolean chatty_history_cursor_at_start (const ChattyHistoryCursor *cursor);
+
+void       chatty_history_load_im_async   (const char                *account,
+                                           const char                *who,
+                                           ChattyMessage             *before,
+                                           const ChattyHistoryCursor *cursor,
+                                           guint                      limit,
+                                           GCancellable              *cancellable,
+                                           GAsyncReadyCallback        callback,
+                                           gpointer                   user_data);
+void       chatty_history_load_chat_async (const char                *account,
+                                           const char                *room,
+                                           ChattyMessage             *before,
+                                           const ChattyHistoryCursor *cursor,
+                                           guint                      limit,
+                                           GCancellable              *cancellable,
+                                           GAsyncReadyCallback        callback,
+                                           gpointer                   user_data);
+GPtrArray *chatty_history_load_finish     (GAsyncResult              *result,
+                                           ChattyHistoryCursor       *cursor,
+                                           GError                   **error);
+
+void           chatty_history_get_im_last_message_async  (const char          *account,
+                                                          const char          *who,
+                                                          GCancellable        *cancellable,
+                                                          GAsyncReadyCallback  callback,
+                                                          gpointer             user_data);
+ChattyMessage *chatty_history_get_im_last_message_finish (GAsyncResult        *result,
+                                                          GError             **error);
+
+void   chatty_history_get_chat_last_message_time_async  (const char          *account,
+                                                         const char          *room,
+                                                         GCancellable        *cancellable,
+                                                         GAsyncReadyCallback  callback,
+                                                         gpointer             user_data);
+time_t chatty_history_get_chat_last_message_time_finish (GAsyncResult        *result,
+                                                         GError             **error);
+
+void     chatty_history_get_last_messages_async  (GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data);
+gboolean chatty_history_get_last_messages_finish (GAsyncResult        *result,
+                                                  GHashTable         **ims,
+                                                  GHashTable         **chats,
+                                                  GError             **error);
+void     chatty_history_get_uids_async           (const char          *account,
+                                                  guint                limit,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data);
+gboolean chatty_history_get_uids_finish          (GAsyncResult        *result,
+                                                  GPtrArray          **im_uids,
+                                                  GPtrArray          **chat_uids,
+                                                  time_t              *since,
+                                                  GError             **error);
 
+/*
+ * A message found by chatty_history_search_async().  @room is
+ * %NULL for IM messages.  @snippet is the text around the
+ * match, as Pango markup with the matching words in bold.
+ */
+typedef struct {
+  char   *account;
+  char   *who;
+  char   *room;
+  char   *uid;
+  char   *snippet;
+  time_t  time;
+  double  rank;
+} ChattyHistoryMatch;
+
+void       chatty_history_match_free    (ChattyHistoryMatch   *match);
+void       chatty_history_search_async  (const char           *text,
+                                         guint                 limit,
+                                         guint                 offset,
+                                         GCancellable         *cancellable,
+                                         GAsyncReadyCallback   callback,
+                                         gpointer              user_data);
+GPtrArray *chatty_history_search_finish (GAsyncResult         *result,
+                                         GError              **error);
 
 void
 chatty_history_delete_chat (const char* account,
@@ -97,11 +184,6 @@ void
 chatty_history_delete_im (const char *account,
                           const char *who);
 
-char
-chatty_history_get_im_last_message (const char*       account,
-                                    const char*       who,
-                                    ChattyLog*  chatty_log);
-
 /**
  * Adds history message to persistent storage, acts as a default handler
  * for "conversation_write" signal.
@@ -125,4 +207,26 @@ chatty_history_add_message (PurpleAccount *pa, PurpleConvMessage *pcm,
                             char **sid, PurpleConversationType type,
                             gpointer data);
 
+/**
+ * Same as chatty_history_add_message(), but with the time of the message
+ * in milliseconds (eg. from the server timestamp) in @mtime_ms, instead
+ * of the time in seconds of @pcm.
+ */
+void
+chatty_history_add_message_ms (PurpleAccount *pa, PurpleConvMessage *pcm,
+                               char **sid, PurpleConversationType type,
+                               gint64 mtime_ms);
+
+void     chatty_history_add_message_if_new_async  (PurpleAccount          *pa,
+                                                   PurpleConvMessage      *pcm,
+                                                   const char             *uid,
+                                                   const char             *origin_id,
+                                                   PurpleConversationType  type,
+                                                   gint64                  mtime_ms,
+                                                   GCancellable           *cancellable,
+                                                   GAsyncReadyCallback     callback,
+                                                   gpointer                user_data);
+gboolean chatty_history_add_message_if_new_finish (GAsyncResult           *result,
+                                                   GError                **error);
+
 #endif
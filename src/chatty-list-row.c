@@ -16,14 +16,10 @@
 #include "users/chatty-contact.h"
 #include "chatty-chat.h"
 #include "chatty-avatar.h"
+#include "chatty-clock.h"
 #include "chatty-utils.h"
 #include "chatty-list-row.h"
 
-#define SECONDS_PER_MINUTE 60.0
-#define SECONDS_PER_HOUR   3600.0
-#define SECONDS_PER_MONTH  2592000.0
-#define SECONDS_PER_YEAR   31536000.0
-
 
 struct _ChattyListRow
 {
@@ -37,163 +33,18 @@ struct _ChattyListRow
 
   ChattyItem    *item;
   gboolean       hide_chat_details;
+
+  /* Updates of chats are done at most once a frame */
+  guint          update_tick_id;
+  guint          n_update_requests;
+  guint          n_updates;
+  /* Called when the time of the last message has to be shown differently */
+  guint          clock_watch_id;
 };
 
 G_DEFINE_TYPE (ChattyListRow, chatty_list_row, GTK_TYPE_LIST_BOX_ROW)
 
 
-/* Copied from chatty-utils by Andrea Schäfer */
-static char *
-chatty_time_ago_in_words (time_t time_stamp)
-{
-  // based on the ruby on rails method 'distance_of_time_in_words'
-
-  time_t time_now;
-  struct tm  *timeinfo;
-
-  g_autofree gchar *iso_timestamp = NULL;
-
-  const char *unit;
-  const char *prefix;
-
-  const char *str_about, *str_less_than;
-  const char *str_seconds, *str_minute, *str_minutes;
-  const char *str_hour, *str_hours, *str_day, *str_days;
-  const char *str_month, *str_months, *str_year, *str_years;
-
-  int number, seconds, minutes, hours, days, months, years, offset, remainder;
-
-  gboolean show_date = FALSE;
-
-  double dist_in_seconds;
-
-    str_about     = "~";
-    str_less_than = "<";
-    str_seconds   = _("s");
-    str_minute    = _("m");
-    str_minutes   = _("m");
-    str_hour      = _("h");
-    str_hours     = _("h");
-    str_day       = _("d");
-    str_days      = _("d");
-    str_month     = _("mo");
-    str_months    = _("mos");
-    str_year      = _("y");
-    str_years     = _("y");
-
-  time (&time_now);
-
-  timeinfo = localtime (&time_stamp);
-
-  iso_timestamp = g_malloc0 (MAX_GMT_ISO_SIZE * sizeof(char));
-
-  strftime (iso_timestamp,
-            MAX_GMT_ISO_SIZE * sizeof(char),
-            "%d.%m.%y",
-            timeinfo);
-
-  dist_in_seconds = difftime (time_now, time_stamp);
-
-  seconds = (int)dist_in_seconds;
-  minutes = (int)(dist_in_seconds / SECONDS_PER_MINUTE);
-  hours   = (int)(dist_in_seconds / SECONDS_PER_HOUR);
-  days    = (int)(dist_in_seconds / SECONDS_PER_DAY);
-  months  = (int)(dist_in_seconds / SECONDS_PER_MONTH);
-  years   = (int)(dist_in_seconds / SECONDS_PER_YEAR);
-
-  switch (minutes) {
-  case 0 ... 1:
-    unit = str_seconds;
-
-    switch (seconds) {
-    case 0 ... 14:
-      prefix = str_less_than;
-      number = 15;
-      break;
-    case 15 ... 29:
-      prefix = str_less_than;
-      number = 30;
-      break;
-    case 30 ... 59:
-      prefix = str_less_than;
-      number = 1;
-      unit = str_minute;
-      break;
-    default:
-      prefix = str_about;
-      number = 1;
-      unit = str_minute;
-      break;
-    }
-    break;
-
-  case 2 ... 44:
-    prefix = "";
-    number = minutes;
-    unit = str_minutes;
-    break;
-  case 45 ... 89:
-    prefix = str_about;
-    number = 1;
-    unit = str_hour;
-    break;
-  case 90 ... 1439:
-    prefix = str_about;
-    number = hours;
-    unit = str_hours;
-    break;
-  case 1440 ... 2529:
-    prefix = str_about;
-    number = 1;
-    unit = str_day;
-    show_date = TRUE;
-    break;
-  case 2530 ... 43199:
-    prefix = "";
-    number = days;
-    unit = str_days;
-    show_date = TRUE;
-    break;
-  case 43200 ... 86399:
-    prefix = str_about;
-    number = 1;
-    unit = str_month;
-    show_date = TRUE;
-    break;
-  case 86400 ... 525600:
-    prefix = "";
-    number = months;
-    unit = str_months;
-    show_date = TRUE;
-    break;
-
-  default:
-    number = years;
-
-    unit = (number == 1) ? str_year : str_years;
-
-    offset = (int)((float)years / 4.0) * 1440.0;
-
-    remainder = (minutes - offset) % 525600;
-    show_date = TRUE;
-
-    if (remainder < 131400) {
-      prefix = str_about;
-    } else if (remainder < 394200) {
-      prefix = _("Over");
-    } else {
-      ++number;
-      unit = str_years;
-      prefix = _("Almost");
-    }
-    break;
-  }
-
-  return show_date ? g_strdup_printf ("%s", iso_timestamp) :
-    g_strdup_printf ("%s%d%s", prefix, number, unit);
-}
-
-
 static char *
 list_row_user_flag_to_str (ChattyUserFlag flags)
 {
@@ -217,6 +68,19 @@ list_row_user_flag_to_str (ChattyUserFlag flags)
   return g_strconcat (color_tag, status, "</span>", NULL);
 }
 
+static void list_row_queue_update (ChattyListRow *self);
+
+static void
+list_row_clock_changed_cb (gpointer user_data)
+{
+  ChattyListRow *self = user_data;
+
+  g_assert (CHATTY_IS_LIST_ROW (self));
+
+  self->clock_watch_id = 0;
+  list_row_queue_update (self);
+}
+
 static void
 chatty_list_row_update (ChattyListRow *self)
 {
@@ -226,6 +90,8 @@ chatty_list_row_update (ChattyListRow *self)
   g_assert (CHATTY_IS_LIST_ROW (self));
   g_assert (CHATTY_IS_ITEM (self->item));
 
+  self->n_updates++;
+
   if (CHATTY_IS_PP_BUDDY (self->item)) {
     if (chatty_pp_buddy_get_buddy (CHATTY_PP_BUDDY (self->item))) { /* Buddy in contact list */
       pp_account = chatty_pp_buddy_get_account (CHATTY_PP_BUDDY (self->item));
@@ -262,14 +128,8 @@ chatty_list_row_update (ChattyListRow *self)
     last_message = chatty_chat_get_last_message (item);
 
     gtk_widget_set_visible (self->subtitle, last_message && *last_message);
-    if (last_message && *last_message) {
-      g_autofree char *message_stripped = NULL;
-
-      message_stripped = purple_markup_strip_html (last_message);
-      g_strstrip (message_stripped);
-
-      gtk_label_set_label (GTK_LABEL (self->subtitle), message_stripped);
-    }
+    if (last_message && *last_message)
+      gtk_label_set_label (GTK_LABEL (self->subtitle), last_message);
 
     unread_count = chatty_chat_get_unread_count (item);
     gtk_widget_set_visible (self->unread_message_count, unread_count > 0);
@@ -284,11 +144,20 @@ chatty_list_row_update (ChattyListRow *self)
 
     if (last_message_time) {
       g_autofree char *str = NULL;
+      ChattyClock *clock;
+      time_t next_change;
+
+      clock = chatty_clock_get_default ();
+      str = chatty_clock_get_time_ago (clock, last_message_time, &next_change);
+      gtk_label_set_label (GTK_LABEL (self->last_modified), str);
 
-      str = chatty_time_ago_in_words (last_message_time);
+      chatty_clock_remove_watch (clock, self->clock_watch_id);
+      self->clock_watch_id = 0;
 
-      if (str)
-        gtk_label_set_label (GTK_LABEL (self->last_modified), str);
+      if (next_change)
+        self->clock_watch_id = chatty_clock_add_watch (clock, next_change,
+                                                       list_row_clock_changed_cb,
+                                                       self);
     }
   }
 
@@ -296,6 +165,55 @@ chatty_list_row_update (ChattyListRow *self)
     gtk_label_set_label (GTK_LABEL (self->subtitle), subtitle);
 }
 
+static gboolean
+list_row_update_tick_cb (GtkWidget     *widget,
+                         GdkFrameClock *frame_clock,
+                         gpointer       user_data)
+{
+  ChattyListRow *self = (ChattyListRow *)widget;
+
+  g_assert (CHATTY_IS_LIST_ROW (self));
+
+  self->update_tick_id = 0;
+  chatty_list_row_update (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * A chat can change many times a frame, say, when a busy
+ * room gets a lot of messages, so the update is done once
+ * before the next frame is drawn.  The tick callback isn't
+ * run until the row is realized, so that hidden rows are
+ * updated only once they are shown.
+ */
+static void
+list_row_queue_update (ChattyListRow *self)
+{
+  g_assert (CHATTY_IS_LIST_ROW (self));
+
+  self->n_update_requests++;
+
+  if (self->update_tick_id)
+    return;
+
+  self->update_tick_id = gtk_widget_add_tick_callback (GTK_WIDGET (self),
+                                                       list_row_update_tick_cb,
+                                                       NULL, NULL);
+}
+
+static void
+chatty_list_row_dispose (GObject *object)
+{
+  ChattyListRow *self = (ChattyListRow *)object;
+
+  if (self->clock_watch_id)
+    chatty_clock_remove_watch (chatty_clock_get_default (), self->clock_watch_id);
+  self->clock_watch_id = 0;
+
+  G_OBJECT_CLASS (chatty_list_row_parent_class)->dispose (object);
+}
+
 static void
 chatty_list_row_finalize (GObject *object)
 {
@@ -312,6 +230,7 @@ chatty_list_row_class_init (ChattyListRowClass *klass)
   GObjectClass   *object_class = G_OBJECT_CLASS (klass);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
 
+  object_class->dispose = chatty_list_row_dispose;
   object_class->finalize = chatty_list_row_finalize;
 
   gtk_widget_class_set_template_from_resource (widget_class,
@@ -396,7 +315,33 @@ chatty_list_row_set_item (ChattyListRow *self,
 
   if (CHATTY_IS_CHAT (item))
     g_signal_connect_object (item, "changed",
-                             G_CALLBACK (chatty_list_row_update),
+                             G_CALLBACK (list_row_queue_update),
                              self, G_CONNECT_SWAPPED);
   chatty_list_row_update (self);
 }
+
+/**
+ * chatty_list_row_get_update_counts:
+ * @self: A #ChattyListRow
+ * @n_requested: (out) (optional): Return location for the
+ *   number of times the item asked for an update
+ * @n_performed: (out) (optional): Return location for the
+ *   number of updates done
+ *
+ * Get how often @self was updated, and how often it was
+ * asked to, which is useful to check that changes of the
+ * item are coalesced.
+ */
+void
+chatty_list_row_get_update_counts (ChattyListRow *self,
+                                   guint         *n_requested,
+                                   guint         *n_performed)
+{
+  g_return_if_fail (CHATTY_IS_LIST_ROW (self));
+
+  if (n_requested)
+    *n_requested = self->n_update_requests;
+
+  if (n_performed)
+    *n_performed = self->n_updates;
+}
@@ -26,6 +26,9 @@ ChattyItem *chatty_list_row_get_item (ChattyListRow *self);
 void        chatty_list_row_set_item (ChattyListRow *self,
                                       ChattyItem    *item);
 GtkWidget  *chatty_list_contact_row_new (ChattyItem *item);
+void        chatty_list_row_get_update_counts (ChattyListRow *self,
+                                               guint         *n_requested,
+                                               guint         *n_performed);
 
 
 G_END_DECLS
@@ -76,6 +76,19 @@ struct _ChattyManager
 
   gboolean         has_modem;
   ChattyProtocol   active_protocols;
+
+  /* Chats in chat_im_list by their conversation, and by their
+   * PurpleChat or PurpleBuddy, which libpurple keeps unique per
+   * account and room or buddy name.  They don't hold references.
+   */
+  GHashTable      *chats_by_conv;
+  GHashTable      *chats_by_node;
+
+  /* Time of the last message of each room by account, until the
+   * room is first joined or the account has autojoined its rooms */
+  GHashTable      *room_last_times;
+  /* Buddies are updated at once when the last messages are loaded */
+  gboolean         loading_last_messages;
 };
 
 G_DEFINE_TYPE (ChattyManager, chatty_manager, G_TYPE_OBJECT)
@@ -128,6 +141,89 @@ manager_sort_chat_item (ChattyChat *a,
   return difftime (b_time, a_time);
 }
 
+/* Only @chat may have moved, the order of others is the same */
+static void
+manager_chat_changed_cb (ChattyManager *self,
+                         ChattyChat    *chat)
+{
+  g_assert (CHATTY_IS_MANAGER (self));
+  g_assert (CHATTY_IS_CHAT (chat));
+
+  gtk_sort_list_model_item_changed (self->sorted_chat_im_list, chat);
+}
+
+static gpointer
+manager_chat_get_node (ChattyChat *chat)
+{
+  if (chatty_chat_get_purple_chat (chat))
+    return chatty_chat_get_purple_chat (chat);
+
+  return chatty_chat_get_purple_buddy (chat);
+}
+
+static void
+manager_index_chat (ChattyManager      *self,
+                    ChattyChat         *chat,
+                    PurpleConversation *old_conv)
+{
+  PurpleConversation *conv;
+  gpointer node;
+
+  conv = chatty_chat_get_purple_conv (chat);
+  node = manager_chat_get_node (chat);
+
+  if (old_conv && old_conv != conv &&
+      g_hash_table_lookup (self->chats_by_conv, old_conv) == chat)
+    g_hash_table_remove (self->chats_by_conv, old_conv);
+
+  if (conv)
+    g_hash_table_insert (self->chats_by_conv, conv, chat);
+
+  if (node)
+    g_hash_table_insert (self->chats_by_node, node, chat);
+}
+
+static void
+manager_unindex_chat (ChattyManager *self,
+                      ChattyChat    *chat)
+{
+  PurpleConversation *conv;
+  gpointer node;
+
+  conv = chatty_chat_get_purple_conv (chat);
+  node = manager_chat_get_node (chat);
+
+  if (conv && g_hash_table_lookup (self->chats_by_conv, conv) == chat)
+    g_hash_table_remove (self->chats_by_conv, conv);
+
+  if (node && g_hash_table_lookup (self->chats_by_node, node) == chat)
+    g_hash_table_remove (self->chats_by_node, node);
+}
+
+static void
+manager_append_chat (ChattyManager *self,
+                     GListStore    *store,
+                     ChattyChat    *chat)
+{
+  manager_index_chat (self, chat, NULL);
+  g_signal_connect_object (chat, "changed",
+                           G_CALLBACK (manager_chat_changed_cb), self,
+                           G_CONNECT_SWAPPED);
+  g_list_store_append (store, chat);
+}
+
+/* Chats of conversations are added to im_list, even for rooms */
+static void
+manager_remove_chat (ChattyManager *self,
+                     ChattyChat    *chat)
+{
+  g_signal_handlers_disconnect_by_func (chat, manager_chat_changed_cb, self);
+  manager_unindex_chat (self, chat);
+
+  if (!chatty_utils_remove_list_item (self->im_list, chat))
+    chatty_utils_remove_list_item (self->chat_list, chat);
+}
+
 static void
 manager_eds_is_ready (ChattyManager *self)
 {
@@ -417,59 +513,201 @@ chatty_blist_remove (PurpleBuddyList *list,
 }
 
 
+typedef struct {
+  PurpleAccount *account;
+  char          *name;
+} BuddyData;
+
+static void
+buddy_data_free (BuddyData *data)
+{
+  g_free (data->name);
+  g_free (data);
+}
+
+static void
+manager_update_buddy_last_message (PurpleBuddy   *buddy,
+                                   ChattyMessage *message)
+{
+  PurpleBlistNode *node;
+
+  node = PURPLE_BLIST_NODE (buddy);
+
+  if (!message && !purple_blist_node_get_bool (node, "chatty-notifications"))
+    purple_blist_node_set_bool (node, "chatty-notifications", TRUE);
+
+  if (purple_blist_node_get_bool (node, "chatty-autojoin") &&
+      purple_account_is_connected (buddy->account) &&
+      message) {
+    g_autoptr(ChattyChat) chat = NULL;
+    GListModel *model;
+    ChattyChat *item;
+
+    chat = chatty_chat_new_im_chat (buddy->account, buddy);
+    item = chatty_manager_add_chat (chatty_manager_get_default (), chat);
+    model = chatty_chat_get_messages (item);
+
+    /* If at least one message is loaded, don’t add again. */
+    if (g_list_model_get_n_items (model) == 0)
+      chatty_chat_append_message (item, message);
+  }
+}
+
+static void
+buddy_last_message_cb (GObject      *object,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  BuddyData *data = user_data;
+  g_autoptr(ChattyMessage) message = NULL;
+  g_autoptr(GError) error = NULL;
+  PurpleBuddy *buddy = NULL;
+
+  message = chatty_history_get_im_last_message_finish (result, &error);
+
+  if (error)
+    g_debug ("Error getting last message: %s", error->message);
+
+  /* The buddy may have been removed while the history was read */
+  if (g_list_find (purple_accounts_get_all (), data->account))
+    buddy = purple_find_buddy (data->account, data->name);
+
+  buddy_data_free (data);
+
+  if (buddy)
+    manager_update_buddy_last_message (buddy, message);
+}
+
 static void
 chatty_blist_update_buddy (PurpleBuddyList *list,
                            PurpleBlistNode *node)
 {
   PurpleBuddy             *buddy;
-  g_autofree ChattyLog    *log_data = NULL;
   PurpleAccount           *account;
+  BuddyData               *data;
   const char              *username;
   g_autofree char         *who = NULL;
-  char                     message_exists;
 
   g_return_if_fail (PURPLE_BLIST_NODE_IS_BUDDY(node));
 
+  /* Every buddy is updated once the last messages are loaded */
+  if (chatty_manager_get_default ()->loading_last_messages)
+    return;
+
   buddy = (PurpleBuddy*)node;
 
   account = purple_buddy_get_account (buddy);
 
   username = purple_account_get_username (account);
   who = chatty_utils_jabber_id_strip (purple_buddy_get_name (buddy));
-  log_data = g_new0(ChattyLog, 1);
 
-  message_exists = chatty_history_get_im_last_message (username, who, log_data);
-  if (!message_exists && !purple_blist_node_get_bool (node, "chatty-notifications"))
-    purple_blist_node_set_bool (node, "chatty-notifications", TRUE);
+  data = g_new0 (BuddyData, 1);
+  data->account = account;
+  data->name = g_strdup (purple_buddy_get_name (buddy));
 
-  if (purple_blist_node_get_bool (node, "chatty-autojoin") &&
-      purple_account_is_connected (buddy->account) &&
-      message_exists) {
-    g_autoptr(ChattyMessage) message = NULL;
-    g_autoptr(ChattyChat) chat = NULL;
-    GListModel *model;
-    ChattyChat *item;
-    ChattyMsgDirection direction;
+  /* Read in the history thread so that startup isn’t blocked on disk */
+  chatty_history_get_im_last_message_async (username, who, NULL,
+                                            buddy_last_message_cb, data);
+}
 
-    if (log_data->dir == 1)
-      direction = CHATTY_DIRECTION_IN;
-      else if (log_data->dir == -1)
-      direction = CHATTY_DIRECTION_OUT;
-    else
-      direction = CHATTY_DIRECTION_SYSTEM;
 
-    chat = chatty_chat_new_im_chat (account, buddy);
-    item = chatty_manager_add_chat (chatty_manager_get_default (), chat);
-    model = chatty_chat_get_messages (item);
+/*
+ * Get the time of the last message of the rooms in @chats, for
+ * the accounts yet to connect.  The rooms they autojoin ask for
+ * the messages since then.
+ */
+static GHashTable *
+manager_get_room_last_times (GHashTable *chats)
+{
+  GHashTable *times;
 
-    /* If at least one message is loaded, don’t add again. */
-    if (g_list_model_get_n_items (model) > 0)
-      return;
+  times = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                 (GDestroyNotify)g_hash_table_unref);
+
+  for (GList *node = purple_accounts_get_all (); node; node = node->next) {
+    PurpleAccount *account = node->data;
+    GHashTable *rooms, *room_times;
+    GHashTableIter iter;
+    gpointer room, message;
+    const char *username;
+
+    username = purple_account_get_username (account);
+
+    if (purple_account_is_connected (account) ||
+        !purple_account_get_enabled (account, CHATTY_UI) ||
+        g_hash_table_contains (times, username))
+      continue;
+
+    rooms = g_hash_table_lookup (chats, username);
+
+    if (!rooms)
+      continue;
+
+    room_times = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    g_hash_table_insert (times, g_strdup (username), room_times);
+
+    g_hash_table_iter_init (&iter, rooms);
+    while (g_hash_table_iter_next (&iter, &room, &message)) {
+      time_t *mtime;
+
+      mtime = g_new (time_t, 1);
+      *mtime = chatty_message_get_time (message);
+      g_hash_table_insert (room_times, g_strdup (room), mtime);
+    }
+  }
+
+  if (g_hash_table_size (times) == 0)
+    g_clear_pointer (&times, g_hash_table_unref);
+
+  return times;
+}
+
+
+static void
+manager_last_messages_cb (GObject      *object,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+  g_autoptr(ChattyManager) self = user_data;
+  g_autoptr(GHashTable) ims = NULL;
+  g_autoptr(GHashTable) chats = NULL;
+  g_autoptr(GError) error = NULL;
+  GSList *buddies;
 
-    message = chatty_message_new (NULL, NULL, log_data->msg, log_data->uid,
-                                  log_data->epoch, direction, 0);
-    chatty_chat_append_message (item, message);
+  g_assert (CHATTY_IS_MANAGER (self));
+
+  self->loading_last_messages = FALSE;
+  g_clear_pointer (&self->room_last_times, g_hash_table_unref);
+
+  if (!chatty_history_get_last_messages_finish (result, &ims, &chats, &error))
+    g_warning ("Error loading last messages: %s", error->message);
+  else
+    self->room_last_times = manager_get_room_last_times (chats);
+
+  buddies = purple_blist_get_buddies ();
+
+  for (GSList *item = buddies; item; item = item->next) {
+    PurpleBuddy *buddy = item->data;
+    g_autofree char *who = NULL;
+    ChattyMessage *message = NULL;
+    GHashTable *table;
+
+    /* Fallback to loading one by one */
+    if (!ims) {
+      chatty_blist_update_buddy (purple_get_blist (), item->data);
+      continue;
+    }
+
+    who = chatty_utils_jabber_id_strip (purple_buddy_get_name (buddy));
+    table = g_hash_table_lookup (ims, purple_account_get_username (buddy->account));
+
+    if (table)
+      message = g_hash_table_lookup (table, who);
+
+    manager_update_buddy_last_message (buddy, message);
   }
+
+  g_slist_free (buddies);
 }
 
 
@@ -960,6 +1198,15 @@ chatty_conv_write_conversation (PurpleConversation *conv,
   g_debug("Posting mesage id:%s flags:%d type:%d from:%s",
           uuid, pcm.flags, type, pcm.who);
 
+  // Held back (eg. by MAM until it's known not to be a duplicate)
+  if (pcm.flags & PURPLE_MESSAGE_INVISIBLE) {
+    g_free (pcm.who);
+    g_free (pcm.what);
+    g_free (pcm.alias);
+
+    return;
+  }
+
   if (*message != '\0') {
 
     if (pcm.flags & (PURPLE_MESSAGE_SYSTEM | PURPLE_MESSAGE_ERROR)) {
@@ -1005,17 +1252,13 @@ chatty_conv_write_conversation (PurpleConversation *conv,
       chatty_message_set_status (chat_message, CHATTY_STATUS_SENT, 0);
       chatty_chat_append_message (chat, chat_message);
     } else if (pcm.flags & PURPLE_MESSAGE_SEND) {
-      // offline send (from MAM)
-      // FIXME: current list_box does not allow ordering rows by timestamp
-      // TODO: Needs proper sort function and timestamp as user_data for rows
-      // FIXME: Alternatively may need to reload history to re-populate rows
+      // offline send (from MAM), placed by its timestamp
       chat_message = chatty_message_new (NULL, NULL, message, uuid, mtime, CHATTY_DIRECTION_OUT, 0);
       chatty_message_set_status (chat_message, CHATTY_STATUS_SENT, 0);
       chatty_chat_append_message (chat, chat_message);
     }
 
     chatty_chat_set_unread_count (chat, chatty_chat_get_unread_count (chat) + 1);
-    gtk_sorter_changed (self->chat_sorter, GTK_SORTER_ORDER_TOTAL);
   }
 
   g_free (pcm.who);
@@ -1038,6 +1281,21 @@ chatty_conv_muc_list_add_users (PurpleConversation *conv,
 }
 
 
+static void
+chatty_conv_muc_list_rename_user (PurpleConversation *conv,
+                                  const char         *old_name,
+                                  const char         *new_name,
+                                  const char         *new_alias)
+{
+  ChattyChat *chat;
+
+  chat = chatty_manager_find_purple_conv (chatty_manager_get_default (), conv);
+
+  if (chat)
+    chatty_chat_rename_user (chat, old_name, new_name);
+}
+
+
 static void
 chatty_conv_muc_list_update_user (PurpleConversation *conv,
                                   const char         *user)
@@ -1072,7 +1330,7 @@ static PurpleConversationUiOps conversation_ui_ops =
   chatty_conv_write_im,
   chatty_conv_write_conversation,
   chatty_conv_muc_list_add_users,
-  NULL,
+  chatty_conv_muc_list_rename_user,
   NULL,
   chatty_conv_muc_list_update_user,
   chatty_conv_present_conversation,
@@ -1385,6 +1643,20 @@ manager_conversation_buddy_leaving_cb (PurpleConversation *conv,
   return TRUE;
 }
 
+/* The rooms of @account are joined, their times won't be asked again */
+static void
+manager_forget_room_last_times (ChattyManager *self,
+                                PurpleAccount *account)
+{
+  if (!self->room_last_times)
+    return;
+
+  g_hash_table_remove (self->room_last_times, purple_account_get_username (account));
+
+  if (g_hash_table_size (self->room_last_times) == 0)
+    g_clear_pointer (&self->room_last_times, g_hash_table_unref);
+}
+
 static gboolean
 auto_join_chat_cb (gpointer data)
 {
@@ -1407,14 +1679,13 @@ auto_join_chat_cb (gpointer data)
         prpl_info = PURPLE_PLUGIN_PROTOCOL_INFO(purple_find_prpl (purple_account_get_protocol_id (account)));
         components = purple_chat_get_components (chat);
         chat_name = prpl_info->get_chat_name(components);
-        chatty_conv_add_history_since_component(components, account->username, chat_name);
-
-        serv_join_chat (purple_account_get_connection (account),
-                        purple_chat_get_components (chat));
+        chatty_conv_join_chat_with_history (chat, chat_name);
       }
     }
   }
 
+  manager_forget_room_last_times (chatty_manager_get_default (), account);
+
   return FALSE;
 }
 
@@ -1533,21 +1804,15 @@ manager_connection_signed_off_cb (PurpleConnection *gc,
 }
 
 static ChattyChat *
-manager_find_chat (GListModel *model,
-                   PurpleChat *pp_chat)
+manager_find_chat (ChattyManager *self,
+                   PurpleChat    *pp_chat)
 {
-  guint n_items;
-
-  n_items = g_list_model_get_n_items (model);
-
-  for (guint i = 0; i < n_items; i++) {
-    g_autoptr(ChattyChat) chat = NULL;
+  ChattyChat *chat;
 
-    chat = g_list_model_get_item (model, i);
+  chat = g_hash_table_lookup (self->chats_by_node, pp_chat);
 
-    if (chatty_chat_get_purple_chat (chat) == pp_chat)
-      return chat;
-  }
+  if (chat && chatty_chat_get_purple_chat (chat) == pp_chat)
+    return chat;
 
   return NULL;
 }
@@ -1852,6 +2117,7 @@ chatty_manager_dispose (GObject *object)
   ChattyManager *self = (ChattyManager *)object;
 
   purple_signals_disconnect_by_handle (self);
+  g_clear_pointer (&self->room_last_times, g_hash_table_unref);
   g_clear_object (&self->contact_list);
   g_clear_object (&self->list_of_user_list);
   g_clear_object (&self->account_list);
@@ -1862,8 +2128,13 @@ chatty_manager_dispose (GObject *object)
 static void
 chatty_manager_finalize (GObject *object)
 {
+  ChattyManager *self = (ChattyManager *)object;
+
   chatty_purple_quit ();
 
+  g_hash_table_unref (self->chats_by_conv);
+  g_hash_table_unref (self->chats_by_node);
+
   G_OBJECT_CLASS (chatty_manager_parent_class)->finalize (object);
 }
 
@@ -1962,6 +2233,8 @@ chatty_manager_init (ChattyManager *self)
 
   self->chat_list = g_list_store_new (CHATTY_TYPE_CHAT);
   self->im_list = g_list_store_new (CHATTY_TYPE_CHAT);
+  self->chats_by_conv = g_hash_table_new (g_direct_hash, g_direct_equal);
+  self->chats_by_node = g_hash_table_new (g_direct_hash, g_direct_equal);
   self->list_of_chat_list = g_list_store_new (G_TYPE_LIST_MODEL);
   self->list_of_user_list = g_list_store_new (G_TYPE_LIST_MODEL);
 
@@ -2056,6 +2329,11 @@ chatty_manager_purple (ChattyManager *self)
     g_application_quit (g_application_get_default ());
   }
 
+  /* Load the last message of every conversation at once, instead of one by one */
+  self->loading_last_messages = TRUE;
+  chatty_history_get_last_messages_async (NULL, manager_last_messages_cb,
+                                          g_object_ref (self));
+
   purple_set_blist (purple_blist_new ());
   purple_prefs_load ();
   purple_blist_load ();
@@ -2234,6 +2512,50 @@ chatty_manager_get_eds (ChattyManager *self)
 }
 
 
+/**
+ * chatty_manager_take_room_last_message_time:
+ * @self: A #ChattyManager
+ * @account: The account name
+ * @room: The room name
+ * @mtime: (out): return location for the time
+ *
+ * Get the time of the last message in @room, as loaded
+ * at startup.  As new messages can be added once the room
+ * is joined, this is only answered once for each room, and
+ * not after the account has autojoined its rooms.
+ *
+ * Returns: %TRUE if @mtime is set, %FALSE if unknown.
+ */
+gboolean
+chatty_manager_take_room_last_message_time (ChattyManager *self,
+                                            const char    *account,
+                                            const char    *room,
+                                            time_t        *mtime)
+{
+  GHashTable *rooms = NULL;
+  time_t *last_time;
+
+  g_return_val_if_fail (CHATTY_IS_MANAGER (self), FALSE);
+  g_return_val_if_fail (mtime, FALSE);
+
+  if (self->room_last_times && account)
+    rooms = g_hash_table_lookup (self->room_last_times, account);
+
+  if (!rooms || !room)
+    return FALSE;
+
+  last_time = g_hash_table_lookup (rooms, room);
+
+  if (!last_time)
+    return FALSE;
+
+  *mtime = *last_time;
+  g_hash_table_remove (rooms, room);
+
+  return TRUE;
+}
+
+
 void
 chatty_manager_update_node (ChattyManager   *self,
                             PurpleBlistNode *node)
@@ -2251,7 +2573,7 @@ chatty_manager_update_node (ChattyManager   *self,
   if(!purple_account_is_connected (pp_chat->account))
     return;
 
-  chat = manager_find_chat (G_LIST_MODEL (self->chat_list), pp_chat);
+  chat = manager_find_chat (self, pp_chat);
 
   if (chat) {
     g_object_notify_by_pspec (G_OBJECT (self), properties[PROP_ACTIVE_PROTOCOLS]);
@@ -2262,7 +2584,7 @@ chatty_manager_update_node (ChattyManager   *self,
 
   chat = chatty_chat_new_purple_chat (pp_chat);
 
-  g_list_store_append (self->chat_list, chat);
+  manager_append_chat (self, self->chat_list, chat);
 }
 
 
@@ -2280,30 +2602,44 @@ chatty_manager_remove_node (ChattyManager   *self,
 
   pp_chat = (PurpleChat*)node;
 
-  chat = manager_find_chat (G_LIST_MODEL (self->chat_list), pp_chat);
+  chat = manager_find_chat (self, pp_chat);
 
   if (chat)
-    chatty_utils_remove_list_item (self->chat_list, chat);
+    manager_remove_chat (self, chat);
 }
 
 static ChattyChat *
-manager_find_im (GListModel         *model,
+manager_find_im (ChattyManager      *self,
                  PurpleConversation *conv)
 {
-  guint n_items;
+  PurpleConversation *old_conv;
+  ChattyChat *chat;
+  gpointer node;
 
-  n_items = g_list_model_get_n_items (model);
+  chat = g_hash_table_lookup (self->chats_by_conv, conv);
 
-  for (guint i = 0; i < n_items; i++) {
-    g_autoptr(ChattyChat) chat = NULL;
+  if (chat && chatty_chat_get_purple_conv (chat) == conv)
+    return chat;
 
-    chat = g_list_model_get_item (model, i);
+  /* The conversation may be new for a chat we already have */
+  node = chatty_utils_get_conv_blist_node (conv);
 
-    if (chatty_chat_match_purple_conv (chat, conv))
-      return chat;
-  }
+  if (!node)
+    return NULL;
 
-  return NULL;
+  chat = g_hash_table_lookup (self->chats_by_node, node);
+
+  if (!chat)
+    return NULL;
+
+  old_conv = chatty_chat_get_purple_conv (chat);
+
+  if (!chatty_chat_match_purple_conv (chat, conv))
+    return NULL;
+
+  manager_index_chat (self, chat, old_conv);
+
+  return chat;
 }
 
 
@@ -2318,18 +2654,21 @@ chatty_manager_add_conversation (ChattyManager      *self,
   if (!conv)
     return NULL;
 
-  chat = manager_find_im (G_LIST_MODEL (self->chat_im_list), conv);
+  chat = manager_find_im (self, conv);
 
   if (chat) {
+    PurpleConversation *old_conv;
+
+    old_conv = chatty_chat_get_purple_conv (chat);
     chatty_chat_set_purple_conv (chat, conv);
+    manager_index_chat (self, chat, old_conv);
     g_signal_emit_by_name (chat, "changed");
 
     return chat;
   }
 
   chat = chatty_chat_new_purple_conv (conv);
-  g_list_store_append (self->im_list, chat);
-  gtk_sorter_changed (self->chat_sorter, GTK_SORTER_ORDER_TOTAL);
+  manager_append_chat (self, self->im_list, chat);
 
   g_object_unref (chat);
 
@@ -2343,18 +2682,11 @@ chatty_manager_delete_conversation (ChattyManager      *self,
 {
   ChattyChat *chat;
   PurpleBuddy *pp_buddy;
-  GListModel *model;
 
   g_return_if_fail (CHATTY_IS_MANAGER (self));
   g_return_if_fail (conv);
 
-  model = G_LIST_MODEL (self->im_list);
-  chat  = manager_find_im (model, conv);
-
-  if (!chat) {
-    model = G_LIST_MODEL (self->chat_list);
-    chat  = manager_find_im (model, conv);
-  }
+  chat = manager_find_im (self, conv);
 
   if (!chat)
     return;
@@ -2371,27 +2703,29 @@ chatty_manager_delete_conversation (ChattyManager      *self,
 
   if (chat) {
     chatty_chat_view_remove_footer (CHATTY_CHAT_VIEW (CHATTY_CONVERSATION (conv)->chat_view));
-    chatty_utils_remove_list_item (G_LIST_STORE (model), chat);
+    manager_remove_chat (self, chat);
   }
 }
 
 
 static ChattyChat *
-chatty_manager_find_chat (GListModel *model,
-                          ChattyChat *item)
+chatty_manager_find_chat (ChattyManager *self,
+                          ChattyChat    *item)
 {
-  guint n_items;
+  PurpleConversation *conv;
+  ChattyChat *chat;
+  gpointer node;
 
-  n_items = g_list_model_get_n_items (model);
+  node = manager_chat_get_node (item);
+  chat = node ? g_hash_table_lookup (self->chats_by_node, node) : NULL;
 
-  for (guint i = 0; i < n_items; i++) {
-    g_autoptr(ChattyChat) chat = NULL;
+  if (chat)
+    return chat;
 
-    chat = g_list_model_get_item (model, i);
+  conv = chatty_chat_get_purple_conv (item);
 
-    if (chatty_chat_are_same (chat, item))
-      return chat;
-  }
+  if (conv)
+    return manager_find_im (self, conv);
 
   return NULL;
 }
@@ -2402,22 +2736,14 @@ chatty_manager_add_chat (ChattyManager *self,
                          ChattyChat    *chat)
 {
   ChattyChat *item;
-  GListModel *model;
 
   g_return_val_if_fail (CHATTY_IS_MANAGER (self), NULL);
   g_return_val_if_fail (CHATTY_IS_CHAT (chat), NULL);
 
-  model = G_LIST_MODEL (self->im_list);
-
-  if (chatty_utils_get_item_position (model, chat, NULL))
-    item = chat;
-  else
-    item = chatty_manager_find_chat (model, chat);
+  item = chatty_manager_find_chat (self, chat);
 
   if (!item)
-    g_list_store_append (self->im_list, chat);
-
-  gtk_sorter_changed (self->chat_sorter, GTK_SORTER_ORDER_TOTAL);
+    manager_append_chat (self, self->im_list, chat);
 
   return item ? item : chat;
 }
@@ -2429,7 +2755,7 @@ chatty_manager_find_purple_conv (ChattyManager      *self,
 {
   g_return_val_if_fail (CHATTY_IS_MANAGER (self), NULL);
 
-  return manager_find_im (G_LIST_MODEL (self->chat_im_list), conv);
+  return manager_find_im (self, conv);
 }
 
 
@@ -45,6 +45,10 @@ gboolean        chatty_manager_has_file_upload_plugin (ChattyManager   *self);
 gboolean        chatty_manager_lurch_plugin_is_loaded (ChattyManager   *self);
 ChattyProtocol  chatty_manager_get_active_protocols   (ChattyManager   *self);
 ChattyEds      *chatty_manager_get_eds                (ChattyManager   *self);
+gboolean        chatty_manager_take_room_last_message_time (ChattyManager *self,
+                                                            const char    *account,
+                                                            const char    *room,
+                                                            time_t        *mtime);
 void            chatty_manager_update_node            (ChattyManager   *self,
                                                        PurpleBlistNode *node);
 void            chatty_manager_remove_node            (ChattyManager   *self,
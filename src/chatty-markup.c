@@ -0,0 +1,639 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-markup.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-markup"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+
+#include "chatty-markup.h"
+
+/**
+ * SECTION: chatty-markup
+ * @title: chatty-markup
+ * @short_description: Convert message text to Pango markup
+ * @include: "chatty-markup.h"
+ *
+ * Message text, which may be HTML as received by libpurple, is
+ * converted to Pango markup in a single scan: HTML tags are dropped
+ * (except line breaks), entities are decoded and the text escaped
+ * again, and links, email addresses and international phone numbers
+ * are made clickable.  Like purple_markup_strip_html() did, the target
+ * of an HTML link is kept after its text, if it differs.
+ *
+ * Runs of plain text, including any non-ASCII text like emoji, are
+ * copied as they are, without being decoded.
+ */
+
+/* Digits in an international phone number, see E.164 */
+#define PHONE_MIN_DIGITS  7
+#define PHONE_MAX_DIGITS  15
+
+typedef enum {
+  LINK_NONE,
+  LINK_URL,    /* The text is the URI */
+  LINK_WWW,    /* www.example.com */
+  LINK_EMAIL,  /* user@example.com */
+  LINK_PHONE,  /* +1 555 0100 */
+} LinkKind;
+
+/* The HTML link being scanned */
+typedef struct {
+  const char *href;
+  gsize       href_len;
+  const char *text;
+} Anchor;
+
+static const char *link_schemes[] = {
+  "http://", "https://", "ftp://",
+  "mailto:", "xmpp:", "sip:", "tel:", "sms:",
+};
+
+static gboolean
+markup_is_special (guchar c)
+{
+  return c == '&' || c == '<' || c == '>' ||
+    c == '"' || c == '\'' || c == '\r';
+}
+
+static void
+markup_append_char (GString  *str,
+                    gunichar  c)
+{
+  switch (c)
+    {
+    case '&':
+      g_string_append (str, "&amp;");
+      break;
+
+    case '<':
+      g_string_append (str, "&lt;");
+      break;
+
+    case '>':
+      g_string_append (str, "&gt;");
+      break;
+
+    case '"':
+      g_string_append (str, "&quot;");
+      break;
+
+    case '\'':
+      g_string_append (str, "&apos;");
+      break;
+
+    default:
+      g_string_append_unichar (str, c);
+    }
+}
+
+/*
+ * Decode the HTML entity at @p into @c.
+ * Returns the length of the entity, or 0 if @p isn't one.
+ */
+static gsize
+markup_decode_entity (const char *p,
+                      gunichar   *c)
+{
+  static const struct {
+    const char *name;
+    gunichar    c;
+  } entities[] = {
+    { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' },
+    { "&quot;", '"' }, { "&apos;", '\'' }, { "&nbsp;", 0xa0 },
+    { "&copy;", 0xa9 }, { "&reg;", 0xae },
+  };
+  const char *end;
+  guint64 value;
+
+  g_assert (*p == '&');
+
+  if (p[1] != '#')
+    {
+      for (guint i = 0; i < G_N_ELEMENTS (entities); i++)
+        {
+          gsize len = strlen (entities[i].name);
+
+          if (strncmp (p, entities[i].name, len) == 0)
+            {
+              *c = entities[i].c;
+
+              return len;
+            }
+        }
+
+      return 0;
+    }
+
+  if (p[2] == 'x' || p[2] == 'X')
+    {
+      if (!g_ascii_isxdigit (p[3]))
+        return 0;
+
+      value = g_ascii_strtoull (p + 3, (char **)&end, 16);
+    }
+  else
+    {
+      if (!g_ascii_isdigit (p[2]))
+        return 0;
+
+      value = g_ascii_strtoull (p + 2, (char **)&end, 10);
+    }
+
+  if (*end != ';' || value == 0 || value > G_MAXUINT32 ||
+      !g_unichar_validate ((gunichar)value))
+    return 0;
+
+  *c = (gunichar)value;
+
+  return end - p + 1;
+}
+
+/*
+ * Append the text at @p, which is a special char (see markup_is_special()),
+ * and return the position of the text following it.
+ */
+static const char *
+markup_append_special (GString    *str,
+                       const char *p)
+{
+  gunichar c;
+  gsize len;
+
+  switch (*p)
+    {
+    case '\r':
+      /* Line breaks are ‘\n’ */
+      return p + 1;
+
+    case '&':
+      len = markup_decode_entity (p, &c);
+
+      if (!len)
+        {
+          g_string_append (str, "&amp;");
+
+          return p + 1;
+        }
+
+      markup_append_char (str, c);
+
+      return p + len;
+
+    case '<':
+      /* An HTML tag, only line breaks are kept */
+      if (g_ascii_isalpha (p[1]) || p[1] == '/' || p[1] == '!')
+        {
+          const char *end;
+
+          end = strpbrk (p + 1, "<>");
+
+          if (end && *end == '>')
+            {
+              if (g_ascii_strncasecmp (p + 1, "br", 2) == 0 &&
+                  !g_ascii_isalnum (p[3]))
+                g_string_append_c (str, '\n');
+
+              return end + 1;
+            }
+        }
+
+      g_string_append (str, "&lt;");
+
+      return p + 1;
+
+    default:
+      markup_append_char (str, (guchar)*p);
+
+      return p + 1;
+    }
+}
+
+/* Append the text from @p to @end, which has no tags */
+static void
+markup_append_text (GString    *str,
+                    const char *p,
+                    const char *end)
+{
+  const char *run = p;
+
+  while (p < end)
+    {
+      if (!markup_is_special (*p))
+        {
+          p++;
+          continue;
+        }
+
+      g_string_append_len (str, run, p - run);
+      p = markup_append_special (str, p);
+      run = p;
+    }
+
+  g_string_append_len (str, run, end - run);
+}
+
+/* Find the end of the URI, or of the part after the scheme, at @p */
+static const char *
+markup_find_uri_end (const char *p)
+{
+  const char *start = p;
+  guint n_open = 0, n_close = 0;
+
+  while ((guchar)*p > ' ' && (guchar)*p < 0x80 &&
+         *p != '<' && *p != '>' && *p != '"')
+    {
+      if (*p == '&')
+        {
+          gunichar c;
+          gsize len;
+
+          len = markup_decode_entity (p, &c);
+
+          /* Quotes and brackets, even escaped, end the URI */
+          if (len && (c == '<' || c == '>' || c == '"' || c == '\'' || c == 0xa0))
+            break;
+
+          p += MAX (len, 1);
+          continue;
+        }
+
+      if (*p == '(')
+        n_open++;
+      else if (*p == ')')
+        n_close++;
+
+      p++;
+    }
+
+  /* Punctuation at the end is part of the sentence */
+  while (p > start)
+    {
+      char c = p[-1];
+
+      if (c == ')' && n_close > n_open)
+        n_close--;
+      else if (!strchr (".,:!?'", c))
+        break;
+
+      p--;
+    }
+
+  return p;
+}
+
+/*
+ * Find the end of the email address at @p.  @local_end is set
+ * to where the part before ‘@’ ends, or would end.
+ */
+static const char *
+markup_find_email_end (const char  *p,
+                       const char **local_end)
+{
+  const char *end = NULL;
+  gboolean alpha_label = FALSE;
+  guint n_labels = 0;
+
+  while (g_ascii_isalnum (*p) || (*p && strchr ("._%+-", *p)))
+    p++;
+
+  *local_end = p;
+
+  if (*p != '@')
+    return NULL;
+
+  p++;
+
+  /* The domain, with at least two labels, and a top level one of letters */
+  while (g_ascii_isalnum (*p))
+    {
+      alpha_label = TRUE;
+
+      while (g_ascii_isalnum (*p) || *p == '-')
+        {
+          if (!g_ascii_isalpha (*p))
+            alpha_label = FALSE;
+          p++;
+        }
+
+      if (p[-1] == '-')
+        break;
+
+      n_labels++;
+
+      if (n_labels >= 2 && alpha_label)
+        end = p;
+
+      if (*p != '.')
+        break;
+
+      p++;
+    }
+
+  return end;
+}
+
+static const char *
+markup_find_phone_end (const char *p)
+{
+  const char *end = NULL;
+  guint n_digits = 0;
+
+  g_assert (*p == '+');
+  p++;
+
+  while (g_ascii_isdigit (*p))
+    {
+      n_digits++;
+      end = ++p;
+
+      /* Groups of digits can be separated by a space or a dash */
+      if ((*p == ' ' || *p == '-') && g_ascii_isdigit (p[1]))
+        p++;
+    }
+
+  if (n_digits < PHONE_MIN_DIGITS || n_digits > PHONE_MAX_DIGITS ||
+      g_ascii_isalpha (*end))
+    return NULL;
+
+  return end;
+}
+
+/*
+ * Find the link starting at @p, which is at the start of a word.
+ * @no_email is where the last email address looked for ended, words
+ * before it end at the same place and can’t be an address either.
+ * Returns the end of the link, or %NULL if there is none.
+ */
+static const char *
+markup_find_link (const char  *p,
+                  LinkKind    *kind,
+                  const char **no_email)
+{
+  const char *end;
+
+  *kind = LINK_NONE;
+
+  if (*p == '+')
+    {
+      *kind = LINK_PHONE;
+
+      return markup_find_phone_end (p);
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (link_schemes); i++)
+    {
+      gsize len;
+
+      if (g_ascii_tolower (*p) != link_schemes[i][0])
+        continue;
+
+      len = strlen (link_schemes[i]);
+
+      if (g_ascii_strncasecmp (p, link_schemes[i], len) != 0)
+        continue;
+
+      end = markup_find_uri_end (p + len);
+      *kind = LINK_URL;
+
+      return end > p + len ? end : NULL;
+    }
+
+  if (g_ascii_strncasecmp (p, "www.", 4) == 0 && g_ascii_isalnum (p[4]))
+    {
+      *kind = LINK_WWW;
+
+      return markup_find_uri_end (p);
+    }
+
+  if (p < *no_email)
+    return NULL;
+
+  *kind = LINK_EMAIL;
+
+  return markup_find_email_end (p, no_email);
+}
+
+static void
+markup_append_link (GString    *str,
+                    const char *start,
+                    const char *end,
+                    LinkKind    kind)
+{
+  g_string_append (str, "<a href=\"");
+
+  if (kind == LINK_PHONE)
+    {
+      g_string_append (str, "tel:+");
+
+      for (const char *p = start; p < end; p++)
+        if (g_ascii_isdigit (*p))
+          g_string_append_c (str, *p);
+    }
+  else
+    {
+      if (kind == LINK_WWW)
+        g_string_append (str, "http://");
+      else if (kind == LINK_EMAIL)
+        g_string_append (str, "mailto:");
+
+      markup_append_text (str, start, end);
+    }
+
+  g_string_append (str, "\">");
+  markup_append_text (str, start, end);
+  g_string_append (str, "</a>");
+}
+
+/*
+ * Find the href of the HTML link tag at @p, if any.
+ * Returns the end of the tag, or %NULL if @p isn't one.
+ */
+static const char *
+markup_find_anchor_href (const char  *p,
+                         const char **href,
+                         gsize       *href_len)
+{
+  const char *end;
+
+  *href = NULL;
+  *href_len = 0;
+
+  if (g_ascii_tolower (p[1]) != 'a' || !g_ascii_isspace (p[2]))
+    return NULL;
+
+  end = strpbrk (p + 1, "<>");
+
+  if (!end || *end != '>')
+    return NULL;
+
+  for (p += 2; p + 5 < end; p++)
+    {
+      const char *value_end;
+      char quote;
+
+      if (!g_ascii_isspace (*p) || g_ascii_strncasecmp (p + 1, "href=", 5) != 0)
+        continue;
+
+      p += 6;
+      quote = *p;
+
+      if (quote == '"' || quote == '\'')
+        {
+          value_end = memchr (p + 1, quote, end - p - 1);
+
+          if (value_end)
+            {
+              *href = p + 1;
+              *href_len = value_end - *href;
+            }
+        }
+      else
+        {
+          for (value_end = p; value_end < end && !g_ascii_isspace (*value_end); value_end++)
+            ;
+
+          *href = p;
+          *href_len = value_end - p;
+        }
+
+      break;
+    }
+
+  return end + 1;
+}
+
+/*
+ * Keep track of the HTML link tags at @p, and append the target
+ * of the link that ends at @p if it isn't the same as its text.
+ */
+static void
+markup_update_anchor (GString    *str,
+                      const char *p,
+                      Anchor     *anchor)
+{
+  const char *href, *text, *link_end, *no_email;
+  LinkKind kind;
+  gsize len, text_len;
+
+  g_assert (*p == '<');
+
+  if ((text = markup_find_anchor_href (p, &href, &len)))
+    {
+      anchor->href = href;
+      anchor->href_len = len;
+      anchor->text = text;
+
+      return;
+    }
+
+  if (!anchor->href || g_ascii_strncasecmp (p, "</a>", 4) != 0)
+    return;
+
+  href = anchor->href;
+  len = anchor->href_len;
+  text_len = p - anchor->text;
+  anchor->href = NULL;
+
+  if (!len)
+    return;
+
+  if (text_len == len && strncmp (href, anchor->text, len) == 0)
+    return;
+
+  /* The address of “mailto:” links is their text */
+  if (text_len == len - 7 && g_ascii_strncasecmp (href, "mailto:", 7) == 0 &&
+      strncmp (href + 7, anchor->text, text_len) == 0)
+    return;
+
+  g_string_append (str, " (");
+
+  no_email = href;
+  link_end = markup_find_link (href, &kind, &no_email);
+
+  if (link_end == href + len)
+    markup_append_link (str, href, link_end, kind);
+  else
+    markup_append_text (str, href, href + len);
+
+  g_string_append_c (str, ')');
+}
+
+/**
+ * chatty_markup_from_text:
+ * @text: (nullable): The text of a message
+ *
+ * Convert @text, which may contain HTML, to Pango markup
+ * suitable for a #GtkLabel, with links made clickable.
+ * This is done in a single pass over @text.
+ *
+ * Returns: (transfer full): The markup, free with g_free()
+ */
+char *
+chatty_markup_from_text (const char *text)
+{
+  const char *p, *run, *no_email;
+  GString *str;
+  Anchor anchor = { NULL };
+  gboolean in_word = FALSE;
+
+  if (!text)
+    return g_strdup ("");
+
+  str = g_string_sized_new (strlen (text) + 16);
+  p = run = no_email = text;
+
+  while (*p)
+    {
+      guchar c = *p;
+
+      /* Letters, digits and ‘+’ may start a link at the start of a word */
+      if (g_ascii_isalnum (c) || c == '+')
+        {
+          LinkKind kind;
+          const char *end;
+
+          if (!in_word && (end = markup_find_link (p, &kind, &no_email)))
+            {
+              g_string_append_len (str, run, p - run);
+              markup_append_link (str, p, end, kind);
+              p = run = end;
+              in_word = FALSE;
+              continue;
+            }
+
+          in_word = TRUE;
+          p++;
+          continue;
+        }
+
+      in_word = FALSE;
+
+      /* Anything else, including the bytes of multibyte chars, is copied as is */
+      if (!markup_is_special (c))
+        {
+          p++;
+          continue;
+        }
+
+      g_string_append_len (str, run, p - run);
+
+      if (c == '<')
+        markup_update_anchor (str, p, &anchor);
+
+      p = markup_append_special (str, p);
+      run = p;
+    }
+
+  g_string_append_len (str, run, p - run);
+
+  return g_string_free (str, FALSE);
+}
@@ -0,0 +1,851 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-message-list-view.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-message-list-view"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "contrib/gtkrbtreeprivate.h"
+#include "chatty-message-list-view.h"
+
+/**
+ * SECTION: chatty-message-list-view
+ * @title: ChattyMessageListView
+ * @short_description: A list of messages that creates rows only when visible
+ * @include: "chatty-message-list-view.h"
+ *
+ * #ChattyMessageListView shows a #GListModel of #ChattyMessage like
+ * a #GtkListBox does, but #ChattyMessageRow widgets are created only
+ * for the messages near the visible part of the list.  Rows that are
+ * scrolled out are hidden and kept aside to show other messages, so
+ * that the number of rows doesn’t grow with the number of messages.
+ *
+ * The view is to be put inside a #GtkScrolledWindow, possibly packed
+ * with other widgets.  The height of a message is known only once a
+ * row has shown it, other messages are assumed to have the average
+ * height of the messages seen so far.  Heights are kept in a
+ * #GtkRbTree, so that finding the message at some offset, or the
+ * height of the whole list, doesn’t depend on the number of messages.
+ * The heights measured at the previous width are kept too, so that
+ * going back and forth between two widths (say, rotating a phone)
+ * doesn’t measure everything again.
+ */
+
+/* Rows are kept for this many pixels above and below the visible area */
+#define OVERSCAN_HEIGHT     360
+/* Assumed height of messages until one has been measured */
+#define DEFAULT_ROW_HEIGHT  60
+
+typedef struct _HeightNode HeightNode;
+typedef struct _HeightAugment HeightAugment;
+
+struct _HeightNode
+{
+  /* The height of the message at the view width, -1 if not known */
+  int height;
+};
+
+struct _HeightAugment
+{
+  guint  n_items;
+  guint  n_measured;
+  gint64 measured_height;
+};
+
+struct _ChattyMessageListView
+{
+  GtkContainer   parent_instance;
+
+  GListModel    *model;
+  ChattyMessageListViewBindFunc bind_func;
+  gpointer       bind_data;
+
+  GtkWidget     *placeholder;
+  GtkAdjustment *vadjustment;
+
+  /* ChattyMessage -> ChattyMessageRow for the rows shown */
+  GHashTable    *rows;
+  /* Hidden rows, to be reused */
+  GPtrArray     *free_rows;
+  /* A HeightNode for each message, measured at @width */
+  GtkRbTree     *heights;
+  int            width;
+  /* The same, measured at @other_width */
+  GtkRbTree     *other_heights;
+  int            other_width;
+  guint          resize_id;
+  /* The messages whose rows have to be bound again */
+  guint          rebind_start;
+  guint          rebind_end;
+};
+
+G_DEFINE_TYPE (ChattyMessageListView, chatty_message_list_view, GTK_TYPE_CONTAINER)
+
+static void
+list_view_augment (GtkRbTree *tree,
+                   gpointer   node_augment,
+                   gpointer   node,
+                   gpointer   left,
+                   gpointer   right)
+{
+  HeightAugment *aug = node_augment;
+  HeightNode *height_node = node;
+
+  aug->n_items = 1;
+  aug->n_measured = height_node->height >= 0;
+  aug->measured_height = MAX (height_node->height, 0);
+
+  if (left) {
+    HeightAugment *left_aug = gtk_rb_tree_get_augment (tree, left);
+
+    aug->n_items += left_aug->n_items;
+    aug->n_measured += left_aug->n_measured;
+    aug->measured_height += left_aug->measured_height;
+  }
+
+  if (right) {
+    HeightAugment *right_aug = gtk_rb_tree_get_augment (tree, right);
+
+    aug->n_items += right_aug->n_items;
+    aug->n_measured += right_aug->n_measured;
+    aug->measured_height += right_aug->measured_height;
+  }
+}
+
+static HeightAugment *
+list_view_get_augment (GtkRbTree  *tree,
+                       HeightNode *node)
+{
+  static HeightAugment empty = { 0 };
+
+  if (!node)
+    return &empty;
+
+  return gtk_rb_tree_get_augment (tree, node);
+}
+
+static guint
+list_view_get_n_items (ChattyMessageListView *self)
+{
+  return list_view_get_augment (self->heights, gtk_rb_tree_get_root (self->heights))->n_items;
+}
+
+static int
+list_view_get_estimated_height (GtkRbTree *tree)
+{
+  HeightAugment *aug;
+
+  aug = list_view_get_augment (tree, gtk_rb_tree_get_root (tree));
+
+  if (aug->n_measured == 0)
+    return DEFAULT_ROW_HEIGHT;
+
+  return aug->measured_height / aug->n_measured;
+}
+
+/* The height of @node and its children, using @estimate for the unknown ones */
+static gint64
+list_view_get_tree_height (GtkRbTree  *tree,
+                           HeightNode *node,
+                           int         estimate)
+{
+  HeightAugment *aug;
+
+  aug = list_view_get_augment (tree, node);
+
+  return aug->measured_height + (gint64)(aug->n_items - aug->n_measured) * estimate;
+}
+
+static void
+list_view_set_item_height (HeightNode *node,
+                           int         height)
+{
+  if (node->height == height)
+    return;
+
+  node->height = height;
+  gtk_rb_tree_node_mark_dirty (node);
+}
+
+static HeightNode *
+list_view_get_nth (GtkRbTree *tree,
+                   guint      position)
+{
+  HeightNode *node, *left;
+
+  node = gtk_rb_tree_get_root (tree);
+
+  while (node) {
+    left = gtk_rb_tree_node_get_left (node);
+
+    if (left) {
+      HeightAugment *aug = gtk_rb_tree_get_augment (tree, left);
+
+      if (position < aug->n_items) {
+        node = left;
+        continue;
+      }
+
+      position -= aug->n_items;
+    }
+
+    if (position == 0)
+      break;
+
+    position--;
+    node = gtk_rb_tree_node_get_right (node);
+  }
+
+  return node;
+}
+
+/*
+ * Find the message shown at offset @y, or %NULL if @y is below
+ * the last one.  @position and @item_y are set to its position
+ * and to its offset.
+ */
+static HeightNode *
+list_view_get_item_at_y (ChattyMessageListView *self,
+                         int                    y,
+                         guint                 *position,
+                         int                   *item_y)
+{
+  HeightNode *node;
+  gint64 top = 0;
+  int estimate;
+
+  estimate = list_view_get_estimated_height (self->heights);
+  node = gtk_rb_tree_get_root (self->heights);
+  *position = 0;
+  y = MAX (y, 0);
+
+  while (node) {
+    HeightNode *left;
+    gint64 height;
+
+    left = gtk_rb_tree_node_get_left (node);
+    height = list_view_get_tree_height (self->heights, left, estimate);
+
+    if (y < top + height) {
+      node = left;
+      continue;
+    }
+
+    top += height;
+    *position += list_view_get_augment (self->heights, left)->n_items;
+    height = node->height >= 0 ? node->height : estimate;
+
+    if (y < top + height)
+      break;
+
+    top += height;
+    (*position)++;
+    node = gtk_rb_tree_node_get_right (node);
+  }
+
+  *item_y = top;
+
+  return node;
+}
+
+/* Replace @removed items at @position of @tree by @added unknown ones */
+static void
+list_view_splice_heights (GtkRbTree *tree,
+                          guint      position,
+                          guint      removed,
+                          guint      added)
+{
+  HeightNode *node;
+
+  node = list_view_get_nth (tree, position);
+
+  for (guint i = 0; i < removed; i++) {
+    HeightNode *next;
+
+    next = gtk_rb_tree_node_get_next (node);
+    gtk_rb_tree_remove (tree, node);
+    node = next;
+  }
+
+  for (guint i = 0; i < added; i++) {
+    HeightNode *new_node;
+
+    new_node = gtk_rb_tree_insert_before (tree, node);
+    new_node->height = -1;
+  }
+}
+
+/*
+ * Use the heights measured at @width, those of the previous
+ * width are kept.  This is done only when allocating, never
+ * while measuring, so that GTK asking for the height at some
+ * other width doesn't throw the heights away.
+ */
+static void
+list_view_set_width (ChattyMessageListView *self,
+                     int                    width)
+{
+  GtkRbTree *tree;
+  HeightNode *node;
+  int old_width;
+
+  if (width == self->width)
+    return;
+
+  tree = self->other_heights;
+  old_width = self->other_width;
+  self->other_heights = self->heights;
+  self->other_width = self->width;
+  self->heights = tree;
+  self->width = width;
+
+  if (old_width == width)
+    return;
+
+  /* The heights known were measured for some other width */
+  for (node = gtk_rb_tree_get_first (tree); node;
+       node = gtk_rb_tree_node_get_next (node))
+    list_view_set_item_height (node, -1);
+}
+
+/* The height of all messages, using estimates for the unknown ones */
+static int
+list_view_get_height (ChattyMessageListView *self,
+                      int                    width)
+{
+  GtkRbTree *tree;
+  int height;
+
+  if (list_view_get_n_items (self) == 0) {
+    height = 0;
+
+    if (self->placeholder && gtk_widget_get_visible (self->placeholder))
+      gtk_widget_get_preferred_height_for_width (self->placeholder, width,
+                                                 &height, NULL);
+    return height;
+  }
+
+  tree = self->heights;
+
+  if (width >= 0 && width != self->width && width == self->other_width)
+    tree = self->other_heights;
+
+  return MIN (list_view_get_tree_height (tree, gtk_rb_tree_get_root (tree),
+                                         list_view_get_estimated_height (tree)),
+              G_MAXINT);
+}
+
+static gboolean
+list_view_resize_cb (gpointer user_data)
+{
+  ChattyMessageListView *self = user_data;
+
+  g_assert (CHATTY_IS_MESSAGE_LIST_VIEW (self));
+
+  self->resize_id = 0;
+  gtk_widget_queue_resize (GTK_WIDGET (self));
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+list_view_adjustment_changed_cb (ChattyMessageListView *self)
+{
+  g_assert (CHATTY_IS_MESSAGE_LIST_VIEW (self));
+
+  /* Scrolling doesn't change the height, only the rows shown */
+  gtk_widget_queue_allocate (GTK_WIDGET (self));
+}
+
+static void
+list_view_set_vadjustment (ChattyMessageListView *self,
+                           GtkAdjustment         *vadjustment)
+{
+  if (self->vadjustment == vadjustment)
+    return;
+
+  if (self->vadjustment)
+    g_signal_handlers_disconnect_by_func (self->vadjustment,
+                                          list_view_adjustment_changed_cb,
+                                          self);
+
+  g_set_object (&self->vadjustment, vadjustment);
+
+  if (vadjustment)
+    g_signal_connect_object (vadjustment, "value-changed",
+                             G_CALLBACK (list_view_adjustment_changed_cb),
+                             self, G_CONNECT_SWAPPED);
+}
+
+/*
+ * Get the part of @self that is visible in the scrolled
+ * window, if any.  Everything is visible otherwise.
+ */
+static void
+list_view_get_visible_range (ChattyMessageListView *self,
+                             int                   *top,
+                             int                   *bottom)
+{
+  GtkWidget *viewport, *child;
+  GtkAdjustment *vadjustment = NULL;
+  int x, y;
+
+  viewport = gtk_widget_get_ancestor (GTK_WIDGET (self), GTK_TYPE_VIEWPORT);
+
+  if (viewport)
+    vadjustment = gtk_scrollable_get_vadjustment (GTK_SCROLLABLE (viewport));
+
+  list_view_set_vadjustment (self, vadjustment);
+  child = viewport ? gtk_bin_get_child (GTK_BIN (viewport)) : NULL;
+
+  /* @y is our position in the scrolled content */
+  if (!vadjustment || !child ||
+      !gtk_widget_translate_coordinates (GTK_WIDGET (self), child, 0, 0, &x, &y)) {
+    *top = 0;
+    *bottom = G_MAXINT;
+
+    return;
+  }
+
+  *top = gtk_adjustment_get_value (vadjustment) - y;
+  *bottom = *top + gtk_adjustment_get_page_size (vadjustment);
+}
+
+static GtkWidget *
+list_view_get_free_row (ChattyMessageListView *self)
+{
+  GtkWidget *row;
+
+  if (self->free_rows->len > 0) {
+    row = g_ptr_array_index (self->free_rows, self->free_rows->len - 1);
+    g_ptr_array_remove_index_fast (self->free_rows, self->free_rows->len - 1);
+    gtk_widget_set_child_visible (row, TRUE);
+
+    return row;
+  }
+
+  row = chatty_message_row_new (NULL, CHATTY_PROTOCOL_NONE, FALSE);
+  gtk_widget_set_parent (row, GTK_WIDGET (self));
+
+  return row;
+}
+
+/* Where the item at @position is after @removed items at @change are replaced */
+static guint
+list_view_map_position (guint position,
+                        guint change,
+                        guint removed,
+                        guint added)
+{
+  if (position <= change)
+    return position;
+
+  if (position >= change + removed)
+    return position - removed + added;
+
+  return change + added;
+}
+
+static void
+list_view_items_changed_cb (ChattyMessageListView *self,
+                            guint                  position,
+                            guint                  removed,
+                            guint                  added)
+{
+  guint start, end;
+
+  g_assert (CHATTY_IS_MESSAGE_LIST_VIEW (self));
+
+  list_view_splice_heights (self->heights, position, removed, added);
+  list_view_splice_heights (self->other_heights, position, removed, added);
+
+  /* A change may affect how the message before is shown */
+  start = position > 0 ? position - 1 : 0;
+  end = position + added;
+
+  if (self->rebind_start < self->rebind_end) {
+    start = MIN (start, list_view_map_position (self->rebind_start, position, removed, added));
+    end = MAX (end, list_view_map_position (self->rebind_end, position, removed, added));
+  }
+
+  self->rebind_start = start;
+  self->rebind_end = MIN (end, list_view_get_n_items (self));
+
+  if (self->placeholder)
+    gtk_widget_set_child_visible (self->placeholder, list_view_get_n_items (self) == 0);
+
+  gtk_widget_queue_resize (GTK_WIDGET (self));
+}
+
+/*
+ * Show the messages near the visible part of @self in rows,
+ * measuring and allocating them at the width of @allocation.
+ */
+static void
+list_view_update_rows (ChattyMessageListView *self,
+                       const GtkAllocation   *allocation)
+{
+  g_autoptr(GHashTable) old_rows = NULL;
+  GHashTableIter iter;
+  HeightNode *node;
+  gpointer row;
+  guint position;
+  int top, bottom, y;
+
+  list_view_set_width (self, allocation->width);
+  list_view_get_visible_range (self, &top, &bottom);
+  top -= OVERSCAN_HEIGHT;
+  bottom = bottom > G_MAXINT - OVERSCAN_HEIGHT ? G_MAXINT : bottom + OVERSCAN_HEIGHT;
+
+  old_rows = self->rows;
+  self->rows = g_hash_table_new (NULL, NULL);
+
+  node = list_view_get_item_at_y (self, top, &position, &y);
+
+  for (; node && y < bottom; node = gtk_rb_tree_node_get_next (node), position++) {
+    g_autoptr(ChattyMessage) message = NULL;
+    GtkAllocation child_allocation;
+    int height;
+
+    message = g_list_model_get_item (self->model, position);
+    row = g_hash_table_lookup (old_rows, message);
+
+    if (row) {
+      g_hash_table_remove (old_rows, message);
+
+      if (position >= self->rebind_start && position < self->rebind_end)
+        self->bind_func (row, message, position, self->bind_data);
+    } else {
+      row = list_view_get_free_row (self);
+      self->bind_func (row, message, position, self->bind_data);
+    }
+
+    g_hash_table_insert (self->rows, message, row);
+
+    gtk_widget_get_preferred_height_for_width (row, allocation->width, &height, NULL);
+    list_view_set_item_height (node, height);
+
+    child_allocation.x = allocation->x;
+    child_allocation.y = allocation->y + y;
+    child_allocation.width = allocation->width;
+    child_allocation.height = height;
+    gtk_widget_size_allocate (row, &child_allocation);
+
+    y += height;
+  }
+
+  /* Rows not shown are bound when they are */
+  self->rebind_start = self->rebind_end = 0;
+
+  /* Keep rows that are no more visible for later use */
+  g_hash_table_iter_init (&iter, old_rows);
+  while (g_hash_table_iter_next (&iter, NULL, &row)) {
+    gtk_widget_set_child_visible (row, FALSE);
+    g_ptr_array_add (self->free_rows, row);
+  }
+}
+
+static void
+chatty_message_list_view_size_allocate (GtkWidget     *widget,
+                                        GtkAllocation *allocation)
+{
+  ChattyMessageListView *self = (ChattyMessageListView *)widget;
+  int height;
+
+  gtk_widget_set_allocation (widget, allocation);
+
+  if (self->placeholder && list_view_get_n_items (self) == 0)
+    gtk_widget_size_allocate (self->placeholder, allocation);
+
+  height = list_view_get_height (self, allocation->width);
+  list_view_update_rows (self, allocation);
+
+  /*
+   * The rows measured may change the estimated height of the list.
+   * If so, ask for the new height once this layout is done, rather
+   * than from here, which would lay out the window again at once.
+   */
+  if (!self->resize_id &&
+      list_view_get_height (self, allocation->width) != height)
+    self->resize_id = g_idle_add (list_view_resize_cb, self);
+}
+
+static GtkSizeRequestMode
+chatty_message_list_view_get_request_mode (GtkWidget *widget)
+{
+  return GTK_SIZE_REQUEST_HEIGHT_FOR_WIDTH;
+}
+
+static void
+chatty_message_list_view_get_preferred_width (GtkWidget *widget,
+                                              int       *minimum_width,
+                                              int       *natural_width)
+{
+  ChattyMessageListView *self = (ChattyMessageListView *)widget;
+  GHashTableIter iter;
+  gpointer row;
+
+  *minimum_width = *natural_width = 0;
+
+  if (self->placeholder && gtk_widget_get_visible (self->placeholder))
+    gtk_widget_get_preferred_width (self->placeholder, minimum_width, natural_width);
+
+  g_hash_table_iter_init (&iter, self->rows);
+  while (g_hash_table_iter_next (&iter, NULL, &row)) {
+    int min, nat;
+
+    gtk_widget_get_preferred_width (row, &min, &nat);
+    *minimum_width = MAX (*minimum_width, min);
+    *natural_width = MAX (*natural_width, nat);
+  }
+}
+
+static void
+chatty_message_list_view_get_preferred_height_for_width (GtkWidget *widget,
+                                                         int        width,
+                                                         int       *minimum_height,
+                                                         int       *natural_height)
+{
+  ChattyMessageListView *self = (ChattyMessageListView *)widget;
+
+  *minimum_height = *natural_height = list_view_get_height (self, width);
+}
+
+static void
+chatty_message_list_view_get_preferred_height (GtkWidget *widget,
+                                               int       *minimum_height,
+                                               int       *natural_height)
+{
+  chatty_message_list_view_get_preferred_height_for_width (widget, -1,
+                                                           minimum_height,
+                                                           natural_height);
+}
+
+static void
+chatty_message_list_view_add (GtkContainer *container,
+                              GtkWidget    *widget)
+{
+  g_warning ("Use chatty_message_list_view_bind_model() to add messages");
+}
+
+static void
+chatty_message_list_view_remove (GtkContainer *container,
+                                 GtkWidget    *widget)
+{
+  ChattyMessageListView *self = (ChattyMessageListView *)container;
+  GHashTableIter iter;
+  gpointer row;
+
+  if (widget == self->placeholder) {
+    self->placeholder = NULL;
+  } else if (!g_ptr_array_remove_fast (self->free_rows, widget)) {
+    g_hash_table_iter_init (&iter, self->rows);
+
+    while (g_hash_table_iter_next (&iter, NULL, &row))
+      if (row == widget) {
+        g_hash_table_iter_remove (&iter);
+        break;
+      }
+  }
+
+  gtk_widget_unparent (widget);
+}
+
+static void
+chatty_message_list_view_forall (GtkContainer *container,
+                                 gboolean      include_internals,
+                                 GtkCallback   callback,
+                                 gpointer      callback_data)
+{
+  ChattyMessageListView *self = (ChattyMessageListView *)container;
+  g_autoptr(GPtrArray) children = NULL;
+  GHashTableIter iter;
+  gpointer row;
+
+  /* @callback may remove children */
+  children = g_ptr_array_new ();
+
+  if (self->placeholder)
+    g_ptr_array_add (children, self->placeholder);
+
+  g_hash_table_iter_init (&iter, self->rows);
+  while (g_hash_table_iter_next (&iter, NULL, &row))
+    g_ptr_array_add (children, row);
+
+  for (guint i = 0; i < self->free_rows->len; i++)
+    g_ptr_array_add (children, self->free_rows->pdata[i]);
+
+  for (guint i = 0; i < children->len; i++)
+    callback (children->pdata[i], callback_data);
+}
+
+static void
+chatty_message_list_view_dispose (GObject *object)
+{
+  ChattyMessageListView *self = (ChattyMessageListView *)object;
+
+  chatty_message_list_view_bind_model (self, NULL, NULL, NULL);
+  list_view_set_vadjustment (self, NULL);
+  g_clear_handle_id (&self->resize_id, g_source_remove);
+
+  G_OBJECT_CLASS (chatty_message_list_view_parent_class)->dispose (object);
+}
+
+static void
+chatty_message_list_view_finalize (GObject *object)
+{
+  ChattyMessageListView *self = (ChattyMessageListView *)object;
+
+  g_hash_table_unref (self->rows);
+  g_ptr_array_unref (self->free_rows);
+  gtk_rb_tree_unref (self->heights);
+  gtk_rb_tree_unref (self->other_heights);
+
+  G_OBJECT_CLASS (chatty_message_list_view_parent_class)->finalize (object);
+}
+
+static void
+chatty_message_list_view_class_init (ChattyMessageListViewClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
+  GtkContainerClass *container_class = GTK_CONTAINER_CLASS (klass);
+
+  object_class->dispose = chatty_message_list_view_dispose;
+  object_class->finalize = chatty_message_list_view_finalize;
+
+  widget_class->size_allocate = chatty_message_list_view_size_allocate;
+  widget_class->get_request_mode = chatty_message_list_view_get_request_mode;
+  widget_class->get_preferred_width = chatty_message_list_view_get_preferred_width;
+  widget_class->get_preferred_height = chatty_message_list_view_get_preferred_height;
+  widget_class->get_preferred_height_for_width = chatty_message_list_view_get_preferred_height_for_width;
+
+  container_class->add = chatty_message_list_view_add;
+  container_class->remove = chatty_message_list_view_remove;
+  container_class->forall = chatty_message_list_view_forall;
+
+  /* Style like a GtkListBox, the rows are GtkListBoxRows */
+  gtk_widget_class_set_css_name (widget_class, "list");
+}
+
+static void
+chatty_message_list_view_init (ChattyMessageListView *self)
+{
+  gtk_widget_set_has_window (GTK_WIDGET (self), FALSE);
+
+  self->rows = g_hash_table_new (NULL, NULL);
+  self->free_rows = g_ptr_array_new ();
+  self->heights = gtk_rb_tree_new (HeightNode,
+                                   HeightAugment,
+                                   list_view_augment,
+                                   NULL,
+                                   NULL);
+  self->other_heights = gtk_rb_tree_new (HeightNode,
+                                         HeightAugment,
+                                         list_view_augment,
+                                         NULL,
+                                         NULL);
+  self->other_width = -1;
+}
+
+GtkWidget *
+chatty_message_list_view_new (void)
+{
+  return g_object_new (CHATTY_TYPE_MESSAGE_LIST_VIEW, NULL);
+}
+
+/**
+ * chatty_message_list_view_bind_model:
+ * @self: A #ChattyMessageListView
+ * @model: (nullable): A #GListModel of #ChattyMessage
+ * @bind_func: (nullable): A function to show a message in a row
+ * @user_data: user data for @bind_func
+ *
+ * Show the messages in @model, @bind_func is called
+ * whenever a row is to show a message.  If @model
+ * is %NULL, the current model is removed.
+ */
+void
+chatty_message_list_view_bind_model (ChattyMessageListView         *self,
+                                     GListModel                    *model,
+                                     ChattyMessageListViewBindFunc  bind_func,
+                                     gpointer                       user_data)
+{
+  guint n_items;
+
+  g_return_if_fail (CHATTY_IS_MESSAGE_LIST_VIEW (self));
+  g_return_if_fail (!model || G_IS_LIST_MODEL (model));
+  g_return_if_fail (!model || bind_func);
+
+  if (self->model) {
+    g_signal_handlers_disconnect_by_func (self->model,
+                                          list_view_items_changed_cb,
+                                          self);
+    list_view_items_changed_cb (self, 0, list_view_get_n_items (self), 0);
+    g_clear_object (&self->model);
+  }
+
+  self->bind_func = bind_func;
+  self->bind_data = user_data;
+
+  if (!model)
+    return;
+
+  self->model = g_object_ref (model);
+  g_signal_connect_object (model, "items-changed",
+                           G_CALLBACK (list_view_items_changed_cb),
+                           self, G_CONNECT_SWAPPED);
+
+  n_items = g_list_model_get_n_items (model);
+  list_view_items_changed_cb (self, 0, 0, n_items);
+}
+
+/**
+ * chatty_message_list_view_set_placeholder:
+ * @self: A #ChattyMessageListView
+ * @placeholder: (nullable): A #GtkWidget
+ *
+ * Set the widget to show when there are no messages,
+ * like gtk_list_box_set_placeholder().
+ */
+void
+chatty_message_list_view_set_placeholder (ChattyMessageListView *self,
+                                          GtkWidget             *placeholder)
+{
+  g_return_if_fail (CHATTY_IS_MESSAGE_LIST_VIEW (self));
+  g_return_if_fail (!placeholder || GTK_IS_WIDGET (placeholder));
+
+  if (self->placeholder)
+    gtk_widget_unparent (self->placeholder);
+
+  self->placeholder = placeholder;
+
+  if (placeholder) {
+    gtk_widget_set_parent (placeholder, GTK_WIDGET (self));
+    gtk_widget_set_child_visible (placeholder, list_view_get_n_items (self) == 0);
+  }
+}
+
+/**
+ * chatty_message_list_view_get_n_rows:
+ * @self: A #ChattyMessageListView
+ *
+ * Get the number of #ChattyMessageRow widgets created,
+ * which includes the rows that are kept for reuse.
+ *
+ * Returns: The number of rows
+ */
+guint
+chatty_message_list_view_get_n_rows (ChattyMessageListView *self)
+{
+  g_return_val_if_fail (CHATTY_IS_MESSAGE_LIST_VIEW (self), 0);
+
+  return g_hash_table_size (self->rows) + self->free_rows->len;
+}
@@ -0,0 +1,46 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-message-list-view.h
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gtk/gtk.h>
+
+#include "chatty-message.h"
+#include "chatty-message-row.h"
+
+G_BEGIN_DECLS
+
+#define CHATTY_TYPE_MESSAGE_LIST_VIEW (chatty_message_list_view_get_type ())
+
+G_DECLARE_FINAL_TYPE (ChattyMessageListView, chatty_message_list_view, CHATTY, MESSAGE_LIST_VIEW, GtkContainer)
+
+/**
+ * ChattyMessageListViewBindFunc:
+ * @row: A #ChattyMessageRow
+ * @message: The #ChattyMessage to show in @row
+ * @position: The position of @message in the model
+ * @user_data: user data
+ *
+ * Called to show @message in @row.  @row may have shown
+ * some other message before.
+ */
+typedef void (*ChattyMessageListViewBindFunc) (ChattyMessageRow *row,
+                                               ChattyMessage    *message,
+                                               guint             position,
+                                               gpointer          user_data);
+
+GtkWidget *chatty_message_list_view_new             (void);
+void       chatty_message_list_view_bind_model      (ChattyMessageListView         *self,
+                                                     GListModel                    *model,
+                                                     ChattyMessageListViewBindFunc  bind_func,
+                                                     gpointer                       user_data);
+void       chatty_message_list_view_set_placeholder (ChattyMessageListView         *self,
+                                                     GtkWidget                     *placeholder);
+guint      chatty_message_list_view_get_n_rows      (ChattyMessageListView         *self);
+
+G_END_DECLS
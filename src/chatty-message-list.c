@@ -0,0 +1,469 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-message-list.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "chatty-message-list"
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "contrib/gtkrbtreeprivate.h"
+#include "chatty-message-list.h"
+
+/**
+ * SECTION: chatty-message-list
+ * @title: ChattyMessageList
+ * @short_description: A list model of messages sorted by time
+ * @include: "chatty-message-list.h"
+ *
+ * #ChattyMessageList keeps #ChattyMessage items ordered by their
+ * time, oldest first.  Items are stored in a #GtkRbTree, so that
+ * messages can be inserted anywhere (say, a page of history at the
+ * start, or a message from the archive in the middle) in O(log n),
+ * and a batch of messages results in a single #GListModel::items-changed.
+ *
+ * Messages with the same time are kept in the order they were added,
+ * unless added as older messages, in which case they are placed before
+ * the existing ones.
+ */
+
+typedef struct _MessageNode MessageNode;
+typedef struct _MessageAugment MessageAugment;
+
+struct _MessageNode
+{
+  ChattyMessage *message;
+  time_t         time;
+  guint          batch;
+};
+
+struct _MessageAugment
+{
+  guint n_items;
+};
+
+struct _ChattyMessageList
+{
+  GObject      parent_instance;
+
+  GtkRbTree   *messages;
+  /* Serial of the batch being added, to keep its order on equal times */
+  guint        batch;
+
+  /* The last item retrieved, lists are usually walked in order */
+  MessageNode *cached_node;
+  guint        cached_position;
+};
+
+static void chatty_message_list_model_init (GListModelInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (ChattyMessageList, chatty_message_list, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (G_TYPE_LIST_MODEL, chatty_message_list_model_init))
+
+static void
+message_list_augment (GtkRbTree *tree,
+                      gpointer   node_augment,
+                      gpointer   node,
+                      gpointer   left,
+                      gpointer   right)
+{
+  MessageAugment *aug = node_augment;
+
+  aug->n_items = 1;
+
+  if (left)
+    {
+      MessageAugment *left_aug = gtk_rb_tree_get_augment (tree, left);
+
+      aug->n_items += left_aug->n_items;
+    }
+
+  if (right)
+    {
+      MessageAugment *right_aug = gtk_rb_tree_get_augment (tree, right);
+
+      aug->n_items += right_aug->n_items;
+    }
+}
+
+static void
+message_list_clear_node (gpointer data)
+{
+  MessageNode *node = data;
+
+  g_object_unref (node->message);
+}
+
+static MessageNode *
+message_list_get_nth (ChattyMessageList *self,
+                      guint              position)
+{
+  MessageNode *node, *left;
+
+  node = gtk_rb_tree_get_root (self->messages);
+
+  while (node)
+    {
+      left = gtk_rb_tree_node_get_left (node);
+
+      if (left)
+        {
+          MessageAugment *aug = gtk_rb_tree_get_augment (self->messages, left);
+
+          if (position < aug->n_items)
+            {
+              node = left;
+              continue;
+            }
+
+          position -= aug->n_items;
+        }
+
+      if (position == 0)
+        break;
+
+      position--;
+      node = gtk_rb_tree_node_get_right (node);
+    }
+
+  return node;
+}
+
+static guint
+message_list_get_position (ChattyMessageList *self,
+                           MessageNode       *node)
+{
+  MessageNode *parent, *left;
+  guint position = 0;
+
+  left = gtk_rb_tree_node_get_left (node);
+
+  if (left)
+    {
+      MessageAugment *aug = gtk_rb_tree_get_augment (self->messages, left);
+
+      position += aug->n_items;
+    }
+
+  for (; (parent = gtk_rb_tree_node_get_parent (node)) != NULL; node = parent)
+    {
+      left = gtk_rb_tree_node_get_left (parent);
+
+      /* @node is the right child, count @parent and everything at its left */
+      if (left != node)
+        {
+          if (left)
+            {
+              MessageAugment *aug = gtk_rb_tree_get_augment (self->messages, left);
+
+              position += aug->n_items;
+            }
+
+          position++;
+        }
+    }
+
+  return position;
+}
+
+/*
+ * Find the first node that should be after a message with time @time,
+ * or %NULL if the message should be the last one.
+ */
+static MessageNode *
+message_list_find_next (ChattyMessageList *self,
+                        time_t             time,
+                        gboolean           older)
+{
+  MessageNode *node, *next = NULL;
+
+  node = gtk_rb_tree_get_root (self->messages);
+
+  while (node)
+    {
+      /*
+       * Older messages go before the existing ones with the same time,
+       * but after the ones from the same batch, which are added in order.
+       */
+      if (node->time > time ||
+          (older && node->time == time && node->batch != self->batch))
+        {
+          next = node;
+          node = gtk_rb_tree_node_get_left (node);
+        }
+      else
+        {
+          node = gtk_rb_tree_node_get_right (node);
+        }
+    }
+
+  return next;
+}
+
+static gint
+message_list_compare_time (gconstpointer a,
+                           gconstpointer b)
+{
+  time_t time_a, time_b;
+
+  time_a = chatty_message_get_time (*(ChattyMessage **)a);
+  time_b = chatty_message_get_time (*(ChattyMessage **)b);
+
+  return (time_a > time_b) - (time_a < time_b);
+}
+
+static GType
+chatty_message_list_get_item_type (GListModel *list)
+{
+  return CHATTY_TYPE_MESSAGE;
+}
+
+static guint
+chatty_message_list_get_n_items (GListModel *list)
+{
+  ChattyMessageList *self = (ChattyMessageList *)list;
+  MessageAugment *aug;
+  MessageNode *node;
+
+  node = gtk_rb_tree_get_root (self->messages);
+
+  if (!node)
+    return 0;
+
+  aug = gtk_rb_tree_get_augment (self->messages, node);
+
+  return aug->n_items;
+}
+
+static gpointer
+chatty_message_list_get_item (GListModel *list,
+                              guint       position)
+{
+  ChattyMessageList *self = (ChattyMessageList *)list;
+  MessageNode *node = NULL;
+
+  if (self->cached_node)
+    {
+      if (position == self->cached_position)
+        node = self->cached_node;
+      else if (position == self->cached_position + 1)
+        node = gtk_rb_tree_node_get_next (self->cached_node);
+      else if (position + 1 == self->cached_position)
+        node = gtk_rb_tree_node_get_previous (self->cached_node);
+    }
+
+  if (!node)
+    node = message_list_get_nth (self, position);
+
+  if (!node)
+    return NULL;
+
+  self->cached_node = node;
+  self->cached_position = position;
+
+  return g_object_ref (node->message);
+}
+
+static void
+chatty_message_list_model_init (GListModelInterface *iface)
+{
+  iface->get_item_type = chatty_message_list_get_item_type;
+  iface->get_n_items = chatty_message_list_get_n_items;
+  iface->get_item = chatty_message_list_get_item;
+}
+
+static void
+chatty_message_list_finalize (GObject *object)
+{
+  ChattyMessageList *self = (ChattyMessageList *)object;
+
+  gtk_rb_tree_unref (self->messages);
+
+  G_OBJECT_CLASS (chatty_message_list_parent_class)->finalize (object);
+}
+
+static void
+chatty_message_list_class_init (ChattyMessageListClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = chatty_message_list_finalize;
+}
+
+static void
+chatty_message_list_init (ChattyMessageList *self)
+{
+  self->messages = gtk_rb_tree_new (MessageNode,
+                                    MessageAugment,
+                                    message_list_augment,
+                                    message_list_clear_node,
+                                    NULL);
+}
+
+ChattyMessageList *
+chatty_message_list_new (void)
+{
+  return g_object_new (CHATTY_TYPE_MESSAGE_LIST, NULL);
+}
+
+/**
+ * chatty_message_list_add:
+ * @self: A #ChattyMessageList
+ * @message: A #ChattyMessage
+ * @older: Whether @message is older than the ones in @self
+ *
+ * Add @message to @self at the position of its time.
+ * See chatty_message_list_add_messages().
+ */
+void
+chatty_message_list_add (ChattyMessageList *self,
+                         ChattyMessage     *message,
+                         gboolean           older)
+{
+  g_autoptr(GPtrArray) messages = NULL;
+
+  g_return_if_fail (CHATTY_IS_MESSAGE_LIST (self));
+  g_return_if_fail (CHATTY_IS_MESSAGE (message));
+
+  messages = g_ptr_array_new ();
+  g_ptr_array_add (messages, message);
+  chatty_message_list_add_messages (self, messages, older);
+}
+
+/**
+ * chatty_message_list_add_messages:
+ * @self: A #ChattyMessageList
+ * @messages: A #GPtrArray of #ChattyMessage
+ * @older: Whether @messages are older than the ones in @self
+ *
+ * Add @messages to @self, each at the position of its time.
+ * @messages need not be sorted, messages with the same time
+ * are kept in the order of @messages.
+ *
+ * If @older is %TRUE, @messages are placed before the messages
+ * in @self with the same time, which is what a page of history
+ * loaded before the first message needs.  Otherwise they are
+ * placed after them.
+ *
+ * #GListModel::items-changed is emitted once, spanning from the
+ * first to the last message added.
+ */
+void
+chatty_message_list_add_messages (ChattyMessageList *self,
+                                  GPtrArray         *messages,
+                                  gboolean           older)
+{
+  g_autoptr(GPtrArray) sorted = NULL;
+  MessageNode *first = NULL, *last = NULL;
+  guint start, end;
+
+  g_return_if_fail (CHATTY_IS_MESSAGE_LIST (self));
+  g_return_if_fail (messages);
+
+  if (messages->len == 0)
+    return;
+
+  sorted = g_ptr_array_sized_new (messages->len);
+
+  for (guint i = 0; i < messages->len; i++)
+    {
+      g_return_if_fail (CHATTY_IS_MESSAGE (messages->pdata[i]));
+      g_ptr_array_add (sorted, messages->pdata[i]);
+    }
+
+  /* This is a stable sort */
+  g_ptr_array_sort (sorted, message_list_compare_time);
+
+  self->batch++;
+  self->cached_node = NULL;
+
+  for (guint i = 0; i < sorted->len; i++)
+    {
+      ChattyMessage *message = sorted->pdata[i];
+      MessageNode *node;
+      time_t time;
+
+      time = chatty_message_get_time (message);
+      node = gtk_rb_tree_insert_before (self->messages,
+                                        message_list_find_next (self, time, older));
+      node->message = g_object_ref (message);
+      node->time = time;
+      node->batch = self->batch;
+
+      if (!first)
+        first = node;
+      last = node;
+    }
+
+  start = message_list_get_position (self, first);
+  end = message_list_get_position (self, last) + 1;
+
+  /* Existing messages between the new ones are reported as re-added */
+  g_list_model_items_changed (G_LIST_MODEL (self), start,
+                              end - start - sorted->len, end - start);
+}
+
+/**
+ * chatty_message_list_get_last:
+ * @self: A #ChattyMessageList
+ *
+ * Get the latest message in @self.
+ *
+ * Returns: (transfer none) (nullable): A #ChattyMessage
+ */
+ChattyMessage *
+chatty_message_list_get_last (ChattyMessageList *self)
+{
+  MessageNode *node;
+
+  g_return_val_if_fail (CHATTY_IS_MESSAGE_LIST (self), NULL);
+
+  node = gtk_rb_tree_get_last (self->messages);
+
+  if (!node)
+    return NULL;
+
+  return node->message;
+}
+
+/**
+ * chatty_message_list_trim:
+ * @self: A #ChattyMessageList
+ * @n_keep: The number of messages to keep
+ *
+ * Remove the oldest messages from @self, so that
+ * only the latest @n_keep messages are kept.
+ *
+ * #GListModel::items-changed is emitted once, if
+ * any message was removed.
+ *
+ * Returns: The number of messages removed
+ */
+guint
+chatty_message_list_trim (ChattyMessageList *self,
+                          guint              n_keep)
+{
+  guint n_items, n_removed;
+
+  g_return_val_if_fail (CHATTY_IS_MESSAGE_LIST (self), 0);
+
+  n_items = g_list_model_get_n_items (G_LIST_MODEL (self));
+
+  if (n_items <= n_keep)
+    return 0;
+
+  n_removed = n_items - n_keep;
+  self->cached_node = NULL;
+
+  for (guint i = 0; i < n_removed; i++)
+    gtk_rb_tree_remove (self->messages, gtk_rb_tree_get_first (self->messages));
+
+  g_list_model_items_changed (G_LIST_MODEL (self), 0, n_removed, 0);
+
+  return n_removed;
+}
@@ -0,0 +1,32 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chatty-message-list.h
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "chatty-message.h"
+
+G_BEGIN_DECLS
+
+#define CHATTY_TYPE_MESSAGE_LIST (chatty_message_list_get_type ())
+
+G_DECLARE_FINAL_TYPE (ChattyMessageList, chatty_message_list, CHATTY, MESSAGE_LIST, GObject)
+
+ChattyMessageList *chatty_message_list_new          (void);
+void               chatty_message_list_add          (ChattyMessageList *self,
+                                                     ChattyMessage     *message,
+                                                     gboolean           older);
+void               chatty_message_list_add_messages (ChattyMessageList *self,
+                                                     GPtrArray         *messages,
+                                                     gboolean           older);
+ChattyMessage     *chatty_message_list_get_last     (ChattyMessageList *self);
+guint              chatty_message_list_trim         (ChattyMessageList *self,
+                                                     guint              n_keep);
+
+G_END_DECLS
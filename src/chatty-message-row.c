@@ -13,6 +13,8 @@
 #include <glib/gi18n.h>
 
 #include "chatty-avatar.h"
+#include "chatty-clock.h"
+#include "chatty-markup.h"
 #include "chatty-utils.h"
 #include "chatty-message-row.h"
 
@@ -41,25 +43,6 @@ struct _ChattyMessageRow
 G_DEFINE_TYPE (ChattyMessageRow, chatty_message_row, GTK_TYPE_LIST_BOX_ROW)
 
 
-static gchar *
-chatty_msg_list_escape_message (const char *message)
-{
-  g_autofree char *nl_2_br;
-  g_autofree char *striped;
-  g_autofree char *escaped;
-  g_autofree char *linkified;
-  char *result;
-
-  nl_2_br = purple_strdup_withhtml (message);
-  striped = purple_markup_strip_html (nl_2_br);
-  escaped = purple_markup_escape_text (striped, -1);
-  linkified = purple_markup_linkify (escaped);
-  // convert all tags to lowercase for GtkLabel markup parser
-  purple_markup_html_to_xhtml (linkified, &result, NULL);
-
-  return result;
-}
-
 static void
 copy_clicked_cb (ChattyMessageRow *self)
 {
@@ -110,8 +93,8 @@ message_row_hold_cb (ChattyMessageRow *self)
 static void
 message_row_update_message (ChattyMessageRow *self)
 {
-  g_autofree char *message = NULL;
   g_autofree char *footer = NULL;
+  const char *markup;
   const char *status_str = "";
   ChattyMsgStatus status;
 
@@ -132,7 +115,7 @@ message_row_update_message (ChattyMessageRow *self)
     time_t time_stamp;
 
     time_stamp = chatty_message_get_time (self->message);
-    time_str = chatty_utils_get_human_time (time_stamp);
+    time_str = chatty_clock_get_human_time (chatty_clock_get_default (), time_stamp);
 
     footer = g_strconcat ("<span color='grey'>",
                           time_str,
@@ -151,8 +134,18 @@ message_row_update_message (ChattyMessageRow *self)
                             NULL);
   }
 
-  message = chatty_msg_list_escape_message (chatty_message_get_text (self->message));
-  gtk_label_set_markup (GTK_LABEL (self->message_label), message);
+  /* The markup is generated once, and kept with the message */
+  markup = chatty_message_get_markup (self->message);
+
+  if (!markup) {
+    g_autofree char *message = NULL;
+
+    message = chatty_markup_from_text (chatty_message_get_text (self->message));
+    chatty_message_set_markup (self->message, message);
+    markup = chatty_message_get_markup (self->message);
+  }
+
+  gtk_label_set_markup (GTK_LABEL (self->message_label), markup);
   gtk_label_set_markup (GTK_LABEL (self->footer_label), footer);
   gtk_widget_set_visible (self->footer_label, footer && *footer);
 }
@@ -220,18 +213,56 @@ chatty_message_row_new (ChattyMessage  *message,
                         gboolean        is_im)
 {
   ChattyMessageRow *self;
+
+  self = g_object_new (CHATTY_TYPE_MESSAGE_ROW, NULL);
+
+  if (message)
+    chatty_message_row_set_item (self, message, protocol, is_im);
+
+  return GTK_WIDGET (self);
+}
+
+/**
+ * chatty_message_row_set_item:
+ * @self: A #ChattyMessageRow
+ * @message: A #ChattyMessage
+ * @protocol: The protocol of the chat of @message
+ * @is_im: Whether the chat is an IM chat
+ *
+ * Show @message in @self, replacing the message shown
+ * before, if any.  This lets a row be reused for another
+ * message, instead of creating a new row.
+ */
+void
+chatty_message_row_set_item (ChattyMessageRow *self,
+                             ChattyMessage    *message,
+                             ChattyProtocol    protocol,
+                             gboolean          is_im)
+{
   GtkStyleContext *sc;
   ChattyMsgDirection direction;
 
-  self = g_object_new (CHATTY_TYPE_MESSAGE_ROW, NULL);
-  sc = gtk_widget_get_style_context (self->message_label);
+  g_return_if_fail (CHATTY_IS_MESSAGE_ROW (self));
+  g_return_if_fail (CHATTY_IS_MESSAGE (message));
 
-  if (!message)
-    return GTK_WIDGET (self);
+  if (self->message)
+    g_signal_handlers_disconnect_by_func (self->message,
+                                          message_row_update_message,
+                                          self);
 
-  self->message = g_object_ref (message);
+  g_set_object (&self->message, message);
   self->is_im = !!is_im;
   direction = chatty_message_get_msg_direction (message);
+  sc = gtk_widget_get_style_context (self->message_label);
+
+  /* Undo what the previous message may have set */
+  gtk_style_context_remove_class (sc, "bubble_white");
+  gtk_style_context_remove_class (sc, "bubble_green");
+  gtk_style_context_remove_class (sc, "bubble_blue");
+  gtk_style_context_remove_class (sc, "bubble_purple");
+  gtk_widget_set_halign (self->content_grid, GTK_ALIGN_FILL);
+  gtk_widget_set_halign (self->message_label, GTK_ALIGN_FILL);
+  gtk_widget_set_hexpand (self->message_label, FALSE);
 
   if (direction == CHATTY_DIRECTION_IN) {
     gtk_style_context_add_class (sc, "bubble_white");
@@ -254,11 +285,13 @@ chatty_message_row_new (ChattyMessage  *message,
     gtk_label_set_xalign (GTK_LABEL (self->footer_label), 0);
   }
 
-  if (is_im || direction == CHATTY_DIRECTION_SYSTEM)
+  if (is_im || direction == CHATTY_DIRECTION_SYSTEM) {
     gtk_widget_hide (self->avatar_image);
-  else
+  } else {
     chatty_avatar_set_item (CHATTY_AVATAR (self->avatar_image),
                             chatty_message_get_user (message));
+    gtk_widget_show (self->avatar_image);
+  }
 
   g_signal_connect_object (message, "updated",
                            G_CALLBACK (message_row_update_message),
@@ -268,11 +301,13 @@ chatty_message_row_new (ChattyMessage  *message,
   /*
    * HACK: This is to delay showing the revealer child, so that it
    * is revealed after @self is added to some container.  Otherwise,
-   * the child revealing won’t be animated.
+   * the child revealing won’t be animated.  Reused rows are already
+   * revealed.
    */
-  g_idle_add (G_SOURCE_FUNC (message_row_show_revealer), self);
-
-  return GTK_WIDGET (self);
+  if (!gtk_revealer_get_reveal_child (GTK_REVEALER (self->revealer)))
+    g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
+                     G_SOURCE_FUNC (message_row_show_revealer),
+                     g_object_ref (self), g_object_unref);
 }
 
 ChattyMessage *
@@ -25,6 +25,10 @@ G_DECLARE_FINAL_TYPE (ChattyMessageRow, chatty_message_row, CHATTY, MESSAGE_ROW,
 GtkWidget     *chatty_message_row_new              (ChattyMessage  *message,
                                                     ChattyProtocol  protocol,
                                                     gboolean        is_im);
+void           chatty_message_row_set_item         (ChattyMessageRow *self,
+                                                    ChattyMessage    *message,
+                                                    ChattyProtocol    protocol,
+                                                    gboolean          is_im);
 ChattyMessage *chatty_message_row_get_item         (ChattyMessageRow *self);
 void           chatty_message_row_set_footer       (ChattyMessageRow *self,
                                                     GtkWidget        *footer);
@@ -15,6 +15,8 @@
 # include "config.h"
 #endif
 
+#include <string.h>
+
 #include "chatty-message.h"
 
 /**
@@ -22,6 +24,12 @@
  * @title: ChattyMessage
  * @short_description: An abstraction for chat messages
  * @include: "chatty-message.h"
+ *
+ * Lots of messages can be loaded at once, so they are kept small.
+ * The alias of the sender, which is the same for all the messages
+ * from a MUC participant, is shared by them as a #GRefString, freed
+ * with the last of them.  The text and uid of the message share a
+ * single allocation.
  */
 
 struct _ChattyMessage
@@ -29,10 +37,11 @@ struct _ChattyMessage
   GObject          parent_instance;
 
   ChattyItem      *user;
-  char            *user_alias;
-  char            *message;
-  char            *uid;
+  char            *user_alias;  /* GRefString */
+  char            *message;     /* The text, followed by the uid */
+  const char      *uid;         /* points into @message */
   char            *id;
+  char            *markup;
   ChattyMsgStatus  status;
   ChattyMsgDirection direction;
   time_t           time;
@@ -53,10 +62,10 @@ chatty_message_finalize (GObject *object)
   ChattyMessage *self = (ChattyMessage *)object;
 
   g_clear_object (&self->user);
+  g_clear_pointer (&self->user_alias, g_ref_string_release);
   g_free (self->message);
-  g_free (self->uid);
-  g_free (self->user_alias);
   g_free (self->id);
+  g_free (self->markup);
 
   G_OBJECT_CLASS (chatty_message_parent_class)->finalize (object);
 }
@@ -99,15 +108,29 @@ chatty_message_new (ChattyItem         *user,
                     ChattyMsgStatus     status)
 {
   ChattyMessage *self;
+  gsize text_len, uid_len;
 
   if (!timestamp)
     timestamp = time (NULL);
 
+  if (!message)
+    message = "";
+
+  text_len = strlen (message) + 1;
+  uid_len = uid ? strlen (uid) + 1 : 0;
+
   self = g_object_new (CHATTY_TYPE_MESSAGE, NULL);
   g_set_object (&self->user, user);
-  self->user_alias = g_strdup (user_alias);
-  self->message = g_strdup (message);
-  self->uid = g_strdup (uid);
+
+  if (user_alias)
+    self->user_alias = g_ref_string_new_intern (user_alias);
+
+  self->message = g_malloc (text_len + uid_len);
+  memcpy (self->message, message, text_len);
+
+  if (uid)
+    self->uid = memcpy (self->message + text_len, uid, uid_len);
+
   self->status = status;
   self->direction = direction;
   self->time = timestamp;
@@ -146,12 +169,45 @@ chatty_message_get_text (ChattyMessage *self)
 {
   g_return_val_if_fail (CHATTY_IS_MESSAGE (self), "");
 
-  if (!self->message)
-    return "";
-
   return self->message;
 }
 
+/**
+ * chatty_message_get_markup:
+ * @self: A #ChattyMessage
+ *
+ * Get the text of @self as Pango markup, as set
+ * with chatty_message_set_markup().
+ *
+ * Returns: (nullable): The markup, or %NULL if
+ * not yet set.
+ */
+const char *
+chatty_message_get_markup (ChattyMessage *self)
+{
+  g_return_val_if_fail (CHATTY_IS_MESSAGE (self), NULL);
+
+  return self->markup;
+}
+
+/**
+ * chatty_message_set_markup:
+ * @self: A #ChattyMessage
+ * @markup: (nullable): The markup of the text
+ *
+ * Cache the text of @self rendered as Pango markup,
+ * so that it is generated only once per message.
+ */
+void
+chatty_message_set_markup (ChattyMessage *self,
+                           const char    *markup)
+{
+  g_return_if_fail (CHATTY_IS_MESSAGE (self));
+
+  g_free (self->markup);
+  self->markup = g_strdup (markup);
+}
+
 
 ChattyItem *
 chatty_message_get_user (ChattyMessage *self)
@@ -161,6 +217,25 @@ chatty_message_get_user (ChattyMessage *self)
   return self->user;
 }
 
+/**
+ * chatty_message_set_user:
+ * @self: A #ChattyMessage
+ * @user: (nullable): A #ChattyItem
+ *
+ * Set the sender of @self.  Useful for messages
+ * loaded from history, which only know the alias
+ * of the sender.
+ */
+void
+chatty_message_set_user (ChattyMessage *self,
+                         ChattyItem    *user)
+{
+  g_return_if_fail (CHATTY_IS_MESSAGE (self));
+  g_return_if_fail (!user || CHATTY_IS_ITEM (user));
+
+  g_set_object (&self->user, user);
+}
+
 const char *
 chatty_message_get_user_alias (ChattyMessage *self)
 {
@@ -36,7 +36,12 @@ const char         *chatty_message_get_id          (ChattyMessage      *self);
 void                chatty_message_set_id          (ChattyMessage      *self,
                                                     const char         *id);
 const char         *chatty_message_get_text        (ChattyMessage      *self);
+const char         *chatty_message_get_markup      (ChattyMessage      *self);
+void                chatty_message_set_markup      (ChattyMessage      *self,
+                                                    const char         *markup);
 ChattyItem         *chatty_message_get_user        (ChattyMessage      *self);
+void                chatty_message_set_user        (ChattyMessage      *self,
+                                                    ChattyItem         *user);
 const char         *chatty_message_get_user_alias  (ChattyMessage      *self);
 time_t              chatty_message_get_time        (ChattyMessage      *self);
 ChattyMsgStatus     chatty_message_get_status      (ChattyMessage      *self);
@@ -535,6 +535,93 @@ chatty_settings_set_window_geometry (ChattySettings *self,
   g_settings_set (G_SETTINGS (self->settings), "window-size", "(ii)", geometry->width, geometry->height);
 }
 
+/**
+ * chatty_settings_get_history_synchronous:
+ * @self: A #ChattySettings
+ *
+ * Get how strictly the message history should be synced
+ * to disk.  The value can be used as the SQLite “synchronous”
+ * pragma.
+ *
+ * Returns: 0 (off), 1 (normal) or 2 (full).
+ */
+guint
+chatty_settings_get_history_synchronous (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 1);
+
+  return g_settings_get_enum (self->settings, "history-synchronous");
+}
+
+/**
+ * chatty_settings_get_history_cache_size:
+ * @self: A #ChattySettings
+ *
+ * Get the size of the message history page cache.
+ *
+ * Returns: The cache size in KiB.
+ */
+guint
+chatty_settings_get_history_cache_size (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 0);
+
+  return g_settings_get_uint (self->settings, "history-cache-size");
+}
+
+/**
+ * chatty_settings_get_history_mmap_size:
+ * @self: A #ChattySettings
+ *
+ * Get the maximum size of the message history that
+ * may be mapped to memory.
+ *
+ * Returns: The size in MiB, 0 if memory mapping is disabled.
+ */
+guint
+chatty_settings_get_history_mmap_size (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 0);
+
+  return g_settings_get_uint (self->settings, "history-mmap-size");
+}
+
+/**
+ * chatty_settings_get_history_temp_store:
+ * @self: A #ChattySettings
+ *
+ * Get where the temporary data of the message history
+ * should be kept.  The value can be used as the SQLite
+ * “temp_store” pragma.
+ *
+ * Returns: 0 (default), 1 (file) or 2 (memory).
+ */
+guint
+chatty_settings_get_history_temp_store (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 0);
+
+  return g_settings_get_enum (self->settings, "history-temp-store");
+}
+
+/**
+ * chatty_settings_get_history_checkpoint_interval:
+ * @self: A #ChattySettings
+ *
+ * Get the interval at which the message history
+ * write-ahead log should be checkpointed.
+ *
+ * Returns: The interval in seconds, 0 if periodic
+ * checkpoints are disabled.
+ */
+guint
+chatty_settings_get_history_checkpoint_interval (ChattySettings *self)
+{
+  g_return_val_if_fail (CHATTY_IS_SETTINGS (self), 0);
+
+  return g_settings_get_uint (self->settings, "history-checkpoint-interval");
+}
+
 const char *
 chatty_settings_get_country_iso_code (ChattySettings *self)
 {
@@ -49,6 +49,11 @@ void            chatty_settings_get_window_geometry          (ChattySettings *se
                                                               GdkRectangle   *geometry);
 void            chatty_settings_set_window_geometry          (ChattySettings *self,
                                                               GdkRectangle   *geometry);
+guint           chatty_settings_get_history_synchronous      (ChattySettings *self);
+guint           chatty_settings_get_history_cache_size       (ChattySettings *self);
+guint           chatty_settings_get_history_mmap_size        (ChattySettings *self);
+guint           chatty_settings_get_history_temp_store       (ChattySettings *self);
+guint           chatty_settings_get_history_checkpoint_interval (ChattySettings *self);
 const char     *chatty_settings_get_country_iso_code         (ChattySettings *self);
 void            chatty_settings_set_country_iso_code         (ChattySettings *self,
                                                               const char     *iso_code);
@@ -78,9 +78,18 @@ struct _ChattyWindow
   char          *chat_needle;
   GtkFilter     *chat_filter;
   GtkFilterListModel *filter_model;
+
+  /* account username -> set of buddy/room names with messages matching chat_needle */
+  GHashTable    *history_matches;
+  GCancellable  *search_cancellable;
+  guint          search_timeout_id;
 };
 
 
+#define HISTORY_SEARCH_LIMIT 100
+/* Search the history once the text hasn't changed for this long, in ms */
+#define HISTORY_SEARCH_DELAY 150
+
 G_DEFINE_TYPE (ChattyWindow, chatty_window, GTK_TYPE_APPLICATION_WINDOW)
 
 
@@ -302,6 +311,35 @@ window_notebook_after_switch_cb (GtkNotebook  *notebook,
 }
 
 
+static gboolean
+window_chat_history_matches (ChattyChat   *chat,
+                             ChattyWindow *self)
+{
+  PurpleConversation *conv;
+  PurpleBuddy *buddy;
+  GHashTable *names;
+  g_autofree char *who = NULL;
+
+  if (!self->history_matches)
+    return FALSE;
+
+  names = g_hash_table_lookup (self->history_matches,
+                               chatty_chat_get_username (chat));
+  if (!names)
+    return FALSE;
+
+  buddy = chatty_chat_get_purple_buddy (chat);
+  conv = chatty_chat_get_purple_conv (chat);
+
+  if (buddy)
+    who = chatty_utils_jabber_id_strip (purple_buddy_get_name (buddy));
+  else if (conv)
+    who = g_strdup (purple_conversation_get_name (conv));
+
+  return who && g_hash_table_contains (names, who);
+}
+
+
 static gboolean
 window_chat_name_matches (ChattyItem   *item,
                           ChattyWindow *self)
@@ -341,8 +379,11 @@ window_chat_name_matches (ChattyItem   *item,
   if (!self->chat_needle || !*self->chat_needle)
     return TRUE;
 
-  return chatty_item_matches (item, self->chat_needle,
-                              CHATTY_PROTOCOL_ANY, TRUE);
+  if (chatty_item_matches (item, self->chat_needle,
+                           CHATTY_PROTOCOL_ANY, TRUE))
+    return TRUE;
+
+  return window_chat_history_matches (CHATTY_CHAT (item), self);
 }
 
 
@@ -443,6 +484,73 @@ header_visible_child_cb (GObject      *sender,
 }
 
 
+static void
+window_search_history_cb (GObject      *object,
+                          GAsyncResult *result,
+                          gpointer      user_data)
+{
+  g_autoptr(ChattyWindow) self = user_data;
+  g_autoptr(GPtrArray) matches = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert (CHATTY_IS_WINDOW (self));
+
+  matches = chatty_history_search_finish (result, &error);
+
+  if (error) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+        !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+      g_warning ("Error searching history: %s", error->message);
+
+    return;
+  }
+
+  g_clear_pointer (&self->history_matches, g_hash_table_unref);
+  self->history_matches = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                 (GDestroyNotify)g_hash_table_unref);
+
+  for (guint i = 0; i < matches->len; i++) {
+    ChattyHistoryMatch *match = matches->pdata[i];
+    GHashTable *names;
+    char *name;
+
+    names = g_hash_table_lookup (self->history_matches, match->account);
+
+    if (!names) {
+      names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_hash_table_insert (self->history_matches, g_strdup (match->account), names);
+    }
+
+    if (match->room)
+      name = g_strdup (match->room);
+    else
+      name = chatty_utils_jabber_id_strip (match->who);
+
+    g_hash_table_add (names, name);
+  }
+
+  gtk_filter_changed (self->chat_filter, GTK_FILTER_CHANGE_DIFFERENT);
+}
+
+
+static gboolean
+window_search_timeout_cb (gpointer user_data)
+{
+  ChattyWindow *self = user_data;
+
+  g_assert (CHATTY_IS_WINDOW (self));
+
+  self->search_timeout_id = 0;
+  self->search_cancellable = g_cancellable_new ();
+  chatty_history_search_async (self->chat_needle, HISTORY_SEARCH_LIMIT, 0,
+                               self->search_cancellable,
+                               window_search_history_cb,
+                               g_object_ref (self));
+
+  return G_SOURCE_REMOVE;
+}
+
+
 static void
 window_search_changed_cb (ChattyWindow *self,
                           GtkEntry     *entry)
@@ -452,6 +560,17 @@ window_search_changed_cb (ChattyWindow *self,
   g_free (self->chat_needle);
   self->chat_needle = g_strdup (gtk_entry_get_text (entry));
 
+  /* Matches of the previous text no longer apply */
+  g_clear_handle_id (&self->search_timeout_id, g_source_remove);
+  g_cancellable_cancel (self->search_cancellable);
+  g_clear_object (&self->search_cancellable);
+  g_clear_pointer (&self->history_matches, g_hash_table_unref);
+
+  /* Don't search the history for every key typed */
+  if (self->chat_needle && *self->chat_needle)
+    self->search_timeout_id = g_timeout_add (HISTORY_SEARCH_DELAY,
+                                             window_search_timeout_cb, self);
+
   gtk_filter_changed (self->chat_filter, GTK_FILTER_CHANGE_DIFFERENT);
 }
 
@@ -1051,6 +1170,10 @@ chatty_window_dispose (GObject *object)
 {
   ChattyWindow *self = (ChattyWindow *)object;
 
+  g_clear_handle_id (&self->search_timeout_id, g_source_remove);
+  g_cancellable_cancel (self->search_cancellable);
+  g_clear_object (&self->search_cancellable);
+  g_clear_pointer (&self->history_matches, g_hash_table_unref);
   g_clear_object (&self->filter_model);
   g_clear_object (&self->chat_filter);
   g_clear_object (&self->manager);
@@ -59,7 +59,8 @@ struct _GtkSortListModel
   GtkSorter *sorter;
 
   GSequence *sorted; /* NULL if known unsorted */
-  GSequence *unsorted; /* NULL if known unsorted */
+  GSequence *unsorted; /* NULL if known unsorted, owns the entries */
+  GHashTable *entries; /* item => entry, NULL if known unsorted */
 };
 
 struct _GtkSortListModelClass
@@ -102,6 +103,10 @@ gtk_sort_list_model_get_n_items (GListModel *list)
   if (self->model == NULL)
     return 0;
 
+  /* Differs from the model while an item is moved */
+  if (self->sorted)
+    return g_sequence_get_length (self->sorted);
+
   return g_list_model_get_n_items (self->model);
 }
 
@@ -164,8 +169,11 @@ gtk_sort_list_model_remove_items (GtkSortListModel *self,
       start = MIN (start, pos);
       end = MIN (end, length_before - i - 1 - pos);
 
-      g_sequence_remove (entry->unsorted_iter);
+      if (g_hash_table_lookup (self->entries, entry->item) == entry)
+        g_hash_table_remove (self->entries, entry->item);
+
       g_sequence_remove (entry->sorted_iter);
+      g_sequence_remove (entry->unsorted_iter);
 
       unsorted_iter = next;
     }
@@ -211,6 +219,7 @@ gtk_sort_list_model_add_items (GtkSortListModel *self,
       entry->item = g_list_model_get_item (self->model, position + i);
       entry->unsorted_iter = g_sequence_insert_before (unsorted_end, entry);
       entry->sorted_iter = g_sequence_insert_sorted (self->sorted, entry, _sort_func, self->sorter);
+      g_hash_table_insert (self->entries, entry->item, entry);
       if (unmodified_start != NULL || unmodified_end != NULL)
         {
           pos = g_sequence_iter_get_position (entry->sorted_iter);
@@ -326,6 +335,7 @@ gtk_sort_list_model_clear_model (GtkSortListModel *self)
 
   g_signal_handlers_disconnect_by_func (self->model, gtk_sort_list_model_items_changed_cb, self);
   g_clear_object (&self->model);
+  g_clear_pointer (&self->entries, g_hash_table_unref);
   g_clear_pointer (&self->sorted, g_sequence_free);
   g_clear_pointer (&self->unsorted, g_sequence_free);
 }
@@ -457,8 +467,9 @@ gtk_sort_list_model_create_sequences (GtkSortListModel *self)
   if (self->sorter == NULL || self->model == NULL)
     return;
 
-  self->sorted = g_sequence_new (gtk_sort_list_entry_free);
-  self->unsorted = g_sequence_new (NULL);
+  self->sorted = g_sequence_new (NULL);
+  self->unsorted = g_sequence_new (gtk_sort_list_entry_free);
+  self->entries = g_hash_table_new (NULL, NULL);
 
   gtk_sort_list_model_add_items (self, 0, g_list_model_get_n_items (self->model), NULL, NULL);
 }
@@ -566,6 +577,7 @@ gtk_sort_list_model_set_sorter (GtkSortListModel *self,
       g_signal_connect (sorter, "changed", G_CALLBACK (gtk_sort_list_model_sorter_changed_cb), self);
     }
 
+  g_clear_pointer (&self->entries, g_hash_table_unref);
   g_clear_pointer (&self->unsorted, g_sequence_free);
   g_clear_pointer (&self->sorted, g_sequence_free);
   
@@ -593,3 +605,59 @@ gtk_sort_list_model_get_sorter (GtkSortListModel *self)
 
   return self->sorter;
 }
+
+/**
+ * gtk_sort_list_model_item_changed:
+ * @self: a #GtkSortListModel
+ * @item: (type GObject): an item in the model
+ *
+ * Tells @self that the sort order of @item may have changed, say,
+ * because a property the sorter compares has changed, while the
+ * order of all other items has not.
+ *
+ * Unlike gtk_sorter_changed(), which sorts the whole model again,
+ * only @item is moved to its new position, if it has one.  This
+ * is done in O(log n), and emits #GListModel::items-changed twice:
+ * once for removing @item from its old position and once for
+ * adding it to the new one.
+ *
+ * If @item is in the model more than once, only one of them is moved.
+ */
+void
+gtk_sort_list_model_item_changed (GtkSortListModel *self,
+                                  gpointer          item)
+{
+  GtkSortListEntry *entry;
+  GSequenceIter *iter;
+  guint position;
+
+  g_return_if_fail (GTK_IS_SORT_LIST_MODEL (self));
+  g_return_if_fail (G_IS_OBJECT (item));
+
+  if (self->sorted == NULL)
+    return;
+
+  entry = g_hash_table_lookup (self->entries, item);
+
+  if (entry == NULL)
+    return;
+
+  /* Nothing to do if it's still between its neighbours */
+  iter = g_sequence_iter_prev (entry->sorted_iter);
+  if (iter == entry->sorted_iter ||
+      _sort_func (g_sequence_get (iter), entry, self->sorter) < 0)
+    {
+      iter = g_sequence_iter_next (entry->sorted_iter);
+      if (g_sequence_iter_is_end (iter) ||
+          _sort_func (entry, g_sequence_get (iter), self->sorter) < 0)
+        return;
+    }
+
+  position = g_sequence_iter_get_position (entry->sorted_iter);
+  g_sequence_remove (entry->sorted_iter);
+  g_list_model_items_changed (G_LIST_MODEL (self), position, 1, 0);
+
+  entry->sorted_iter = g_sequence_insert_sorted (self->sorted, entry, _sort_func, self->sorter);
+  position = g_sequence_iter_get_position (entry->sorted_iter);
+  g_list_model_items_changed (G_LIST_MODEL (self), position, 0, 1);
+}
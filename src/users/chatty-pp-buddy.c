@@ -42,6 +42,7 @@ struct _ChattyPpBuddy
   PurpleConversation *conv;
 
   PurpleConvChatBuddy *chat_buddy;
+  gboolean             owns_chat_buddy;
 
   gpointer          *avatar_data; /* purple icon data */
   PurpleStoredImage *pp_avatar;
@@ -404,6 +405,14 @@ chatty_pp_buddy_dispose (GObject *object)
   g_clear_pointer (&self->username, g_free);
   g_clear_pointer (&self->name, g_free);
 
+  if (self->owns_chat_buddy) {
+    g_free (self->chat_buddy->name);
+    g_free (self->chat_buddy->alias);
+    g_free (self->chat_buddy->alias_key);
+    g_clear_pointer (&self->chat_buddy, g_free);
+    self->owns_chat_buddy = FALSE;
+  }
+
   G_OBJECT_CLASS (chatty_pp_buddy_parent_class)->dispose (object);
 }
 
@@ -509,6 +518,36 @@ chatty_pp_buddy_set_chat (ChattyPpBuddy      *self,
 }
 
 
+/**
+ * chatty_pp_buddy_keep_chat_buddy:
+ * @self: a #ChattyPpBuddy
+ *
+ * Make @self keep a copy of its #PurpleConvChatBuddy,
+ * so that it can still be used after the user has left
+ * the chat and libpurple has freed it.
+ */
+void
+chatty_pp_buddy_keep_chat_buddy (ChattyPpBuddy *self)
+{
+  PurpleConvChatBuddy *cb;
+
+  g_return_if_fail (CHATTY_IS_PP_BUDDY (self));
+
+  if (!self->chat_buddy || self->owns_chat_buddy)
+    return;
+
+  cb = g_new0 (PurpleConvChatBuddy, 1);
+  cb->name = g_strdup (self->chat_buddy->name);
+  cb->alias = g_strdup (self->chat_buddy->alias);
+  cb->alias_key = g_strdup (self->chat_buddy->alias_key);
+  cb->buddy = self->chat_buddy->buddy;
+  cb->flags = self->chat_buddy->flags;
+
+  self->chat_buddy = cb;
+  self->owns_chat_buddy = TRUE;
+}
+
+
 PurpleBuddy *
 chatty_pp_buddy_get_buddy (ChattyPpBuddy *self)
 {
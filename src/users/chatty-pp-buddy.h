@@ -29,6 +29,7 @@ PurpleAccount   *chatty_pp_buddy_get_account   (ChattyPpBuddy *self);
 PurpleConversation *chatty_pp_buddy_get_chat   (ChattyPpBuddy *self);
 void             chatty_pp_buddy_set_chat      (ChattyPpBuddy      *self,
                                                 PurpleConversation *conv);
+void             chatty_pp_buddy_keep_chat_buddy (ChattyPpBuddy    *self);
 PurpleBuddy     *chatty_pp_buddy_get_buddy      (ChattyPpBuddy *self);
 const char      *chatty_pp_buddy_get_id        (ChattyPpBuddy *self);
 ChattyContact   *chatty_pp_buddy_get_contact   (ChattyPpBuddy *self);
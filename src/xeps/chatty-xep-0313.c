@@ -7,6 +7,7 @@
 
 #define G_LOG_DOMAIN "chatty-xeps"
 
+#include <string.h>
 #include <glib.h>
 #include <prpl.h>
 #include <xmlnode.h>
@@ -28,10 +29,22 @@
 #define NS_DATA "jabber:x:data"
 #define NS_RSM "http://jabber.org/protocol/rsm"
 
+/* The latest IM and room message ids of the account loaded in the filter */
+#define SEEN_IDS_MAX      100000
+/* About 1% false positives with 10 bits per id, for twice the ids loaded */
+#define SEEN_IDS_PER_ID   20
+#define SEEN_IDS_MIN_BITS (1 << 16)
+#define SEEN_IDS_HASHES   7
+
 typedef struct {
   PurpleConvMessage p;
   char *id;
   PurpleConversationType type;
+  gint64 when_ms;
+  // Not shown until history tells it's new, see cb_mam_msg_added()
+  gboolean held;
+  char *account;
+  char *from; // who to write the held message as
 } MamMsg;
 
 typedef struct {
@@ -46,13 +59,34 @@ typedef struct {
   int           max;
 } MAMQuery;
 
+/*
+ * Bloom filter of the ids of the latest messages stored for the
+ * account, so that most new messages are known to be new without a
+ * query.  It's only used once @ready, ie. it has the latest ids of
+ * the history.  Older messages, up to @since, are always checked.
+ */
+typedef struct {
+  guint64      *bits;
+  guint32       n_bits;
+  time_t        since;
+  // (room, id) pairs stored until the filter is loaded
+  GPtrArray    *early;
+  GCancellable *cancellable;
+  gboolean      ready;
+  guint         n_checked;
+  guint         n_queried;
+} MamSeenIds;
+
 /* FIXME: What if purple becomes multithreaded 8-O */
 typedef struct {
   GHashTable *qs;
   time_t   last_ts;
   MamMsg  *cur_msg;
+  MamMsg  *cur_new;
   char    *cur_oid;
   char    *ns;
+  MamSeenIds seen;
+  GCancellable *cancellable;
 } MamCtx;
 
 static GHashTable *ht_mam_ctx = NULL;
@@ -60,13 +94,16 @@ static GHashTable *ht_mam_ctx = NULL;
 /**
  * mamq_free:
  *
- * Free MAMQuery structure and its internals
+ * Free MAMQuery structure and its internals.
+ * Also ends the history batch opened for the query,
+ * committing the messages received so far.
  */
 static void
 mamq_free(void *ptr)
 {
   MAMQuery *mamq = (MAMQuery*)ptr;
   if(ptr==NULL) return;
+  chatty_history_end_batch();
   g_free(mamq->id);
   g_free(mamq->to);
   g_free(mamq->with);
@@ -91,9 +128,202 @@ mamm_free(void *ptr)
   g_free(mm->p.who);
   g_free(mm->p.what);
   g_free(mm->p.alias);
+  g_free(mm->account);
+  g_free(mm->from);
   g_free(mm);
 }
 
+/**
+ * Seen Message IDs API
+ */
+
+/*
+ * Hash @room and @id (64 bit FNV-1a), @room being NULL for IM.
+ * Both halves of the result are used as independent hashes
+ * to get the SEEN_IDS_HASHES bits (Kirsch-Mitzenmacher).
+ */
+static guint64
+seen_ids_hash(const char *room, const char *id)
+{
+  const guint64 prime = G_GUINT64_CONSTANT(0x100000001b3);
+  guint64 h = G_GUINT64_CONSTANT(0xcbf29ce484222325);
+
+  // Keep IM and room ids apart, and the room apart from the id
+  h = (h ^ (room ? 'c' : 'i')) * prime;
+  for(const char *c = room; c && *c; c++)
+    h = (h ^ (guchar)*c) * prime;
+  h = h * prime;
+  for(const char *c = id; *c; c++)
+    h = (h ^ (guchar)*c) * prime;
+
+  return h;
+}
+
+/**
+ * seen_ids_add:
+ * @seen: MamSeenIds of the account
+ * @room: room jid for groupchat messages, NULL for IM
+ * @id: message id as stored in history
+ *
+ * Remember that a message with @id has been stored.
+ */
+static void
+seen_ids_add(MamSeenIds *seen, const char *room, const char *id)
+{
+  guint64 h;
+  guint32 h1, h2;
+
+  if(id == NULL)
+    return;
+
+  if(seen->bits == NULL) {
+    // Added once the filter is sized, see cb_seen_ids_loaded()
+    g_ptr_array_add(seen->early, g_strdup(room));
+    g_ptr_array_add(seen->early, g_strdup(id));
+    return;
+  }
+
+  h = seen_ids_hash(room, id);
+  h1 = h & 0xffffffff;
+  h2 = h >> 32;
+  for(guint i = 0; i < SEEN_IDS_HASHES; i++) {
+    guint32 bit = (h1 + i * h2) & (seen->n_bits - 1);
+    seen->bits[bit / 64] |= G_GUINT64_CONSTANT(1) << (bit % 64);
+  }
+}
+
+/**
+ * seen_ids_maybe_contains:
+ *
+ * Returns FALSE if the message with @id, sent at @when (0 if now),
+ * is definitely not stored, TRUE if it may be (or if the filter
+ * isn't ready yet, or the message is older than the ids in the
+ * filter), in which case the history has to be checked.
+ */
+static gboolean
+seen_ids_maybe_contains(MamSeenIds *seen, const char *room, const char *id,
+                        time_t when)
+{
+  guint64 h;
+  guint32 h1, h2;
+
+  seen->n_checked++;
+
+  if(!seen->ready || id == NULL || (when && when <= seen->since)) {
+    seen->n_queried++;
+    return TRUE;
+  }
+
+  h = seen_ids_hash(room, id);
+  h1 = h & 0xffffffff;
+  h2 = h >> 32;
+  for(guint i = 0; i < SEEN_IDS_HASHES; i++) {
+    guint32 bit = (h1 + i * h2) & (seen->n_bits - 1);
+    if(!(seen->bits[bit / 64] & (G_GUINT64_CONSTANT(1) << (bit % 64))))
+      return FALSE;
+  }
+
+  seen->n_queried++;
+  return TRUE;
+}
+
+static void
+cb_seen_ids_loaded(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  g_autofree char *account = user_data;
+  GPtrArray *im_uids = NULL;
+  GPtrArray *chat_uids = NULL;
+  GError *error = NULL;
+  time_t since = 0;
+  MamCtx *mamc;
+
+  if(!chatty_history_get_uids_finish(result, &im_uids, &chat_uids, &since, &error)) {
+    if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning("Failed to load message ids for %s: %s", account, error->message);
+    g_error_free(error);
+    return;
+  }
+
+  // Not cancelled, so the context is still there
+  mamc = g_hash_table_lookup(ht_mam_ctx, account);
+  if(mamc != NULL) {
+    MamSeenIds *seen = &mamc->seen;
+    guint n_ids = im_uids->len + chat_uids->len / 2;
+
+    // Size the filter for the ids loaded, and as many new ones
+    seen->n_bits = SEEN_IDS_MIN_BITS;
+    while(seen->n_bits < G_MAXUINT32 / 2 && seen->n_bits / SEEN_IDS_PER_ID < n_ids)
+      seen->n_bits <<= 1;
+    seen->bits = g_new0(guint64, seen->n_bits / 64);
+    seen->since = since;
+
+    for(guint i = 0; i < im_uids->len; i++)
+      seen_ids_add(seen, NULL, im_uids->pdata[i]);
+    for(guint i = 0; i + 1 < chat_uids->len; i += 2)
+      seen_ids_add(seen, chat_uids->pdata[i], chat_uids->pdata[i + 1]);
+    // Messages stored meanwhile
+    for(guint i = 0; i + 1 < seen->early->len; i += 2)
+      seen_ids_add(seen, seen->early->pdata[i], seen->early->pdata[i + 1]);
+    g_ptr_array_set_size(seen->early, 0);
+
+    seen->ready = TRUE;
+    g_debug("Loaded %u message ids for %s in %u bits", n_ids, account, seen->n_bits);
+  }
+
+  g_ptr_array_unref(im_uids);
+  g_ptr_array_unref(chat_uids);
+}
+
+/**
+ * seen_ids_init:
+ *
+ * Load the latest ids in history, the filter is sized and filled
+ * once they are loaded.  Until that's done all the lookups go to
+ * history.
+ */
+static void
+seen_ids_init(MamSeenIds *seen, const char *account)
+{
+  seen->early = g_ptr_array_new_with_free_func(g_free);
+  seen->cancellable = g_cancellable_new();
+  chatty_history_get_uids_async(account, SEEN_IDS_MAX, seen->cancellable,
+                                cb_seen_ids_loaded, g_strdup(account));
+}
+
+static void
+seen_ids_clear(MamSeenIds *seen)
+{
+  if(seen->n_checked)
+    g_debug("%u of %u message ids checked in history",
+            seen->n_queried, seen->n_checked);
+  g_cancellable_cancel(seen->cancellable);
+  g_clear_object(&seen->cancellable);
+  g_clear_pointer(&seen->bits, g_free);
+  g_clear_pointer(&seen->early, g_ptr_array_unref);
+}
+
+/**
+ * chatty_mam_stamp_to_ms:
+ * @stamp: XEP-0082 DateTime string, eg. delay stamp
+ *
+ * Returns the time of @stamp in milliseconds, keeping the
+ * fraction of second which purple_str_to_time() drops.
+ */
+static gint64
+chatty_mam_stamp_to_ms(const char *stamp)
+{
+  gint64 ms = (gint64)purple_str_to_time(stamp, TRUE, NULL, NULL, NULL) * 1000;
+  const char *frac = strchr(stamp, '.');
+
+  if(frac) {
+    int scale = 100;
+    for(frac++; g_ascii_isdigit(*frac) && scale > 0; frac++, scale /= 10)
+      ms += (*frac - '0') * scale;
+  }
+
+  return ms;
+}
+
 /**
  * MAM Context Management API
  */
@@ -112,6 +342,9 @@ mamc_free(void *ptr)
   g_free(mamc->cur_oid);
   mamm_free(mamc->cur_msg);
   g_hash_table_destroy(mamc->qs);
+  seen_ids_clear(&mamc->seen);
+  g_cancellable_cancel(mamc->cancellable);
+  g_clear_object(&mamc->cancellable);
   g_free(mamc);
 }
 
@@ -128,6 +361,7 @@ mamc_new(void)
                                    g_str_equal,
                                    g_free,
                                    mamq_free);
+  mamc->cancellable = g_cancellable_new();
   return mamc;
 }
 
@@ -162,6 +396,7 @@ chatty_mam_ctx_add(PurpleAccount *pa)
     mamc = mamc_new();
     g_hash_table_insert(ht_mam_ctx,
                         g_strdup(purple_account_get_username(pa)), mamc);
+    seen_ids_init(&mamc->seen, purple_account_get_username(pa));
   }
   return mamc;
 }
@@ -330,7 +565,7 @@ cb_mam_query_result(JabberStream *js, const char *from,
     g_debug("Error for MAM Query: %s", xml);
     g_free(xml);
   }
-  // No follow up, clean up the context
+  // No follow up, clean up the context, this also commits the history batch
   g_hash_table_remove(mamc->qs, mamq->id);
 }
 
@@ -442,6 +677,60 @@ chatty_mam_is_enabled(PurpleAccount *pa, const char *room)
   return TRUE;
 }
 
+/**
+ * chatty_mam_query_start:
+ * @mamq: MAMQuery to send
+ * @dt: (transfer full) (nullable): GDateTime to query messages from
+ *
+ * Sets the start of the query and sends it. If @dt is NULL
+ * the messages are queried from the last stop point of the
+ * account, or from last week.
+ */
+static void
+chatty_mam_query_start(MAMQuery *mamq, GDateTime *dt)
+{
+  PurpleAccount *pa = purple_connection_get_account(mamq->js->gc);
+  MamCtx *mamc = chatty_mam_ctx_get(pa);
+
+  if(dt == NULL) {
+    if(mamc->last_ts > 0 && mamq->to == NULL) {
+      dt = g_date_time_new_from_unix_utc(mamc->last_ts);
+    } else {
+      // last week should be good enough for the start
+      GDateTime *now = g_date_time_new_now_utc();
+      dt = g_date_time_add_days(now, -7);
+      g_date_time_unref(now);
+    }
+  }
+  mamq->start = g_date_time_format(dt,"%FT%TZ");
+  g_date_time_unref(dt);
+  g_debug ("Querying by %s from %s after %s", mamq->id, mamq->start, mamq->after);
+  // Request MAM backlog
+  chatty_mam_query_archive(mamq);
+}
+
+static void
+cb_mam_room_last_message_time(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  MAMQuery *mamq = user_data;
+  GError *error = NULL;
+  time_t ts;
+
+  ts = chatty_history_get_chat_last_message_time_finish(result, &error);
+  if(g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    g_error_free(error);
+    return;
+  }
+  if(error) {
+    g_debug("Failed to get last message time of %s: %s", mamq->to, error->message);
+    g_error_free(error);
+  }
+
+  // Not cancelled, so the query is still there
+  // For MUC we're getting all messages so last history ts is ok
+  chatty_mam_query_start(mamq, ts > 0 ? g_date_time_new_from_unix_utc(ts) : NULL);
+}
+
 /**
  * cb_chatty_mam_bare_info:
  * @pc: PurpleConnection on which bare was discovered
@@ -460,7 +749,6 @@ cb_chatty_mam_bare_info(PurpleConnection *pc,
   if(g_strcmp0(var, NS_MAMv2) == 0) {
     JabberStream  *js = purple_connection_get_protocol_data (pc);
     char *qid = jabber_get_next_id(js);
-    GDateTime *dt = NULL;
     PurpleAccount *pa = purple_connection_get_account(pc);
     // Init CTX
     MamCtx *mamc = chatty_mam_ctx_add(pa);
@@ -472,37 +760,26 @@ cb_chatty_mam_bare_info(PurpleConnection *pc,
     if(!chatty_mam_is_enabled(pa, bare))
       return; // ok, if you say so
 
+    // Messages of the backlog are stored in batches until the query is done
+    chatty_history_begin_batch();
     mamq = g_new0(MAMQuery, 1);
     mamq->js = js;
     mamq->id = g_strdup(qid);
+    g_hash_table_insert(mamc->qs, qid, mamq);
+    g_debug ("Server supports MAM %s on %s", var, bare);
     if(g_strcmp0(bare, purple_account_get_username(pa))) {
-      time_t ts = chatty_history_get_chat_last_message_time(
-                            purple_account_get_username(pa), bare);
-      // For MUC we're getting all messages so last history ts is ok
-      if(ts>0)
-        dt = g_date_time_new_from_unix_utc(ts);
       // This becomes indication of the foreign archive, eg MUC
       mamq->to = g_strdup(bare);
-    } else
+      // Query from the last message of the room once it's known
+      chatty_history_get_chat_last_message_time_async(purple_account_get_username(pa),
+                                                      bare, mamc->cancellable,
+                                                      cb_mam_room_last_message_time,
+                                                      mamq);
+    } else {
       // Get last stop point on the account
       mamc->last_ts = purple_account_get_int(pa, "mam_last_ts", 0);
-    g_hash_table_insert(mamc->qs, qid, mamq);
-    if(dt == NULL) {
-      if(mamc->last_ts > 0 && mamq->to == NULL) {
-        dt = g_date_time_new_from_unix_utc(mamc->last_ts);
-      } else {
-        // last week should be good enough for the start
-        GDateTime *now = g_date_time_new_now_utc();
-        dt = g_date_time_add_days(now, -7);
-        g_date_time_unref(now);
-      }
+      chatty_mam_query_start(mamq, NULL);
     }
-    mamq->start = g_date_time_format(dt,"%FT%TZ");
-    g_date_time_unref(dt);
-    g_debug ("Server supports MAM %s on %s; Querying by %s from %s after %s",
-                                    var, bare, qid, mamq->start, mamq->after);
-    // Request MAM backlog
-    chatty_mam_query_archive(mamq);
     // Also - request preferences and correct them if required
     chatty_mam_query_prefs(pc, mamq->to);
   }
@@ -570,9 +847,16 @@ cb_chatty_mam_msg_wrote(PurpleAccount *pa, PurpleConvMessage *pcm,
   MamCtx *mamc = chatty_mam_ctx_get(pa);
   if(mamc == NULL)
     return;
+  if(mamc->cur_new) {
+    // Held message which history has just stored, see cb_mam_msg_added()
+    pcm->flags = mamc->cur_new->p.flags | PURPLE_MESSAGE_NO_LOG;
+    *uuid = g_strdup(mamc->cur_new->id);
+    return;
+  }
   if(mamc->cur_oid && pcm->flags & PURPLE_MESSAGE_SEND) {
     // copy origin_id into uuid to be able to dedup outgoing messages
     *uuid = g_strdup(mamc->cur_oid);
+    seen_ids_add(&mamc->seen, type == PURPLE_CONV_TYPE_CHAT ? pcm->alias : NULL, *uuid);
     g_free(mamc->cur_oid);
     mamc->cur_oid = NULL;
     return;
@@ -594,6 +878,9 @@ cb_chatty_mam_msg_wrote(PurpleAccount *pa, PurpleConvMessage *pcm,
     mamc->cur_msg->p.flags = pcm->flags;
     pcm->flags |= PURPLE_MESSAGE_NO_LOG;
   }
+  // Don't show it until history tells it's new
+  if(mamc->cur_msg->held)
+    pcm->flags |= PURPLE_MESSAGE_INVISIBLE;
   mamc->cur_msg->type = type;
   mamc->cur_msg->p.alias = g_strdup(pcm->alias);
   mamc->cur_msg->p.when = pcm->when;
@@ -604,6 +891,80 @@ cb_chatty_mam_msg_wrote(PurpleAccount *pa, PurpleConvMessage *pcm,
             mamc->cur_msg->p.alias, mamc->cur_msg->type, mamc->cur_msg->p.flags);
 }
 
+/**
+ * chatty_mam_msg_hold:
+ * @cur: the MamMsg being parsed
+ * @peer: the full jid of the peer
+ * @user: the username of the account
+ *
+ * Copies the parsed message to show it later.
+ *
+ * Returns: (transfer full): a new MamMsg, free with mamm_free()
+ */
+static MamMsg *
+chatty_mam_msg_hold(MamMsg *cur, const char *peer, const char *user)
+{
+  MamMsg *mm = g_new0(MamMsg, 1);
+
+  mm->id = g_strdup(cur->id);
+  mm->type = cur->type;
+  mm->when_ms = cur->when_ms;
+  mm->held = TRUE;
+  mm->account = g_strdup(user);
+  mm->p.what = g_strdup(cur->p.what);
+  mm->p.alias = g_strdup(cur->p.alias);
+  mm->p.who = g_strdup(cur->p.who);
+  mm->p.flags = cur->p.flags;
+  mm->p.when = cur->p.when;
+  // Chats are written by the nick of the occupant
+  if(mm->type == PURPLE_CONV_TYPE_CHAT && peer && strchr(peer, '/'))
+    mm->from = g_strdup(strchr(peer, '/') + 1);
+  else
+    mm->from = g_strdup(peer);
+
+  return mm;
+}
+
+/**
+ * cb_mam_msg_added:
+ *
+ * Shows the held message if history did not have it yet.
+ */
+static void
+cb_mam_msg_added(GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  MamMsg *mm = user_data;
+  PurpleAccount *pa;
+  PurpleConversation *conv = NULL;
+  MamCtx *mamc = NULL;
+  GError *error = NULL;
+
+  if(!chatty_history_add_message_if_new_finish(result, &error)) {
+    if(error == NULL)
+      g_debug("Message id %s for acc %s is already stored", mm->id, mm->account);
+    else if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning("Failed to store message id %s: %s", mm->id, error->message);
+    g_clear_error(&error);
+    mamm_free(mm);
+    return;
+  }
+
+  pa = purple_accounts_find(mm->account, "prpl-jabber");
+  if(pa) {
+    mamc = chatty_mam_ctx_get(pa);
+    conv = purple_find_conversation_with_account(mm->type, mm->p.alias, pa);
+  }
+  // The message is stored already, write it without storing it again
+  if(conv && mm->p.what && mamc && mamc->cur_msg == NULL) {
+    mamc->cur_new = mm;
+    purple_conversation_write(conv, mm->from, mm->p.what,
+                              (mm->p.flags & ~PURPLE_MESSAGE_SEND) | PURPLE_MESSAGE_RECV,
+                              mm->p.when);
+    mamc->cur_new = NULL;
+  }
+  mamm_free(mm);
+}
+
 static gboolean
 cb_chatty_mam_msg_receiving(PurpleAccount *pa, char **who, char **msg,
                             PurpleConversation *conv, PurpleMessageFlags *flags)
@@ -635,7 +996,10 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
   const char *query_id;
   const char *stanza_id = NULL;
   const char *stamp = NULL;
+  const char *origin_id = NULL;
   const char *user;
+  gboolean maybe_stored = FALSE;
+  time_t when = 0;
   PurpleMessageFlags flags = 0;
   JabberStream  *js = purple_connection_get_protocol_data (pc);
   PurpleAccount *pa = purple_connection_get_account (pc);
@@ -657,7 +1021,6 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
   user = purple_account_get_username (pa);
 
   if(node_result != NULL || node_sid != NULL) {
-    int dts;
     const char *msg_type;
     if(node_result != NULL) {
       xmlnode    *node_fwd;
@@ -700,17 +1063,15 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
       peer = from;
       g_debug ("Received forward id %s from %s", stanza_id, peer);
     }
-    // check history and drop the dup
+    // Messages which may be stored already are held until history tells,
+    // new messages are mostly known without asking it
     msg_type = xmlnode_get_attrib(message, "type");
-    if(from && msg_type && g_strcmp0(msg_type, "groupchat") == 0) {
-      dts = get_chat_timestamp_for_uuid(stanza_id, from);
-    } else {
-      dts = get_im_timestamp_for_uuid(stanza_id, user);
-    }
-    if(dts < INT_MAX) {
-      g_debug ("Message id %s for acc %s is already stored on %d", stanza_id, user, dts);
-      return TRUE; // note - true means stop processing
-    }
+    if(stamp)
+      when = chatty_mam_stamp_to_ms(stamp) / 1000;
+    if(from && msg_type && g_strcmp0(msg_type, "groupchat") == 0)
+      maybe_stored = seen_ids_maybe_contains(&mamc->seen, from, stanza_id, when);
+    else
+      maybe_stored = seen_ids_maybe_contains(&mamc->seen, NULL, stanza_id, when);
     // Swap from/to for outgoing messages
     peer = xmlnode_get_attrib (message, "from");
     if(peer) {
@@ -734,14 +1095,9 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
       // For sent messages need to attempt dedup based on origin-id
       xmlnode *node_oid = xmlnode_get_child_with_namespace (message, "origin-id", NS_SIDv0);
       if(node_oid) {
-        const char *uuid = xmlnode_get_attrib (node_oid, "id");
-        if(uuid) {
-          dts = get_im_timestamp_for_uuid(uuid, user);
-          if(dts < INT_MAX) {
-            g_debug ("Message id %s for acc %s is already stored on %d", uuid, user, dts);
-            return TRUE; // note - true means stop processing
-          }
-        }
+        origin_id = xmlnode_get_attrib (node_oid, "id");
+        if(origin_id && seen_ids_maybe_contains(&mamc->seen, NULL, origin_id, when))
+          maybe_stored = TRUE;
       }
     }
   } else {
@@ -761,13 +1117,38 @@ cb_chatty_mam_msg_received (PurpleConnection *pc,
   mamc->cur_msg->id = (char*)stanza_id;
   mamc->cur_msg->p.who = (char*)peer;
   mamc->cur_msg->p.flags = flags;
-  if(stamp)
-    mamc->cur_msg->p.when = purple_str_to_time (stamp, TRUE, NULL, NULL, NULL);
+  mamc->cur_msg->held = maybe_stored && stanza_id != NULL;
+  if(stamp) {
+    mamc->cur_msg->when_ms = chatty_mam_stamp_to_ms (stamp);
+    mamc->cur_msg->p.when = mamc->cur_msg->when_ms / 1000;
+  }
   jabber_message_parse (js, message);
-  if(stanza_id != NULL || mamc->cur_msg->p.what != NULL)
-    chatty_history_add_message (pc->account, &(mamc->cur_msg->p),
-                                (char**)&stanza_id, mamc->cur_msg->type,
-                                NULL);
+  if(mamc->cur_msg->held) {
+    // Check and store in one go, it's shown once it's known to be new
+    MamMsg *held = chatty_mam_msg_hold(mamc->cur_msg, peer, user);
+
+    chatty_history_add_message_if_new_async(pc->account, &held->p, stanza_id,
+                                            origin_id, held->type,
+                                            stamp ? held->when_ms : 0,
+                                            mamc->cancellable,
+                                            cb_mam_msg_added, held);
+    seen_ids_add(&mamc->seen,
+                 held->type == PURPLE_CONV_TYPE_CHAT ? held->p.alias : NULL,
+                 stanza_id);
+  } else if(stanza_id != NULL || mamc->cur_msg->p.what != NULL) {
+    // Keep the server time to the millisecond, to order the backlog exactly
+    if(stamp)
+      chatty_history_add_message_ms (pc->account, &(mamc->cur_msg->p),
+                                     (char**)&stanza_id, mamc->cur_msg->type,
+                                     mamc->cur_msg->when_ms);
+    else
+      chatty_history_add_message (pc->account, &(mamc->cur_msg->p),
+                                  (char**)&stanza_id, mamc->cur_msg->type,
+                                  NULL);
+    seen_ids_add(&mamc->seen,
+                 mamc->cur_msg->type == PURPLE_CONV_TYPE_CHAT ? mamc->cur_msg->p.alias : NULL,
+                 stanza_id);
+  }
   // Update last timestamp for account's archive
   if(mamq != NULL && mamq->to == NULL)
     mamc->last_ts = mamc->cur_msg->p.when;
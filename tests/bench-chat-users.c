@@ -0,0 +1,273 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* bench-chat-users.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Benchmarks joining big rooms, run with ‘meson benchmark’.
+ *
+ * A room of occupants, a few of them owners, moderators or members, is
+ * joined by adding all of them to a ChattyChat, and the time until the
+ * list of users is sorted is measured.  The same is done with a
+ * GtkSortListModel over an unsorted list, which is how the users were
+ * kept before.  Then users joining one by one, and users whose role
+ * changes, are timed in the joined room.  The results are printed as
+ * JSON on stdout.
+ *
+ * The room sizes, in occupants, can be given as arguments, eg.
+ * ‘bench-chat-users 100 10000’.
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#define N_SAMPLES  5
+#define N_CHANGES  100
+
+#include <stdlib.h>
+#include <purple.h>
+
+#include "bench-utils.h"
+#include "contrib/gtk.h"
+#include "chatty-chat.h"
+#include "users/chatty-pp-buddy.h"
+
+static const guint default_sizes[] = { 100, 1000, 10000 };
+
+/* The order of users in ChattyChat */
+static gint
+sort_chat_buddy (ChattyPpBuddy *a,
+                 ChattyPpBuddy *b)
+{
+  ChattyUserFlag flag_a, flag_b;
+
+  flag_a = chatty_pp_buddy_get_flags (a);
+  flag_b = chatty_pp_buddy_get_flags (b);
+
+  if (flag_a == flag_b)
+    return chatty_item_compare (CHATTY_ITEM (a), CHATTY_ITEM (b));
+
+  return flag_a > flag_b ? -1 : 1;
+}
+
+static PurpleConvChatBuddy *
+chat_buddy_new (guint i,
+                guint size)
+{
+  PurpleConvChatBuddy *cb;
+
+  cb = g_new0 (PurpleConvChatBuddy, 1);
+  /* Servers send occupants in no particular order */
+  cb->name = g_strdup_printf ("user%05u@example.com", (guint)(((guint64)i * 7919) % size));
+
+  if (i % 500 == 0)
+    cb->flags = PURPLE_CBFLAGS_FOUNDER;
+  else if (i % 100 == 0)
+    cb->flags = PURPLE_CBFLAGS_OP;
+  else if (i % 10 == 0)
+    cb->flags = PURPLE_CBFLAGS_VOICE;
+
+  return cb;
+}
+
+static void
+chat_buddy_free (PurpleConvChatBuddy *cb)
+{
+  g_free (cb->name);
+  g_free (cb);
+}
+
+static GList *
+create_room (guint size)
+{
+  GList *users = NULL;
+
+  /* The sizes used are prime to 7919, so that the names are unique */
+  for (guint i = 0; i < size; i++)
+    users = g_list_prepend (users, chat_buddy_new (i, size));
+
+  return users;
+}
+
+/* Time in ms to join a room of @users with ChattyChat */
+static double
+bench_join_chat (GList *users)
+{
+  g_autoptr(GArray) samples = NULL;
+
+  samples = g_array_new (FALSE, FALSE, sizeof (double));
+
+  for (guint i = 0; i < N_SAMPLES; i++) {
+    g_autoptr(ChattyChat) chat = NULL;
+    gint64 start;
+    double value;
+
+    chat = g_object_new (CHATTY_TYPE_CHAT, NULL);
+
+    start = g_get_monotonic_time ();
+    chatty_chat_add_users (chat, users);
+    /* Getting the users adds the ones that joined at once */
+    chatty_chat_get_users (chat);
+    value = bench_elapsed_ms (start);
+
+    g_assert_cmpint (g_list_model_get_n_items (chatty_chat_get_users (chat)), ==,
+                     g_list_length (users));
+    g_array_append_val (samples, value);
+  }
+
+  return bench_median (samples);
+}
+
+/* Time in ms to join a room of @users with a sorted list model, as before */
+static double
+bench_join_sort_model (GList *users)
+{
+  g_autoptr(GArray) samples = NULL;
+
+  samples = g_array_new (FALSE, FALSE, sizeof (double));
+
+  for (guint i = 0; i < N_SAMPLES; i++) {
+    g_autoptr(GtkSortListModel) sorted = NULL;
+    g_autoptr(GtkSorter) sorter = NULL;
+    g_autoptr(GListStore) store = NULL;
+    g_autoptr(GPtrArray) buddies = NULL;
+    gint64 start;
+    double value;
+
+    store = g_list_store_new (CHATTY_TYPE_PP_BUDDY);
+    sorter = gtk_custom_sorter_new ((GCompareDataFunc)sort_chat_buddy, NULL, NULL);
+    sorted = gtk_sort_list_model_new (G_LIST_MODEL (store), sorter);
+
+    start = g_get_monotonic_time ();
+    buddies = g_ptr_array_new_with_free_func (g_object_unref);
+
+    for (GList *node = users; node; node = node->next)
+      g_ptr_array_add (buddies, g_object_new (CHATTY_TYPE_PP_BUDDY,
+                                              "chat-buddy", node->data, NULL));
+
+    g_list_store_splice (store, 0, 0, buddies->pdata, buddies->len);
+    value = bench_elapsed_ms (start);
+
+    g_assert_cmpint (g_list_model_get_n_items (G_LIST_MODEL (sorted)), ==,
+                     g_list_length (users));
+    g_array_append_val (samples, value);
+  }
+
+  return bench_median (samples);
+}
+
+/* Times in µs for a user to join, and for the role of a user to change */
+static void
+bench_changes (GList  *users,
+               guint   size,
+               double *join_us,
+               double *role_us)
+{
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(GPtrArray) joined = NULL;
+  GList *node;
+  gint64 start;
+
+  chat = g_object_new (CHATTY_TYPE_CHAT, NULL);
+  chatty_chat_add_users (chat, users);
+  chatty_chat_get_users (chat);
+
+  joined = g_ptr_array_new_with_free_func ((GDestroyNotify)chat_buddy_free);
+
+  for (guint i = 0; i < N_CHANGES; i++) {
+    PurpleConvChatBuddy *cb;
+
+    cb = g_new0 (PurpleConvChatBuddy, 1);
+    cb->name = g_strdup_printf ("late%05u@example.com", i * 7919 % N_CHANGES);
+    g_ptr_array_add (joined, cb);
+  }
+
+  start = g_get_monotonic_time ();
+
+  for (guint i = 0; i < joined->len; i++) {
+    GList list = { joined->pdata[i], NULL, NULL };
+
+    chatty_chat_add_users (chat, &list);
+    chatty_chat_get_users (chat);
+  }
+
+  *join_us = (g_get_monotonic_time () - start) / (double)N_CHANGES;
+
+  node = users;
+  start = g_get_monotonic_time ();
+
+  for (guint i = 0; i < N_CHANGES && node; i++, node = node->next) {
+    PurpleConvChatBuddy *cb = node->data;
+
+    cb->flags ^= PURPLE_CBFLAGS_OP;
+    chatty_chat_emit_user_changed (chat, cb->name);
+  }
+
+  *role_us = (g_get_monotonic_time () - start) / (double)MIN (N_CHANGES, size);
+
+  g_clear_object (&chat);
+}
+
+static void
+bench_run (GString *json,
+           guint    size)
+{
+  GList *users;
+  double chat_ms, sort_model_ms, join_us, role_us;
+
+  users = create_room (size);
+  chat_ms = bench_join_chat (users);
+  sort_model_ms = bench_join_sort_model (users);
+  bench_changes (users, size, &join_us, &role_us);
+  g_list_free_full (users, (GDestroyNotify)chat_buddy_free);
+
+  bench_json_begin_run (json, "\"occupants\": %u", size);
+  bench_json_add_result (json, "join_room", chat_ms, "ms");
+  bench_json_add_result (json, "join_room_sort_model", sort_model_ms, "ms");
+  bench_json_add_result (json, "speedup", sort_model_ms / chat_ms, "x");
+  bench_json_add_result (json, "user_join", join_us, "µs");
+  bench_json_add_result (json, "role_change", role_us, "µs");
+  bench_json_end_run (json);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GArray) sizes = NULL;
+  GString *json;
+
+  sizes = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  if (!bench_parse_sizes (sizes, argc, argv, 1)) {
+    g_printerr ("Usage: %s [OCCUPANTS…]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  for (guint i = 0; i < sizes->len; i++) {
+    if (g_array_index (sizes, guint, i) % 7919 == 0) {
+      g_printerr ("Usage: %s [OCCUPANTS…]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!sizes->len)
+    g_array_append_vals (sizes, default_sizes, G_N_ELEMENTS (default_sizes));
+
+  json = bench_json_new ("chat-users");
+  bench_json_begin_runs (json, "runs");
+
+  for (guint i = 0; i < sizes->len; i++)
+    bench_run (json, g_array_index (sizes, guint, i));
+
+  bench_json_end_runs (json);
+  bench_json_print_free (json);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,304 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* bench-chat-view.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Benchmarks the time to first paint of a chat, run with ‘meson benchmark’.
+ *
+ * A window with a message list, set up like the one in ChattyChatView,
+ * is shown empty.  Then a page of history is added to the chat, and the
+ * time until the frame clock has painted it is measured.  The page is
+ * added once as a batch, and once one message at a time, which is how
+ * history was loaded before.  The number of message rows created, and
+ * the time to scroll through the whole list, are measured too.  The
+ * results are printed as JSON on stdout.
+ *
+ * The page sizes can be given as arguments, eg. ‘bench-chat-view 20 5000’.
+ * A display is required, the benchmark is skipped otherwise.
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#define N_SAMPLES  7
+#define EXIT_SKIP  77
+
+#include <stdlib.h>
+#include <gtk/gtk.h>
+
+#include "bench-utils.h"
+#include "chatty-avatar.h"
+#include "chatty-chat.h"
+#include "chatty-message-list-view.h"
+#include "chatty-message-row.h"
+
+static const guint default_sizes[] = { 20, 200, 2000 };
+
+typedef struct {
+  GtkWidget  *window;
+  GtkWidget  *scrolled_window;
+  GtkWidget  *list;
+  ChattyChat *chat;
+  guint       n_changed;
+  gboolean    painted;
+} View;
+
+static void
+view_bind_message_row (ChattyMessageRow *row,
+                       ChattyMessage    *message,
+                       guint             position,
+                       gpointer          user_data)
+{
+  chatty_message_row_set_item (row, message, CHATTY_PROTOCOL_XMPP, TRUE);
+  chatty_message_row_set_alias (row, chatty_message_get_user_alias (message));
+}
+
+static void
+view_after_paint_cb (GdkFrameClock *frame_clock,
+                     View          *view)
+{
+  view->painted = TRUE;
+}
+
+static void
+view_changed_cb (View *view)
+{
+  view->n_changed++;
+}
+
+static void
+view_wait_for_paint (View *view)
+{
+  view->painted = FALSE;
+  gtk_widget_queue_draw (view->window);
+
+  while (!view->painted)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+view_init (View *view)
+{
+  GdkFrameClock *frame_clock;
+
+  view->chat = chatty_chat_new_purple_chat (NULL);
+  g_signal_connect_swapped (view->chat, "changed",
+                            G_CALLBACK (view_changed_cb), view);
+
+  view->window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  gtk_window_set_default_size (GTK_WINDOW (view->window), 360, 720);
+
+  view->scrolled_window = gtk_scrolled_window_new (NULL, NULL);
+  view->list = chatty_message_list_view_new ();
+  gtk_widget_set_valign (view->list, GTK_ALIGN_END);
+  gtk_container_add (GTK_CONTAINER (view->scrolled_window), view->list);
+  gtk_container_add (GTK_CONTAINER (view->window), view->scrolled_window);
+
+  chatty_message_list_view_bind_model (CHATTY_MESSAGE_LIST_VIEW (view->list),
+                                       chatty_chat_get_messages (view->chat),
+                                       view_bind_message_row, view);
+
+  gtk_widget_show_all (view->window);
+
+  frame_clock = gtk_widget_get_frame_clock (view->window);
+  g_signal_connect (frame_clock, "after-paint",
+                    G_CALLBACK (view_after_paint_cb), view);
+
+  view_wait_for_paint (view);
+}
+
+static void
+view_destroy (View *view)
+{
+  gtk_widget_destroy (view->window);
+  g_object_unref (view->chat);
+}
+
+static GPtrArray *
+create_page (guint size)
+{
+  GPtrArray *messages;
+  time_t start;
+
+  messages = g_ptr_array_new_full (size, g_object_unref);
+  start = time (NULL) - size;
+
+  for (guint i = 0; i < size; i++) {
+    g_autofree char *text = NULL;
+    g_autofree char *uid = NULL;
+
+    text = g_strdup_printf ("Message %u of the page, long enough to be wrapped "
+                            "on a narrow screen like that of a phone", i);
+    uid = g_strdup_printf ("uid-%u", i);
+    g_ptr_array_add (messages,
+                     chatty_message_new (NULL, "alice@example.com", text, uid, start + i,
+                                         i % 3 ? CHATTY_DIRECTION_IN : CHATTY_DIRECTION_OUT,
+                                         0));
+  }
+
+  return messages;
+}
+
+/* Scroll from the top to the bottom, a page at a time */
+static double
+view_scroll_through (View *view)
+{
+  GtkAdjustment *vadjustment;
+  gint64 start;
+  double value, page_size;
+
+  vadjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (view->scrolled_window));
+  gtk_adjustment_set_value (vadjustment, 0);
+  view_wait_for_paint (view);
+
+  start = g_get_monotonic_time ();
+
+  do {
+    value = gtk_adjustment_get_value (vadjustment);
+    page_size = gtk_adjustment_get_page_size (vadjustment);
+    gtk_adjustment_set_value (vadjustment, value + page_size);
+    view_wait_for_paint (view);
+  } while (gtk_adjustment_get_value (vadjustment) > value);
+
+  return bench_elapsed_ms (start);
+}
+
+/*
+ * Time from adding @messages to an open chat until they are painted.
+ * If @scroll_time is not %NULL, the list is then scrolled through.
+ */
+static double
+bench_first_paint (GPtrArray *messages,
+                   gboolean   batch,
+                   guint     *n_changed,
+                   guint     *n_rows,
+                   double    *scroll_time)
+{
+  View view = { 0 };
+  gint64 start;
+  double value;
+
+  view_init (&view);
+
+  start = g_get_monotonic_time ();
+
+  /* The page is sorted oldest first */
+  if (batch) {
+    chatty_chat_prepend_messages (view.chat, messages);
+  } else {
+    for (guint i = messages->len; i > 0; i--)
+      chatty_chat_prepend_message (view.chat, messages->pdata[i - 1]);
+  }
+
+  view_wait_for_paint (&view);
+  value = bench_elapsed_ms (start);
+
+  g_assert_cmpint (g_list_model_get_n_items (chatty_chat_get_messages (view.chat)),
+                   ==, messages->len);
+  *n_changed = view.n_changed;
+
+  if (scroll_time)
+    *scroll_time = view_scroll_through (&view);
+
+  *n_rows = chatty_message_list_view_get_n_rows (CHATTY_MESSAGE_LIST_VIEW (view.list));
+  view_destroy (&view);
+
+  return value;
+}
+
+static void
+bench_run (GString *json,
+           guint    size)
+{
+  g_autoptr(GPtrArray) messages = NULL;
+
+  messages = create_page (size);
+
+  bench_json_begin_run (json, "\"messages\": %u", size);
+
+  for (guint mode = 0; mode < 2; mode++) {
+    g_autoptr(GArray) samples = NULL;
+    g_autoptr(GArray) scroll_samples = NULL;
+    g_autofree char *first_paint = NULL;
+    g_autofree char *changed_signals = NULL;
+    const char *name;
+    guint n_changed = 0, n_rows = 0;
+
+    name = mode ? "single" : "batch";
+    samples = g_array_new (FALSE, FALSE, sizeof (double));
+    scroll_samples = g_array_new (FALSE, FALSE, sizeof (double));
+
+    for (guint i = 0; i < N_SAMPLES; i++) {
+      double value, scroll_time;
+
+      value = bench_first_paint (messages, !mode, &n_changed, &n_rows,
+                                 mode ? NULL : &scroll_time);
+      g_array_append_val (samples, value);
+
+      if (!mode)
+        g_array_append_val (scroll_samples, scroll_time);
+    }
+
+    first_paint = g_strdup_printf ("%s_first_paint_p50", name);
+    changed_signals = g_strdup_printf ("%s_changed_signals", name);
+    bench_json_add_result (json, first_paint, bench_median (samples), "ms");
+    bench_json_add_result (json, changed_signals, n_changed, "count");
+
+    if (!mode) {
+      bench_json_add_result (json, "scroll_through_p50", bench_median (scroll_samples), "ms");
+      bench_json_add_result (json, "rows_created", n_rows, "count");
+    }
+  }
+
+  bench_json_end_run (json);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GtkCssProvider) css_provider = NULL;
+  g_autoptr(GArray) sizes = NULL;
+  GString *json;
+
+  if (!gtk_init_check (&argc, &argv)) {
+    g_printerr ("No display, skipping\n");
+    return EXIT_SKIP;
+  }
+
+  sizes = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  if (!bench_parse_sizes (sizes, argc, argv, 1)) {
+    g_printerr ("Usage: %s [MESSAGES…]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!sizes->len)
+    g_array_append_vals (sizes, default_sizes, G_N_ELEMENTS (default_sizes));
+
+  /* Message rows are styled by the application */
+  css_provider = gtk_css_provider_new ();
+  gtk_css_provider_load_from_resource (css_provider, "/sm/puri/chatty/css/style.css");
+  gtk_style_context_add_provider_for_screen (gdk_screen_get_default (),
+                                             GTK_STYLE_PROVIDER (css_provider),
+                                             GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+  g_type_ensure (CHATTY_TYPE_AVATAR);
+
+  json = bench_json_new ("chat-view");
+  bench_json_begin_runs (json, "runs");
+
+  for (guint i = 0; i < sizes->len; i++)
+    bench_run (json, g_array_index (sizes, guint, i));
+
+  bench_json_end_runs (json);
+  bench_json_print_free (json);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,505 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* bench-history.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Benchmarks of the history storage, run with ‘meson benchmark’.
+ *
+ * For each database size a synthetic history is generated, spread
+ * over several accounts with as many IM conversations as rooms, and
+ * the main history operations are timed.  The results are printed as
+ * JSON on stdout, so that they can be compared between builds.
+ *
+ * The database sizes (in rows) can be given as arguments, eg.
+ * ‘bench-history 10000 5000000’.
+ *
+ * The startup load of the last message of every contact is also
+ * timed, with one query per contact as the buddy list used to do,
+ * and with a single query for all of them.  The numbers of contacts
+ * can be given after ‘--contacts’, eg. ‘bench-history --contacts 500’,
+ * in which case only those are run.
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#define N_ACCOUNTS                 4
+#define MESSAGES_PER_CONVERSATION  100
+#define PAGE_SIZE                  20
+#define PAGES_PER_CONVERSATION     5
+#define N_SAMPLES                  200
+#define MESSAGES_PER_CONTACT       5
+
+#include <stdlib.h>
+#include <glib/gstdio.h>
+
+#include "bench-utils.h"
+#include "purple-init.h"
+#include "chatty-history.h"
+
+static const guint default_rows[] = { 10000, 100000, 1000000 };
+static const guint default_contacts[] = { 100, 1000, 10000 };
+
+typedef struct {
+  guint     rows;
+  guint     conversations;
+  time_t    start_time;
+  GRand    *rand;
+  GString  *json;
+} Bench;
+
+static void
+task_done_cb (GObject      *object,
+              GAsyncResult *result,
+              gpointer      user_data)
+{
+  GAsyncResult **out = user_data;
+
+  *out = g_object_ref (result);
+}
+
+/* Run the main loop until the async call completes */
+static GAsyncResult *
+wait_for_result (GAsyncResult **result)
+{
+  while (!*result)
+    g_main_context_iteration (NULL, TRUE);
+
+  return *result;
+}
+
+/* Jobs are done in order, so queued writes are done once this returns */
+static void
+wait_for_history (void)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+
+  chatty_history_get_statement_stats_async (NULL, task_done_cb, &result);
+  g_assert_true (chatty_history_get_statement_stats_finish (wait_for_result (&result),
+                                                            NULL, NULL, NULL));
+}
+
+/*
+ * Conversation @i is an IM conversation if even, a room otherwise,
+ * and belongs to account @i % N_ACCOUNTS.
+ */
+static char *
+conversation_account (guint i)
+{
+  return g_strdup_printf ("account-%u@example.com", i % N_ACCOUNTS);
+}
+
+static char *
+conversation_name (guint i)
+{
+  if (i % 2 == 0)
+    return g_strdup_printf ("buddy-%u@example.com", i);
+
+  return g_strdup_printf ("room-%u@conference.example.com", i);
+}
+
+static char *
+message_uid (guint conversation,
+             guint message)
+{
+  return g_strdup_printf ("%08x-%04x-4000-8000-%012x", conversation, message, conversation * message);
+}
+
+static void
+bench_insert (Bench *bench)
+{
+  gint64 start;
+  double ms;
+  guint n = 0;
+
+  start = g_get_monotonic_time ();
+  chatty_history_begin_batch ();
+
+  for (guint i = 0; n < bench->rows; i++) {
+    g_autofree char *account = conversation_account (i);
+    g_autofree char *name = conversation_name (i);
+
+    for (guint j = 0; j < MESSAGES_PER_CONVERSATION && n < bench->rows; j++, n++) {
+      g_autofree char *text = g_strdup_printf ("Message %u of conversation %u, padded to "
+                                               "the length of a usual chat message", j, i);
+      g_autofree char *uid = message_uid (i, j);
+      time_t time_stamp = bench->start_time + j;
+      int direction = g_rand_boolean (bench->rand) ? 1 : -1;
+
+      if (i % 2 == 0) {
+        chatty_history_add_im_message (text, direction, account, name, uid, time_stamp);
+      } else {
+        g_autofree char *who = g_strdup_printf ("%s/nick-%u", name, j % 7);
+
+        chatty_history_add_chat_message (text, direction, account, who, uid,
+                                         time_stamp, name);
+      }
+    }
+
+    bench->conversations = i + 1;
+  }
+
+  chatty_history_end_batch ();
+  wait_for_history ();
+  ms = bench_elapsed_ms (start);
+
+  bench_json_add_result (bench->json, "insert_time", ms, "ms");
+  bench_json_add_result (bench->json, "insert_throughput", bench->rows / (ms / 1000.0), "rows/s");
+}
+
+/* Scroll back through the history of random conversations, page by page */
+static void
+bench_paging (Bench *bench)
+{
+  g_autoptr(GArray) first = g_array_new (FALSE, FALSE, sizeof (double));
+  g_autoptr(GArray) next = g_array_new (FALSE, FALSE, sizeof (double));
+
+  for (guint n = 0; n < N_SAMPLES; n++) {
+    ChattyHistoryCursor cursor;
+    g_autofree char *account = NULL;
+    g_autofree char *name = NULL;
+    guint i;
+
+    i = g_rand_int_range (bench->rand, 0, bench->conversations);
+    account = conversation_account (i);
+    name = conversation_name (i);
+
+    for (guint page = 0; page < PAGES_PER_CONVERSATION; page++) {
+      g_autoptr(GAsyncResult) result = NULL;
+      g_autoptr(GPtrArray) messages = NULL;
+      gint64 start;
+      double ms;
+
+      start = g_get_monotonic_time ();
+
+      if (i % 2 == 0)
+        chatty_history_load_im_async (account, name, NULL, page ? &cursor : NULL,
+                                      PAGE_SIZE, NULL, task_done_cb, &result);
+      else
+        chatty_history_load_chat_async (account, name, NULL, page ? &cursor : NULL,
+                                        PAGE_SIZE, NULL, task_done_cb, &result);
+
+      messages = chatty_history_load_finish (wait_for_result (&result), &cursor, NULL);
+      ms = bench_elapsed_ms (start);
+      g_assert_nonnull (messages);
+
+      g_array_append_val (page ? next : first, ms);
+    }
+  }
+
+  bench_json_add_percentiles (bench->json, "first_page_latency", first, "ms");
+  bench_json_add_percentiles (bench->json, "next_page_latency", next, "ms");
+}
+
+static void
+bench_last_message (Bench *bench)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  g_autoptr(GArray) samples = g_array_new (FALSE, FALSE, sizeof (double));
+  GHashTable *ims = NULL, *chats = NULL;
+  gint64 start;
+
+  /* One conversation at a time */
+  for (guint n = 0; n < N_SAMPLES; n++) {
+    g_autoptr(GAsyncResult) message_result = NULL;
+    g_autoptr(ChattyMessage) message = NULL;
+    g_autofree char *account = NULL;
+    g_autofree char *name = NULL;
+    guint i;
+    double ms;
+
+    i = g_rand_int_range (bench->rand, 0, (bench->conversations + 1) / 2) * 2;
+    account = conversation_account (i);
+    name = conversation_name (i);
+
+    start = g_get_monotonic_time ();
+    chatty_history_get_im_last_message_async (account, name, NULL, task_done_cb, &message_result);
+    message = chatty_history_get_im_last_message_finish (wait_for_result (&message_result), NULL);
+    ms = bench_elapsed_ms (start);
+
+    g_assert_nonnull (message);
+    g_array_append_val (samples, ms);
+  }
+
+  bench_json_add_percentiles (bench->json, "last_message_latency", samples, "ms");
+
+  /* All of them, as done at startup */
+  start = g_get_monotonic_time ();
+  chatty_history_get_last_messages_async (NULL, task_done_cb, &result);
+  g_assert_true (chatty_history_get_last_messages_finish (wait_for_result (&result),
+                                                          &ims, &chats, NULL));
+  bench_json_add_result (bench->json, "all_last_messages_time", bench_elapsed_ms (start), "ms");
+
+  g_hash_table_unref (ims);
+  g_hash_table_unref (chats);
+}
+
+/* What the MAM receive path does for every archived message */
+static void
+bench_dedup (Bench *bench)
+{
+  g_autoptr(GArray) hits = g_array_new (FALSE, FALSE, sizeof (double));
+  g_autoptr(GArray) misses = g_array_new (FALSE, FALSE, sizeof (double));
+  PurpleConvMessage pcm = { NULL };
+  PurpleAccount *pa;
+
+  pa = g_new0 (PurpleAccount, 1);
+  pcm.flags = PURPLE_MESSAGE_RECV;
+  pcm.when = bench->start_time;
+
+  for (guint n = 0; n < N_SAMPLES; n++) {
+    g_autoptr(GAsyncResult) hit_result = NULL;
+    g_autoptr(GAsyncResult) miss_result = NULL;
+    g_autofree char *account = NULL;
+    g_autofree char *known = NULL;
+    g_autofree char *unknown = NULL;
+    g_autofree char *name = NULL;
+    gint64 start;
+    double ms;
+    guint i;
+
+    i = g_rand_int_range (bench->rand, 0, (bench->conversations + 1) / 2) * 2;
+    account = conversation_account (i);
+    name = conversation_name (i);
+    known = message_uid (i, g_rand_int_range (bench->rand, 0, MESSAGES_PER_CONVERSATION));
+    unknown = g_uuid_string_random ();
+    pa->username = account;
+    pcm.who = name;
+    /* (timestamp, message) is unique */
+    pcm.what = unknown;
+
+    /* Checked, and added if new, in one job */
+    start = g_get_monotonic_time ();
+    chatty_history_add_message_if_new_async (pa, &pcm, known, NULL, PURPLE_CONV_TYPE_IM, 0,
+                                             NULL, task_done_cb, &hit_result);
+    g_assert_false (chatty_history_add_message_if_new_finish (wait_for_result (&hit_result), NULL));
+    ms = bench_elapsed_ms (start);
+    g_array_append_val (hits, ms);
+
+    start = g_get_monotonic_time ();
+    chatty_history_add_message_if_new_async (pa, &pcm, unknown, NULL, PURPLE_CONV_TYPE_IM, 0,
+                                             NULL, task_done_cb, &miss_result);
+    g_assert_true (chatty_history_add_message_if_new_finish (wait_for_result (&miss_result), NULL));
+    ms = bench_elapsed_ms (start);
+    g_array_append_val (misses, ms);
+  }
+
+  g_free (pa);
+
+  bench_json_add_percentiles (bench->json, "dedup_hit_latency", hits, "ms");
+  bench_json_add_percentiles (bench->json, "dedup_miss_latency", misses, "ms");
+}
+
+static void
+bench_delete (Bench *bench)
+{
+  g_autofree char *im_account = conversation_account (0);
+  g_autofree char *im_name = conversation_name (0);
+  g_autofree char *chat_account = conversation_account (1);
+  g_autofree char *chat_name = conversation_name (1);
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  chatty_history_delete_im (im_account, im_name);
+  wait_for_history ();
+  bench_json_add_result (bench->json, "delete_im_time", bench_elapsed_ms (start), "ms");
+
+  start = g_get_monotonic_time ();
+  chatty_history_delete_chat (chat_account, chat_name);
+  wait_for_history ();
+  bench_json_add_result (bench->json, "delete_chat_time", bench_elapsed_ms (start), "ms");
+}
+
+static void
+fill_contacts (guint contacts)
+{
+  time_t time_stamp;
+
+  time_stamp = time (NULL) - contacts * MESSAGES_PER_CONTACT;
+
+  chatty_history_begin_batch ();
+
+  for (guint i = 0; i < contacts; i++) {
+    g_autofree char *who = g_strdup_printf ("buddy-%u@example.com", i);
+
+    for (guint j = 0; j < MESSAGES_PER_CONTACT; j++) {
+      g_autofree char *text = g_strdup_printf ("Message %u to buddy %u", j, i);
+      g_autofree char *uid = g_uuid_string_random ();
+
+      chatty_history_add_im_message (text, j % 2 ? 1 : -1, "account@example.com",
+                                     who, uid, time_stamp++);
+    }
+  }
+
+  chatty_history_end_batch ();
+  wait_for_history ();
+}
+
+/* What the buddy list did at startup: one query per contact */
+static double
+bench_per_contact (guint contacts)
+{
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+
+  for (guint i = 0; i < contacts; i++) {
+    g_autoptr(GAsyncResult) result = NULL;
+    g_autoptr(ChattyMessage) message = NULL;
+    g_autofree char *who = g_strdup_printf ("buddy-%u@example.com", i);
+
+    chatty_history_get_im_last_message_async ("account@example.com", who, NULL,
+                                              task_done_cb, &result);
+    message = chatty_history_get_im_last_message_finish (wait_for_result (&result), NULL);
+    g_assert_nonnull (message);
+  }
+
+  return bench_elapsed_ms (start);
+}
+
+/* What is done now: one query for all of them */
+static double
+bench_bulk (guint contacts)
+{
+  g_autoptr(GAsyncResult) result = NULL;
+  GHashTable *ims = NULL, *chats = NULL;
+  GHashTable *table;
+  gint64 start;
+  double ms;
+
+  start = g_get_monotonic_time ();
+  chatty_history_get_last_messages_async (NULL, task_done_cb, &result);
+  g_assert_true (chatty_history_get_last_messages_finish (wait_for_result (&result),
+                                                          &ims, &chats, NULL));
+  ms = bench_elapsed_ms (start);
+
+  table = g_hash_table_lookup (ims, "account@example.com");
+  g_assert_nonnull (table);
+  g_assert_cmpint (g_hash_table_size (table), ==, contacts);
+
+  g_hash_table_unref (ims);
+  g_hash_table_unref (chats);
+
+  return ms;
+}
+
+static void
+bench_startup (Bench      *bench,
+               guint       contacts,
+               const char *dir)
+{
+  g_autofree char *db_path = NULL;
+  double per_contact, bulk;
+
+  db_path = g_build_filename (dir, "bench-history.db", NULL);
+  g_remove (db_path);
+
+  chatty_history_open (dir, "bench-history.db");
+  fill_contacts (contacts);
+
+  /* Same warm cache for both */
+  per_contact = bench_per_contact (contacts);
+  bulk = bench_bulk (contacts);
+
+  bench_json_begin_run (bench->json, "\"contacts\": %u", contacts);
+  bench_json_add_result (bench->json, "per_contact_time", per_contact, "ms");
+  bench_json_add_result (bench->json, "bulk_time", bulk, "ms");
+  bench_json_add_result (bench->json, "speedup", per_contact / bulk, "x");
+  bench_json_end_run (bench->json);
+
+  chatty_history_close ();
+  g_remove (db_path);
+}
+
+static void
+bench_run (Bench      *bench,
+           const char *dir)
+{
+  g_autofree char *db_path = NULL;
+
+  db_path = g_build_filename (dir, "bench-history.db", NULL);
+  g_remove (db_path);
+
+  chatty_history_open (dir, "bench-history.db");
+
+  bench_json_begin_run (bench->json, "\"rows\": %u", bench->rows);
+
+  bench_insert (bench);
+  bench_paging (bench);
+  bench_last_message (bench);
+  bench_dedup (bench);
+  bench_delete (bench);
+
+  bench_json_end_run (bench->json);
+
+  chatty_history_close ();
+  g_remove (db_path);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autofree char *dir = NULL;
+  g_autoptr(GArray) rows = NULL;
+  g_autoptr(GArray) contacts = NULL;
+  Bench bench = { 0 };
+
+  rows = g_array_new (FALSE, FALSE, sizeof (guint));
+  contacts = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  if (argc > 1 && g_str_equal (argv[1], "--contacts")) {
+    if (!bench_parse_sizes (contacts, argc, argv, 2)) {
+      g_printerr ("Usage: %s [ROWS…] | --contacts [CONTACTS…]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    if (!contacts->len)
+      g_array_append_vals (contacts, default_contacts, G_N_ELEMENTS (default_contacts));
+  } else {
+    if (!bench_parse_sizes (rows, argc, argv, 1)) {
+      g_printerr ("Usage: %s [ROWS…] | --contacts [CONTACTS…]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+    if (!rows->len) {
+      g_array_append_vals (rows, default_rows, G_N_ELEMENTS (default_rows));
+      g_array_append_vals (contacts, default_contacts, G_N_ELEMENTS (default_contacts));
+    }
+  }
+
+  test_purple_init ();
+
+  dir = g_dir_make_tmp ("chatty-bench-XXXXXX", NULL);
+  g_assert_nonnull (dir);
+
+  bench.rand = g_rand_new_with_seed (42);
+  bench.start_time = time (NULL) - MESSAGES_PER_CONVERSATION;
+  bench.json = bench_json_new ("history");
+  bench_json_begin_runs (bench.json, "runs");
+
+  for (guint i = 0; i < rows->len; i++) {
+    bench.rows = g_array_index (rows, guint, i);
+    bench_run (&bench, dir);
+  }
+
+  bench_json_end_runs (bench.json);
+  bench_json_begin_runs (bench.json, "startup_runs");
+
+  for (guint i = 0; i < contacts->len; i++)
+    bench_startup (&bench, g_array_index (contacts, guint, i), dir);
+
+  bench_json_end_runs (bench.json);
+  bench_json_print_free (bench.json);
+  g_rand_free (bench.rand);
+  g_rmdir (dir);
+
+  return EXIT_SUCCESS;
+}
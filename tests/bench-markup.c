@@ -0,0 +1,169 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* bench-markup.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Benchmarks converting message text to markup, run with ‘meson benchmark’.
+ *
+ * A corpus of messages is made of plain ASCII text, text with emoji,
+ * links, HTML and multi-line text, in about the proportions seen in
+ * chats.  It's converted with chatty_markup_from_text(), and with the
+ * chain of libpurple functions that was used before, and the throughput
+ * of both is compared.  The results are printed as JSON on stdout.
+ *
+ * The corpus sizes, in messages, can be given as arguments, eg.
+ * ‘bench-markup 1000 100000’.
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#define N_SAMPLES  5
+
+#include <stdlib.h>
+#include <string.h>
+#include <purple.h>
+
+#include "bench-utils.h"
+#include "chatty-markup.h"
+
+static const guint default_sizes[] = { 1000, 10000, 100000 };
+
+static const char *corpus_texts[] = {
+  "ok",
+  "See you tomorrow at the station, I'll be there around nine",
+  "Did you get the files I sent yesterday? Let me know if anything is missing.",
+  "Haha 😂😂 that's great 👍",
+  "Привет! Как дела? Всё хорошо 🙂",
+  "Have a look at https://source.puri.sm/Librem5/chatty/-/merge_requests?state=opened&sort=updated",
+  "Docs are on www.example.com/docs (see the FAQ), or mail support@example.com",
+  "Call me at +1 555 0100 12 when you land",
+  "<b>Important:</b> the meeting moved to 3pm &amp; room B<br>Thanks!",
+  "First line\nSecond line\nThird line with a link xmpp:room@conference.example.com?join\n",
+  "Quote: \"1 < 2 && 3 > 2\" isn't news",
+};
+
+/* How message text was converted to markup before chatty_markup_from_text() */
+static char *
+purple_markup_from_text (const char *text)
+{
+  g_autofree char *nl_2_br = NULL;
+  g_autofree char *striped = NULL;
+  g_autofree char *escaped = NULL;
+  g_autofree char *linkified = NULL;
+  char *result;
+
+  nl_2_br = purple_strdup_withhtml (text);
+  striped = purple_markup_strip_html (nl_2_br);
+  escaped = purple_markup_escape_text (striped, -1);
+  linkified = purple_markup_linkify (escaped);
+  purple_markup_html_to_xhtml (linkified, &result, NULL);
+
+  return result;
+}
+
+static GPtrArray *
+create_corpus (guint  size,
+               gsize *n_bytes)
+{
+  GPtrArray *corpus;
+
+  corpus = g_ptr_array_new_full (size, g_free);
+  *n_bytes = 0;
+
+  for (guint i = 0; i < size; i++) {
+    const char *text;
+
+    /* Mostly short plain text, as in most chats */
+    if (i % 2)
+      text = corpus_texts[i % 4];
+    else
+      text = corpus_texts[(i / 2) % G_N_ELEMENTS (corpus_texts)];
+
+    g_ptr_array_add (corpus, g_strdup (text));
+    *n_bytes += strlen (text);
+  }
+
+  return corpus;
+}
+
+/* Throughput in MB/s of converting each text in @corpus with @func */
+static double
+bench_convert (GPtrArray *corpus,
+               gsize      n_bytes,
+               char    *(*func) (const char *))
+{
+  g_autoptr(GArray) samples = NULL;
+
+  samples = g_array_new (FALSE, FALSE, sizeof (double));
+
+  for (guint i = 0; i < N_SAMPLES; i++) {
+    gint64 start;
+    double value;
+
+    start = g_get_monotonic_time ();
+
+    for (guint j = 0; j < corpus->len; j++)
+      g_free (func (corpus->pdata[j]));
+
+    value = bench_elapsed_ms (start);
+    g_array_append_val (samples, value);
+  }
+
+  return n_bytes / (bench_median (samples) * 1000.0);
+}
+
+static void
+bench_run (GString *json,
+           guint    size)
+{
+  g_autoptr(GPtrArray) corpus = NULL;
+  double single_pass, purple_chain;
+  gsize n_bytes;
+
+  corpus = create_corpus (size, &n_bytes);
+  single_pass = bench_convert (corpus, n_bytes, chatty_markup_from_text);
+  purple_chain = bench_convert (corpus, n_bytes, purple_markup_from_text);
+
+  bench_json_begin_run (json, "\"messages\": %u, \"bytes\": %" G_GSIZE_FORMAT, size, n_bytes);
+  bench_json_add_result (json, "single_pass", single_pass, "MB/s");
+  bench_json_add_result (json, "purple_chain", purple_chain, "MB/s");
+  bench_json_add_result (json, "speedup", single_pass / purple_chain, "x");
+  bench_json_end_run (json);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GArray) sizes = NULL;
+  GString *json;
+
+  sizes = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  if (!bench_parse_sizes (sizes, argc, argv, 1)) {
+    g_printerr ("Usage: %s [MESSAGES…]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!sizes->len)
+    g_array_append_vals (sizes, default_sizes, G_N_ELEMENTS (default_sizes));
+
+  json = bench_json_new ("markup");
+  bench_json_begin_runs (json, "runs");
+
+  for (guint i = 0; i < sizes->len; i++)
+    bench_run (json, g_array_index (sizes, guint, i));
+
+  bench_json_end_runs (json);
+  bench_json_print_free (json);
+
+  return EXIT_SUCCESS;
+}
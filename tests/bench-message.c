@@ -0,0 +1,144 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* bench-message.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Measures the memory used by messages, run with ‘meson benchmark’.
+ *
+ * Messages are created like a page of history would be, and added to
+ * a #ChattyMessageList.  The heap in use before and after is compared
+ * to get the bytes used per message, both for IM messages, which have
+ * no alias, and for MUC messages, where a few participants send all
+ * the messages.  The results are printed as JSON on stdout.
+ *
+ * The number of messages can be given as arguments, eg.
+ * ‘bench-message 1000 100000’.  The heap usage is read with
+ * mallinfo(), the benchmark is skipped without glibc.
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#define N_PARTICIPANTS  12
+#define EXIT_SKIP       77
+
+#include <stdlib.h>
+#ifdef __GLIBC__
+# include <malloc.h>
+#endif
+
+#include "bench-utils.h"
+#include "chatty-message-list.h"
+
+static const guint default_sizes[] = { 1000, 10000, 100000 };
+
+static gssize
+heap_in_use (void)
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ (2, 33)
+  struct mallinfo2 info = mallinfo2 ();
+
+  return info.uordblks + info.hblkhd;
+#elif defined(__GLIBC__)
+  struct mallinfo info = mallinfo ();
+
+  return (gssize)(guint)info.uordblks + (guint)info.hblkhd;
+#else
+  return -1;
+#endif
+}
+
+static double
+bench_bytes_per_message (guint    size,
+                         gboolean muc)
+{
+  g_autoptr(ChattyMessageList) list = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  gssize before, after;
+  time_t start;
+
+  list = chatty_message_list_new ();
+  start = time (NULL) - size;
+
+  /* Make sure the type and the string pool are set up */
+  g_object_unref (chatty_message_new (NULL, "alias", "", NULL, 0, CHATTY_DIRECTION_IN, 0));
+
+  before = heap_in_use ();
+  messages = g_ptr_array_new_full (size, g_object_unref);
+
+  for (guint i = 0; i < size; i++) {
+    g_autofree char *text = NULL;
+    g_autofree char *uid = NULL;
+    g_autofree char *alias = NULL;
+
+    /* As read from the database, each alias is a new string */
+    if (muc)
+      alias = g_strdup_printf ("participant-%u", g_random_int_range (0, N_PARTICIPANTS));
+
+    text = g_strdup_printf ("Message %u, about as long as a usual chat message", i);
+    /* Sized like a UUID */
+    uid = g_strdup_printf ("%08x-0000-4000-8000-%012u", g_random_int (), i);
+    g_ptr_array_add (messages,
+                     chatty_message_new (NULL, alias, text, uid, start + i,
+                                         i % 3 ? CHATTY_DIRECTION_IN : CHATTY_DIRECTION_OUT,
+                                         0));
+  }
+
+  chatty_message_list_add_messages (list, messages, TRUE);
+
+  /* The list holds the only reference to the messages now */
+  g_clear_pointer (&messages, g_ptr_array_unref);
+  after = heap_in_use ();
+  g_assert_cmpint (g_list_model_get_n_items (G_LIST_MODEL (list)), ==, size);
+
+  return (double)(after - before) / size;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GArray) sizes = NULL;
+  GString *json;
+
+  if (heap_in_use () < 0) {
+    g_printerr ("Heap usage can't be measured, skipping\n");
+    return EXIT_SKIP;
+  }
+
+  sizes = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  if (!bench_parse_sizes (sizes, argc, argv, 1)) {
+    g_printerr ("Usage: %s [MESSAGES…]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!sizes->len)
+    g_array_append_vals (sizes, default_sizes, G_N_ELEMENTS (default_sizes));
+
+  json = bench_json_new ("message");
+  bench_json_begin_runs (json, "runs");
+
+  for (guint i = 0; i < sizes->len; i++) {
+    guint size = g_array_index (sizes, guint, i);
+
+    bench_json_begin_run (json, "\"messages\": %u", size);
+    bench_json_add_result (json, "im_bytes_per_message",
+                           bench_bytes_per_message (size, FALSE), "B");
+    bench_json_add_result (json, "muc_bytes_per_message",
+                           bench_bytes_per_message (size, TRUE), "B");
+    bench_json_end_run (json);
+  }
+
+  bench_json_end_runs (json);
+  bench_json_print_free (json);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* bench-utils.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * What the benchmarks share: timing, statistics over samples,
+ * parsing the sizes given as arguments, and printing the results
+ * as JSON on stdout, in the form:
+ *
+ *   { "benchmark": "name",
+ *     "runs": [
+ *       { "size": 100,
+ *         "results": {
+ *           "result": { "value": 1.234, "unit": "ms" } } } ] }
+ */
+
+#include "bench-utils.h"
+
+double
+bench_elapsed_ms (gint64 start)
+{
+  return (g_get_monotonic_time () - start) / 1000.0;
+}
+
+static int
+compare_double (gconstpointer a,
+                gconstpointer b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* The value below which @p of @samples are, @samples is sorted */
+double
+bench_percentile (GArray *samples,
+                  double  p)
+{
+  guint i;
+
+  g_assert (samples->len > 0);
+
+  g_array_sort (samples, compare_double);
+  i = MIN (samples->len - 1, (guint)(p * samples->len));
+
+  return g_array_index (samples, double, i);
+}
+
+double
+bench_median (GArray *samples)
+{
+  return bench_percentile (samples, 0.5);
+}
+
+/* Append the sizes in @argv from @first to @sizes, %FALSE if one isn't valid */
+gboolean
+bench_parse_sizes (GArray *sizes,
+                   int     argc,
+                   char   *argv[],
+                   int     first)
+{
+  for (int i = first; i < argc; i++) {
+    char *end = NULL;
+    guint value;
+
+    value = g_ascii_strtoull (argv[i], &end, 10);
+
+    if (!value || !end || *end)
+      return FALSE;
+
+    g_array_append_val (sizes, value);
+  }
+
+  return TRUE;
+}
+
+GString *
+bench_json_new (const char *benchmark)
+{
+  GString *json;
+
+  json = g_string_new (NULL);
+  g_string_append_printf (json, "{\n  \"benchmark\": \"%s\"", benchmark);
+
+  return json;
+}
+
+/* Start the list of runs @name */
+void
+bench_json_begin_runs (GString    *json,
+                       const char *name)
+{
+  g_string_append_printf (json, ",\n  \"%s\": [", name);
+}
+
+void
+bench_json_end_runs (GString *json)
+{
+  g_string_append (json, "\n  ]");
+}
+
+/* Start a run, @format gives what the run is about, eg. ‘"rows": %u’ */
+void
+bench_json_begin_run (GString    *json,
+                      const char *format,
+                      ...)
+{
+  va_list args;
+
+  if (json->str[json->len - 1] != '[')
+    g_string_append_c (json, ',');
+
+  g_string_append (json, "\n    { ");
+
+  va_start (args, format);
+  g_string_append_vprintf (json, format, args);
+  va_end (args);
+
+  g_string_append (json, ",\n      \"results\": {");
+}
+
+void
+bench_json_end_run (GString *json)
+{
+  g_string_append (json, "\n      } }");
+}
+
+void
+bench_json_add_result (GString    *json,
+                       const char *name,
+                       double      value,
+                       const char *unit)
+{
+  char buffer[G_ASCII_DTOSTR_BUF_SIZE];
+
+  if (json->str[json->len - 1] != '{')
+    g_string_append_c (json, ',');
+
+  /* Not in the locale, which may use a decimal comma */
+  g_ascii_formatd (buffer, sizeof buffer, "%.3f", value);
+  g_string_append_printf (json, "\n        \"%s\": { \"value\": %s, \"unit\": \"%s\" }",
+                          name, buffer, unit);
+}
+
+/* Add the median and the 95th percentile of @samples */
+void
+bench_json_add_percentiles (GString    *json,
+                            const char *name,
+                            GArray     *samples,
+                            const char *unit)
+{
+  g_autofree char *median = g_strdup_printf ("%s_p50", name);
+  g_autofree char *p95 = g_strdup_printf ("%s_p95", name);
+
+  bench_json_add_result (json, median, bench_percentile (samples, 0.5), unit);
+  bench_json_add_result (json, p95, bench_percentile (samples, 0.95), unit);
+}
+
+void
+bench_json_print_free (GString *json)
+{
+  g_string_append (json, "\n}\n");
+  g_print ("%s", json->str);
+  g_string_free (json, TRUE);
+}
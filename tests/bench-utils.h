@@ -0,0 +1,42 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* bench-utils.h
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+double   bench_elapsed_ms           (gint64      start);
+double   bench_percentile           (GArray     *samples,
+                                     double      p);
+double   bench_median               (GArray     *samples);
+gboolean bench_parse_sizes          (GArray     *sizes,
+                                     int         argc,
+                                     char       *argv[],
+                                     int         first);
+
+GString *bench_json_new             (const char *benchmark);
+void     bench_json_begin_runs      (GString    *json,
+                                     const char *name);
+void     bench_json_end_runs        (GString    *json);
+void     bench_json_begin_run       (GString    *json,
+                                     const char *format,
+                                     ...) G_GNUC_PRINTF (2, 3);
+void     bench_json_end_run         (GString    *json);
+void     bench_json_add_result      (GString    *json,
+                                     const char *name,
+                                     double      value,
+                                     const char *unit);
+void     bench_json_add_percentiles (GString    *json,
+                                     const char *name,
+                                     GArray     *samples,
+                                     const char *unit);
+void     bench_json_print_free      (GString    *json);
+
+G_END_DECLS
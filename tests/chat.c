@@ -0,0 +1,258 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* chat.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <purple.h>
+
+#include "chatty-chat.h"
+#include "users/chatty-pp-buddy.h"
+
+#define N_USERS 100
+
+static void
+items_changed_cb (GListModel *model,
+                  guint       position,
+                  guint       removed,
+                  guint       added,
+                  guint      *n_emitted)
+{
+  (*n_emitted)++;
+}
+
+static PurpleConvChatBuddy *
+chat_buddy_new (const char *name)
+{
+  PurpleConvChatBuddy *cb;
+
+  cb = g_new0 (PurpleConvChatBuddy, 1);
+  cb->name = g_strdup (name);
+
+  return cb;
+}
+
+static void
+chat_buddy_free (PurpleConvChatBuddy *cb)
+{
+  g_free (cb->name);
+  g_free (cb);
+}
+
+static void
+check_sorted (GListModel *users)
+{
+  guint n_items;
+
+  n_items = g_list_model_get_n_items (users);
+
+  for (guint i = 1; i < n_items; i++) {
+    g_autoptr(ChattyPpBuddy) prev = NULL;
+    g_autoptr(ChattyPpBuddy) item = NULL;
+    ChattyUserFlag prev_flag, flag;
+
+    prev = g_list_model_get_item (users, i - 1);
+    item = g_list_model_get_item (users, i);
+    prev_flag = chatty_pp_buddy_get_flags (prev);
+    flag = chatty_pp_buddy_get_flags (item);
+
+    /* Owners, then moderators, then members, each sorted by name */
+    g_assert_cmpint (prev_flag, >=, flag);
+
+    if (prev_flag == flag)
+      g_assert_cmpint (chatty_item_compare (CHATTY_ITEM (prev), CHATTY_ITEM (item)), <, 0);
+  }
+}
+
+static void
+test_chat_users (void)
+{
+  g_autoptr(ChattyChat) chat = NULL;
+  g_autoptr(GPtrArray) chat_buddies = NULL;
+  GList *removed = NULL;
+  GListModel *users;
+  guint n_emitted = 0;
+
+  chat = g_object_new (CHATTY_TYPE_CHAT, NULL);
+  users = chatty_chat_get_users (chat);
+  g_signal_connect (users, "items-changed",
+                    G_CALLBACK (items_changed_cb), &n_emitted);
+
+  chat_buddies = g_ptr_array_new_with_free_func ((GDestroyNotify)chat_buddy_free);
+
+  /* Users joining one by one are added to the list at once */
+  for (guint i = 0; i < N_USERS; i++) {
+    g_autofree char *name = NULL;
+    PurpleConvChatBuddy *cb;
+    GList list = { NULL, NULL, NULL };
+
+    name = g_strdup_printf ("user%03u@example.com", (i * 37) % N_USERS);
+    cb = chat_buddy_new (name);
+    g_ptr_array_add (chat_buddies, cb);
+    list.data = cb;
+    chatty_chat_add_users (chat, &list);
+  }
+
+  g_assert_cmpint (n_emitted, ==, 0);
+  g_assert_nonnull (chatty_chat_find_user (chat, "user042@example.com"));
+  g_assert_null (chatty_chat_find_user (chat, "user@example.com"));
+
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+
+  g_assert_cmpint (n_emitted, ==, 1);
+  g_assert_cmpint (g_list_model_get_n_items (users), ==, N_USERS);
+
+  check_sorted (users);
+
+  /* Users leaving together are removed from the list at once */
+  for (guint i = 0; i < N_USERS; i += 10)
+    removed = g_list_prepend (removed, g_strdup_printf ("user%03u@example.com", i));
+
+  chatty_chat_remove_users (chat, removed);
+  g_list_free_full (removed, g_free);
+
+  g_assert_cmpint (n_emitted, ==, 2);
+  g_assert_cmpint (g_list_model_get_n_items (users), ==, N_USERS - N_USERS / 10);
+  g_assert_null (chatty_chat_find_user (chat, "user010@example.com"));
+  g_assert_nonnull (chatty_chat_find_user (chat, "user011@example.com"));
+
+  /* A user leaving before being added to the list isn't added */
+  {
+    PurpleConvChatBuddy *cb;
+    GList list = { NULL, NULL, NULL };
+
+    cb = chat_buddy_new ("late@example.com");
+    g_ptr_array_add (chat_buddies, cb);
+    list.data = cb;
+    chatty_chat_add_users (chat, &list);
+    chatty_chat_remove_user (chat, "late@example.com");
+  }
+
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+
+  g_assert_cmpint (n_emitted, ==, 2);
+  g_assert_null (chatty_chat_find_user (chat, "late@example.com"));
+
+  /* Removing unknown users does nothing */
+  chatty_chat_remove_user (chat, "user010@example.com");
+  g_assert_cmpint (n_emitted, ==, 2);
+
+  /* A user joining later is inserted at their place */
+  {
+    g_autoptr(ChattyPpBuddy) buddy = NULL;
+    PurpleConvChatBuddy *cb;
+    GList list = { NULL, NULL, NULL };
+
+    cb = chat_buddy_new ("user010@example.com");
+    g_ptr_array_add (chat_buddies, cb);
+    list.data = cb;
+    chatty_chat_add_users (chat, &list);
+
+    while (g_main_context_iteration (NULL, FALSE))
+      ;
+
+    g_assert_cmpint (n_emitted, ==, 3);
+    g_assert_cmpint (g_list_model_get_n_items (users), ==, N_USERS - N_USERS / 10 + 1);
+    check_sorted (users);
+
+    buddy = g_list_model_get_item (users, 9);
+    g_assert_cmpstr (chatty_pp_buddy_get_id (buddy), ==, "user010@example.com");
+  }
+
+  /* A user whose role changes is moved to their new place */
+  {
+    g_autoptr(ChattyPpBuddy) buddy = NULL;
+    PurpleConvChatBuddy *cb = NULL;
+
+    for (guint i = 0; i < chat_buddies->len; i++) {
+      cb = chat_buddies->pdata[i];
+
+      if (g_str_equal (cb->name, "user051@example.com"))
+        break;
+    }
+
+    cb->flags = PURPLE_CBFLAGS_OP;
+    chatty_chat_emit_user_changed (chat, "user051@example.com");
+    check_sorted (users);
+
+    buddy = g_list_model_get_item (users, 0);
+    g_assert_cmpstr (chatty_pp_buddy_get_id (buddy), ==, "user051@example.com");
+  }
+
+  /* Users joining later together are merged in at once */
+  {
+    GList *joined = NULL;
+    guint n_items;
+
+    for (guint i = 0; i < N_USERS; i += 20) {
+      g_autofree char *name = NULL;
+      PurpleConvChatBuddy *cb;
+
+      name = g_strdup_printf ("user%03u-late@example.com", i);
+      cb = chat_buddy_new (name);
+      g_ptr_array_add (chat_buddies, cb);
+      joined = g_list_prepend (joined, cb);
+    }
+
+    n_items = g_list_model_get_n_items (users);
+    n_emitted = 0;
+    chatty_chat_add_users (chat, joined);
+    g_list_free (joined);
+
+    while (g_main_context_iteration (NULL, FALSE))
+      ;
+
+    g_assert_cmpint (n_emitted, ==, 1);
+    g_assert_cmpint (g_list_model_get_n_items (users), ==, n_items + N_USERS / 20);
+    check_sorted (users);
+  }
+
+  /* Users leaving one by one are removed from the list at once */
+  {
+    guint n_items;
+
+    n_items = g_list_model_get_n_items (users);
+    n_emitted = 0;
+
+    for (guint i = 1; i < N_USERS; i += 10) {
+      g_autofree char *name = NULL;
+
+      name = g_strdup_printf ("user%03u@example.com", i);
+      chatty_chat_remove_user (chat, name);
+    }
+
+    g_assert_cmpint (n_emitted, ==, 0);
+    g_assert_null (chatty_chat_find_user (chat, "user011@example.com"));
+
+    while (g_main_context_iteration (NULL, FALSE))
+      ;
+
+    g_assert_cmpint (n_emitted, ==, 1);
+    g_assert_cmpint (g_list_model_get_n_items (users), ==, n_items - N_USERS / 10);
+    check_sorted (users);
+  }
+
+  g_signal_handlers_disconnect_by_func (users, items_changed_cb, &n_emitted);
+  g_clear_object (&chat);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/chat/users", test_chat_users);
+
+  return g_test_run ();
+}
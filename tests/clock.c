@@ -0,0 +1,150 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* clock.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+
+#include "chatty-clock.h"
+
+static void
+test_clock_time_ago (void)
+{
+  /* Times are picked away from the boundaries, so that a second passing doesn't matter */
+  static const struct {
+    time_t      ago;
+    const char *str;
+    time_t      next_change;
+  } tests[] = {
+    { -100, "<15s", 15 },
+    { 5, "<15s", 15 },
+    { 20, "<30s", 30 },
+    { 40, "<1m", 60 },
+    { 90, "~1m", 120 },
+    { 5 * 60 + 20, "5m", 6 * 60 },
+    { 60 * 60, "~1h", 90 * 60 },
+    { 5 * 3600 + 20, "~5h", 6 * 3600 },
+    { 23 * 3600 + 20, "~23h", 24 * 3600 },
+  };
+  ChattyClock *clock;
+  time_t now;
+
+  clock = chatty_clock_get_default ();
+  now = time (NULL);
+
+  for (guint i = 0; i < G_N_ELEMENTS (tests); i++) {
+    g_autofree char *str = NULL;
+    time_t next_change = 0;
+
+    str = chatty_clock_get_time_ago (clock, now - tests[i].ago, &next_change);
+    g_assert_cmpstr (str, ==, tests[i].str);
+
+    /* Times ahead are now */
+    if (tests[i].ago < 0)
+      g_assert_cmpint (next_change, >=, now + tests[i].next_change);
+    else
+      g_assert_cmpint (next_change, ==, now - tests[i].ago + tests[i].next_change);
+  }
+
+  /* A day ago and more, the date is shown, which doesn't change */
+  for (guint i = 1; i < 3; i++) {
+    g_autoptr(GDateTime) date = NULL;
+    g_autofree char *expected = NULL;
+    g_autofree char *str = NULL;
+    time_t next_change = 1;
+
+    date = g_date_time_new_from_unix_local (now - i * 86400 * 365);
+    expected = g_date_time_format (date, "%d.%m.%y");
+    str = chatty_clock_get_time_ago (clock, now - i * 86400 * 365, &next_change);
+    g_assert_cmpstr (str, ==, expected);
+    g_assert_cmpint (next_change, ==, 0);
+  }
+}
+
+static void
+watch_called_cb (gpointer user_data)
+{
+  guint *count = user_data;
+
+  (*count)++;
+}
+
+typedef struct {
+  GPtrArray *calls;  /* The watches called, in order */
+  time_t     time;   /* When this one was called */
+} WatchCall;
+
+static void
+watch_call_cb (gpointer user_data)
+{
+  WatchCall *call = user_data;
+
+  call->time = time (NULL);
+  g_ptr_array_add (call->calls, call);
+}
+
+static void
+test_clock_watch (void)
+{
+  g_autoptr(GPtrArray) calls = NULL;
+  WatchCall sooner = { NULL }, later = { NULL };
+  ChattyClock *clock;
+  guint count = 0, removed_count = 0;
+  guint id, removed_id;
+  time_t now;
+
+  clock = chatty_clock_get_default ();
+  now = time (NULL);
+
+  /* Watches for the past are called at once */
+  id = chatty_clock_add_watch (clock, now - 10, watch_called_cb, &count);
+  g_assert_cmpint (id, >, 0);
+  removed_id = chatty_clock_add_watch (clock, now - 5, watch_called_cb, &removed_count);
+  g_assert_cmpint (removed_id, !=, id);
+  chatty_clock_remove_watch (clock, removed_id);
+
+  while (count == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpint (count, ==, 1);
+  g_assert_cmpint (removed_count, ==, 0);
+
+  /* Removing a watch that was called does nothing */
+  chatty_clock_remove_watch (clock, id);
+
+  /* Watches in the future are called in time order, once their time has come */
+  calls = g_ptr_array_new ();
+  sooner.calls = later.calls = calls;
+  chatty_clock_add_watch (clock, now + 2, watch_call_cb, &later);
+  chatty_clock_add_watch (clock, now + 1, watch_call_cb, &sooner);
+
+  while (calls->len < 2)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_true (calls->pdata[0] == &sooner);
+  g_assert_true (calls->pdata[1] == &later);
+  g_assert_cmpint (sooner.time, >=, now + 1);
+  g_assert_cmpint (later.time, >=, now + 2);
+  g_assert_cmpint (removed_count, ==, 0);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/clock/time-ago", test_clock_time_ago);
+  g_test_add_func ("/clock/watch", test_clock_watch);
+
+  return g_test_run ();
+}
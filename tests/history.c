@@ -18,6 +18,7 @@
 #define MESSAGE_LIMIT 20
 
 #include <glib/gstdio.h>
+#include <sqlite3.h>
 
 #include "purple-init.h"
 #include "chatty-history.h"
@@ -85,70 +86,247 @@ new_message (const char         *buddy_username,
   return message;
 }
 
+static ChattyMsgDirection
+msg_direction (int direction)
+{
+  if (direction == 1)
+    return CHATTY_DIRECTION_IN;
+
+  if (direction == -1)
+    return CHATTY_DIRECTION_OUT;
+
+  return CHATTY_DIRECTION_SYSTEM;
+}
+
+/*
+ * Compare a page of @messages, oldest first, with the messages of
+ * @msg_array not compared yet, newest first.
+ */
 static void
-compare_im (const guchar *msg_text,
-            int           direction,
-            time_t        time_stamp,
-            const guchar *uuid,
-            gpointer      data,
-            int           last_message)
-{
-  GPtrArray *msg_array = data;
-  PurpleConvMessage *msg;
-  Message *message;
-  int dir;
+compare_page (GPtrArray *msg_array,
+              GPtrArray *messages,
+              gboolean   is_chat)
+{
+  g_assert (msg_array);
+  g_assert (messages);
 
-  g_assert (data);
-  g_assert (array_index < msg_array->len);
+  for (guint i = messages->len; i > 0; i--) {
+    ChattyMessage *item = messages->pdata[i - 1];
+    PurpleConvMessage *msg;
+    Message *message;
+    int dir;
 
-  message = msg_array->pdata[msg_array->len - array_index - 1];
-  g_assert (message);
-  g_assert (message->msg);
+    g_assert (array_index < msg_array->len);
 
-  msg = message->msg;
-  dir = direction_for_flag (msg->flags);
+    message = msg_array->pdata[msg_array->len - array_index - 1];
+    g_assert (message);
+    g_assert (message->msg);
+
+    msg = message->msg;
+    dir = direction_for_flag (msg->flags);
+
+    g_assert_cmpstr (message->uuid, ==, chatty_message_get_uid (item));
+    g_assert_cmpstr (msg->what, ==, chatty_message_get_text (item));
+    g_assert_cmpint (msg->when, ==, chatty_message_get_time (item));
+    g_assert_cmpint (msg_direction (dir), ==, chatty_message_get_msg_direction (item));
+
+    /* The nick of the sender is kept for received messages */
+    if (is_chat && dir == 1)
+      g_assert_cmpstr (msg->who, ==, chatty_message_get_user_alias (item));
 
-  g_assert_cmpstr (message->uuid, ==, (const char *)uuid);
-  g_assert_cmpstr (msg->what, ==, (const char *)msg_text);
-  g_assert_cmpint (msg->when, ==, time_stamp);
-  g_assert_cmpint (dir, ==, direction);
+    array_index++;
+  }
+}
 
-  array_index++;
+static gpointer
+wait_for_task (GTask *task)
+{
+  while (!g_task_get_completed (task))
+    g_main_context_iteration (NULL, TRUE);
+
+  return g_task_propagate_pointer (task, NULL);
 }
 
 static void
-compare_chat (const guchar *msg_text,
-              int           direction,
-              int           time_stamp,
-              const char   *room,
-              const guchar *who,
-              const guchar *uuid,
-              gpointer      data)
-{
-  GPtrArray *msg_array = data;
-  PurpleConvMessage *msg;
-  Message *message;
-  int dir;
+finish_load_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  GTask *task = user_data;
+  ChattyHistoryCursor *cursor;
+  GPtrArray *messages;
+  GError *error = NULL;
 
-  g_assert (data);
+  g_assert_true (G_IS_TASK (task));
 
-  g_assert (array_index < msg_array->len);
+  cursor = g_task_get_task_data (task);
+  messages = chatty_history_load_finish (result, cursor, &error);
+  g_assert_no_error (error);
 
-  message = msg_array->pdata[msg_array->len - array_index - 1];
-  g_assert (message);
-  g_assert (message->msg);
+  g_task_return_pointer (task, messages, (GDestroyNotify)g_ptr_array_unref);
+  g_object_unref (task);
+}
 
-  msg = message->msg;
-  dir = direction_for_flag (msg->flags);
+/*
+ * Load a page of up to @limit messages before @before, or from
+ * @cursor (which is updated) if @before is %NULL.
+ */
+static GPtrArray *
+load_messages (gboolean             is_chat,
+               const char          *account,
+               const char          *name,
+               ChattyMessage       *before,
+               ChattyHistoryCursor *cursor,
+               guint                limit)
+{
+  GPtrArray *messages;
+  GTask *task;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, cursor, NULL);
+
+  if (is_chat)
+    chatty_history_load_chat_async (account, name, before, before ? NULL : cursor,
+                                    limit, NULL, finish_load_cb, g_object_ref (task));
+  else
+    chatty_history_load_im_async (account, name, before, before ? NULL : cursor,
+                                  limit, NULL, finish_load_cb, g_object_ref (task));
 
-  g_assert_cmpstr (message->uuid, ==, (const char *)uuid);
-  g_assert_cmpstr (message->room, ==, room);
-  g_assert_cmpstr (msg->who, ==, (const char *)who);
-  g_assert_cmpstr (msg->what, ==, (const char *)msg_text);
-  g_assert_cmpint (msg->when, ==, time_stamp);
-  g_assert_cmpint (dir, ==, direction);
+  messages = wait_for_task (task);
+  g_object_unref (task);
+  g_assert_nonnull (messages);
 
-  array_index++;
+  return messages;
+}
+
+/* Load a page of messages and compare it, returns the number of messages loaded */
+static guint
+compare_messages (GPtrArray           *msg_array,
+                  gboolean             is_chat,
+                  const char          *account,
+                  const char          *name,
+                  ChattyMessage       *before,
+                  ChattyHistoryCursor *cursor,
+                  guint                limit)
+{
+  g_autoptr(GPtrArray) messages = NULL;
+
+  messages = load_messages (is_chat, account, name, before, cursor, limit);
+  compare_page (msg_array, messages, is_chat);
+
+  return messages->len;
+}
+
+static void
+finish_last_message_cb (GObject      *object,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  GTask *task = user_data;
+  ChattyMessage *message;
+  GError *error = NULL;
+
+  g_assert_true (G_IS_TASK (task));
+
+  message = chatty_history_get_im_last_message_finish (result, &error);
+  g_assert_no_error (error);
+
+  g_task_return_pointer (task, message, g_object_unref);
+  g_object_unref (task);
+}
+
+static ChattyMessage *
+get_im_last_message (const char *account,
+                     const char *buddy)
+{
+  ChattyMessage *message;
+  GTask *task;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_im_last_message_async (account, buddy, NULL,
+                                            finish_last_message_cb, g_object_ref (task));
+  message = wait_for_task (task);
+  g_object_unref (task);
+
+  return message;
+}
+
+static void
+finish_last_time_cb (GObject      *object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  GTask *task = user_data;
+  time_t *last_time;
+  GError *error = NULL;
+
+  last_time = g_task_get_task_data (task);
+  *last_time = chatty_history_get_chat_last_message_time_finish (result, &error);
+  g_assert_no_error (error);
+
+  g_task_return_pointer (task, NULL, NULL);
+  g_object_unref (task);
+}
+
+static time_t
+get_chat_last_message_time (const char *account,
+                            const char *room)
+{
+  time_t last_time = -1;
+  GTask *task;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, &last_time, NULL);
+  chatty_history_get_chat_last_message_time_async (account, room, NULL,
+                                                   finish_last_time_cb, g_object_ref (task));
+  wait_for_task (task);
+  g_object_unref (task);
+
+  return last_time;
+}
+
+static void
+finish_stats_cb (GObject      *object,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  GTask *task = user_data;
+  guint *stats;
+  GError *error = NULL;
+
+  stats = g_task_get_task_data (task);
+  g_assert_true (chatty_history_get_statement_stats_finish (result, &stats[0], &stats[1], &error));
+  g_assert_no_error (error);
+
+  g_task_return_pointer (task, NULL, NULL);
+  g_object_unref (task);
+}
+
+static void
+get_statement_stats (guint *n_prepared,
+                     guint *n_reused)
+{
+  guint stats[2] = { 0, 0 };
+  GTask *task;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, stats, NULL);
+  chatty_history_get_statement_stats_async (NULL, finish_stats_cb, g_object_ref (task));
+  wait_for_task (task);
+  g_object_unref (task);
+
+  if (n_prepared)
+    *n_prepared = stats[0];
+
+  if (n_reused)
+    *n_reused = stats[1];
+}
+
+/* Jobs are done in order, so this waits for the queued jobs to be done */
+static void
+wait_for_history (void)
+{
+  get_statement_stats (NULL, NULL);
 }
 
 static void
@@ -159,12 +337,12 @@ add_im (GPtrArray          *msg_array,
         time_t              time_stamp,
         PurpleMessageFlags  flags)
 {
+  g_autoptr(ChattyMessage) last_message = NULL;
   PurpleConvMessage *msg;
   Message *message;
-  ChattyLog *log_data;
+  ChattyHistoryCursor cursor;
   char *uuid;
   int dir;
-  char message_exists;
 
   uuid = g_uuid_string_random ();
   message = new_message (buddy, msg_text, uuid, flags, time_stamp, NULL);
@@ -175,18 +353,16 @@ add_im (GPtrArray          *msg_array,
 
   array_index = 0;
   chatty_history_add_im_message (msg->what, dir, ac, msg->who, uuid, msg->when);
-  chatty_history_get_im_messages (ac, buddy, compare_im, msg_array, msg_array->len, NULL);
+  chatty_history_cursor_init (&cursor);
+  compare_messages (msg_array, FALSE, ac, buddy, NULL, &cursor, msg_array->len);
   g_assert_cmpint (array_index, ==, msg_array->len);
 
-  log_data = g_new0 (ChattyLog, 1);
-  message_exists = chatty_history_get_im_last_message (ac, buddy, log_data);
-  g_assert_true (!!message_exists);
-  g_assert_cmpint (log_data->epoch, ==, msg->when);
-  g_assert_cmpint (log_data->dir, ==, dir);
-  g_assert_cmpstr (log_data->msg, ==, msg->what);
-  g_assert_cmpstr (log_data->uid, ==, message->uuid);
-  g_free (log_data->msg);
-  g_free (log_data);
+  last_message = get_im_last_message (ac, buddy);
+  g_assert_true (CHATTY_IS_MESSAGE (last_message));
+  g_assert_cmpint (chatty_message_get_time (last_message), ==, msg->when);
+  g_assert_cmpint (chatty_message_get_msg_direction (last_message), ==, msg_direction (dir));
+  g_assert_cmpstr (chatty_message_get_text (last_message), ==, msg->what);
+  g_assert_cmpstr (chatty_message_get_uid (last_message), ==, message->uuid);
 }
 
 static void
@@ -200,8 +376,10 @@ add_chat (GPtrArray          *msg_array,
 {
   PurpleConvMessage *msg;
   Message *message;
+  ChattyHistoryCursor cursor;
   char *uuid;
-  int dir, last_time;
+  time_t last_time;
+  int dir;
 
   uuid = g_uuid_string_random ();
   message = new_message (buddy,  msg_text, uuid, flags, time_stamp, room);
@@ -212,27 +390,33 @@ add_chat (GPtrArray          *msg_array,
 
   array_index = 0;
   chatty_history_add_chat_message (msg->what, dir, ac, msg->who, uuid, msg->when, room);
-  chatty_history_get_chat_messages (ac, room, compare_chat, msg_array, msg_array->len, NULL);
+  chatty_history_cursor_init (&cursor);
+  compare_messages (msg_array, TRUE, ac, room, NULL, &cursor, msg_array->len);
   g_assert_cmpint (array_index, ==, msg_array->len);
 
   /* Load some of the contents */
   if (msg_array->len >= 2) {
     array_index = 0;
-    chatty_history_get_chat_messages (ac, room, compare_chat, msg_array, msg_array->len - 1, NULL);
+    chatty_history_cursor_init (&cursor);
+    compare_messages (msg_array, TRUE, ac, room, NULL, &cursor, msg_array->len - 1);
     g_assert_cmpint (array_index, ==, msg_array->len - 1);
+
+    /* And the rest */
+    g_assert_cmpint (compare_messages (msg_array, TRUE, ac, room, NULL, &cursor,
+                                       msg_array->len), ==, 1);
+    g_assert_cmpint (array_index, ==, msg_array->len);
   }
 
-  last_time = chatty_history_get_chat_last_message_time (ac, room);
+  last_time = get_chat_last_message_time (ac, room);
   g_assert_cmpint (last_time, ==, msg->when);
 }
 
 static void
 test_history_im (void)
 {
+  g_autoptr(ChattyMessage) last_message = NULL;
   GPtrArray *msg_array;
-  ChattyLog *log_data;
   const char *account, *buddy;
-  char message_exists;
 
   g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
   chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
@@ -243,10 +427,7 @@ test_history_im (void)
   account = "account@test";
   buddy = "buddy@test";
 
-  log_data = g_new0 (ChattyLog, 1);
-  message_exists = chatty_history_get_im_last_message (account, buddy, log_data);
-  g_assert_false (!!message_exists);
-  g_free (log_data->msg);
+  g_assert_null (get_im_last_message (account, buddy));
 
   add_im (msg_array, account, buddy,
           "Message", time (NULL) - 4, PURPLE_MESSAGE_SYSTEM);
@@ -285,18 +466,18 @@ test_history_im (void)
           "And one more", time (NULL) + 3, PURPLE_MESSAGE_RECV);
 
   buddy = "buddy@test";
-  message_exists = chatty_history_get_im_last_message (account, buddy, log_data);
-  g_assert_true (!!message_exists);
+  last_message = get_im_last_message (account, buddy);
+  g_assert_true (CHATTY_IS_MESSAGE (last_message));
+  g_clear_object (&last_message);
   chatty_history_delete_im (account, buddy);
-  message_exists = chatty_history_get_im_last_message (account, buddy, log_data);
-  g_assert_false (!!message_exists);
+  g_assert_null (get_im_last_message (account, buddy));
 
   buddy = "somebuddy@test";
-  message_exists = chatty_history_get_im_last_message (account, buddy, log_data);
-  g_assert_true (!!message_exists);
+  last_message = get_im_last_message (account, buddy);
+  g_assert_true (CHATTY_IS_MESSAGE (last_message));
+  g_clear_object (&last_message);
   chatty_history_delete_im (account, buddy);
-  message_exists = chatty_history_get_im_last_message (account, buddy, log_data);
-  g_assert_false (!!message_exists);
+  g_assert_null (get_im_last_message (account, buddy));
 
   chatty_history_close ();
 }
@@ -305,9 +486,8 @@ static void
 test_history_chat (void)
 {
   GPtrArray *msg_array;
-  ChattyLog *log_data;
   const char *account, *buddy, *room;
-  int last_time;
+  time_t last_time;
 
   g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
   chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
@@ -318,10 +498,7 @@ test_history_chat (void)
   account = "account@test";
   buddy = "buddy@test";
 
-  log_data = g_new0 (ChattyLog, 1);
-  last_time = chatty_history_get_im_last_message (account, buddy, log_data);
-  g_assert_false (!!last_time);
-  g_free (log_data->msg);
+  g_assert_null (get_im_last_message (account, buddy));
 
   room = "room@test";
   add_chat (msg_array, account, buddy, room,
@@ -362,17 +539,17 @@ test_history_chat (void)
           "And one more", time (NULL) + 3, PURPLE_MESSAGE_RECV);
 
   room = "room@test";
-  last_time = chatty_history_get_chat_last_message_time (account, room);
+  last_time = get_chat_last_message_time (account, room);
   g_assert_true (!!last_time);
   chatty_history_delete_chat (account, room);
-  last_time = chatty_history_get_chat_last_message_time (account, room);
+  last_time = get_chat_last_message_time (account, room);
   g_assert_false (!!last_time);
 
   room = "another@test";
-  last_time = chatty_history_get_chat_last_message_time (account, room);
+  last_time = get_chat_last_message_time (account, room);
   g_assert_true (!!last_time);
   chatty_history_delete_chat (account, room);
-  last_time = chatty_history_get_chat_last_message_time (account, room);
+  last_time = get_chat_last_message_time (account, room);
   g_assert_false (!!last_time);
 
   chatty_history_close ();
@@ -382,6 +559,7 @@ static void
 test_history_message (void)
 {
   GPtrArray *msg_array;
+  ChattyHistoryCursor cursor;
   PurpleAccount *pa;
   Message *message;
   const char *buddy;
@@ -405,8 +583,9 @@ test_history_message (void)
   chatty_history_add_message (pa, message->msg, &uuid, PURPLE_CONV_TYPE_CHAT, NULL);
 
   array_index = 0;
-  chatty_history_get_chat_messages (pa->username, message->room, compare_chat,
-                                    msg_array, msg_array->len, NULL);
+  chatty_history_cursor_init (&cursor);
+  compare_messages (msg_array, TRUE, pa->username, message->room, NULL,
+                    &cursor, msg_array->len);
   g_assert_cmpint (array_index, ==, msg_array->len);
   g_clear_pointer (&uuid, g_free);
   g_ptr_array_free (msg_array, TRUE);
@@ -423,14 +602,818 @@ test_history_message (void)
   message->uuid = uuid;
 
   array_index = 0;
-  chatty_history_get_im_messages (pa->username, buddy, compare_im,
-                                    msg_array, msg_array->len, NULL);
+  chatty_history_cursor_init (&cursor);
+  compare_messages (msg_array, FALSE, pa->username, buddy, NULL,
+                    &cursor, msg_array->len);
   g_assert_cmpint (array_index, ==, msg_array->len);
   g_ptr_array_free (msg_array, TRUE);
 
   chatty_history_close ();
 }
 
+static void
+test_history_paging (void)
+{
+  g_autoptr(ChattyMessage) before = NULL;
+  GPtrArray *msg_array, *messages;
+  ChattyHistoryCursor cursor;
+  Message *message;
+  const char *account, *buddy;
+  time_t time_stamp;
+  guint count, n_messages;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  msg_array = g_ptr_array_new ();
+  g_ptr_array_set_free_func (msg_array, (GDestroyNotify)free_message);
+
+  account = "account@test";
+  buddy = "buddy@test";
+  time_stamp = time (NULL);
+  n_messages = 3 * MESSAGE_LIMIT + 5;
+
+  /* A burst of messages, all in the same second */
+  for (guint i = 0; i < n_messages; i++) {
+    g_autofree char *text = g_strdup_printf ("Message %u", i);
+    g_autofree char *uuid = g_uuid_string_random ();
+
+    g_ptr_array_add (msg_array, new_message (buddy, text, uuid, PURPLE_MESSAGE_RECV, time_stamp, NULL));
+    chatty_history_add_im_message (text, 1, account, buddy, uuid, time_stamp);
+  }
+
+  /* Every page should have exactly the requested number of messages, in order */
+  array_index = 0;
+  chatty_history_cursor_init (&cursor);
+
+  for (guint i = 0; i < 3; i++) {
+    count = compare_messages (msg_array, FALSE, account, buddy, NULL, &cursor, MESSAGE_LIMIT);
+    g_assert_cmpint (count, ==, MESSAGE_LIMIT);
+    g_assert_cmpint (array_index, ==, (i + 1) * MESSAGE_LIMIT);
+    g_assert_false (chatty_history_cursor_at_start (&cursor));
+  }
+
+  count = compare_messages (msg_array, FALSE, account, buddy, NULL, &cursor, MESSAGE_LIMIT);
+  g_assert_cmpint (count, ==, 5);
+  g_assert_cmpint (array_index, ==, n_messages);
+  g_assert_true (chatty_history_cursor_at_start (&cursor));
+
+  count = compare_messages (msg_array, FALSE, account, buddy, NULL, &cursor, MESSAGE_LIMIT);
+  g_assert_cmpint (count, ==, 0);
+
+  /* Loading before a message should continue right before that message */
+  message = msg_array->pdata[n_messages - MESSAGE_LIMIT];
+  before = chatty_message_new (NULL, NULL, message->msg->what, message->uuid,
+                               time_stamp, CHATTY_DIRECTION_IN, 0);
+  array_index = MESSAGE_LIMIT;
+  count = compare_messages (msg_array, FALSE, account, buddy, before, &cursor, MESSAGE_LIMIT);
+  g_assert_cmpint (count, ==, MESSAGE_LIMIT);
+  g_assert_cmpint (array_index, ==, 2 * MESSAGE_LIMIT);
+  g_clear_object (&before);
+
+  /* Unknown messages are only known by their time, load up to that */
+  before = chatty_message_new (NULL, NULL, "Message", "invalid-uid",
+                               time_stamp, CHATTY_DIRECTION_IN, 0);
+  array_index = 0;
+  count = compare_messages (msg_array, FALSE, account, buddy, before, &cursor, MESSAGE_LIMIT);
+  g_assert_cmpint (count, ==, MESSAGE_LIMIT);
+  g_assert_cmpint (array_index, ==, MESSAGE_LIMIT);
+  g_clear_object (&before);
+
+  /* Messages without text are skipped, but the history goes on */
+  buddy = "empty@test";
+  chatty_history_add_im_message ("Hi", 1, account, buddy, "empty-uid-0", time_stamp - 1);
+
+  for (guint i = 1; i <= MESSAGE_LIMIT; i++) {
+    g_autofree char *uuid = g_strdup_printf ("empty-uid-%u", i);
+
+    chatty_history_add_im_message ("", 1, account, buddy, uuid, time_stamp);
+  }
+
+  chatty_history_cursor_init (&cursor);
+  messages = load_messages (FALSE, account, buddy, NULL, &cursor, MESSAGE_LIMIT);
+  g_assert_cmpint (messages->len, ==, 0);
+  g_assert_false (chatty_history_cursor_at_start (&cursor));
+  g_clear_pointer (&messages, g_ptr_array_unref);
+
+  messages = load_messages (FALSE, account, buddy, NULL, &cursor, MESSAGE_LIMIT);
+  g_assert_cmpint (messages->len, ==, 1);
+  g_assert_cmpstr (chatty_message_get_text (messages->pdata[0]), ==, "Hi");
+  g_assert_true (chatty_history_cursor_at_start (&cursor));
+  g_clear_pointer (&messages, g_ptr_array_unref);
+
+  g_ptr_array_free (msg_array, TRUE);
+  chatty_history_close ();
+}
+
+static void
+test_history_statement_cache (void)
+{
+  GPtrArray *msg_array;
+  const char *account, *buddy;
+  guint prepared, reused, n_prepared, n_reused;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  msg_array = g_ptr_array_new ();
+  g_ptr_array_set_free_func (msg_array, (GDestroyNotify)free_message);
+
+  account = "account@test";
+  buddy = "buddy@test";
+
+  /* Warm up, so that every statement used below is compiled once */
+  add_im (msg_array, account, buddy,
+          "Message", time (NULL) - 2, PURPLE_MESSAGE_RECV);
+  get_statement_stats (&prepared, &reused);
+  g_assert_cmpint (prepared, >, 0);
+
+  for (guint i = 0; i < MESSAGE_LIMIT; i++) {
+    g_autofree char *text = g_strdup_printf ("Message %u", i);
+
+    add_im (msg_array, account, buddy, text, time (NULL) + i, PURPLE_MESSAGE_RECV);
+  }
+
+  /* No new statement should be compiled, all should be reused */
+  get_statement_stats (&n_prepared, &n_reused);
+  g_assert_cmpint (n_prepared, ==, prepared);
+  g_assert_cmpint (n_reused, >=, reused + 3 * MESSAGE_LIMIT);
+
+  g_ptr_array_free (msg_array, TRUE);
+  chatty_history_close ();
+}
+
+static int
+count_im_rows (const char *db_path)
+{
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  int count = -1;
+
+  g_assert_cmpint (sqlite3_open (db_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_prepare_v2 (db, "SELECT COUNT(*) FROM chatty_im", -1, &stmt, NULL), ==, SQLITE_OK);
+
+  if (sqlite3_step (stmt) == SQLITE_ROW)
+    count = sqlite3_column_int (stmt, 0);
+
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+
+  return count;
+}
+
+static void
+test_history_journal (void)
+{
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  const char *db_path;
+
+  db_path = g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_remove (db_path);
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  wait_for_history ();
+
+  /* The journal mode is persistent, so it should be visible from other connections */
+  g_assert_cmpint (sqlite3_open (db_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_prepare_v2 (db, "PRAGMA journal_mode", -1, &stmt, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_step (stmt), ==, SQLITE_ROW);
+  g_assert_cmpstr ((const char *)sqlite3_column_text (stmt, 0), ==, "wal");
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+
+  chatty_history_close ();
+}
+
+static void
+test_history_migration (void)
+{
+  GPtrArray *msg_array;
+  ChattyHistoryCursor cursor;
+  Message *message;
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  const char *db_path;
+  time_t time_stamp;
+  char *sql;
+
+  db_path = g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_remove (db_path);
+
+  /* Create a database with the schema used before versioning */
+  time_stamp = time (NULL);
+  sql = g_strdup_printf ("CREATE TABLE chatty_im("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT_NULL,"
+                         "direction INTEGER NOT NULL, account TEXT NOT_NULL, who TEXT NOT_NULL,"
+                         "uid TEXT NOT_NULL, message TEXT, UNIQUE (timestamp, message));"
+                         "CREATE UNIQUE INDEX chatty_im_acc_uid ON chatty_im(account, uid);"
+                         "INSERT INTO chatty_im VALUES (NULL, %ld, 1, 'account@test', 'buddy@test',"
+                         "'old-uid', 'Old message');", (long)time_stamp);
+  g_assert_cmpint (sqlite3_open (db_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_exec (db, sql, NULL, NULL, NULL), ==, SQLITE_OK);
+  sqlite3_close (db);
+  g_free (sql);
+
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  /* The existing message should be kept */
+  msg_array = g_ptr_array_new ();
+  g_ptr_array_set_free_func (msg_array, (GDestroyNotify)free_message);
+  message = new_message ("buddy@test", "Old message", "old-uid",
+                         PURPLE_MESSAGE_RECV, time_stamp, NULL);
+  g_ptr_array_add (msg_array, message);
+
+  array_index = 0;
+  chatty_history_cursor_init (&cursor);
+  compare_messages (msg_array, FALSE, "account@test", "buddy@test", NULL,
+                    &cursor, MESSAGE_LIMIT);
+  g_assert_cmpint (array_index, ==, msg_array->len);
+
+  g_ptr_array_free (msg_array, TRUE);
+
+  /* And the missing table and indexes created */
+  msg_array = g_ptr_array_new ();
+  g_ptr_array_set_free_func (msg_array, (GDestroyNotify)free_message);
+  add_chat (msg_array, "account@test", "buddy@test", "room@test",
+            "Message", time_stamp, PURPLE_MESSAGE_RECV);
+  g_ptr_array_free (msg_array, TRUE);
+
+  g_assert_cmpint (sqlite3_open (db_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_prepare_v2 (db, "PRAGMA user_version", -1, &stmt, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_step (stmt), ==, SQLITE_ROW);
+  g_assert_cmpint (sqlite3_column_int (stmt, 0), >=, 5);
+  sqlite3_finalize (stmt);
+
+  g_assert_cmpint (sqlite3_prepare_v2 (db, "SELECT COUNT(*) FROM sqlite_master WHERE type='index' "
+                                       "AND name IN ('chatty_im_acc_who_seq', 'chatty_chat_room_acc_seq') "
+                                       "AND sql LIKE 'CREATE UNIQUE INDEX%'",
+                                       -1, &stmt, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_step (stmt), ==, SQLITE_ROW);
+  g_assert_cmpint (sqlite3_column_int (stmt, 0), ==, 2);
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+
+  chatty_history_close ();
+}
+
+static void
+test_history_order (void)
+{
+  g_autoptr(ChattyMessage) last_message = NULL;
+  GPtrArray *msg_array;
+  ChattyHistoryCursor cursor;
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  const char *db_path;
+  gint64 time_ms;
+  char *sql;
+
+  db_path = g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_remove (db_path);
+
+  /* Messages of the same second in an old database keep their order */
+  sql = g_strdup_printf ("CREATE TABLE chatty_im("
+                         "id INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT_NULL,"
+                         "direction INTEGER NOT NULL, account TEXT NOT_NULL, who TEXT NOT_NULL,"
+                         "uid TEXT NOT_NULL, message TEXT, UNIQUE (timestamp, message));"
+                         "CREATE UNIQUE INDEX chatty_im_acc_uid ON chatty_im(account, uid);"
+                         "CREATE INDEX chatty_im_acc_who_time ON chatty_im(account, who, timestamp);"
+                         "INSERT INTO chatty_im VALUES (NULL, 1000, 1, 'account@test', 'buddy@test', 'uid-1', 'One');"
+                         "INSERT INTO chatty_im VALUES (NULL, 1000, 1, 'account@test', 'buddy@test', 'uid-2', 'Two');"
+                         "INSERT INTO chatty_im VALUES (NULL, 999, 1, 'account@test', 'buddy@test', 'uid-0', 'Zero');");
+  g_assert_cmpint (sqlite3_open (db_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_exec (db, sql, NULL, NULL, NULL), ==, SQLITE_OK);
+  sqlite3_close (db);
+  g_free (sql);
+
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  /*
+   * The backlog arrives out of order, with times in milliseconds:
+   * it should be sorted by time, then by arrival in a millisecond.
+   */
+  time_ms = (gint64)2000 * 1000;
+  chatty_history_add_im_message_ms ("Five", 1, "account@test", "buddy@test", "uid-5", time_ms + 500);
+  chatty_history_add_im_message_ms ("Three", 1, "account@test", "buddy@test", "uid-3", time_ms + 10);
+  chatty_history_add_im_message_ms ("Six", 1, "account@test", "buddy@test", "uid-6", time_ms + 500);
+  chatty_history_add_im_message_ms ("Four", 1, "account@test", "buddy@test", "uid-4", time_ms + 499);
+
+  msg_array = g_ptr_array_new ();
+  g_ptr_array_set_free_func (msg_array, (GDestroyNotify)free_message);
+  g_ptr_array_add (msg_array, new_message ("buddy@test", "Zero", "uid-0", PURPLE_MESSAGE_RECV, 999, NULL));
+  g_ptr_array_add (msg_array, new_message ("buddy@test", "One", "uid-1", PURPLE_MESSAGE_RECV, 1000, NULL));
+  g_ptr_array_add (msg_array, new_message ("buddy@test", "Two", "uid-2", PURPLE_MESSAGE_RECV, 1000, NULL));
+  g_ptr_array_add (msg_array, new_message ("buddy@test", "Three", "uid-3", PURPLE_MESSAGE_RECV, 2000, NULL));
+  g_ptr_array_add (msg_array, new_message ("buddy@test", "Four", "uid-4", PURPLE_MESSAGE_RECV, 2000, NULL));
+  g_ptr_array_add (msg_array, new_message ("buddy@test", "Five", "uid-5", PURPLE_MESSAGE_RECV, 2000, NULL));
+  g_ptr_array_add (msg_array, new_message ("buddy@test", "Six", "uid-6", PURPLE_MESSAGE_RECV, 2000, NULL));
+
+  /* One message per page, so that each page starts at the cursor */
+  array_index = 0;
+  chatty_history_cursor_init (&cursor);
+
+  for (guint i = 0; i < msg_array->len; i++)
+    g_assert_cmpint (compare_messages (msg_array, FALSE, "account@test", "buddy@test",
+                                       NULL, &cursor, 1), ==, 1);
+
+  g_assert_cmpint (array_index, ==, msg_array->len);
+  g_assert_cmpint (compare_messages (msg_array, FALSE, "account@test", "buddy@test",
+                                     NULL, &cursor, 1), ==, 0);
+
+  /* Seconds are still seconds */
+  last_message = get_im_last_message ("account@test", "buddy@test");
+  g_assert_cmpstr (chatty_message_get_uid (last_message), ==, "uid-6");
+  g_assert_cmpint (chatty_message_get_time (last_message), ==, 2000);
+
+  /* A full millisecond (of 1024 messages) doesn't reuse the seq of a message */
+  chatty_history_begin_batch ();
+
+  for (guint i = 0; i <= 1024; i++) {
+    g_autofree char *uid = g_strdup_printf ("uid-full-%u", i);
+
+    chatty_history_add_im_message_ms ("Full", 1, "account@test", "full@test", uid, time_ms);
+  }
+
+  chatty_history_add_im_message_ms ("Later", 1, "account@test", "full@test", "uid-later", time_ms + 1);
+  chatty_history_add_im_message_ms ("Late", 1, "account@test", "full@test", "uid-late", time_ms);
+  chatty_history_end_batch ();
+
+  g_ptr_array_free (msg_array, TRUE);
+  chatty_history_close ();
+
+  g_assert_cmpint (sqlite3_open (db_path, &db), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_prepare_v2 (db, "SELECT COUNT(*), COUNT(DISTINCT seq) FROM chatty_im "
+                                       "WHERE who='full@test'", -1, &stmt, NULL), ==, SQLITE_OK);
+  g_assert_cmpint (sqlite3_step (stmt), ==, SQLITE_ROW);
+  g_assert_cmpint (sqlite3_column_int (stmt, 0), ==, 1024 + 3);
+  g_assert_cmpint (sqlite3_column_int (stmt, 1), ==, 1024 + 3);
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+}
+
+static void
+test_history_batch (void)
+{
+  GPtrArray *msg_array;
+  const char *account, *buddy, *db_path;
+
+  db_path = g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL);
+  g_remove (db_path);
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  msg_array = g_ptr_array_new ();
+  g_ptr_array_set_free_func (msg_array, (GDestroyNotify)free_message);
+
+  account = "account@test";
+  buddy = "buddy@test";
+
+  chatty_history_begin_batch ();
+  /* Nested batches should be merged with the outer one */
+  chatty_history_begin_batch ();
+
+  for (guint i = 0; i < MESSAGE_LIMIT; i++) {
+    g_autofree char *text = g_strdup_printf ("Message %u", i);
+
+    /* The batched messages should be readable from the same connection */
+    add_im (msg_array, account, buddy, text, time (NULL) + i, PURPLE_MESSAGE_RECV);
+  }
+
+  chatty_history_end_batch ();
+  wait_for_history ();
+  /* Other connections shouldn't see the uncommitted messages */
+  g_assert_cmpint (count_im_rows (db_path), ==, 0);
+
+  chatty_history_end_batch ();
+  wait_for_history ();
+  g_assert_cmpint (count_im_rows (db_path), ==, MESSAGE_LIMIT);
+
+  /* Unbalanced end should be ignored */
+  chatty_history_end_batch ();
+
+  /* Pending batch should be committed on close */
+  chatty_history_begin_batch ();
+  add_im (msg_array, account, buddy, "Last", time (NULL) + MESSAGE_LIMIT, PURPLE_MESSAGE_RECV);
+  chatty_history_close ();
+  g_assert_cmpint (count_im_rows (db_path), ==, MESSAGE_LIMIT + 1);
+
+  g_ptr_array_free (msg_array, TRUE);
+}
+
+static void
+test_history_async (void)
+{
+  g_autoptr(ChattyMessage) message = NULL;
+  GPtrArray *messages;
+  ChattyHistoryCursor cursor;
+  const char *account, *buddy, *room;
+  GTask *task;
+  time_t time_stamp;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  account = "account@test";
+  buddy = "buddy@test";
+  room = "room@test";
+  time_stamp = time (NULL);
+
+  /* No message yet */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_im_last_message_async (account, buddy, NULL,
+                                            finish_last_message_cb, g_object_ref (task));
+  g_assert_null (wait_for_task (task));
+  g_object_unref (task);
+
+  /* Writes are queued, and should be done before the reads queued after */
+  for (guint i = 0; i < MESSAGE_LIMIT + 5; i++) {
+    g_autofree char *text = g_strdup_printf ("Message %u", i);
+    g_autofree char *uuid = g_strdup_printf ("uid-%u", i);
+    g_autofree char *who = g_strdup_printf ("%s/nick", room);
+
+    chatty_history_add_im_message (text, i % 2 ? 1 : -1, account, buddy, uuid, time_stamp + i);
+    chatty_history_add_chat_message (text, 1, account, who, uuid, time_stamp + i, room);
+  }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_get_im_last_message_async (account, buddy, NULL,
+                                            finish_last_message_cb, g_object_ref (task));
+  message = wait_for_task (task);
+  g_object_unref (task);
+  g_assert_true (CHATTY_IS_MESSAGE (message));
+  g_assert_cmpstr (chatty_message_get_uid (message), ==, "uid-24");
+  g_assert_cmpint (chatty_message_get_msg_direction (message), ==, CHATTY_DIRECTION_OUT);
+
+  /* The latest page, oldest message first */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, &cursor, NULL);
+  chatty_history_load_im_async (account, buddy, NULL, NULL, MESSAGE_LIMIT, NULL,
+                                finish_load_cb, g_object_ref (task));
+  messages = wait_for_task (task);
+  g_object_unref (task);
+  g_assert_cmpint (messages->len, ==, MESSAGE_LIMIT);
+  g_assert_cmpstr (chatty_message_get_uid (messages->pdata[0]), ==, "uid-5");
+  g_assert_cmpstr (chatty_message_get_uid (messages->pdata[MESSAGE_LIMIT - 1]), ==, "uid-24");
+  g_ptr_array_unref (messages);
+
+  /* The cursor should continue from where the last page ended */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, &cursor, NULL);
+  chatty_history_load_im_async (account, buddy, NULL, &cursor, MESSAGE_LIMIT, NULL,
+                                finish_load_cb, g_object_ref (task));
+  messages = wait_for_task (task);
+  g_object_unref (task);
+  g_assert_cmpint (messages->len, ==, 5);
+  g_assert_cmpstr (chatty_message_get_uid (messages->pdata[4]), ==, "uid-4");
+  g_ptr_array_unref (messages);
+
+  /* Only messages before @message should be loaded */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, &cursor, NULL);
+  chatty_history_load_chat_async (account, room, message, NULL, 3, NULL,
+                                  finish_load_cb, g_object_ref (task));
+  messages = wait_for_task (task);
+  g_object_unref (task);
+  g_assert_cmpint (messages->len, ==, 3);
+  g_assert_cmpstr (chatty_message_get_uid (messages->pdata[2]), ==, "uid-23");
+  g_assert_cmpstr (chatty_message_get_user_alias (messages->pdata[2]), ==, "nick");
+  g_assert_cmpint (chatty_message_get_msg_direction (messages->pdata[2]), ==, CHATTY_DIRECTION_IN);
+  g_ptr_array_unref (messages);
+
+  chatty_history_close ();
+}
+
+static void
+test_history_markup (void)
+{
+  GPtrArray *messages;
+  ChattyHistoryCursor cursor;
+  const char *account, *buddy, *room;
+  GTask *task;
+  time_t time_stamp;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+
+  account = "account@test";
+  buddy = "buddy@test";
+  room = "room@test";
+  time_stamp = time (NULL);
+
+  chatty_history_add_im_message ("Message 0", 1, account, buddy, "uid-0", time_stamp);
+  chatty_history_add_im_message ("Message 1", 1, account, buddy, "uid-1", time_stamp + 1);
+  chatty_history_add_chat_message ("Message 0", 1, account, "room@test/nick", "uid-0", time_stamp, room);
+
+  /* Markup is saved in order with the messages, and within a batch */
+  chatty_history_begin_batch ();
+  chatty_history_set_im_markup (account, "uid-1", "<b>Message 1</b>");
+  chatty_history_set_chat_markup (room, "uid-0", "<i>Message 0</i>");
+  /* Unknown messages are ignored */
+  chatty_history_set_im_markup (account, "uid-none", "Message");
+  chatty_history_end_batch ();
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, &cursor, NULL);
+  chatty_history_load_im_async (account, buddy, NULL, NULL, MESSAGE_LIMIT, NULL,
+                                finish_load_cb, g_object_ref (task));
+  messages = wait_for_task (task);
+  g_object_unref (task);
+  g_assert_cmpint (messages->len, ==, 2);
+  g_assert_null (chatty_message_get_markup (messages->pdata[0]));
+  g_assert_cmpstr (chatty_message_get_markup (messages->pdata[1]), ==, "<b>Message 1</b>");
+  g_ptr_array_unref (messages);
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, &cursor, NULL);
+  chatty_history_load_chat_async (account, room, NULL, NULL, MESSAGE_LIMIT, NULL,
+                                  finish_load_cb, g_object_ref (task));
+  messages = wait_for_task (task);
+  g_object_unref (task);
+  g_assert_cmpint (messages->len, ==, 1);
+  g_assert_cmpstr (chatty_message_get_markup (messages->pdata[0]), ==, "<i>Message 0</i>");
+  g_ptr_array_unref (messages);
+
+  chatty_history_close ();
+}
+
+static void
+finish_last_messages_cb (GObject      *object,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  GTask *task = user_data;
+  GHashTable **tables;
+  GError *error = NULL;
+
+  tables = g_task_get_task_data (task);
+  g_assert_true (chatty_history_get_last_messages_finish (result, &tables[0], &tables[1], &error));
+  g_assert_no_error (error);
+
+  g_task_return_pointer (task, NULL, NULL);
+  g_object_unref (task);
+}
+
+static void
+test_history_last_messages (void)
+{
+  GHashTable *tables[2] = { NULL, NULL };
+  GHashTable *table;
+  ChattyMessage *message;
+  GTask *task;
+  time_t time_stamp;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  time_stamp = time (NULL);
+
+  for (guint i = 0; i < 10; i++) {
+    g_autofree char *text = g_strdup_printf ("Message %u", i);
+    g_autofree char *other = g_strdup_printf ("Other message %u", i);
+    g_autofree char *uuid = g_strdup_printf ("uid-%u", i);
+    g_autofree char *buddy = g_strdup_printf ("buddy-%u@test", i % 3);
+    g_autofree char *room = g_strdup_printf ("room-%u@test", i % 2);
+    g_autofree char *who = g_strdup_printf ("%s/nick-%u", room, i);
+
+    chatty_history_add_im_message (text, 1, "account@test", buddy, uuid, time_stamp + i);
+    /* (timestamp, message) is unique */
+    chatty_history_add_im_message (other, -1, "other@test", buddy, uuid, time_stamp + i);
+    chatty_history_add_chat_message (text, 1, "account@test", who, uuid, time_stamp + i, room);
+  }
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, tables, NULL);
+  chatty_history_get_last_messages_async (NULL, finish_last_messages_cb, g_object_ref (task));
+  wait_for_task (task);
+  g_object_unref (task);
+
+  /* One table per account, with one message per buddy */
+  g_assert_cmpint (g_hash_table_size (tables[0]), ==, 2);
+  table = g_hash_table_lookup (tables[0], "account@test");
+  g_assert_nonnull (table);
+  g_assert_cmpint (g_hash_table_size (table), ==, 3);
+
+  message = g_hash_table_lookup (table, "buddy-0@test");
+  g_assert_cmpstr (chatty_message_get_uid (message), ==, "uid-9");
+  g_assert_cmpint (chatty_message_get_time (message), ==, time_stamp + 9);
+  message = g_hash_table_lookup (table, "buddy-2@test");
+  g_assert_cmpstr (chatty_message_get_text (message), ==, "Message 8");
+
+  table = g_hash_table_lookup (tables[0], "other@test");
+  message = g_hash_table_lookup (table, "buddy-1@test");
+  g_assert_cmpstr (chatty_message_get_uid (message), ==, "uid-7");
+  g_assert_cmpint (chatty_message_get_msg_direction (message), ==, CHATTY_DIRECTION_OUT);
+
+  /* And one message per room */
+  g_assert_cmpint (g_hash_table_size (tables[1]), ==, 1);
+  table = g_hash_table_lookup (tables[1], "account@test");
+  g_assert_cmpint (g_hash_table_size (table), ==, 2);
+  message = g_hash_table_lookup (table, "room-0@test");
+  g_assert_cmpstr (chatty_message_get_uid (message), ==, "uid-8");
+  g_assert_cmpstr (chatty_message_get_user_alias (message), ==, "nick-8");
+
+  g_hash_table_unref (tables[0]);
+  g_hash_table_unref (tables[1]);
+  chatty_history_close ();
+}
+
+static void
+finish_search_cb (GObject      *object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  GTask *task = user_data;
+  GPtrArray *matches;
+  GError *error = NULL;
+
+  matches = chatty_history_search_finish (result, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (matches);
+
+  g_task_return_pointer (task, matches, (GDestroyNotify)g_ptr_array_unref);
+  g_object_unref (task);
+}
+
+static GPtrArray *
+search_history (const char *text,
+                guint       limit,
+                guint       offset)
+{
+  GPtrArray *matches;
+  GTask *task;
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  chatty_history_search_async (text, limit, offset, NULL,
+                               finish_search_cb, g_object_ref (task));
+  matches = wait_for_task (task);
+  g_object_unref (task);
+
+  return matches;
+}
+
+static void
+test_history_search (void)
+{
+  ChattyHistoryMatch *match;
+  GPtrArray *matches;
+  time_t time_stamp;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  time_stamp = time (NULL);
+
+  chatty_history_add_im_message ("Shall we have lunch today?", 1, "account@test",
+                                 "buddy@test", "uid-1", time_stamp);
+  chatty_history_add_im_message ("Lunch, lunch, lunch!", -1, "account@test",
+                                 "buddy@test", "uid-2", time_stamp + 1);
+  chatty_history_add_im_message ("Nothing to see here", 1, "account@test",
+                                 "buddy@test", "uid-3", time_stamp + 2);
+  chatty_history_add_chat_message ("Who is up for <lunch> & coffee?", 1, "account@test",
+                                   "room@test/nick", "uid-4", time_stamp + 3, "room@test");
+  chatty_history_add_chat_message ("He said \"hi\" (twice)", 1, "account@test",
+                                   "room@test/nick", "uid-5", time_stamp + 4, "room@test");
+
+  /* Messages added before the index existed are found too */
+  matches = search_history ("lunch", 10, 0);
+  g_assert_cmpint (matches->len, ==, 3);
+
+  /* More occurrences rank better */
+  match = matches->pdata[0];
+  g_assert_cmpstr (match->uid, ==, "uid-2");
+  g_assert_cmpstr (match->who, ==, "buddy@test");
+  g_assert_null (match->room);
+  g_assert_cmpint (match->time, ==, time_stamp + 1);
+  g_assert_cmpstr (match->snippet, ==, "<b>Lunch</b>, <b>lunch</b>, <b>lunch</b>!");
+
+  for (guint i = 0; i < matches->len; i++) {
+    match = matches->pdata[i];
+
+    if (g_strcmp0 (match->uid, "uid-4") == 0) {
+      g_assert_cmpstr (match->room, ==, "room@test");
+      g_assert_cmpstr (match->snippet, ==, "Who is up for &lt;<b>lunch</b>&gt; &amp; coffee?");
+    }
+  }
+  g_ptr_array_unref (matches);
+
+  /* Pages */
+  matches = search_history ("lunch", 2, 0);
+  g_assert_cmpint (matches->len, ==, 2);
+  g_ptr_array_unref (matches);
+  matches = search_history ("lunch", 2, 2);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_ptr_array_unref (matches);
+
+  /* All words have to match, the last one as a prefix */
+  matches = search_history ("lunch tod", 10, 0);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_assert_cmpstr (((ChattyHistoryMatch *)matches->pdata[0])->uid, ==, "uid-1");
+  g_ptr_array_unref (matches);
+
+  /* Query syntax is not interpreted */
+  matches = search_history ("\"hi\" (twice", 10, 0);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_ptr_array_unref (matches);
+  matches = search_history ("lunch OR nothing", 10, 0);
+  g_assert_cmpint (matches->len, ==, 0);
+  g_ptr_array_unref (matches);
+  matches = search_history ("   ", 10, 0);
+  g_assert_cmpint (matches->len, ==, 0);
+  g_ptr_array_unref (matches);
+
+  /* Deleted messages are no longer found */
+  chatty_history_delete_im ("account@test", "buddy@test");
+  matches = search_history ("lunch", 10, 0);
+  g_assert_cmpint (matches->len, ==, 1);
+  g_assert_cmpstr (((ChattyHistoryMatch *)matches->pdata[0])->uid, ==, "uid-4");
+  g_ptr_array_unref (matches);
+
+  /* New messages are */
+  chatty_history_add_im_message ("Lunch again", 1, "account@test",
+                                 "buddy@test", "uid-6", time_stamp + 5);
+  matches = search_history ("lunch", 10, 0);
+  g_assert_cmpint (matches->len, ==, 2);
+  g_ptr_array_unref (matches);
+
+  chatty_history_close ();
+}
+
+static void
+finish_uids_cb (GObject      *object,
+                GAsyncResult *result,
+                gpointer      user_data)
+{
+  GTask *task = user_data;
+  GPtrArray **uids;
+  time_t *since;
+  GError *error = NULL;
+
+  uids = g_task_get_task_data (task);
+  since = g_object_get_data (G_OBJECT (task), "since");
+  g_assert_true (chatty_history_get_uids_finish (result, &uids[0], &uids[1], since, &error));
+  g_assert_no_error (error);
+
+  g_task_return_pointer (task, NULL, NULL);
+  g_object_unref (task);
+}
+
+static void
+test_history_uids (void)
+{
+  GPtrArray *uids[2] = { NULL, NULL };
+  GTask *task;
+  time_t time_stamp, since = -1;
+
+  g_remove (g_test_get_filename (G_TEST_BUILT, "test-history.db", NULL));
+  chatty_history_open (g_test_get_dir (G_TEST_BUILT), "test-history.db");
+  time_stamp = time (NULL);
+
+  chatty_history_add_im_message ("Hello", 1, "account@test", "buddy@test", "uid-1", time_stamp);
+  chatty_history_add_im_message ("Hi", -1, "account@test", "buddy@test", "uid-2", time_stamp + 1);
+  chatty_history_add_im_message ("Hello", 1, "other@test", "buddy@test", "uid-3", time_stamp + 2);
+  chatty_history_add_chat_message ("Hey", 1, "account@test", "room@test/nick",
+                                   "uid-4", time_stamp + 3, "room@test");
+
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, uids, NULL);
+  g_object_set_data (G_OBJECT (task), "since", &since);
+  chatty_history_get_uids_async ("account@test", 10, NULL, finish_uids_cb, g_object_ref (task));
+  wait_for_task (task);
+  g_object_unref (task);
+
+  /* All of them are listed */
+  g_assert_cmpint (since, ==, 0);
+
+  /* Only the uids of the account */
+  g_assert_cmpint (uids[0]->len, ==, 2);
+  g_assert_true (g_strcmp0 (uids[0]->pdata[0], "uid-1") == 0 ||
+                 g_strcmp0 (uids[0]->pdata[1], "uid-1") == 0);
+  g_assert_true (g_strcmp0 (uids[0]->pdata[0], "uid-2") == 0 ||
+                 g_strcmp0 (uids[0]->pdata[1], "uid-2") == 0);
+
+  /* Pairs of room and uid */
+  g_assert_cmpint (uids[1]->len, ==, 2);
+  g_assert_cmpstr (uids[1]->pdata[0], ==, "room@test");
+  g_assert_cmpstr (uids[1]->pdata[1], ==, "uid-4");
+
+  g_ptr_array_unref (uids[0]);
+  g_ptr_array_unref (uids[1]);
+
+  /* Only the latest ones, older messages may be stored too */
+  task = g_task_new (NULL, NULL, NULL, NULL);
+  g_task_set_task_data (task, uids, NULL);
+  g_object_set_data (G_OBJECT (task), "since", &since);
+  chatty_history_get_uids_async ("account@test", 1, NULL, finish_uids_cb, g_object_ref (task));
+  wait_for_task (task);
+  g_object_unref (task);
+
+  g_assert_cmpint (uids[0]->len, ==, 1);
+  g_assert_cmpstr (uids[0]->pdata[0], ==, "uid-2");
+  g_assert_cmpint (uids[1]->len, ==, 2);
+  g_assert_cmpint (since, ==, time_stamp + 3);
+
+  g_ptr_array_unref (uids[0]);
+  g_ptr_array_unref (uids[1]);
+  chatty_history_close ();
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -444,6 +1427,17 @@ main (int   argc,
   g_test_add_func ("/history/im", test_history_im);
   g_test_add_func ("/history/chat", test_history_chat);
   g_test_add_func ("/history/message", test_history_message);
+  g_test_add_func ("/history/paging", test_history_paging);
+  g_test_add_func ("/history/statement-cache", test_history_statement_cache);
+  g_test_add_func ("/history/journal", test_history_journal);
+  g_test_add_func ("/history/migration", test_history_migration);
+  g_test_add_func ("/history/order", test_history_order);
+  g_test_add_func ("/history/batch", test_history_batch);
+  g_test_add_func ("/history/async", test_history_async);
+  g_test_add_func ("/history/markup", test_history_markup);
+  g_test_add_func ("/history/last-messages", test_history_last_messages);
+  g_test_add_func ("/history/search", test_history_search);
+  g_test_add_func ("/history/uids", test_history_uids);
 
   ret = g_test_run ();
 
@@ -0,0 +1,103 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* list-row.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <gtk/gtk.h>
+
+#include "chatty-avatar.h"
+#include "chatty-chat.h"
+#include "chatty-list-row.h"
+
+#define N_CHANGES 50
+
+static void
+after_paint_cb (GdkFrameClock *frame_clock,
+                gboolean      *painted)
+{
+  *painted = TRUE;
+}
+
+static void
+wait_for_paint (GtkWidget *window)
+{
+  GdkFrameClock *frame_clock;
+  gboolean painted = FALSE;
+  gulong handler_id;
+
+  frame_clock = gtk_widget_get_frame_clock (window);
+  handler_id = g_signal_connect (frame_clock, "after-paint",
+                                 G_CALLBACK (after_paint_cb), &painted);
+  gtk_widget_queue_draw (window);
+
+  while (!painted)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_signal_handler_disconnect (frame_clock, handler_id);
+}
+
+static void
+test_list_row_updates (void)
+{
+  g_autoptr(ChattyChat) chat = NULL;
+  GtkWidget *window, *list, *row;
+  guint requested, performed;
+  guint old_requested, old_performed;
+
+  if (!gtk_init_check (NULL, NULL)) {
+    g_test_skip ("No display");
+    return;
+  }
+
+  g_type_ensure (CHATTY_TYPE_AVATAR);
+
+  chat = chatty_chat_new_purple_chat (NULL);
+  row = chatty_list_row_new (CHATTY_ITEM (chat));
+
+  window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  list = gtk_list_box_new ();
+  gtk_container_add (GTK_CONTAINER (list), row);
+  gtk_container_add (GTK_CONTAINER (window), list);
+  gtk_widget_show_all (window);
+  wait_for_paint (window);
+
+  chatty_list_row_get_update_counts (CHATTY_LIST_ROW (row), &old_requested, &old_performed);
+
+  /* Changes in the same frame are only queued */
+  for (guint i = 0; i < N_CHANGES; i++)
+    g_signal_emit_by_name (chat, "changed");
+
+  chatty_list_row_get_update_counts (CHATTY_LIST_ROW (row), &requested, &performed);
+  g_assert_cmpint (requested - old_requested, ==, N_CHANGES);
+  g_assert_cmpint (performed - old_performed, ==, 0);
+
+  /* And the row is updated once before the next frame */
+  wait_for_paint (window);
+
+  chatty_list_row_get_update_counts (CHATTY_LIST_ROW (row), &requested, &performed);
+  g_assert_cmpint (requested - old_requested, ==, N_CHANGES);
+  g_assert_cmpint (performed - old_performed, ==, 1);
+  g_assert_cmpint (requested - old_requested, >, performed - old_performed);
+
+  gtk_widget_destroy (window);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/list-row/updates", test_list_row_updates);
+
+  return g_test_run ();
+}
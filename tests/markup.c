@@ -0,0 +1,171 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* markup.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+
+#include "chatty-markup.h"
+
+typedef struct {
+  const char *text;
+  const char *markup;
+} MarkupTest;
+
+static void
+check_markup (const MarkupTest *tests,
+              guint             n_tests)
+{
+  for (guint i = 0; i < n_tests; i++) {
+    g_autofree char *markup = NULL;
+
+    markup = chatty_markup_from_text (tests[i].text);
+    g_assert_cmpstr (markup, ==, tests[i].markup);
+  }
+}
+
+static void
+test_markup_text (void)
+{
+  static const MarkupTest tests[] = {
+    { "", "" },
+    { "Hello", "Hello" },
+    { "Hi 👋, ça va?", "Hi 👋, ça va?" },
+    { "1 < 2 && 3 > 2", "1 &lt; 2 &amp;&amp; 3 &gt; 2" },
+    { "\"quoted\" and 'single'", "&quot;quoted&quot; and &apos;single&apos;" },
+    { "<3", "&lt;3" },
+    { "line 1\r\nline 2\nline 3", "line 1\nline 2\nline 3" },
+  };
+  g_autofree char *markup = NULL;
+
+  check_markup (tests, G_N_ELEMENTS (tests));
+
+  markup = chatty_markup_from_text (NULL);
+  g_assert_cmpstr (markup, ==, "");
+}
+
+static void
+test_markup_html (void)
+{
+  static const MarkupTest tests[] = {
+    { "<b>bold</b> and <i>italic</i>", "bold and italic" },
+    { "line 1<br>line 2<BR/>line 3<br />", "line 1\nline 2\nline 3\n" },
+    { "<broken> tag", " tag" },
+    { "a <b and c", "a &lt;b and c" },
+    { "a <b <i>c</i>", "a &lt;b c" },
+    { "&lt;b&gt; &amp; &quot;&apos;", "&lt;b&gt; &amp; &quot;&apos;" },
+    { "&nbsp;&copy;&reg;", "\u00a0©®" },
+    { "&#65;&#x42;&#x1F600;", "AB😀" },
+    { "&unknown; & &#0; &#xZZ; &#12", "&amp;unknown; &amp; &amp;#0; &amp;#xZZ; &amp;#12" },
+  };
+
+  check_markup (tests, G_N_ELEMENTS (tests));
+}
+
+static void
+test_markup_links (void)
+{
+  static const MarkupTest tests[] = {
+    { "https://example.com",
+      "<a href=\"https://example.com\">https://example.com</a>" },
+    { "see http://example.com/a?b=1&c=2.",
+      "see <a href=\"http://example.com/a?b=1&amp;c=2\">http://example.com/a?b=1&amp;c=2</a>." },
+    { "see http://example.com/a?b=1&amp;c=2, ok",
+      "see <a href=\"http://example.com/a?b=1&amp;c=2\">http://example.com/a?b=1&amp;c=2</a>, ok" },
+    { "(https://en.wikipedia.org/wiki/Chat_(disambiguation))",
+      "(<a href=\"https://en.wikipedia.org/wiki/Chat_(disambiguation)\">"
+      "https://en.wikipedia.org/wiki/Chat_(disambiguation)</a>)" },
+    { "&quot;http://example.com&quot;",
+      "&quot;<a href=\"http://example.com\">http://example.com</a>&quot;" },
+    { "<a href=\"http://example.com\">http://example.com</a>",
+      "<a href=\"http://example.com\">http://example.com</a>" },
+    { "<a href=\"https://example.com\">Example</a>, ok",
+      "Example (<a href=\"https://example.com\">https://example.com</a>), ok" },
+    { "<A HREF='xmpp:room@conference.example.com?join'><b>the room</b></A>",
+      "the room (<a href=\"xmpp:room@conference.example.com?join\">"
+      "xmpp:room@conference.example.com?join</a>)" },
+    { "<a href=\"mailto:user@example.com\">user@example.com</a>",
+      "<a href=\"mailto:user@example.com\">user@example.com</a>" },
+    { "<a href=#top>top</a> <a name=\"x\">x</a>", "top (#top) x" },
+    { "HTTPS://EXAMPLE.COM", "<a href=\"HTTPS://EXAMPLE.COM\">HTTPS://EXAMPLE.COM</a>" },
+    { "www.example.com/path", "<a href=\"http://www.example.com/path\">www.example.com/path</a>" },
+    { "http://example.com😀", "<a href=\"http://example.com\">http://example.com</a>😀" },
+    { "😀http://example.com", "😀<a href=\"http://example.com\">http://example.com</a>" },
+    { "xmpp:room@conference.example.com?join",
+      "<a href=\"xmpp:room@conference.example.com?join\">xmpp:room@conference.example.com?join</a>" },
+    { "mailto:user@example.com", "<a href=\"mailto:user@example.com\">mailto:user@example.com</a>" },
+    /* Not links */
+    { "http:// and www. and xhttp://example.com", "http:// and www. and xhttp://example.com" },
+  };
+
+  check_markup (tests, G_N_ELEMENTS (tests));
+}
+
+static void
+test_markup_addresses (void)
+{
+  static const MarkupTest tests[] = {
+    { "mail john.doe+chat@mail.example.com.",
+      "mail <a href=\"mailto:john.doe+chat@mail.example.com\">john.doe+chat@mail.example.com</a>." },
+    { "user@localhost and user@127.0.0.1", "user@localhost and user@127.0.0.1" },
+    { "a.b-c.d user.name@-bad.example.com x.y@example.com",
+      "a.b-c.d user.name@-bad.example.com <a href=\"mailto:x.y@example.com\">x.y@example.com</a>" },
+    { "call +1 555-0100 12, or +49 30 1234567.",
+      "call <a href=\"tel:+1555010012\">+1 555-0100 12</a>, or "
+      "<a href=\"tel:+49301234567\">+49 30 1234567</a>." },
+    { "+123456 is short, 1+2345678 isn't a number", "+123456 is short, 1+2345678 isn&apos;t a number" },
+    { "+1234567890123456 is too long", "+1234567890123456 is too long" },
+  };
+
+  check_markup (tests, G_N_ELEMENTS (tests));
+}
+
+static void
+test_markup_valid (void)
+{
+  static const char *texts[] = {
+    "<b>a & b</b> <3 https://example.com/?a=<b>&c=\"d\"",
+    "&&&;;;<<<>>>\"\"''",
+    "+1 555 0100 user@example.com www.example.com/(a)(b)))",
+    "<a href=\"http://example.com/?a=1&b='2'\">a</a> <a href='\"<x>'>b</a>",
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (texts); i++) {
+    g_autoptr(GMarkupParseContext) context = NULL;
+    g_autoptr(GError) error = NULL;
+    g_autofree char *markup = NULL;
+    g_autofree char *wrapped = NULL;
+    GMarkupParser parser = { NULL };
+
+    /* Pango markup is parsed as XML, wrapped in an element */
+    markup = chatty_markup_from_text (texts[i]);
+    wrapped = g_strconcat ("<markup>", markup, "</markup>", NULL);
+    context = g_markup_parse_context_new (&parser, 0, NULL, NULL);
+    g_markup_parse_context_parse (context, wrapped, -1, &error);
+    g_assert_no_error (error);
+  }
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/markup/text", test_markup_text);
+  g_test_add_func ("/markup/html", test_markup_html);
+  g_test_add_func ("/markup/links", test_markup_links);
+  g_test_add_func ("/markup/addresses", test_markup_addresses);
+  g_test_add_func ("/markup/valid", test_markup_valid);
+
+  return g_test_run ();
+}
@@ -0,0 +1,237 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+/* message-list.c
+ *
+ * Copyright 2020 Purism SPC
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#undef NDEBUG
+#undef G_DISABLE_ASSERT
+#undef G_DISABLE_CHECKS
+#undef G_DISABLE_CAST_CHECKS
+#undef G_LOG_DOMAIN
+
+#include <glib.h>
+
+#include "chatty-message-list.h"
+
+typedef struct {
+  guint n_emitted;
+  guint position;
+  guint removed;
+  guint added;
+} ItemsChanged;
+
+static void
+items_changed_cb (GListModel   *model,
+                  guint         position,
+                  guint         removed,
+                  guint         added,
+                  ItemsChanged *changed)
+{
+  changed->n_emitted++;
+  changed->position = position;
+  changed->removed = removed;
+  changed->added = added;
+}
+
+static void
+add_message (GPtrArray  *messages,
+             const char *uid,
+             time_t      time)
+{
+  g_ptr_array_add (messages,
+                   chatty_message_new (NULL, NULL, uid, uid, time,
+                                       CHATTY_DIRECTION_IN, 0));
+}
+
+static void
+compare_list (GListModel *model,
+              const char *expected[])
+{
+  guint n_items, i;
+
+  n_items = g_list_model_get_n_items (model);
+
+  for (i = 0; expected[i]; i++) {
+    g_autoptr(ChattyMessage) message = NULL;
+
+    message = g_list_model_get_item (model, i);
+    g_assert_nonnull (message);
+    g_assert_cmpstr (chatty_message_get_uid (message), ==, expected[i]);
+  }
+
+  g_assert_cmpint (i, ==, n_items);
+
+  /* Walk backward too, which uses a different path */
+  for (i = n_items; i > 0; i--) {
+    g_autoptr(ChattyMessage) message = NULL;
+
+    message = g_list_model_get_item (model, i - 1);
+    g_assert_cmpstr (chatty_message_get_uid (message), ==, expected[i - 1]);
+  }
+
+  g_assert_null (g_list_model_get_item (model, n_items));
+}
+
+static void
+test_message_list_order (void)
+{
+  g_autoptr(ChattyMessageList) list = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  ItemsChanged changed = { 0 };
+  GListModel *model;
+
+  list = chatty_message_list_new ();
+  model = G_LIST_MODEL (list);
+  g_signal_connect (list, "items-changed", G_CALLBACK (items_changed_cb), &changed);
+
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, 0);
+  g_assert_true (g_list_model_get_item_type (model) == CHATTY_TYPE_MESSAGE);
+  g_assert_null (chatty_message_list_get_last (list));
+
+  /* New messages, those with the same time are kept in order */
+  messages = g_ptr_array_new_with_free_func (g_object_unref);
+  add_message (messages, "a", 100);
+  add_message (messages, "b", 100);
+  add_message (messages, "c", 200);
+
+  for (guint i = 0; i < messages->len; i++)
+    chatty_message_list_add (list, messages->pdata[i], FALSE);
+
+  compare_list (model, (const char *[]){"a", "b", "c", NULL});
+  g_assert_cmpint (changed.n_emitted, ==, 3);
+  g_assert_cmpint (changed.position, ==, 2);
+  g_assert_cmpint (changed.removed, ==, 0);
+  g_assert_cmpint (changed.added, ==, 1);
+  g_assert_true (chatty_message_list_get_last (list) == messages->pdata[2]);
+
+  /* A page of history goes before the messages of the same time */
+  g_ptr_array_set_size (messages, 0);
+  add_message (messages, "h1", 50);
+  add_message (messages, "h2", 100);
+  add_message (messages, "h3", 100);
+  changed.n_emitted = 0;
+  chatty_message_list_add_messages (list, messages, TRUE);
+
+  compare_list (model, (const char *[]){"h1", "h2", "h3", "a", "b", "c", NULL});
+  g_assert_cmpint (changed.n_emitted, ==, 1);
+  g_assert_cmpint (changed.position, ==, 0);
+  g_assert_cmpint (changed.removed, ==, 0);
+  g_assert_cmpint (changed.added, ==, 3);
+
+  /* Late messages, not sorted, land in between existing ones */
+  g_ptr_array_set_size (messages, 0);
+  add_message (messages, "m1", 150);
+  add_message (messages, "m2", 60);
+  add_message (messages, "m3", 100);
+  changed.n_emitted = 0;
+  chatty_message_list_add_messages (list, messages, FALSE);
+
+  compare_list (model, (const char *[]){"h1", "m2", "h2", "h3", "a", "b", "m3", "m1", "c", NULL});
+  /* A single signal from the first to the last message added */
+  g_assert_cmpint (changed.n_emitted, ==, 1);
+  g_assert_cmpint (changed.position, ==, 1);
+  g_assert_cmpint (changed.removed, ==, 4);
+  g_assert_cmpint (changed.added, ==, 7);
+}
+
+static void
+test_message_list_trim (void)
+{
+  g_autoptr(ChattyMessageList) list = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  ItemsChanged changed = { 0 };
+  GListModel *model;
+
+  list = chatty_message_list_new ();
+  model = G_LIST_MODEL (list);
+  g_signal_connect (list, "items-changed", G_CALLBACK (items_changed_cb), &changed);
+
+  g_assert_cmpint (chatty_message_list_trim (list, 0), ==, 0);
+  g_assert_cmpint (changed.n_emitted, ==, 0);
+
+  messages = g_ptr_array_new_with_free_func (g_object_unref);
+  add_message (messages, "a", 100);
+  add_message (messages, "b", 200);
+  add_message (messages, "c", 300);
+  add_message (messages, "d", 400);
+  chatty_message_list_add_messages (list, messages, FALSE);
+
+  /* Walk the list, so that a removed node is cached */
+  compare_list (model, (const char *[]){"a", "b", "c", "d", NULL});
+
+  changed.n_emitted = 0;
+  g_assert_cmpint (chatty_message_list_trim (list, 4), ==, 0);
+  g_assert_cmpint (changed.n_emitted, ==, 0);
+
+  /* The oldest messages are removed at once */
+  g_assert_cmpint (chatty_message_list_trim (list, 2), ==, 2);
+  compare_list (model, (const char *[]){"c", "d", NULL});
+  g_assert_cmpint (changed.n_emitted, ==, 1);
+  g_assert_cmpint (changed.position, ==, 0);
+  g_assert_cmpint (changed.removed, ==, 2);
+  g_assert_cmpint (changed.added, ==, 0);
+
+  /* The released messages can be added back */
+  g_ptr_array_remove_range (messages, 2, 2);
+  chatty_message_list_add_messages (list, messages, TRUE);
+  compare_list (model, (const char *[]){"a", "b", "c", "d", NULL});
+
+  g_assert_cmpint (chatty_message_list_trim (list, 0), ==, 4);
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, 0);
+  g_assert_null (chatty_message_list_get_last (list));
+}
+
+static void
+test_message_list_random (void)
+{
+  g_autoptr(ChattyMessageList) list = NULL;
+  g_autoptr(GPtrArray) messages = NULL;
+  GListModel *model;
+  time_t last_time = 0;
+  guint n_items = 0;
+
+  list = chatty_message_list_new ();
+  model = G_LIST_MODEL (list);
+  messages = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (guint i = 0; i < 200; i++) {
+    guint count;
+
+    g_ptr_array_set_size (messages, 0);
+    count = g_test_rand_int_range (1, 20);
+
+    for (guint j = 0; j < count; j++)
+      add_message (messages, "", g_test_rand_int_range (1, 1000));
+
+    chatty_message_list_add_messages (list, messages, g_test_rand_bit ());
+    n_items += count;
+  }
+
+  g_assert_cmpint (g_list_model_get_n_items (model), ==, n_items);
+
+  for (guint i = 0; i < n_items; i++) {
+    g_autoptr(ChattyMessage) message = NULL;
+
+    message = g_list_model_get_item (model, i);
+    g_assert_cmpint (chatty_message_get_time (message), >=, last_time);
+    last_time = chatty_message_get_time (message);
+  }
+
+  g_assert_cmpint (chatty_message_get_time (chatty_message_list_get_last (list)), ==, last_time);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/message-list/order", test_message_list_order);
+  g_test_add_func ("/message-list/trim", test_message_list_trim);
+  g_test_add_func ("/message-list/random", test_message_list_random);
+
+  return g_test_run ();
+}
@@ -137,6 +137,37 @@ test_settings_first_start (void)
   g_object_unref (settings);
 }
 
+static void
+test_settings_history (void)
+{
+  ChattySettings *settings;
+  g_autoptr(GSettings) gsettings = NULL;
+
+  gsettings = g_settings_new ("sm.puri.Chatty");
+  g_settings_reset (gsettings, "history-synchronous");
+  g_settings_reset (gsettings, "history-temp-store");
+
+  settings = chatty_settings_get_default ();
+  g_assert_true (CHATTY_IS_SETTINGS (settings));
+
+  /* normal */
+  g_assert_cmpint (chatty_settings_get_history_synchronous (settings), ==, 1);
+  /* memory */
+  g_assert_cmpint (chatty_settings_get_history_temp_store (settings), ==, 2);
+  g_assert_cmpint (chatty_settings_get_history_cache_size (settings), >, 0);
+
+  g_settings_set_string (gsettings, "history-synchronous", "full");
+  g_settings_set_string (gsettings, "history-temp-store", "file");
+  g_settings_set_uint (gsettings, "history-mmap-size", 0);
+  g_settings_set_uint (gsettings, "history-checkpoint-interval", 60);
+
+  g_assert_cmpint (chatty_settings_get_history_synchronous (settings), ==, 2);
+  g_assert_cmpint (chatty_settings_get_history_temp_store (settings), ==, 1);
+  g_assert_cmpint (chatty_settings_get_history_mmap_size (settings), ==, 0);
+  g_assert_cmpint (chatty_settings_get_history_checkpoint_interval (settings), ==, 60);
+  g_object_unref (settings);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -147,6 +178,7 @@ main (int   argc,
 
   g_test_add_func ("/settings/first_start", test_settings_first_start);
   g_test_add_func ("/settings/all_bool", test_settings_all_bool);
+  g_test_add_func ("/settings/history", test_settings_history);
 
   return g_test_run ();
 }